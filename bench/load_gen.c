@@ -0,0 +1,845 @@
+/**
+ * load_gen.c - Open-loop HTTP load generator
+ *
+ * Sends requests on a fixed schedule (--rate per second, spread evenly)
+ * regardless of how fast the server answers, over at most --connections
+ * concurrent connections driven by one epoll loop. Requests that cannot be
+ * sent on time wait in a queue, and latency is measured from the time a
+ * request was scheduled, not from when it was written. A stalled server
+ * therefore shows up in the percentiles instead of silently lowering the
+ * request rate (coordinated omission).
+ *
+ *   load_gen [--host 127.0.0.1] [--port 10680] [--rate 500]
+ *            [--duration 10] [--warmup 2] [--connections 64]
+ *            [--timeout 5] [--keep-alive] [--out FILE]
+ *            [--endpoint PATH]...
+ *
+ * Endpoints are requested round robin. The report is JSON with req/s and
+ * p50/p90/p99/p999/max latency per endpoint and in total; requests
+ * scheduled during the warmup are sent but not recorded.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOAD_MAX_ENDPOINTS 32
+#define LOAD_EVENTS 256
+#define LOAD_QUEUE_MAX (1 << 20) // Scheduled but unsent requests
+#define LOAD_RESPONSE_MAX (16 * 1024 * 1024)
+#define LOAD_REQUEST_MAX 2048
+
+// Log-linear histogram of microseconds: exact below 64, then 32 buckets per
+// power of two (about 3% resolution) up to 2^40 us
+#define LOAD_HIST_SUB 32
+#define LOAD_HIST_BUCKETS (2 * LOAD_HIST_SUB + 35 * LOAD_HIST_SUB)
+
+typedef struct {
+    uint64_t counts[LOAD_HIST_BUCKETS];
+    uint64_t count;
+    uint64_t max_us;
+} LoadHistogram;
+
+typedef struct {
+    const char*   path;
+    uint64_t      ok;      // Complete responses with a 2xx/3xx status
+    uint64_t      non_2xx; // Complete responses with any other status
+    uint64_t      errors;  // Connect, send and receive failures, timeouts
+    uint64_t      dropped; // Never sent because the queue was full
+    LoadHistogram latency;
+} LoadEndpoint;
+
+typedef struct {
+    uint64_t intended_ns; // When the schedule wanted the request sent
+    int      endpoint;
+} LoadRequest;
+
+typedef enum {
+    LOAD_CONNECTION_FREE,       // No socket
+    LOAD_CONNECTION_IDLE,       // Kept-alive socket without a request
+    LOAD_CONNECTION_CONNECTING, // Waiting for connect, request attached
+    LOAD_CONNECTION_WRITING,
+    LOAD_CONNECTION_READING,
+} LoadConnectionState;
+
+typedef struct {
+    LoadConnectionState state;
+    int                 fd;
+    int                 reused; // Socket already carried a response
+    LoadRequest         request;
+    uint64_t            deadline_ns;
+
+    char   write_buffer[LOAD_REQUEST_MAX];
+    size_t write_size;
+    size_t write_offset;
+
+    char*  read_buffer;
+    size_t read_size;
+    size_t read_capacity;
+} LoadConnection;
+
+typedef struct {
+    struct sockaddr_in address;
+    const char*        host;
+    int                port;
+    double             rate;
+    double             duration_s;
+    double             warmup_s;
+    int                connection_count;
+    double             timeout_s;
+    int                keep_alive;
+    const char*        out_path;
+
+    LoadEndpoint endpoints[LOAD_MAX_ENDPOINTS];
+    int          endpoint_count;
+
+    LoadConnection* connections;
+    int             epoll_fd;
+    int             timer_fd;
+
+    LoadRequest* queue;
+    size_t       queue_head;
+    size_t       queue_size;
+    size_t       queue_capacity;
+
+    uint64_t record_from_ns; // Requests scheduled before this are warmup
+    uint64_t connects;
+} LoadGenerator;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+//-----------------------Histogram--------------------------
+
+static int histogram_index(uint64_t us) {
+    if (us < 2 * LOAD_HIST_SUB) {
+        return (int)us;
+    }
+
+    int shift = 63 - __builtin_clzll(us) - 5;
+    int index = 2 * LOAD_HIST_SUB + (shift - 1) * LOAD_HIST_SUB +
+                (int)((us >> shift) - LOAD_HIST_SUB);
+    return index < LOAD_HIST_BUCKETS ? index : LOAD_HIST_BUCKETS - 1;
+}
+
+static uint64_t histogram_upper(int index) {
+    if (index < 2 * LOAD_HIST_SUB) {
+        return (uint64_t)index;
+    }
+
+    int      shift    = (index - 2 * LOAD_HIST_SUB) / LOAD_HIST_SUB + 1;
+    uint64_t mantissa = (uint64_t)((index - 2 * LOAD_HIST_SUB) % LOAD_HIST_SUB +
+                                   LOAD_HIST_SUB);
+    return ((mantissa + 1) << shift) - 1;
+}
+
+static void histogram_record(LoadHistogram* histogram, uint64_t us) {
+    histogram->counts[histogram_index(us)]++;
+    histogram->count++;
+    if (us > histogram->max_us) {
+        histogram->max_us = us;
+    }
+}
+
+static void histogram_merge(LoadHistogram* into, const LoadHistogram* from) {
+    for (int i = 0; i < LOAD_HIST_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->count += from->count;
+    if (from->max_us > into->max_us) {
+        into->max_us = from->max_us;
+    }
+}
+
+static double histogram_percentile_ms(const LoadHistogram* histogram,
+                                      double percentile) {
+    if (histogram->count == 0) {
+        return 0.0;
+    }
+
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)histogram->count);
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < LOAD_HIST_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            uint64_t upper = histogram_upper(i);
+            return (double)(upper < histogram->max_us ? upper
+                                                      : histogram->max_us) /
+                   1000.0;
+        }
+    }
+
+    return (double)histogram->max_us / 1000.0;
+}
+
+//-------------------------Queue----------------------------
+
+static int queue_push(LoadGenerator* gen, LoadRequest request) {
+    if (gen->queue_size == gen->queue_capacity) {
+        if (gen->queue_capacity == LOAD_QUEUE_MAX) {
+            return -1;
+        }
+
+        size_t       capacity = gen->queue_capacity ? gen->queue_capacity * 2
+                                                    : 1024;
+        LoadRequest* queue    = malloc(capacity * sizeof(LoadRequest));
+        if (!queue) {
+            return -1;
+        }
+        for (size_t i = 0; i < gen->queue_size; i++) {
+            queue[i] =
+                gen->queue[(gen->queue_head + i) % gen->queue_capacity];
+        }
+        free(gen->queue);
+        gen->queue          = queue;
+        gen->queue_head     = 0;
+        gen->queue_capacity = capacity;
+    }
+
+    gen->queue[(gen->queue_head + gen->queue_size) % gen->queue_capacity] =
+        request;
+    gen->queue_size++;
+    return 0;
+}
+
+static LoadRequest queue_pop(LoadGenerator* gen) {
+    LoadRequest request = gen->queue[gen->queue_head];
+    gen->queue_head     = (gen->queue_head + 1) % gen->queue_capacity;
+    gen->queue_size--;
+    return request;
+}
+
+//----------------------Connections-------------------------
+
+static void connection_close(LoadGenerator* gen, LoadConnection* conn) {
+    if (conn->fd >= 0) {
+        epoll_ctl(gen->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+    }
+    conn->fd     = -1;
+    conn->state  = LOAD_CONNECTION_FREE;
+    conn->reused = 0;
+}
+
+static void connection_watch(LoadGenerator* gen, LoadConnection* conn,
+                             uint32_t events) {
+    struct epoll_event ev = {.events = events, .data.ptr = conn};
+    if (epoll_ctl(gen->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) != 0) {
+        epoll_ctl(gen->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev);
+    }
+}
+
+static int connection_open(LoadGenerator* gen, LoadConnection* conn) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    if (connect(fd, (struct sockaddr*)&gen->address, sizeof(gen->address)) !=
+            0 &&
+        errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+
+    gen->connects++;
+    conn->fd     = fd;
+    conn->reused = 0;
+    conn->state  = LOAD_CONNECTION_CONNECTING;
+    connection_watch(gen, conn, EPOLLOUT);
+    return 0;
+}
+
+static void connection_send(LoadGenerator* gen, LoadConnection* conn) {
+    while (conn->write_offset < conn->write_size) {
+        ssize_t n = send(conn->fd, conn->write_buffer + conn->write_offset,
+                         conn->write_size - conn->write_offset, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                connection_watch(gen, conn, EPOLLOUT);
+                return;
+            }
+            conn->state = LOAD_CONNECTION_FREE; // Reported by the caller
+            return;
+        }
+        conn->write_offset += (size_t)n;
+    }
+
+    conn->state = LOAD_CONNECTION_READING;
+    connection_watch(gen, conn, EPOLLIN | EPOLLRDHUP);
+}
+
+// Attach a request to a connection and start sending it
+static int connection_start(LoadGenerator* gen, LoadConnection* conn,
+                            LoadRequest request) {
+    conn->request     = request;
+    conn->deadline_ns = now_ns() + (uint64_t)(gen->timeout_s * 1e9);
+    conn->read_size   = 0;
+
+    int length = snprintf(conn->write_buffer, sizeof(conn->write_buffer),
+                          "GET %s HTTP/1.1\r\n"
+                          "Host: %s:%d\r\n"
+                          "User-Agent: just-weather-bench\r\n"
+                          "Accept: application/json\r\n"
+                          "Connection: %s\r\n"
+                          "\r\n",
+                          gen->endpoints[request.endpoint].path, gen->host,
+                          gen->port, gen->keep_alive ? "keep-alive" : "close");
+    if (length < 0 || (size_t)length >= sizeof(conn->write_buffer)) {
+        return -1;
+    }
+    conn->write_size   = (size_t)length;
+    conn->write_offset = 0;
+
+    if (conn->state == LOAD_CONNECTION_IDLE) {
+        conn->state = LOAD_CONNECTION_WRITING;
+        connection_send(gen, conn);
+        return conn->state == LOAD_CONNECTION_FREE ? -1 : 0;
+    }
+
+    return connection_open(gen, conn);
+}
+
+static void record(LoadGenerator* gen, const LoadRequest* request,
+                   int status) {
+    if (request->intended_ns < gen->record_from_ns) {
+        return;
+    }
+
+    LoadEndpoint* endpoint = &gen->endpoints[request->endpoint];
+    if (status <= 0) {
+        endpoint->errors++;
+        return;
+    }
+
+    if (status >= 200 && status < 400) {
+        endpoint->ok++;
+    } else {
+        endpoint->non_2xx++;
+    }
+    histogram_record(&endpoint->latency,
+                     (now_ns() - request->intended_ns) / 1000);
+}
+
+// Fail the attached request, or retry it once on a fresh socket when a
+// reused keep-alive socket turned out to be closed by the server
+static void connection_fail(LoadGenerator* gen, LoadConnection* conn) {
+    int retry = conn->reused && conn->read_size == 0;
+
+    connection_close(gen, conn);
+    if (retry && connection_start(gen, conn, conn->request) == 0) {
+        return;
+    }
+
+    connection_close(gen, conn);
+    record(gen, &conn->request, -1);
+}
+
+// Returns the status once the buffered response is complete, 0 if more
+// data is needed, -1 if it is malformed. *close_after is set when the
+// server will not reuse the connection.
+static int response_complete(LoadConnection* conn, int eof,
+                             int* close_after) {
+    char* buffer = conn->read_buffer;
+    buffer[conn->read_size] = '\0';
+
+    char* header_end = strstr(buffer, "\r\n\r\n");
+    if (!header_end) {
+        return eof ? -1 : 0;
+    }
+    *header_end = '\0';
+
+    int status = 0;
+    if (sscanf(buffer, "HTTP/1.%*d %d", &status) != 1) {
+        return -1;
+    }
+
+    const char* length_header = strcasestr(buffer, "\r\ncontent-length:");
+    int         chunked       = strcasestr(buffer, "chunked") != NULL;
+    *close_after = strcasestr(buffer, "\r\nconnection: close") != NULL ||
+                   strncmp(buffer, "HTTP/1.0", 8) == 0;
+    *header_end = '\r';
+
+    size_t body_start = (size_t)(header_end + 4 - buffer);
+    size_t body_size  = conn->read_size - body_start;
+
+    if (length_header) {
+        size_t length = strtoull(length_header + 17, NULL, 10);
+        if (body_size >= length) {
+            return status;
+        }
+        return eof ? -1 : 0;
+    }
+
+    if (chunked) {
+        if (body_size >= 5 &&
+            memcmp(buffer + conn->read_size - 5, "0\r\n\r\n", 5) == 0) {
+            return status;
+        }
+        return eof ? -1 : 0;
+    }
+
+    // Body runs until the server closes the connection
+    *close_after = 1;
+    return eof ? status : 0;
+}
+
+static void connection_receive(LoadGenerator* gen, LoadConnection* conn) {
+    int eof = 0;
+
+    for (;;) {
+        if (conn->read_capacity - conn->read_size < 4096) {
+            size_t capacity = conn->read_capacity * 2;
+            if (capacity > LOAD_RESPONSE_MAX) {
+                connection_fail(gen, conn);
+                return;
+            }
+            char* buffer = realloc(conn->read_buffer, capacity + 1);
+            if (!buffer) {
+                connection_fail(gen, conn);
+                return;
+            }
+            conn->read_buffer   = buffer;
+            conn->read_capacity = capacity;
+        }
+
+        ssize_t n = recv(conn->fd, conn->read_buffer + conn->read_size,
+                         conn->read_capacity - conn->read_size, 0);
+        if (n > 0) {
+            conn->read_size += (size_t)n;
+            continue;
+        }
+        if (n == 0) {
+            eof = 1;
+            break;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        }
+        connection_fail(gen, conn);
+        return;
+    }
+
+    if (eof && conn->read_size == 0) {
+        connection_fail(gen, conn);
+        return;
+    }
+
+    int close_after = 0;
+    int status      = response_complete(conn, eof, &close_after);
+    if (status == 0) {
+        return;
+    }
+    if (status < 0) {
+        connection_fail(gen, conn);
+        return;
+    }
+
+    record(gen, &conn->request, status);
+
+    if (eof || close_after || !gen->keep_alive) {
+        connection_close(gen, conn);
+    } else {
+        conn->state  = LOAD_CONNECTION_IDLE;
+        conn->reused = 1;
+        connection_watch(gen, conn, EPOLLRDHUP);
+    }
+}
+
+static void connection_event(LoadGenerator* gen, LoadConnection* conn,
+                             uint32_t events) {
+    switch (conn->state) {
+    case LOAD_CONNECTION_IDLE:
+        // The server closed a kept-alive connection
+        connection_close(gen, conn);
+        break;
+
+    case LOAD_CONNECTION_CONNECTING: {
+        int       error  = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0) {
+            connection_fail(gen, conn);
+            break;
+        }
+        conn->state = LOAD_CONNECTION_WRITING;
+        connection_send(gen, conn);
+        if (conn->state == LOAD_CONNECTION_FREE) {
+            connection_fail(gen, conn);
+        }
+        break;
+    }
+
+    case LOAD_CONNECTION_WRITING:
+        connection_send(gen, conn);
+        if (conn->state == LOAD_CONNECTION_FREE) {
+            connection_fail(gen, conn);
+        }
+        break;
+
+    case LOAD_CONNECTION_READING:
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            connection_receive(gen, conn);
+        }
+        break;
+
+    case LOAD_CONNECTION_FREE:
+        break;
+    }
+}
+
+//------------------------Driver----------------------------
+
+// Hand queued requests to idle connections, then to free slots
+static void dispatch(LoadGenerator* gen) {
+    for (int i = 0; i < gen->connection_count && gen->queue_size > 0; i++) {
+        LoadConnection* conn = &gen->connections[i];
+        if (conn->state != LOAD_CONNECTION_IDLE) {
+            continue;
+        }
+        LoadRequest request = queue_pop(gen);
+        if (connection_start(gen, conn, request) != 0) {
+            connection_fail(gen, conn);
+        }
+    }
+
+    for (int i = 0; i < gen->connection_count && gen->queue_size > 0; i++) {
+        LoadConnection* conn = &gen->connections[i];
+        if (conn->state != LOAD_CONNECTION_FREE) {
+            continue;
+        }
+        LoadRequest request = queue_pop(gen);
+        if (connection_start(gen, conn, request) != 0) {
+            connection_close(gen, conn);
+            record(gen, &request, -1);
+        }
+    }
+}
+
+static int busy_connections(const LoadGenerator* gen) {
+    int busy = 0;
+    for (int i = 0; i < gen->connection_count; i++) {
+        LoadConnectionState state = gen->connections[i].state;
+        if (state != LOAD_CONNECTION_FREE && state != LOAD_CONNECTION_IDLE) {
+            busy++;
+        }
+    }
+    return busy;
+}
+
+static void expire(LoadGenerator* gen, uint64_t now) {
+    for (int i = 0; i < gen->connection_count; i++) {
+        LoadConnection* conn = &gen->connections[i];
+        if (conn->state != LOAD_CONNECTION_FREE &&
+            conn->state != LOAD_CONNECTION_IDLE && now >= conn->deadline_ns) {
+            connection_close(gen, conn);
+            record(gen, &conn->request, -1);
+        }
+    }
+}
+
+static void arm_timer(LoadGenerator* gen, uint64_t at_ns) {
+    struct itimerspec spec = {0};
+    spec.it_value.tv_sec   = (time_t)(at_ns / 1000000000ULL);
+    spec.it_value.tv_nsec  = (long)(at_ns % 1000000000ULL);
+    timerfd_settime(gen->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+static void run(LoadGenerator* gen) {
+    uint64_t start_ns    = now_ns();
+    uint64_t warmup_ns   = (uint64_t)(gen->warmup_s * 1e9);
+    uint64_t end_ns      = start_ns + warmup_ns +
+                      (uint64_t)(gen->duration_s * 1e9);
+    uint64_t drain_ns    = (uint64_t)(gen->timeout_s * 1e9);
+    double   interval_ns = 1e9 / gen->rate;
+    uint64_t scheduled   = 0;
+    uint64_t next_ns     = start_ns;
+    uint64_t expire_ns   = start_ns;
+
+    gen->record_from_ns = start_ns + warmup_ns;
+
+    struct epoll_event timer_event = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(gen->epoll_fd, EPOLL_CTL_ADD, gen->timer_fd, &timer_event);
+
+    struct epoll_event events[LOAD_EVENTS];
+    for (;;) {
+        uint64_t now = now_ns();
+
+        while (next_ns <= now && next_ns < end_ns) {
+            LoadRequest request = {
+                next_ns, (int)(scheduled % (uint64_t)gen->endpoint_count)};
+            if (queue_push(gen, request) != 0 &&
+                request.intended_ns >= gen->record_from_ns) {
+                gen->endpoints[request.endpoint].dropped++;
+            }
+            scheduled++;
+            next_ns = start_ns + (uint64_t)((double)scheduled * interval_ns);
+        }
+
+        dispatch(gen);
+
+        if (now >= expire_ns) {
+            expire(gen, now);
+            expire_ns = now + 10000000ULL;
+        }
+
+        if (next_ns >= end_ns) {
+            if (gen->queue_size == 0 && busy_connections(gen) == 0) {
+                break;
+            }
+            if (now >= end_ns + drain_ns) {
+                // Whatever is still queued never got a connection in time
+                while (gen->queue_size > 0) {
+                    LoadRequest request = queue_pop(gen);
+                    record(gen, &request, -1);
+                }
+                expire(gen, UINT64_MAX);
+                break;
+            }
+        } else {
+            arm_timer(gen, next_ns);
+        }
+
+        int n = epoll_wait(gen->epoll_fd, events, LOAD_EVENTS, 10);
+        for (int i = 0; i < n; i++) {
+            LoadConnection* conn = events[i].data.ptr;
+            if (conn == NULL) {
+                // Schedule timer; the next iteration sends what is due
+                uint64_t expirations;
+                ssize_t  ignored = read(gen->timer_fd, &expirations,
+                                        sizeof(expirations));
+                (void)ignored;
+                continue;
+            }
+            connection_event(gen, conn, events[i].events);
+        }
+    }
+}
+
+//------------------------Report----------------------------
+
+static void report_stats(FILE* out, const LoadHistogram* latency,
+                         uint64_t ok, uint64_t non_2xx, uint64_t errors,
+                         uint64_t dropped, double duration_s) {
+    fprintf(out,
+            "\"requests\":%llu,\"ok\":%llu,\"non_2xx\":%llu,\"errors\":%llu,"
+            "\"dropped\":%llu,\"rps\":%.1f,"
+            "\"latency_ms\":{\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,"
+            "\"p999\":%.3f,\"max\":%.3f}",
+            (unsigned long long)(ok + non_2xx), (unsigned long long)ok,
+            (unsigned long long)non_2xx, (unsigned long long)errors,
+            (unsigned long long)dropped,
+            (double)(ok + non_2xx) / duration_s,
+            histogram_percentile_ms(latency, 50.0),
+            histogram_percentile_ms(latency, 90.0),
+            histogram_percentile_ms(latency, 99.0),
+            histogram_percentile_ms(latency, 99.9),
+            (double)latency->max_us / 1000.0);
+}
+
+static void json_string(FILE* out, const char* s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', out);
+        }
+        fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+static void report(LoadGenerator* gen, FILE* out) {
+    static LoadHistogram total;
+    uint64_t             ok = 0, non_2xx = 0, errors = 0, dropped = 0;
+
+    fprintf(out,
+            "{\n  \"target_rps\":%.1f,\n  \"duration_s\":%.1f,\n"
+            "  \"warmup_s\":%.1f,\n  \"connections\":%d,\n"
+            "  \"keep_alive\":%s,\n  \"connects\":%llu,\n"
+            "  \"endpoints\":[\n",
+            gen->rate, gen->duration_s, gen->warmup_s, gen->connection_count,
+            gen->keep_alive ? "true" : "false",
+            (unsigned long long)gen->connects);
+
+    for (int i = 0; i < gen->endpoint_count; i++) {
+        LoadEndpoint* endpoint = &gen->endpoints[i];
+
+        fprintf(out, "    {\"path\":");
+        json_string(out, endpoint->path);
+        fputc(',', out);
+        report_stats(out, &endpoint->latency, endpoint->ok,
+                     endpoint->non_2xx, endpoint->errors, endpoint->dropped,
+                     gen->duration_s);
+        fprintf(out, "}%s\n", i + 1 < gen->endpoint_count ? "," : "");
+
+        histogram_merge(&total, &endpoint->latency);
+        ok += endpoint->ok;
+        non_2xx += endpoint->non_2xx;
+        errors += endpoint->errors;
+        dropped += endpoint->dropped;
+    }
+
+    fprintf(out, "  ],\n  \"total\":{");
+    report_stats(out, &total, ok, non_2xx, errors, dropped, gen->duration_s);
+    fprintf(out, "}\n}\n");
+}
+
+//-------------------------Main-----------------------------
+
+static void usage(const char* name) {
+    fprintf(stderr,
+            "usage: %s [--host ADDR] [--port N] [--rate N] [--duration S]\n"
+            "          [--warmup S] [--connections N] [--timeout S]\n"
+            "          [--keep-alive] [--out FILE] [--endpoint PATH]...\n",
+            name);
+}
+
+int main(int argc, char** argv) {
+    static LoadGenerator gen = {
+        .host             = "127.0.0.1",
+        .port             = 10680,
+        .rate             = 500,
+        .duration_s       = 10,
+        .warmup_s         = 2,
+        .connection_count = 64,
+        .timeout_s        = 5,
+    };
+
+    static const struct option OPTIONS[] = {
+        {"host", required_argument, NULL, 'h'},
+        {"port", required_argument, NULL, 'p'},
+        {"rate", required_argument, NULL, 'r'},
+        {"duration", required_argument, NULL, 'd'},
+        {"warmup", required_argument, NULL, 'w'},
+        {"connections", required_argument, NULL, 'c'},
+        {"timeout", required_argument, NULL, 't'},
+        {"keep-alive", no_argument, NULL, 'k'},
+        {"out", required_argument, NULL, 'o'},
+        {"endpoint", required_argument, NULL, 'e'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", OPTIONS, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            gen.host = optarg;
+            break;
+        case 'p':
+            gen.port = atoi(optarg);
+            break;
+        case 'r':
+            gen.rate = atof(optarg);
+            break;
+        case 'd':
+            gen.duration_s = atof(optarg);
+            break;
+        case 'w':
+            gen.warmup_s = atof(optarg);
+            break;
+        case 'c':
+            gen.connection_count = atoi(optarg);
+            break;
+        case 't':
+            gen.timeout_s = atof(optarg);
+            break;
+        case 'k':
+            gen.keep_alive = 1;
+            break;
+        case 'o':
+            gen.out_path = optarg;
+            break;
+        case 'e':
+            if (gen.endpoint_count == LOAD_MAX_ENDPOINTS) {
+                fprintf(stderr, "load_gen: at most %d endpoints\n",
+                        LOAD_MAX_ENDPOINTS);
+                return 2;
+            }
+            gen.endpoints[gen.endpoint_count++].path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (gen.endpoint_count == 0) {
+        gen.endpoints[gen.endpoint_count++].path = "/";
+    }
+    if (gen.rate <= 0 || gen.duration_s <= 0 || gen.connection_count <= 0 ||
+        gen.timeout_s <= 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    gen.address.sin_family = AF_INET;
+    gen.address.sin_port   = htons((uint16_t)gen.port);
+    if (inet_pton(AF_INET, gen.host, &gen.address.sin_addr) != 1) {
+        fprintf(stderr, "load_gen: --host must be an IPv4 address\n");
+        return 2;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    gen.connections = calloc((size_t)gen.connection_count,
+                             sizeof(LoadConnection));
+    gen.epoll_fd    = epoll_create1(EPOLL_CLOEXEC);
+    gen.timer_fd    = timerfd_create(CLOCK_MONOTONIC,
+                                     TFD_NONBLOCK | TFD_CLOEXEC);
+    if (!gen.connections || gen.epoll_fd < 0 || gen.timer_fd < 0) {
+        perror("load_gen");
+        return 1;
+    }
+
+    for (int i = 0; i < gen.connection_count; i++) {
+        LoadConnection* conn = &gen.connections[i];
+        conn->fd             = -1;
+        conn->read_capacity  = 16384;
+        conn->read_buffer    = malloc(conn->read_capacity + 1);
+        if (!conn->read_buffer) {
+            perror("load_gen");
+            return 1;
+        }
+    }
+
+    run(&gen);
+
+    FILE* out = stdout;
+    if (gen.out_path) {
+        out = fopen(gen.out_path, "w");
+        if (!out) {
+            perror(gen.out_path);
+            return 1;
+        }
+    }
+    report(&gen, out);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    return 0;
+}
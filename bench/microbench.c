@@ -0,0 +1,607 @@
+/**
+ * microbench.c - Microbenchmarks for the hot library components
+ *
+ * Runs each benchmark long enough to fill --min-time and reports ns/op,
+ * allocations/op and allocated bytes/op as JSON:
+ *
+ *   {"benchmarks":[
+ *     {"name":"cache_get/entries=128/value=64","iterations":1048576,
+ *      "ns_per_op":312.4,"allocs_per_op":1.00,"bytes_per_op":64.0},
+ *     ...
+ *   ]}
+ *
+ *   microbench [--filter SUBSTRING] [--min-time SECONDS] [--data DIR]
+ *              [--out FILE]
+ *
+ * Allocations are counted by interposing malloc, calloc and realloc (glibc
+ * routes its own internal allocations, e.g. strdup, through them too).
+ * --data is the directory with hot_cities.json and all_cities.json; the
+ * city search benchmarks are skipped when it has none.
+ */
+
+#define _GNU_SOURCE
+
+#include "cache.h"
+#include "http_client.h"
+#include "http_server_connection.h"
+#include "json_writer.h"
+#include "open_meteo_handler.h"
+#include "popular_cities.h"
+#include "smw.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef void (*BenchFunction)(void* arg, uint64_t iterations);
+
+static const char* g_filter   = NULL;
+static double      g_min_time = 0.5;
+static FILE*       g_out      = NULL;
+static int         g_reported = 0;
+
+// Keeps results alive so the compiler cannot drop the measured work
+static volatile size_t g_sink;
+
+//-------------------Allocation counting--------------------
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static _Thread_local uint64_t t_allocs = 0;
+static _Thread_local uint64_t t_bytes  = 0;
+
+void* malloc(size_t size) {
+    t_allocs++;
+    t_bytes += size;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    t_allocs++;
+    t_bytes += count * size;
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    t_allocs++;
+    t_bytes += size;
+    return __libc_realloc(ptr, size);
+}
+
+//-------------------------Runner---------------------------
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void bench_run(const char* name, BenchFunction function, void* arg) {
+    if (g_filter && !strstr(name, g_filter)) {
+        return;
+    }
+
+    // Warm caches and lazy initialization outside the measurement
+    function(arg, 1);
+
+    uint64_t iterations = 1;
+    uint64_t elapsed    = 0;
+    uint64_t allocs     = 0;
+    uint64_t bytes      = 0;
+    uint64_t target_ns  = (uint64_t)(g_min_time * 1e9);
+
+    for (;;) {
+        uint64_t allocs_before = t_allocs;
+        uint64_t bytes_before  = t_bytes;
+        uint64_t start         = now_ns();
+
+        function(arg, iterations);
+
+        elapsed = now_ns() - start;
+        allocs  = t_allocs - allocs_before;
+        bytes   = t_bytes - bytes_before;
+
+        if (elapsed >= target_ns || iterations >= (1ULL << 40)) {
+            break;
+        }
+
+        // Aim 20% past the target, growing at most 100x per round
+        uint64_t next = elapsed > 0 ? (uint64_t)((double)iterations *
+                                                 1.2 * (double)target_ns /
+                                                 (double)elapsed)
+                                    : iterations * 100;
+        if (next > iterations * 100) {
+            next = iterations * 100;
+        }
+        iterations = next > iterations ? next : iterations + 1;
+    }
+
+    fprintf(g_out,
+            "%s\n    {\"name\":\"%s\",\"iterations\":%llu,"
+            "\"ns_per_op\":%.1f,\"allocs_per_op\":%.2f,"
+            "\"bytes_per_op\":%.1f}",
+            g_reported++ ? "," : "", name, (unsigned long long)iterations,
+            (double)elapsed / (double)iterations,
+            (double)allocs / (double)iterations,
+            (double)bytes / (double)iterations);
+    fflush(g_out);
+}
+
+//-------------------------Cache----------------------------
+
+#define CACHE_KEY_COUNT 512
+
+typedef struct {
+    Cache* cache;
+    char   keys[CACHE_KEY_COUNT][64];
+    size_t entries;
+    char*  value;
+    size_t value_size;
+} CacheBench;
+
+static void bench_cache_set(void* arg, uint64_t iterations) {
+    CacheBench* bench = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        cache_set(bench->cache, bench->keys[i % bench->entries], bench->value,
+                  bench->value_size, 0);
+    }
+}
+
+static void bench_cache_get(void* arg, uint64_t iterations) {
+    CacheBench* bench = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        size_t size = 0;
+        void*  data =
+            cache_get(bench->cache, bench->keys[i % bench->entries], &size);
+        g_sink += size;
+        free(data);
+    }
+}
+
+static void bench_cache_get_miss(void* arg, uint64_t iterations) {
+    CacheBench* bench = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        size_t size = 0;
+        g_sink += cache_get(bench->cache, "missing-key", &size) != NULL;
+    }
+}
+
+static void bench_cache_peek(void* arg, uint64_t iterations) {
+    CacheBench* bench = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        size_t size   = 0;
+        time_t expiry = 0;
+        cache_peek(bench->cache, bench->keys[i % bench->entries], &size,
+                   &expiry);
+        g_sink += size;
+    }
+}
+
+static void run_cache_benchmarks(void) {
+    static const size_t ENTRIES[] = {16, 128, CACHE_KEY_COUNT};
+    static const size_t VALUES[]  = {64, 4096};
+
+    static CacheBench bench;
+    for (size_t i = 0; i < CACHE_KEY_COUNT; i++) {
+        snprintf(bench.keys[i], sizeof(bench.keys[i]),
+                 "/v1/weather?city=City%04zu|compact", i);
+    }
+
+    for (size_t e = 0; e < sizeof(ENTRIES) / sizeof(ENTRIES[0]); e++) {
+        for (size_t v = 0; v < sizeof(VALUES) / sizeof(VALUES[0]); v++) {
+            bench.entries    = ENTRIES[e];
+            bench.value_size = VALUES[v];
+            bench.value      = calloc(1, bench.value_size);
+            bench.cache      = cache_create_named("microbench", bench.entries,
+                                                  3600);
+            if (!bench.value || !bench.cache) {
+                fprintf(stderr, "microbench: cache setup failed\n");
+                exit(1);
+            }
+            for (size_t k = 0; k < bench.entries; k++) {
+                cache_set(bench.cache, bench.keys[k], bench.value,
+                          bench.value_size, 0);
+            }
+
+            char name[128];
+            snprintf(name, sizeof(name), "cache_set/entries=%zu/value=%zu",
+                     bench.entries, bench.value_size);
+            bench_run(name, bench_cache_set, &bench);
+            snprintf(name, sizeof(name), "cache_get/entries=%zu/value=%zu",
+                     bench.entries, bench.value_size);
+            bench_run(name, bench_cache_get, &bench);
+            snprintf(name, sizeof(name), "cache_peek/entries=%zu/value=%zu",
+                     bench.entries, bench.value_size);
+            bench_run(name, bench_cache_peek, &bench);
+            if (v == 0) {
+                snprintf(name, sizeof(name), "cache_get_miss/entries=%zu",
+                         bench.entries);
+                bench_run(name, bench_cache_get_miss, &bench);
+            }
+
+            cache_destroy(bench.cache);
+            free(bench.value);
+        }
+    }
+}
+
+//----------------------City search-------------------------
+
+typedef struct {
+    PopularCitiesDB* db;
+    const char*      query;
+} SearchBench;
+
+static void bench_popular_cities_search(void* arg, uint64_t iterations) {
+    SearchBench* bench = arg;
+    PopularCity* results[10];
+    for (uint64_t i = 0; i < iterations; i++) {
+        size_t count = 0;
+        popular_cities_search(bench->db, bench->query, results, &count, 10);
+        g_sink += count;
+    }
+}
+
+static void run_search_benchmarks(const char* data_dir) {
+    static const char* QUERIES[] = {"s", "Sto", "Stockholm", "New Y", "zzzz"};
+
+    char hot[512];
+    char full[512];
+    snprintf(hot, sizeof(hot), "%s/hot_cities.json", data_dir);
+    snprintf(full, sizeof(full), "%s/all_cities.json", data_dir);
+    if (access(hot, R_OK) != 0 || access(full, R_OK) != 0) {
+        fprintf(stderr, "microbench: no city data in %s, skipping search\n",
+                data_dir);
+        return;
+    }
+
+    SearchBench bench = {0};
+    if (popular_cities_load(hot, full, &bench.db) != 0) {
+        fprintf(stderr, "microbench: cannot load city data from %s\n",
+                data_dir);
+        return;
+    }
+
+    for (size_t i = 0; i < sizeof(QUERIES) / sizeof(QUERIES[0]); i++) {
+        char name[128];
+        bench.query = QUERIES[i];
+        snprintf(name, sizeof(name), "popular_cities_search/query=%s",
+                 QUERIES[i]);
+        bench_run(name, bench_popular_cities_search, &bench);
+    }
+
+    popular_cities_free(bench.db);
+}
+
+//---------------------Request parsing----------------------
+
+typedef struct {
+    int         fds[2];
+    const char* request;
+    size_t      length;
+    int         split; // Deliver in two writes, cycling the split point
+} ReceiveBench;
+
+static int on_request_noop(void* context) {
+    (void)context;
+    return 0;
+}
+
+// Call receive until the connection has consumed `size` bytes or left the
+// RECEIVE state
+static void receive_until(HTTPServerConnection* connection, size_t size) {
+    for (int guard = 0; guard < 10000; guard++) {
+        if (connection->state != HTTP_SERVER_CONNECTION_STATE_RECEIVE ||
+            connection->read_buffer_size >= size) {
+            return;
+        }
+        if (http_server_connection_receive(connection) < 0) {
+            break;
+        }
+    }
+    fprintf(stderr, "microbench: request parsing did not finish\n");
+    exit(1);
+}
+
+static void bench_receive(void* arg, uint64_t iterations) {
+    ReceiveBench* bench = arg;
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        size_t split = bench->split ? 1 + i % (bench->length - 1)
+                                    : bench->length;
+
+        HTTPServerConnection connection;
+        http_server_connection_initiate(&connection, bench->fds[0]);
+        http_server_connection_set_callback(&connection, NULL,
+                                            on_request_noop);
+
+        if (send(bench->fds[1], bench->request, split, 0) != (ssize_t)split) {
+            exit(1);
+        }
+        receive_until(&connection, split);
+
+        if (split < bench->length) {
+            size_t rest = bench->length - split;
+            if (send(bench->fds[1], bench->request + split, rest, 0) !=
+                (ssize_t)rest) {
+                exit(1);
+            }
+        }
+        receive_until(&connection, SIZE_MAX);
+
+        g_sink += connection.body_start;
+
+        // Keep the socket pair for the next request
+        connection.tcpClient.fd = -1;
+        http_server_connection_dispose(&connection);
+    }
+}
+
+static void run_receive_benchmarks(void) {
+    static const struct {
+        const char* name;
+        const char* request;
+    } REQUESTS[] = {
+        {"minimal", "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n"},
+        {"browser",
+         "GET /v1/weather?city=Stockholm&country=SE HTTP/1.1\r\n"
+         "Host: localhost:10680\r\n"
+         "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) "
+         "Gecko/20100101 Firefox/128.0\r\n"
+         "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+         "*/*;q=0.8\r\n"
+         "Accept-Language: sv-SE,sv;q=0.8,en-US;q=0.5,en;q=0.3\r\n"
+         "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+         "Connection: keep-alive\r\n"
+         "Upgrade-Insecure-Requests: 1\r\n"
+         "Sec-Fetch-Dest: document\r\n"
+         "Sec-Fetch-Mode: navigate\r\n"
+         "Sec-Fetch-Site: none\r\n"
+         "If-None-Match: \"9f86d081884c7d65-gzip\"\r\n"
+         "\r\n"},
+        {"post",
+         "POST /echo HTTP/1.1\r\n"
+         "Host: localhost\r\n"
+         "Content-Type: application/json\r\n"
+         "Content-Length: 64\r\n"
+         "\r\n"
+         "{\"city\":\"Stockholm\",\"country\":\"SE\","
+         "\"units\":\"metric\",\"x\":1234567}"},
+    };
+
+    ReceiveBench bench;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, bench.fds) != 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    fcntl(bench.fds[0], F_SETFL, fcntl(bench.fds[0], F_GETFL) | O_NONBLOCK);
+
+    for (size_t i = 0; i < sizeof(REQUESTS) / sizeof(REQUESTS[0]); i++) {
+        bench.request = REQUESTS[i].request;
+        bench.length  = strlen(bench.request);
+
+        char name[128];
+        bench.split = 0;
+        snprintf(name, sizeof(name),
+                 "http_server_connection_receive/request=%s/split=none",
+                 REQUESTS[i].name);
+        bench_run(name, bench_receive, &bench);
+
+        bench.split = 1;
+        snprintf(name, sizeof(name),
+                 "http_server_connection_receive/request=%s/split=every",
+                 REQUESTS[i].name);
+        bench_run(name, bench_receive, &bench);
+    }
+
+    close(bench.fds[0]);
+    close(bench.fds[1]);
+}
+
+//---------------------Chunked decoding---------------------
+
+typedef struct {
+    uint8_t* encoded;
+    size_t   length;
+} ChunkedBench;
+
+static void bench_decode_chunked(void* arg, uint64_t iterations) {
+    ChunkedBench* bench = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        char*  out    = NULL;
+        size_t length = 0;
+        if (http_client_decode_chunked(bench->encoded, bench->length, &out,
+                                       &length) != 0) {
+            fprintf(stderr, "microbench: chunked decoding failed\n");
+            exit(1);
+        }
+        g_sink += length;
+        free(out);
+    }
+}
+
+static void run_chunked_benchmarks(void) {
+    static const struct {
+        size_t size;
+        size_t chunk;
+    } CASES[] = {{1024, 256}, {16384, 16384}, {16384, 512}, {262144, 4096}};
+
+    for (size_t i = 0; i < sizeof(CASES) / sizeof(CASES[0]); i++) {
+        size_t       chunks = CASES[i].size / CASES[i].chunk;
+        ChunkedBench bench;
+        bench.encoded = malloc(CASES[i].size + chunks * 16 + 8);
+        bench.length  = 0;
+        if (!bench.encoded) {
+            exit(1);
+        }
+
+        for (size_t c = 0; c < chunks; c++) {
+            bench.length += (size_t)sprintf(
+                (char*)bench.encoded + bench.length, "%zx\r\n", CASES[i].chunk);
+            memset(bench.encoded + bench.length, 'a' + (int)(c % 26),
+                   CASES[i].chunk);
+            bench.length += CASES[i].chunk;
+            memcpy(bench.encoded + bench.length, "\r\n", 2);
+            bench.length += 2;
+        }
+        memcpy(bench.encoded + bench.length, "0\r\n\r\n", 5);
+        bench.length += 5;
+
+        char name[128];
+        snprintf(name, sizeof(name), "decode_chunked/size=%zu/chunk=%zu",
+                 CASES[i].size, CASES[i].chunk);
+        bench_run(name, bench_decode_chunked, &bench);
+
+        free(bench.encoded);
+    }
+}
+
+//----------------------JSON building-----------------------
+
+typedef struct {
+    WeatherData weather;
+    bool        pretty;
+    JsonWriter  writer;
+} JsonBench;
+
+// Reuses one writer, like a connection that keeps its buffer
+static void bench_write_current(void* arg, uint64_t iterations) {
+    JsonBench* bench = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        json_writer_reset(&bench->writer);
+        open_meteo_handler_write_current(&bench->writer, &bench->weather,
+                                         59.3293, 18.0686);
+        json_writer_finish(&bench->writer);
+        g_sink += bench->writer.size;
+    }
+}
+
+// A fresh writer per response, as the request handlers use it
+static void bench_write_current_new(void* arg, uint64_t iterations) {
+    JsonBench* bench = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        JsonWriter writer;
+        json_writer_init(&writer, 384, bench->pretty);
+        open_meteo_handler_write_current(&writer, &bench->weather, 59.3293,
+                                         18.0686);
+        json_writer_finish(&writer);
+        g_sink += writer.size;
+        json_writer_dispose(&writer);
+    }
+}
+
+static void run_json_benchmarks(void) {
+    static JsonBench bench = {
+        .weather = {.temperature      = 12.3,
+                    .temperature_unit = "°C",
+                    .windspeed        = 4.5,
+                    .windspeed_unit   = "km/h",
+                    .winddirection    = 270,
+                    .weather_code     = 3,
+                    .is_day           = 1,
+                    .precipitation    = 0.1,
+                    .humidity         = 81,
+                    .pressure         = 1013.2},
+    };
+
+    for (int pretty = 0; pretty <= 1; pretty++) {
+        bench.pretty = pretty;
+        if (json_writer_init(&bench.writer, 384, bench.pretty) != 0) {
+            exit(1);
+        }
+
+        char name[128];
+        snprintf(name, sizeof(name),
+                 "open_meteo_handler_write_current/format=%s/writer=reused",
+                 pretty ? "pretty" : "compact");
+        bench_run(name, bench_write_current, &bench);
+        snprintf(name, sizeof(name),
+                 "open_meteo_handler_write_current/format=%s/writer=new",
+                 pretty ? "pretty" : "compact");
+        bench_run(name, bench_write_current_new, &bench);
+
+        json_writer_dispose(&bench.writer);
+    }
+}
+
+//--------------------------Main----------------------------
+
+static void usage(const char* name) {
+    fprintf(stderr,
+            "usage: %s [--filter SUBSTRING] [--min-time SECONDS] "
+            "[--data DIR] [--out FILE]\n",
+            name);
+}
+
+int main(int argc, char** argv) {
+    const char* data_dir = "./data";
+    const char* out_path = NULL;
+
+    static const struct option OPTIONS[] = {
+        {"filter", required_argument, NULL, 'f'},
+        {"min-time", required_argument, NULL, 't'},
+        {"data", required_argument, NULL, 'd'},
+        {"out", required_argument, NULL, 'o'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", OPTIONS, NULL)) != -1) {
+        switch (opt) {
+        case 'f':
+            g_filter = optarg;
+            break;
+        case 't':
+            g_min_time = atof(optarg);
+            break;
+        case 'd':
+            data_dir = optarg;
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    // The library logs to stdout in places; keep stdout for the report and
+    // send everything else to stderr
+    g_out = out_path ? fopen(out_path, "w") : fdopen(dup(STDOUT_FILENO), "w");
+    if (!g_out) {
+        perror(out_path ? out_path : "stdout");
+        return 1;
+    }
+    fflush(stdout);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    // Connections register smw tasks
+    if (smw_init() != 0) {
+        fprintf(stderr, "microbench: smw_init failed\n");
+        return 1;
+    }
+
+    fprintf(g_out, "{\"benchmarks\":[");
+
+    run_cache_benchmarks();
+    run_search_benchmarks(data_dir);
+    run_receive_benchmarks();
+    run_chunked_benchmarks();
+    run_json_benchmarks();
+
+    fprintf(g_out, "\n]}\n");
+
+    fclose(g_out);
+    smw_dispose();
+
+    return 0;
+}
@@ -0,0 +1,82 @@
+#!/usr/bin/env bash
+# Start the stub upstream and the weather server pointed at it, run the
+# open-loop load generator against the server and print its JSON report.
+# All load comes from one address, so rate limiting is off unless the
+# JUST_WEATHER_* limits are set in the environment.
+#
+# Usage: bench/run_bench.sh SERVER_BIN TOOLS_DIR
+#
+# Tunables (environment):
+#   BENCH_RATE         requests per second      (default 500)
+#   BENCH_DURATION     measured seconds         (default 10)
+#   BENCH_WARMUP       unrecorded seconds first (default 2)
+#   BENCH_CONNECTIONS  concurrent connections   (default 64)
+#   BENCH_ENDPOINTS    space separated paths    (default: see below)
+#   BENCH_OUT          report file              (default TOOLS_DIR/bench.json)
+#   STUB_PORT          stub upstream port       (default 18080)
+#   STUB_LATENCY_MS    stub response delay      (default 20)
+#   STUB_JITTER_MS     +/- random delay on top  (default 5)
+set -euo pipefail
+
+server=$1
+tools=$2
+
+rate=${BENCH_RATE:-500}
+duration=${BENCH_DURATION:-10}
+warmup=${BENCH_WARMUP:-2}
+connections=${BENCH_CONNECTIONS:-64}
+default_endpoints="/ /v1/current?lat=59.33&lon=18.07"
+default_endpoints+=" /v1/weather?city=Stockholm&country=SE /v1/cities?query=Sto"
+endpoints=${BENCH_ENDPOINTS:-$default_endpoints}
+out=${BENCH_OUT:-$tools/bench.json}
+stub_port=${STUB_PORT:-18080}
+server_port=10680
+rate_limits=${JUST_WEATHER_RATE_LIMITS:-*=0}
+max_client_connections=${JUST_WEATHER_MAX_CONNECTIONS_PER_CLIENT:-0}
+
+pids=()
+cleanup() {
+    for pid in "${pids[@]}"; do
+        kill "$pid" 2>/dev/null || true
+    done
+    wait 2>/dev/null || true
+}
+trap cleanup EXIT
+
+wait_for_port() {
+    for _ in $(seq 100); do
+        if (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    echo "Nothing listening on port $1" >&2
+    return 1
+}
+
+"$tools/stub_upstream" --port "$stub_port" \
+    --latency-ms "${STUB_LATENCY_MS:-20}" \
+    --jitter-ms "${STUB_JITTER_MS:-5}" &
+pids+=($!)
+wait_for_port "$stub_port"
+
+JUST_WEATHER_UPSTREAM="127.0.0.1:$stub_port" \
+JUST_WEATHER_LOG_LEVEL=${JUST_WEATHER_LOG_LEVEL:-warn} \
+JUST_WEATHER_RATE_LIMITS=$rate_limits \
+JUST_WEATHER_MAX_CONNECTIONS_PER_CLIENT=$max_client_connections \
+    "$server" &
+pids+=($!)
+wait_for_port "$server_port"
+
+args=()
+for endpoint in $endpoints; do
+    args+=(--endpoint "$endpoint")
+done
+
+echo "Benchmarking $rate req/s for ${duration}s," \
+    "$connections connections..." >&2
+"$tools/load_gen" --port "$server_port" --rate "$rate" \
+    --duration "$duration" --warmup "$warmup" \
+    --connections "$connections" --out "$out" "${args[@]}"
+
+cat "$out"
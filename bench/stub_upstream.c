@@ -0,0 +1,539 @@
+/**
+ * stub_upstream.c - Local stand-in for the Open-Meteo APIs
+ *
+ * Answers the forecast (/v1/forecast) and geocoding (/v1/search) endpoints
+ * with responses in the Open-Meteo JSON shapes, after a configurable delay,
+ * so the weather server can be load tested without touching the network.
+ * Single threaded: one epoll loop and a min-heap of delayed responses.
+ *
+ *   stub_upstream [--port 18080] [--latency-ms 20] [--jitter-ms 5]
+ *
+ * Each response is delayed by latency-ms plus a uniform random offset in
+ * [-jitter-ms, +jitter-ms] (never below zero).
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STUB_MAX_FDS 65536
+#define STUB_READ_MAX 8192
+#define STUB_BODY_MAX 2048
+#define STUB_EVENTS 256
+
+typedef struct {
+    int      open;
+    uint32_t generation; // Bumped on close so stale heap entries are ignored
+    int      pending;    // A response is waiting in the heap
+    int      close_after;
+    char     read_buffer[STUB_READ_MAX];
+    size_t   read_size;
+    char*    write_buffer;
+    size_t   write_size;
+    size_t   write_offset;
+} StubConnection;
+
+typedef struct {
+    uint64_t due_ns;
+    int      fd;
+    uint32_t generation;
+} StubTimer;
+
+static StubConnection* g_connections;
+static StubTimer*      g_timers;
+static size_t          g_timer_count    = 0;
+static size_t          g_timer_capacity = 0;
+static int             g_epoll          = -1;
+static uint64_t        g_latency_ns     = 20000000ULL;
+static uint64_t        g_jitter_ns      = 5000000ULL;
+static uint64_t        g_rng            = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t next_random(void) {
+    g_rng ^= g_rng << 13;
+    g_rng ^= g_rng >> 7;
+    g_rng ^= g_rng << 17;
+    return g_rng;
+}
+
+static uint64_t response_delay_ns(void) {
+    if (g_jitter_ns == 0) {
+        return g_latency_ns;
+    }
+
+    int64_t offset = (int64_t)(next_random() % (2 * g_jitter_ns + 1)) -
+                     (int64_t)g_jitter_ns;
+    int64_t delay  = (int64_t)g_latency_ns + offset;
+    return delay > 0 ? (uint64_t)delay : 0;
+}
+
+//------------------------Timer heap------------------------
+
+static void timer_push(StubTimer timer) {
+    if (g_timer_count == g_timer_capacity) {
+        g_timer_capacity = g_timer_capacity ? g_timer_capacity * 2 : 1024;
+        g_timers = realloc(g_timers, g_timer_capacity * sizeof(StubTimer));
+        if (!g_timers) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    size_t i = g_timer_count++;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (g_timers[parent].due_ns <= timer.due_ns) {
+            break;
+        }
+        g_timers[i] = g_timers[parent];
+        i           = parent;
+    }
+    g_timers[i] = timer;
+}
+
+static StubTimer timer_pop(void) {
+    StubTimer top  = g_timers[0];
+    StubTimer last = g_timers[--g_timer_count];
+
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= g_timer_count) {
+            break;
+        }
+        if (child + 1 < g_timer_count &&
+            g_timers[child + 1].due_ns < g_timers[child].due_ns) {
+            child++;
+        }
+        if (last.due_ns <= g_timers[child].due_ns) {
+            break;
+        }
+        g_timers[i] = g_timers[child];
+        i           = child;
+    }
+    if (g_timer_count > 0) {
+        g_timers[i] = last;
+    }
+
+    return top;
+}
+
+//-----------------------Responses--------------------------
+
+// Value of "name=" in a query string, URL decoded into out
+static int query_param(const char* query, const char* name, char* out,
+                       size_t out_size) {
+    size_t name_len = strlen(name);
+    const char* p   = query;
+
+    while (p && *p) {
+        if (strncmp(p, name, name_len) == 0 && p[name_len] == '=') {
+            p += name_len + 1;
+            size_t n = 0;
+            while (*p && *p != '&' && n + 1 < out_size) {
+                if (*p == '%' && p[1] && p[2]) {
+                    char hex[3] = {p[1], p[2], 0};
+                    out[n++]    = (char)strtol(hex, NULL, 16);
+                    p += 3;
+                } else {
+                    out[n++] = *p == '+' ? ' ' : *p;
+                    p++;
+                }
+            }
+            out[n] = '\0';
+            return 0;
+        }
+        p = strchr(p, '&');
+        if (p) {
+            p++;
+        }
+    }
+
+    return -1;
+}
+
+// Copy s as JSON string content, dropping anything that would need escaping
+static void json_safe(const char* s, char* out, size_t out_size) {
+    size_t n = 0;
+    for (; *s && n + 1 < out_size; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            out[n++] = (char)c;
+        }
+    }
+    out[n] = '\0';
+}
+
+static int forecast_body(const char* query, char* body, size_t size) {
+    char   lat_str[32] = "59.3293";
+    char   lon_str[32] = "18.0686";
+    query_param(query, "latitude", lat_str, sizeof(lat_str));
+    query_param(query, "longitude", lon_str, sizeof(lon_str));
+    double lat = atof(lat_str);
+    double lon = atof(lon_str);
+
+    return snprintf(
+        body, size,
+        "{\"latitude\":%.4f,\"longitude\":%.4f,\"generationtime_ms\":0.05,"
+        "\"utc_offset_seconds\":0,\"timezone\":\"GMT\","
+        "\"timezone_abbreviation\":\"GMT\",\"elevation\":28.0,"
+        "\"current_weather_units\":{\"time\":\"iso8601\","
+        "\"interval\":\"seconds\",\"temperature\":\"°C\","
+        "\"windspeed\":\"km/h\",\"winddirection\":\"°\","
+        "\"is_day\":\"\",\"weathercode\":\"wmo code\"},"
+        "\"current_weather\":{\"time\":\"2026-01-01T12:00\",\"interval\":900,"
+        "\"temperature\":12.3,\"windspeed\":4.5,\"winddirection\":270,"
+        "\"is_day\":1,\"weathercode\":3},"
+        "\"current_units\":{\"relative_humidity_2m\":\"%%\","
+        "\"precipitation\":\"mm\",\"surface_pressure\":\"hPa\"},"
+        "\"current\":{\"time\":\"2026-01-01T12:00\",\"interval\":900,"
+        "\"relative_humidity_2m\":81,\"precipitation\":0.1,"
+        "\"surface_pressure\":1013.2}}",
+        lat, lon);
+}
+
+static int geocoding_body(const char* query, char* body, size_t size) {
+    char name[128] = "Stockholm";
+    char safe[128];
+    query_param(query, "name", name, sizeof(name));
+    json_safe(name, safe, sizeof(safe));
+
+    return snprintf(
+        body, size,
+        "{\"results\":[{\"id\":2673730,\"name\":\"%s\","
+        "\"latitude\":59.32938,\"longitude\":18.06871,\"elevation\":28.0,"
+        "\"feature_code\":\"PPLC\",\"country_code\":\"SE\","
+        "\"admin1_id\":2673722,\"timezone\":\"Europe/Stockholm\","
+        "\"population\":1515017,\"country_id\":2661886,"
+        "\"country\":\"Sweden\",\"admin1\":\"Stockholm\"}],"
+        "\"generationtime_ms\":0.5}",
+        safe);
+}
+
+// Build the response for the request at the start of the read buffer.
+// Returns the request length, 0 if it is incomplete, -1 if it is invalid.
+static int build_response(StubConnection* conn) {
+    conn->read_buffer[conn->read_size] = '\0';
+    char* end = strstr(conn->read_buffer, "\r\n\r\n");
+    if (!end) {
+        return conn->read_size >= STUB_READ_MAX - 1 ? -1 : 0;
+    }
+
+    char method[16];
+    char target[1024];
+    if (sscanf(conn->read_buffer, "%15s %1023s", method, target) != 2) {
+        return -1;
+    }
+
+    char* close_header = strcasestr(conn->read_buffer, "connection: close");
+    conn->close_after  = close_header != NULL && close_header < end;
+
+    char*       query  = strchr(target, '?');
+    const char* params = "";
+    if (query) {
+        *query = '\0';
+        params = query + 1;
+    }
+
+    char body[STUB_BODY_MAX];
+    int  status = 200;
+    int  length;
+    if (strcmp(target, "/v1/forecast") == 0) {
+        length = forecast_body(params, body, sizeof(body));
+    } else if (strcmp(target, "/v1/search") == 0) {
+        length = geocoding_body(params, body, sizeof(body));
+    } else {
+        status = 404;
+        length = snprintf(body, sizeof(body),
+                          "{\"error\":true,\"reason\":\"Not found\"}");
+    }
+
+    char* response = malloc(STUB_BODY_MAX + 256);
+    if (!response) {
+        return -1;
+    }
+    int head = snprintf(response, 256,
+                        "HTTP/1.1 %d %s\r\n"
+                        "Content-Type: application/json; charset=utf-8\r\n"
+                        "Content-Length: %d\r\n"
+                        "Connection: %s\r\n"
+                        "\r\n",
+                        status, status == 200 ? "OK" : "Not Found", length,
+                        conn->close_after ? "close" : "keep-alive");
+    memcpy(response + head, body, (size_t)length);
+
+    conn->write_buffer = response;
+    conn->write_size   = (size_t)(head + length);
+    conn->write_offset = 0;
+
+    return (int)(end + 4 - conn->read_buffer);
+}
+
+//----------------------Connections-------------------------
+
+static void connection_close(int fd) {
+    StubConnection* conn = &g_connections[fd];
+
+    epoll_ctl(g_epoll, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    free(conn->write_buffer);
+    conn->write_buffer = NULL;
+    conn->open         = 0;
+    conn->pending      = 0;
+    conn->generation++;
+}
+
+// Parse the next buffered request and schedule its response
+static void connection_parse(int fd) {
+    StubConnection* conn = &g_connections[fd];
+    if (conn->pending || conn->write_buffer || conn->read_size == 0) {
+        return;
+    }
+
+    int consumed = build_response(conn);
+    if (consumed < 0) {
+        connection_close(fd);
+        return;
+    }
+    if (consumed == 0) {
+        return;
+    }
+
+    memmove(conn->read_buffer, conn->read_buffer + consumed,
+            conn->read_size - (size_t)consumed);
+    conn->read_size -= (size_t)consumed;
+
+    conn->pending = 1;
+    timer_push((StubTimer){now_ns() + response_delay_ns(), fd,
+                           conn->generation});
+}
+
+static void connection_write(int fd) {
+    StubConnection* conn = &g_connections[fd];
+    if (!conn->write_buffer) {
+        return;
+    }
+
+    while (conn->write_offset < conn->write_size) {
+        ssize_t n = send(fd, conn->write_buffer + conn->write_offset,
+                         conn->write_size - conn->write_offset, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct epoll_event ev = {.events  = EPOLLIN | EPOLLOUT,
+                                         .data.fd = fd};
+                epoll_ctl(g_epoll, EPOLL_CTL_MOD, fd, &ev);
+                return;
+            }
+            connection_close(fd);
+            return;
+        }
+        conn->write_offset += (size_t)n;
+    }
+
+    free(conn->write_buffer);
+    conn->write_buffer = NULL;
+
+    if (conn->close_after) {
+        connection_close(fd);
+        return;
+    }
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+    epoll_ctl(g_epoll, EPOLL_CTL_MOD, fd, &ev);
+    connection_parse(fd);
+}
+
+static void connection_read(int fd) {
+    StubConnection* conn = &g_connections[fd];
+
+    for (;;) {
+        if (conn->read_size >= STUB_READ_MAX - 1) {
+            break;
+        }
+        ssize_t n = recv(fd, conn->read_buffer + conn->read_size,
+                         STUB_READ_MAX - 1 - conn->read_size, 0);
+        if (n > 0) {
+            conn->read_size += (size_t)n;
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        connection_close(fd);
+        return;
+    }
+
+    connection_parse(fd);
+}
+
+static void accept_all(int listen_fd) {
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        if (fd >= STUB_MAX_FDS) {
+            close(fd);
+            continue;
+        }
+
+        int yes = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+        StubConnection* conn = &g_connections[fd];
+        conn->open           = 1;
+        conn->pending        = 0;
+        conn->read_size      = 0;
+        conn->write_buffer   = NULL;
+
+        struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+        epoll_ctl(g_epoll, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+static void fire_timers(void) {
+    uint64_t now = now_ns();
+
+    while (g_timer_count > 0 && g_timers[0].due_ns <= now) {
+        StubTimer       timer = timer_pop();
+        StubConnection* conn  = &g_connections[timer.fd];
+        if (!conn->open || conn->generation != timer.generation) {
+            continue;
+        }
+        conn->pending = 0;
+        connection_write(timer.fd);
+    }
+}
+
+static int listen_on(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family         = AF_INET;
+    addr.sin_port           = htons((uint16_t)port);
+    addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(fd, 4096) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,
+            "usage: %s [--port N] [--latency-ms N] [--jitter-ms N] "
+            "[--seed N]\n",
+            name);
+}
+
+int main(int argc, char** argv) {
+    int port = 18080;
+
+    static const struct option OPTIONS[] = {
+        {"port", required_argument, NULL, 'p'},
+        {"latency-ms", required_argument, NULL, 'l'},
+        {"jitter-ms", required_argument, NULL, 'j'},
+        {"seed", required_argument, NULL, 's'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", OPTIONS, NULL)) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'l':
+            g_latency_ns = (uint64_t)(atof(optarg) * 1e6);
+            break;
+        case 'j':
+            g_jitter_ns = (uint64_t)(atof(optarg) * 1e6);
+            break;
+        case 's':
+            g_rng = strtoull(optarg, NULL, 10) | 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    g_connections = calloc(STUB_MAX_FDS, sizeof(StubConnection));
+    int listen_fd = listen_on(port);
+    g_epoll       = epoll_create1(EPOLL_CLOEXEC);
+    if (!g_connections || listen_fd < 0 || g_epoll < 0) {
+        fprintf(stderr, "stub_upstream: cannot listen on port %d: %s\n", port,
+                strerror(errno));
+        return 1;
+    }
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = listen_fd};
+    epoll_ctl(g_epoll, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    fprintf(stderr, "stub_upstream: listening on 127.0.0.1:%d\n", port);
+
+    struct epoll_event events[STUB_EVENTS];
+    for (;;) {
+        int timeout_ms = -1;
+        if (g_timer_count > 0) {
+            uint64_t now = now_ns();
+            timeout_ms   = g_timers[0].due_ns <= now
+                               ? 0
+                               : (int)((g_timers[0].due_ns - now + 999999) /
+                                     1000000);
+        }
+
+        int n = epoll_wait(g_epoll, events, STUB_EVENTS, timeout_ms);
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd) {
+                accept_all(listen_fd);
+                continue;
+            }
+            if (!g_connections[fd].open) {
+                continue;
+            }
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                connection_close(fd);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                connection_write(fd);
+            }
+            if (g_connections[fd].open && (events[i].events & EPOLLIN)) {
+                connection_read(fd);
+            }
+        }
+
+        fire_timers();
+    }
+}
@@ -1,6 +1,8 @@
 #include "http_client.h"
 
 #include "errno.h"
+#include "log.h"
+#include "metrics.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,12 +12,84 @@
 #define CHUNK_SIZE 4096
 #define PORTSIZE 100
 
-/* Decode HTTP chunked transfer encoding.
- * Returns 0 on success, non-zero on failure.
- * Allocates *out which must be freed by caller.
- */
-static int decode_chunked(const uint8_t* in, size_t in_len, char** out,
-                          size_t* out_len) {
+// Hosts with their own metric series; any further hosts share host="other"
+#define HTTP_CLIENT_METRIC_HOSTS 16
+
+// "host:port" every request connects to instead of the host in its URL.
+// The Host header and metrics still use the URL host. Used by `make bench`
+// to point the server at a local stub upstream.
+#define HTTP_CLIENT_UPSTREAM_ENV "JUST_WEATHER_UPSTREAM"
+
+// Once a request has been outstanding longer than its host's p95 latency, a
+// duplicate is sent and the first response wins. Every finished request
+// earns this percentage of a hedge, which caps the extra upstream load;
+// 0 disables hedging.
+#define HTTP_CLIENT_HEDGE_ENV "JUST_WEATHER_HEDGE_PERCENT"
+#define HTTP_CLIENT_HEDGE_PERCENT 5
+#define HTTP_CLIENT_HEDGE_BURST 10.0 // Most hedges that can be saved up
+
+// Rolling latency histogram per host: buckets sqrt(2) apart starting at
+// 1 ms, counted over the current and the previous window
+#define HTTP_CLIENT_LATENCY_BUCKETS 32
+#define HTTP_CLIENT_LATENCY_WINDOW_US (10 * 1000000ULL)
+#define HTTP_CLIENT_LATENCY_MIN_SAMPLES 20
+
+// Circuit breaker per host: this many consecutive failures (errors,
+// timeouts, 5xx) open it, failing requests right away. After the open
+// period it lets one probe through per probe interval; the first probe to
+// succeed closes it again, a failed one reopens it.
+#define HTTP_CLIENT_CIRCUIT_FAILURES 5
+#define HTTP_CLIENT_CIRCUIT_OPEN_US (5 * 1000000ULL)
+#define HTTP_CLIENT_CIRCUIT_PROBE_US (1 * 1000000ULL)
+
+typedef enum {
+    HTTP_CLIENT_OUTCOME_OK,         // 2xx response
+    HTTP_CLIENT_OUTCOME_HTTP_ERROR, // Non-2xx response
+    HTTP_CLIENT_OUTCOME_ERROR,      // Connect, send, read or parse failure
+    HTTP_CLIENT_OUTCOME_TIMEOUT,
+    HTTP_CLIENT_OUTCOME_REJECTED,   // Not sent, the circuit is open
+    HTTP_CLIENT_OUTCOME_COUNT,
+} HttpClientOutcome;
+
+typedef enum {
+    HTTP_CLIENT_CIRCUIT_CLOSED    = 0,
+    HTTP_CLIENT_CIRCUIT_OPEN      = 1,
+    HTTP_CLIENT_CIRCUIT_HALF_OPEN = 2,
+} HttpClientCircuit;
+
+typedef struct {
+    char     host[256];
+    MetricId latency;
+    MetricId outcomes[HTTP_CLIENT_OUTCOME_COUNT];
+
+    // Successful request latencies, current window first
+    uint32_t latency_counts[2][HTTP_CLIENT_LATENCY_BUCKETS];
+    uint64_t window_started_us;
+
+    double   hedge_tokens;
+    MetricId hedges;     // Duplicates sent
+    MetricId hedge_wins; // Duplicates that answered first
+
+    HttpClientCircuit circuit;
+    uint32_t          failures;  // Consecutive failures while closed
+    uint64_t          opened_us; // When the circuit last opened
+    uint64_t          probe_us;  // When the last half-open probe was sent
+    MetricId          circuit_state;
+} HttpClientHostMetrics;
+
+// Only touched from the smw thread, like the clients themselves
+static HttpClientHostMetrics g_host_metrics[HTTP_CLIENT_METRIC_HOSTS + 1];
+static int                   g_host_metric_count = 0;
+
+static int  g_upstream_loaded = 0;
+static char g_upstream_host[256];
+static char g_upstream_port[16];
+
+static int    g_hedge_loaded = 0;
+static double g_hedge_share  = 0; // Hedges earned per finished request
+
+int http_client_decode_chunked(const uint8_t* in, size_t in_len, char** out,
+                               size_t* out_len) {
     if (!in || !out || !out_len) {
         return -1;
     }
@@ -128,6 +202,17 @@ static int decode_chunked(const uint8_t* in, size_t in_len, char** out,
 void http_client_work(void* context, uint64_t mon_time);
 void http_client_dispose(HttpClient** client_ptr);
 int  parse_url(const char* url, char* hostname, char* port_str, char* path);
+static void http_client_record(HttpClient* client, HttpClientOutcome outcome);
+static void http_client_notify(HttpClient* client, const char* event,
+                               const char* message);
+static void http_client_release(HttpClient* client);
+static void http_client_hedge(HttpClient* client, uint64_t mon_time);
+static void http_client_on_hedge(void* context, const HttpClientResult* result);
+static HttpClientHostMetrics* http_client_host_metrics(const char* host);
+static int  http_client_circuit_allow(HttpClientHostMetrics* metrics);
+static void http_client_circuit_record(HttpClientHostMetrics* metrics,
+                                       int failed, uint64_t now_us);
+static int  http_client_upstream(const char** host, const char** port);
 
 //----------------------------------------------------
 
@@ -149,10 +234,16 @@ int http_client_init(const char* u_rl, HttpClient** client_ptr,
     /* ensure all fields start zeroed to avoid undefined state */
     client->state = HTTP_CLIENT_STATE_INIT;
 
-    client->task = smw_create_task(client, http_client_work);
+    client->task = smw_create_task_with_priority(client, http_client_work,
+                                                 SMW_PRIORITY_IO);
 
-    client->callback = NULL;
-    client->timer    = 0;
+    client->callback   = NULL;
+    client->on_result  = NULL;
+    client->context    = NULL;
+    client->notified   = 0;
+    client->cancelled  = 0;
+    client->timer      = 0;
+    client->started_us = metrics_now_us();
 
     /* copy url (url buffer already zeroed by calloc) */
     strcpy(client->url, u_rl);
@@ -192,21 +283,42 @@ int http_client_get(const char* url, uint64_t timeout,
     return 0;
 }
 
+int http_client_get_with_context(const char* url, uint64_t timeout,
+                                 HttpClientOnResult on_result, void* context,
+                                 HttpClient** client_ptr) {
+    HttpClient* client = NULL;
+    if (http_client_init(url, &client, NULL) != 0) {
+        return -1;
+    }
+
+    client->timeout   = timeout;
+    client->on_result = on_result;
+    client->context   = context;
+
+    if (client_ptr != NULL) {
+        *(client_ptr) = client;
+    }
+
+    return 0;
+}
+
+void http_client_cancel(HttpClient* client) {
+    if (client != NULL && !client->notified) {
+        client->cancelled = 1;
+    }
+}
+
 HttpClientState http_client_work_init(HttpClient* client) {
     // 1. Parse the URL to extract hostname, port, and path
     if (parse_url(client->url, client->hostname, client->port, client->path) !=
         0) {
-        if (client->callback != NULL) {
-            client->callback("ERROR", "Invalid URL");
-        }
+        http_client_notify(client, "ERROR", "Invalid URL");
         return HTTP_CLIENT_STATE_DISPOSE;
     }
 
     // 2. Validate the parsed data
     if (strlen(client->hostname) == 0) {
-        if (client->callback != NULL) {
-            client->callback("ERROR", "No hostname in URL");
-        }
+        http_client_notify(client, "ERROR", "No hostname in URL");
         return HTTP_CLIENT_STATE_DISPOSE;
     }
 
@@ -214,8 +326,8 @@ HttpClientState http_client_work_init(HttpClient* client) {
     client->response[0] = '\0';
 
     // 4. Log what we're about to do
-    printf("[HTTP_CLIENT] Connecting to %s:%s%s\n", client->hostname,
-           client->port, client->path);
+    LOG_DEBUG("http_client", "Connecting to %s:%s%s", client->hostname,
+              client->port, client->path);
     // Move to connect state
     return HTTP_CLIENT_STATE_CONNECT;
 }
@@ -224,22 +336,22 @@ HttpClientState http_client_work_connect(HttpClient* client) {
     // Allocate TCPClient on heap
     TCPClient* tcp_client = malloc(sizeof(TCPClient));
     if (tcp_client == NULL) {
-        if (client->callback != NULL) {
-            client->callback("ERROR", "Memory allocation failed");
-        }
+        http_client_notify(client, "ERROR", "Memory allocation failed");
         return HTTP_CLIENT_STATE_DISPOSE;
     }
 
     // Initialize the TCPClient
-    tcp_client->fd = -1;
+    tcp_client_initiate(tcp_client, -1);
 
-    // Connect using TCP module
-    int result = tcp_client_connect(tcp_client, client->hostname, client->port);
+    // Connect using TCP module, to the upstream override if one is set
+    const char* host = client->hostname;
+    const char* port = client->port;
+    http_client_upstream(&host, &port);
+
+    int result = tcp_client_connect(tcp_client, host, port);
 
     if (result != 0) {
-        if (client->callback != NULL) {
-            client->callback("ERROR", "Failed to initiate connection");
-        }
+        http_client_notify(client, "ERROR", "Failed to initiate connection");
         free(tcp_client);
         return HTTP_CLIENT_STATE_DISPOSE;
     }
@@ -250,30 +362,22 @@ HttpClientState http_client_work_connect(HttpClient* client) {
 }
 
 HttpClientState http_client_work_connecting(HttpClient* client) {
-    if (client->tcp_conn == NULL || client->tcp_conn->fd < 0) {
+    if (client->tcp_conn == NULL) {
         return HTTP_CLIENT_STATE_DISPOSE;
     }
 
-    int fd = client->tcp_conn->fd;
-
-    // Check if connection has completed
-    int       error = 0;
-    socklen_t len   = sizeof(error);
-    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
-        return HTTP_CLIENT_STATE_DISPOSE;
-    }
+    // Racing attempts to each resolved address, see tcp_client_connect
+    int result = tcp_client_connect_poll(client->tcp_conn);
 
-    if (error == 0) {
+    if (result == 1) {
         // Connection successful!
         return HTTP_CLIENT_STATE_WRITING;
-    } else if (error == EINPROGRESS || error == EALREADY) {
+    } else if (result == 0) {
         // Still connecting, try again next tick
         return HTTP_CLIENT_STATE_CONNECTING;
     } else {
         // Connection failed
-        if (client->callback != NULL) {
-            client->callback("ERROR", "Connection failed");
-        }
+        http_client_notify(client, "ERROR", "Connection failed");
         return HTTP_CLIENT_STATE_DISPOSE;
     }
 }
@@ -282,9 +386,7 @@ HttpClientState http_client_work_writing(HttpClient* client) {
     if (client->write_buffer == NULL) {
         client->write_buffer = malloc(2048);
         if (client->write_buffer == NULL) {
-            if (client->callback != NULL) {
-                client->callback("ERROR", "Memory allocation failed");
-            }
+            http_client_notify(client, "ERROR", "Memory allocation failed");
             return HTTP_CLIENT_STATE_DISPOSE;
         }
 
@@ -318,9 +420,7 @@ HttpClientState http_client_work_writing(HttpClient* client) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             return HTTP_CLIENT_STATE_WRITING; // Try again later
         } else {
-            if (client->callback != NULL) {
-                client->callback("ERROR", "Send failed");
-            }
+            http_client_notify(client, "ERROR", "Send failed");
             return HTTP_CLIENT_STATE_DISPOSE;
         }
     }
@@ -347,9 +447,7 @@ HttpClientState http_client_work_reading(HttpClient* client) {
         tcp_client_read(client->tcp_conn, chunk_buffer, sizeof(chunk_buffer));
 
     if (bytes_read < 0) {
-        if (client->callback) {
-            client->callback("ERROR", "Read failed");
-        }
+        http_client_notify(client, "ERROR", "Read failed");
         return HTTP_CLIENT_STATE_DISPOSE;
     } else if (bytes_read == 0) {
         /* No data available right now (non-blocking). Try again later. */
@@ -366,13 +464,11 @@ HttpClientState http_client_work_reading(HttpClient* client) {
                 /* decode chunked body */
                 char*  decoded = NULL;
                 size_t dec_len = 0;
-                int    rc =
-                    decode_chunked(client->read_buffer + client->body_start,
-                                   remaining, &decoded, &dec_len);
+                int    rc      = http_client_decode_chunked(
+                    client->read_buffer + client->body_start, remaining,
+                    &decoded, &dec_len);
                 if (rc != 0) {
-                    if (client->callback) {
-                        client->callback("ERROR", "Chunked decode failed");
-                    }
+                    http_client_notify(client, "ERROR", "Chunked decode failed");
                     return HTTP_CLIENT_STATE_DISPOSE;
                 }
 
@@ -404,9 +500,7 @@ HttpClientState http_client_work_reading(HttpClient* client) {
     size_t   new_size   = client->read_buffer_size + bytes_read;
     uint8_t* new_buffer = realloc(client->read_buffer, new_size);
     if (!new_buffer) {
-        if (client->callback) {
-            client->callback("ERROR", "Memory allocation failed");
-        }
+        http_client_notify(client, "ERROR", "Memory allocation failed");
         return HTTP_CLIENT_STATE_DISPOSE;
     }
 
@@ -426,9 +520,7 @@ HttpClientState http_client_work_reading(HttpClient* client) {
                 int   header_end = i + 4;
                 char* headers    = malloc(header_end + 1);
                 if (!headers) {
-                    if (client->callback) {
-                        client->callback("ERROR", "Memory allocation failed");
-                    }
+                    http_client_notify(client, "ERROR", "Memory allocation failed");
                     return HTTP_CLIENT_STATE_DISPOSE;
                 }
 
@@ -503,13 +595,11 @@ HttpClientState http_client_work_reading(HttpClient* client) {
                 /* decode chunked data present in buffer */
                 char*  decoded = NULL;
                 size_t dec_len = 0;
-                int    rc =
-                    decode_chunked(client->read_buffer + client->body_start,
-                                   total_len, &decoded, &dec_len);
+                int    rc      = http_client_decode_chunked(
+                    client->read_buffer + client->body_start, total_len,
+                    &decoded, &dec_len);
                 if (rc != 0) {
-                    if (client->callback) {
-                        client->callback("ERROR", "Chunked decode failed");
-                    }
+                    http_client_notify(client, "ERROR", "Chunked decode failed");
                     return HTTP_CLIENT_STATE_DISPOSE;
                 }
                 client->body        = (uint8_t*)decoded;
@@ -547,9 +637,7 @@ HttpClientState http_client_work_reading(HttpClient* client) {
                         // no data available yet, keep reading
                         return HTTP_CLIENT_STATE_READING;
                     } else {
-                        if (client->callback) {
-                            client->callback("ERROR", "Peek failed");
-                        }
+                        http_client_notify(client, "ERROR", "Peek failed");
                         return HTTP_CLIENT_STATE_DISPOSE;
                     }
                 }
@@ -562,22 +650,24 @@ HttpClientState http_client_work_reading(HttpClient* client) {
 }
 
 HttpClientState http_client_work_done(HttpClient* client) {
-    if (client->callback != NULL) {
-        if (client->status_code >= 200 && client->status_code < 300) {
-            // Success response
-            client->callback("RESPONSE",
-                             client->body ? (char*)client->body : "");
-        } else {
-            // Error response
-            char error_info[256];
-            snprintf(error_info, sizeof(error_info), "HTTP %d: %s",
-                     client->status_code,
-                     client->body ? (char*)client->body : "");
-            client->callback("ERROR", error_info);
-        }
+    if (client->status_code >= 200 && client->status_code < 300) {
+        // Success response
+        http_client_notify(client, "RESPONSE", NULL);
+    } else {
+        // Error response
+        char error_info[256];
+        snprintf(error_info, sizeof(error_info), "HTTP %d: %s",
+                 client->status_code, client->body ? (char*)client->body : "");
+        http_client_notify(client, "ERROR", error_info);
     }
 
-    // Clean up resources
+    http_client_release(client);
+
+    return HTTP_CLIENT_STATE_DISPOSE;
+}
+
+// Free the buffers and close the connection; safe to call more than once
+static void http_client_release(HttpClient* client) {
     if (client->read_buffer) {
         free(client->read_buffer);
         client->read_buffer = NULL;
@@ -596,26 +686,49 @@ HttpClientState http_client_work_done(HttpClient* client) {
     // Close TCP connection
     if (client->tcp_conn) {
         tcp_client_disconnect(client->tcp_conn);
+        free(client->tcp_conn);
         client->tcp_conn = NULL;
     }
-
-    return HTTP_CLIENT_STATE_DISPOSE;
 }
 
 void http_client_work(void* context, uint64_t mon_time) {
     HttpClient* client = (HttpClient*)context;
 
+    if (client->cancelled) {
+        http_client_notify(client, "CANCELLED", "Request cancelled");
+        http_client_dispose(&client);
+        return;
+    }
+
     if (client->timer == 0) {
         client->timer = mon_time;
     } else if (mon_time >= client->timer + client->timeout) {
-        if (client->callback != NULL) {
-            client->callback("TIMEOUT", NULL);
-        }
+        http_client_record(client, HTTP_CLIENT_OUTCOME_TIMEOUT);
+        http_client_notify(client, "TIMEOUT", NULL);
+
+        http_client_dispose(&client);
+        return;
+    }
+
+    // The host is known once the URL is parsed
+    if (client->state == HTTP_CLIENT_STATE_CONNECT &&
+        !http_client_circuit_allow(
+            http_client_host_metrics(client->hostname))) {
+        http_client_record(client, HTTP_CLIENT_OUTCOME_REJECTED);
+        http_client_notify(client, "ERROR", "Circuit open");
 
         http_client_dispose(&client);
         return;
     }
 
+    if (!client->hedged && client->hedge_of == NULL &&
+        client->state > HTTP_CLIENT_STATE_CONNECT &&
+        client->state < HTTP_CLIENT_STATE_DONE) {
+        http_client_hedge(client, mon_time);
+    }
+
+    HttpClientState previous = client->state;
+
     switch (client->state) {
     case HTTP_CLIENT_STATE_INIT:
         client->state = http_client_work_init(client);
@@ -643,10 +756,424 @@ void http_client_work(void* context, uint64_t mon_time) {
 
     case HTTP_CLIENT_STATE_DISPOSE:
         http_client_dispose(&client);
+        return;
+    }
+
+    // Every request ends by moving to DISPOSE: from DONE with a response,
+    // from any other state on failure
+    if (client->state == HTTP_CLIENT_STATE_DISPOSE) {
+        HttpClientOutcome outcome = HTTP_CLIENT_OUTCOME_ERROR;
+        if (previous == HTTP_CLIENT_STATE_DONE) {
+            outcome = client->status_code >= 200 && client->status_code < 300
+                          ? HTTP_CLIENT_OUTCOME_OK
+                          : HTTP_CLIENT_OUTCOME_HTTP_ERROR;
+        }
+        http_client_record(client, outcome);
+    }
+}
+
+// Report the result once, to the plain callback and/or the context callback
+static void http_client_notify(HttpClient* client, const char* event,
+                               const char* message) {
+    if (client->notified) {
+        return;
+    }
+    client->notified = 1;
+
+    int is_response = strcmp(event, "RESPONSE") == 0;
+
+    if (client->callback != NULL) {
+        if (is_response) {
+            client->callback(event, client->body ? (char*)client->body : "");
+        } else {
+            client->callback(event, message);
+        }
+    }
+
+    if (client->on_result != NULL) {
+        HttpClientResult result = {
+            .event       = event,
+            .message     = is_response ? NULL : message,
+            .status_code = client->status_code,
+            .body        = (const char*)client->body,
+            .body_len    = client->body ? client->content_len : 0,
+        };
+        client->on_result(client->context, &result);
+    }
+}
+
+static HttpClientHostMetrics* http_client_host_metrics(const char* host) {
+    if (host[0] == '\0') {
+        host = "unknown"; // URL could not be parsed
+    }
+
+    for (int i = 0; i < g_host_metric_count; i++) {
+        if (strcmp(g_host_metrics[i].host, host) == 0) {
+            return &g_host_metrics[i];
+        }
+    }
+
+    if (g_host_metric_count == HTTP_CLIENT_METRIC_HOSTS) {
+        host = "other";
+        for (int i = 0; i < g_host_metric_count; i++) {
+            if (strcmp(g_host_metrics[i].host, host) == 0) {
+                return &g_host_metrics[i];
+            }
+        }
+    }
+
+    static const char* const OUTCOME_NAMES[HTTP_CLIENT_OUTCOME_COUNT] = {
+        "ok", "http_error", "error", "timeout", "rejected"};
+
+    HttpClientHostMetrics* metrics = &g_host_metrics[g_host_metric_count++];
+    snprintf(metrics->host, sizeof(metrics->host), "%s", host);
+
+    char labels[METRICS_LABELS_MAX];
+    snprintf(labels, sizeof(labels), "host=\"%.100s\"", host);
+    metrics->latency = metrics_register(
+        METRIC_HISTOGRAM, "just_weather_upstream_request_duration_seconds",
+        labels, "Time from request start to a complete upstream response");
+
+    for (int i = 0; i < HTTP_CLIENT_OUTCOME_COUNT; i++) {
+        snprintf(labels, sizeof(labels), "host=\"%.100s\",outcome=\"%s\"",
+                 host, OUTCOME_NAMES[i]);
+        metrics->outcomes[i] = metrics_register(
+            METRIC_COUNTER, "just_weather_upstream_requests_total", labels,
+            "Finished upstream requests by outcome");
+    }
+
+    snprintf(labels, sizeof(labels), "host=\"%.100s\"", host);
+    metrics->hedges = metrics_register(
+        METRIC_COUNTER, "just_weather_upstream_hedges_total", labels,
+        "Duplicate requests sent for slow upstream requests");
+    metrics->hedge_wins = metrics_register(
+        METRIC_COUNTER, "just_weather_upstream_hedge_wins_total", labels,
+        "Duplicate requests that answered before the original");
+    metrics->circuit_state = metrics_register(
+        METRIC_GAUGE, "just_weather_upstream_circuit_state", labels,
+        "Circuit breaker state: 0 closed, 1 open, 2 half-open");
+
+    return metrics;
+}
+
+static double http_client_hedge_share(void) {
+    if (!g_hedge_loaded) {
+        g_hedge_loaded = 1;
+
+        const char* value   = getenv(HTTP_CLIENT_HEDGE_ENV);
+        double      percent = HTTP_CLIENT_HEDGE_PERCENT;
+        if (value && *value) {
+            char* end = NULL;
+            percent   = strtod(value, &end);
+            if (*end != '\0' || percent < 0 || percent > 100) {
+                LOG_WARN("http_client", "Ignoring invalid %s=%s",
+                         HTTP_CLIENT_HEDGE_ENV, value);
+                percent = HTTP_CLIENT_HEDGE_PERCENT;
+            }
+        }
+
+        g_hedge_share = percent / 100.0;
+    }
+
+    return g_hedge_share;
+}
+
+// Start a new latency window once the current one is over
+static void http_client_latency_rotate(HttpClientHostMetrics* metrics,
+                                       uint64_t               now_us) {
+    uint64_t elapsed = now_us - metrics->window_started_us;
+    if (elapsed < HTTP_CLIENT_LATENCY_WINDOW_US) {
+        return;
+    }
+
+    if (elapsed < 2 * HTTP_CLIENT_LATENCY_WINDOW_US) {
+        memcpy(metrics->latency_counts[1], metrics->latency_counts[0],
+               sizeof(metrics->latency_counts[1]));
+    } else {
+        memset(metrics->latency_counts[1], 0,
+               sizeof(metrics->latency_counts[1]));
+    }
+
+    memset(metrics->latency_counts[0], 0, sizeof(metrics->latency_counts[0]));
+    metrics->window_started_us = now_us;
+}
+
+// Upper bound of a latency bucket in microseconds
+static uint64_t http_client_latency_bound(int bucket) {
+    uint64_t bound = 1000ULL << (bucket / 2);
+    return bucket % 2 ? bound * 181 / 128 : bound; // 181 / 128 ~ sqrt(2)
+}
+
+static void http_client_latency_add(HttpClientHostMetrics* metrics,
+                                    uint64_t now_us, uint64_t latency_us) {
+    http_client_latency_rotate(metrics, now_us);
+
+    int bucket = 0;
+    while (bucket < HTTP_CLIENT_LATENCY_BUCKETS - 1 &&
+           latency_us > http_client_latency_bound(bucket)) {
+        bucket++;
+    }
+
+    metrics->latency_counts[0][bucket]++;
+}
+
+// 95th percentile latency over both windows, or 0 with too few samples
+static uint64_t http_client_latency_p95(HttpClientHostMetrics* metrics,
+                                        uint64_t               now_us) {
+    http_client_latency_rotate(metrics, now_us);
+
+    uint64_t total = 0;
+    for (int i = 0; i < HTTP_CLIENT_LATENCY_BUCKETS; i++) {
+        total += metrics->latency_counts[0][i] + metrics->latency_counts[1][i];
+    }
+
+    if (total < HTTP_CLIENT_LATENCY_MIN_SAMPLES) {
+        return 0;
+    }
+
+    uint64_t rank = (total * 95 + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < HTTP_CLIENT_LATENCY_BUCKETS; i++) {
+        seen += metrics->latency_counts[0][i] + metrics->latency_counts[1][i];
+        if (seen >= rank) {
+            return http_client_latency_bound(i);
+        }
+    }
+
+    return http_client_latency_bound(HTTP_CLIENT_LATENCY_BUCKETS - 1);
+}
+
+static void http_client_record(HttpClient* client, HttpClientOutcome outcome) {
+    HttpClientHostMetrics* metrics = http_client_host_metrics(client->hostname);
+    uint64_t               now_us  = metrics_now_us();
+
+    metrics_inc(metrics->outcomes[outcome]);
+    if (outcome == HTTP_CLIENT_OUTCOME_REJECTED) {
+        return;
+    }
+
+    if (outcome == HTTP_CLIENT_OUTCOME_OK ||
+        outcome == HTTP_CLIENT_OUTCOME_HTTP_ERROR) {
+        metrics_observe(metrics->latency, now_us - client->started_us);
+    }
+
+    // A 4xx is the request's fault, not the host's
+    int failed = outcome == HTTP_CLIENT_OUTCOME_ERROR ||
+                 outcome == HTTP_CLIENT_OUTCOME_TIMEOUT ||
+                 client->status_code >= 500;
+    http_client_circuit_record(metrics, failed, now_us);
+
+    if (outcome == HTTP_CLIENT_OUTCOME_OK) {
+        http_client_latency_add(metrics, now_us, now_us - client->started_us);
+    }
+
+    // Only original requests earn hedges, so hedges never pay for hedges
+    if (client->hedge_of == NULL) {
+        metrics->hedge_tokens += http_client_hedge_share();
+        if (metrics->hedge_tokens > HTTP_CLIENT_HEDGE_BURST) {
+            metrics->hedge_tokens = HTTP_CLIENT_HEDGE_BURST;
+        }
+    }
+}
+
+static void http_client_circuit_set(HttpClientHostMetrics* metrics,
+                                    HttpClientCircuit state, uint64_t now_us) {
+    if (state == HTTP_CLIENT_CIRCUIT_OPEN) {
+        metrics->opened_us = now_us;
+    }
+
+    if (metrics->circuit != state) {
+        LOG_INFO("http_client", "Circuit for %s %s", metrics->host,
+                 state == HTTP_CLIENT_CIRCUIT_OPEN        ? "opened"
+                 : state == HTTP_CLIENT_CIRCUIT_HALF_OPEN ? "half-open"
+                                                          : "closed");
+    }
+
+    metrics->circuit  = state;
+    metrics->failures = 0;
+    metrics_gauge_set(metrics->circuit_state, state);
+}
+
+// Move an open circuit to half-open once its open period is over
+static void http_client_circuit_update(HttpClientHostMetrics* metrics,
+                                       uint64_t               now_us) {
+    if (metrics->circuit == HTTP_CLIENT_CIRCUIT_OPEN &&
+        now_us - metrics->opened_us >= HTTP_CLIENT_CIRCUIT_OPEN_US) {
+        http_client_circuit_set(metrics, HTTP_CLIENT_CIRCUIT_HALF_OPEN, now_us);
+    }
+}
+
+// Whether a request may be sent; a half-open circuit lets through one probe
+// per interval
+static int http_client_circuit_allow(HttpClientHostMetrics* metrics) {
+    uint64_t now_us = metrics_now_us();
+    http_client_circuit_update(metrics, now_us);
+
+    switch (metrics->circuit) {
+    case HTTP_CLIENT_CIRCUIT_CLOSED:
+        return 1;
+
+    case HTTP_CLIENT_CIRCUIT_OPEN:
+        return 0;
+
+    case HTTP_CLIENT_CIRCUIT_HALF_OPEN:
+        if (now_us - metrics->probe_us < HTTP_CLIENT_CIRCUIT_PROBE_US) {
+            return 0;
+        }
+        metrics->probe_us = now_us;
+        return 1;
+    }
+
+    return 1;
+}
+
+static void http_client_circuit_record(HttpClientHostMetrics* metrics,
+                                       int failed, uint64_t now_us) {
+    switch (metrics->circuit) {
+    case HTTP_CLIENT_CIRCUIT_CLOSED:
+        if (!failed) {
+            metrics->failures = 0;
+        } else if (++metrics->failures >= HTTP_CLIENT_CIRCUIT_FAILURES) {
+            http_client_circuit_set(metrics, HTTP_CLIENT_CIRCUIT_OPEN, now_us);
+        }
+        break;
+
+    case HTTP_CLIENT_CIRCUIT_HALF_OPEN:
+        http_client_circuit_set(metrics,
+                                failed ? HTTP_CLIENT_CIRCUIT_OPEN
+                                       : HTTP_CLIENT_CIRCUIT_CLOSED,
+                                now_us);
+        break;
+
+    case HTTP_CLIENT_CIRCUIT_OPEN:
+        // Requests sent before it opened; the open period decides
         break;
     }
 }
 
+bool http_client_circuit_open(const char* host) {
+    HttpClientHostMetrics* metrics = http_client_host_metrics(host);
+    uint64_t               now_us  = metrics_now_us();
+    http_client_circuit_update(metrics, now_us);
+
+    return metrics->circuit == HTTP_CLIENT_CIRCUIT_OPEN ||
+           (metrics->circuit == HTTP_CLIENT_CIRCUIT_HALF_OPEN &&
+            now_us - metrics->probe_us < HTTP_CLIENT_CIRCUIT_PROBE_US);
+}
+
+// Send a duplicate of a request that has been outstanding longer than its
+// host's p95, when the hedge budget allows. GETs are idempotent, so running
+// both is safe.
+static void http_client_hedge(HttpClient* client, uint64_t mon_time) {
+    if (http_client_hedge_share() <= 0) {
+        return;
+    }
+
+    HttpClientHostMetrics* metrics = http_client_host_metrics(client->hostname);
+    uint64_t               now_us  = metrics_now_us();
+    uint64_t               p95     = http_client_latency_p95(metrics, now_us);
+    if (p95 == 0 || now_us - client->started_us < p95 ||
+        metrics->hedge_tokens < 1.0) {
+        return;
+    }
+
+    uint64_t deadline = client->timer + client->timeout;
+    if (mon_time >= deadline) {
+        return;
+    }
+
+    client->hedged = 1;
+
+    HttpClient* hedge = NULL;
+    if (http_client_init(client->url, &hedge, NULL) != 0) {
+        return;
+    }
+
+    metrics->hedge_tokens -= 1.0;
+    metrics_inc(metrics->hedges);
+
+    hedge->timeout   = deadline - mon_time;
+    hedge->on_result = http_client_on_hedge;
+    hedge->context   = client;
+    hedge->hedge_of  = client;
+    client->hedge    = hedge;
+
+    LOG_DEBUG("http_client", "Hedging %s after %llu us (p95 %llu us)",
+              client->url, (unsigned long long)(now_us - client->started_us),
+              (unsigned long long)p95);
+}
+
+// Result of a duplicate. A response below 500 is reported as the original
+// request's result, which then ends on its next tick. A failure or a 5xx
+// finishes silently and leaves the original running, since it may still
+// succeed.
+static void http_client_on_hedge(void*                   context,
+                                 const HttpClientResult* result) {
+    HttpClient* client = (HttpClient*)context;
+    client->hedge      = NULL;
+
+    if (result->status_code == 0 || result->status_code >= 500 ||
+        client->state == HTTP_CLIENT_STATE_DONE) {
+        return;
+    }
+
+    uint8_t* body = NULL;
+    if (result->body != NULL) {
+        body = malloc(result->body_len + 1);
+        if (body == NULL) {
+            return;
+        }
+        memcpy(body, result->body, result->body_len);
+        body[result->body_len] = '\0';
+    }
+
+    free(client->body);
+    client->body        = body;
+    client->content_len = result->body_len;
+    client->status_code = result->status_code;
+
+    metrics_inc(http_client_host_metrics(client->hostname)->hedge_wins);
+
+    http_client_notify(client, result->event, result->message);
+    client->cancelled = 1;
+}
+
+// Replaces host and port with the HTTP_CLIENT_UPSTREAM_ENV override.
+// Returns 1 if an override applies, 0 otherwise.
+static int http_client_upstream(const char** host, const char** port) {
+    if (!g_upstream_loaded) {
+        g_upstream_loaded = 1;
+
+        const char* value = getenv(HTTP_CLIENT_UPSTREAM_ENV);
+        const char* colon = value ? strrchr(value, ':') : NULL;
+        if (value && *value) {
+            size_t host_len = colon ? (size_t)(colon - value) : strlen(value);
+            const char* port_str = colon ? colon + 1 : "80";
+
+            if (host_len == 0 || host_len >= sizeof(g_upstream_host) ||
+                strlen(port_str) == 0 ||
+                strlen(port_str) >= sizeof(g_upstream_port)) {
+                LOG_ERROR("http_client", "Ignoring invalid %s=%s",
+                          HTTP_CLIENT_UPSTREAM_ENV, value);
+            } else {
+                memcpy(g_upstream_host, value, host_len);
+                g_upstream_host[host_len] = '\0';
+                strcpy(g_upstream_port, port_str);
+                LOG_INFO("http_client", "All upstream requests go to %s:%s",
+                         g_upstream_host, g_upstream_port);
+            }
+        }
+    }
+
+    if (g_upstream_host[0] == '\0') {
+        return 0;
+    }
+
+    *host = g_upstream_host;
+    *port = g_upstream_port;
+    return 1;
+}
+
 void http_client_dispose(HttpClient** client_ptr) {
     if (client_ptr == NULL || *(client_ptr) == NULL) {
         return;
@@ -654,6 +1181,23 @@ void http_client_dispose(HttpClient** client_ptr) {
 
     HttpClient* client = *(client_ptr);
 
+    // Some failures end the request without a word; every request reports
+    http_client_notify(client, "ERROR", "Request failed");
+
+    // Failed, timed out and cancelled requests end here without passing
+    // through the done state
+    http_client_release(client);
+
+    // A duplicate still running lost the race; detach it so it never
+    // reports to this client
+    if (client->hedge != NULL) {
+        client->hedge->on_result = NULL;
+        client->hedge->context   = NULL;
+        client->hedge->hedge_of  = NULL;
+        http_client_cancel(client->hedge);
+        client->hedge = NULL;
+    }
+
     if (client->task != NULL) {
         smw_destroy_task(client->task);
     }
@@ -4,6 +4,8 @@
 #include "smw.h"
 #include "tcp_client.h"
 
+#include <stdbool.h>
+
 #ifndef http_client_max_url_length
 #    define http_client_max_url_length 1024
 #endif
@@ -19,9 +21,22 @@ typedef enum {
 
 } HttpClientState;
 
+// Outcome of a request as passed to HttpClientOnResult
+typedef struct {
+    const char* event;       // "RESPONSE", "ERROR", "TIMEOUT" or "CANCELLED"
+    const char* message;     // Error description, NULL for "RESPONSE"
+    int         status_code; // 0 when no response arrived
+    const char* body;        // NUL-terminated response body, or NULL
+    size_t      body_len;
+} HttpClientResult;
+
+// Called exactly once per request, with the context it was started with
+typedef void (*HttpClientOnResult)(void*                   context,
+                                   const HttpClientResult* result);
+
 // TODO:change to send response with heap instead of copyuting to
 // stack!!!!!!!!!!!!!!!!!!!
-typedef struct {
+typedef struct HttpClient {
     HttpClientState state;
     SmwTask*        task;
     char            url[http_client_max_url_length + 1];
@@ -29,7 +44,19 @@ typedef struct {
 
     void (*callback)(const char* event, const char* response);
 
+    HttpClientOnResult on_result;
+    void*              context;
+    int                notified;  // The result has been reported
+    int                cancelled; // Set by http_client_cancel
+
+    // Hedging: a slow request starts a duplicate and reports whichever
+    // response comes first (see http_client_hedge)
+    struct HttpClient* hedge;    // Duplicate racing this request
+    struct HttpClient* hedge_of; // On a duplicate: the request it races
+    int                hedged;   // A duplicate has been started
+
     uint64_t timer;
+    uint64_t started_us; // metrics_now_us() when the request was created
 
     uint8_t* write_buffer;
     size_t   write_size;
@@ -65,4 +92,33 @@ int http_client_get(const char* url, uint64_t timeout,
                     void (*callback)(const char* event, const char* response),
                     const char* port);
 
+/* Start a GET request whose result is reported to on_result with context.
+ * timeout is in smw time units (milliseconds). The client pointer stored in
+ * client_ptr (can be NULL) stays valid until on_result has been called.
+ * Returns 0 on success; on_result is not called when starting fails.
+ */
+int http_client_get_with_context(const char* url, uint64_t timeout,
+                                 HttpClientOnResult on_result, void* context,
+                                 HttpClient** client_ptr);
+
+/* Abandon a request. Its result, "CANCELLED", is reported on the next smw
+ * tick, so this is safe to call from any callback. Does nothing once the
+ * result has been reported.
+ */
+void http_client_cancel(HttpClient* client);
+
+/* Whether requests to host are failed right away by its circuit breaker,
+ * which opens after repeated errors, timeouts or 5xx responses. Lets a
+ * caller serve a fallback instead of starting a request that is rejected
+ * anyway. host is the host name as it appears in request URLs.
+ */
+bool http_client_circuit_open(const char* host);
+
+/* Decode HTTP chunked transfer encoding.
+ * Returns 0 on success, non-zero on failure.
+ * Allocates *out (NUL-terminated) which must be freed by caller.
+ */
+int http_client_decode_chunked(const uint8_t* in, size_t in_len, char** out,
+                               size_t* out_len);
+
 #endif // http_client_h
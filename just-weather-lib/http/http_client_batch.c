@@ -0,0 +1,220 @@
+#include "http_client_batch.h"
+
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+//-----------------Internal Functions-----------------
+
+void http_client_batch_task_work(void* context, uint64_t mon_time);
+static void http_client_batch_on_client(void*                   context,
+                                        const HttpClientResult* result);
+static void http_client_batch_report(HttpClientBatchSlot* slot,
+                                     const char* event, const char* message);
+static void http_client_batch_start_next(HttpClientBatch* batch,
+                                         uint64_t         mon_time);
+static void http_client_batch_free(HttpClientBatch* batch);
+
+//----------------------------------------------------
+
+int http_client_batch_start(const HttpClientBatchRequest* requests,
+                            size_t count, size_t max_concurrency,
+                            uint64_t timeout_ms,
+                            HttpClientBatchOnResult   on_result,
+                            HttpClientBatchOnComplete on_complete,
+                            void* context, HttpClientBatch** batch_ptr) {
+    if (requests == NULL || count == 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (requests[i].url == NULL ||
+            (requests[i].timeout_ms == 0 && timeout_ms == 0)) {
+            return -1;
+        }
+    }
+
+    HttpClientBatch* batch = (HttpClientBatch*)calloc(1, sizeof(*batch));
+    if (batch == NULL) {
+        return -2;
+    }
+
+    batch->slots = (HttpClientBatchSlot*)calloc(count, sizeof(*batch->slots));
+    if (batch->slots == NULL) {
+        free(batch);
+        return -2;
+    }
+
+    batch->count           = count;
+    batch->max_concurrency = max_concurrency == 0 ? count : max_concurrency;
+    batch->timeout_ms      = timeout_ms;
+    batch->on_result       = on_result;
+    batch->on_complete     = on_complete;
+    batch->context         = context;
+
+    for (size_t i = 0; i < count; i++) {
+        HttpClientBatchSlot* slot = &batch->slots[i];
+
+        slot->batch       = batch;
+        slot->request     = requests[i];
+        slot->request.url = strdup(requests[i].url);
+        if (slot->request.url == NULL) {
+            http_client_batch_free(batch);
+            return -2;
+        }
+
+        if (slot->request.timeout_ms == 0) {
+            slot->request.timeout_ms = timeout_ms;
+        }
+    }
+
+    batch->task = smw_create_task(batch, http_client_batch_task_work);
+    if (batch->task == NULL) {
+        http_client_batch_free(batch);
+        return -2;
+    }
+
+    if (batch_ptr != NULL) {
+        *(batch_ptr) = batch;
+    }
+
+    return 0;
+}
+
+void http_client_batch_cancel_request(HttpClientBatch* batch, size_t index) {
+    if (batch == NULL || index >= batch->count) {
+        return;
+    }
+
+    HttpClientBatchSlot* slot = &batch->slots[index];
+    if (slot->done) {
+        return;
+    }
+
+    if (slot->client != NULL) {
+        http_client_cancel(slot->client);
+    } else {
+        slot->cancelled       = true;
+        batch->cancel_pending = true;
+    }
+}
+
+void http_client_batch_cancel(HttpClientBatch* batch) {
+    if (batch == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < batch->count; i++) {
+        http_client_batch_cancel_request(batch, i);
+    }
+}
+
+void http_client_batch_task_work(void* context, uint64_t mon_time) {
+    HttpClientBatch* batch = (HttpClientBatch*)context;
+
+    if (batch->started_ms == 0) {
+        batch->started_ms = mon_time;
+    }
+
+    if (batch->cancel_pending) {
+        batch->cancel_pending = false;
+
+        for (size_t i = batch->next; i < batch->count; i++) {
+            HttpClientBatchSlot* slot = &batch->slots[i];
+            if (slot->cancelled && !slot->done) {
+                http_client_batch_report(slot, "CANCELLED",
+                                         "Request cancelled");
+            }
+        }
+    }
+
+    http_client_batch_start_next(batch, mon_time);
+
+    if (batch->completed == batch->count) {
+        if (batch->on_complete != NULL) {
+            batch->on_complete(batch, batch->context);
+        }
+
+        http_client_batch_free(batch);
+    }
+}
+
+// Start queued requests while there are free slots
+static void http_client_batch_start_next(HttpClientBatch* batch,
+                                         uint64_t         mon_time) {
+    while (batch->next < batch->count &&
+           batch->in_flight < batch->max_concurrency) {
+        HttpClientBatchSlot* slot = &batch->slots[batch->next++];
+        if (slot->done) {
+            continue;
+        }
+
+        uint64_t deadline = batch->started_ms + slot->request.timeout_ms;
+        if (mon_time >= deadline) {
+            http_client_batch_report(slot, "TIMEOUT",
+                                     "Deadline passed while queued");
+            continue;
+        }
+
+        HttpClient* client = NULL;
+        if (http_client_get_with_context(slot->request.url, deadline - mon_time,
+                                         http_client_batch_on_client, slot,
+                                         &client) != 0) {
+            LOG_WARN("http", "batch request %zu failed to start: %s",
+                     (size_t)(slot - batch->slots), slot->request.url);
+            http_client_batch_report(slot, "ERROR", "Request failed to start");
+            continue;
+        }
+
+        slot->client = client;
+        batch->in_flight++;
+    }
+}
+
+// Result of a started request, called from the client's task
+static void http_client_batch_on_client(void*                   context,
+                                        const HttpClientResult* result) {
+    HttpClientBatchSlot* slot  = (HttpClientBatchSlot*)context;
+    HttpClientBatch*     batch = slot->batch;
+
+    slot->client = NULL;
+    batch->in_flight--;
+
+    slot->done = true;
+    batch->completed++;
+
+    if (batch->on_result != NULL) {
+        batch->on_result(slot->request.context, result);
+    }
+}
+
+// Result of a request that was never started
+static void http_client_batch_report(HttpClientBatchSlot* slot,
+                                     const char* event, const char* message) {
+    HttpClientBatch* batch = slot->batch;
+
+    slot->done = true;
+    batch->completed++;
+
+    if (batch->on_result != NULL) {
+        HttpClientResult result = {
+            .event   = event,
+            .message = message,
+        };
+        batch->on_result(slot->request.context, &result);
+    }
+}
+
+static void http_client_batch_free(HttpClientBatch* batch) {
+    if (batch->task != NULL) {
+        smw_destroy_task(batch->task);
+    }
+
+    for (size_t i = 0; i < batch->count; i++) {
+        free((char*)batch->slots[i].request.url);
+    }
+
+    free(batch->slots);
+    free(batch);
+}
@@ -0,0 +1,82 @@
+#ifndef HTTP_CLIENT_BATCH_H
+#define HTTP_CLIENT_BATCH_H
+
+#include "http_client.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Runs a set of GET requests with at most max_concurrency of them in flight,
+// reporting each result as it arrives and calling on_complete once all have
+// been reported. Requests start in the order given.
+//
+// Deadlines count from when the batch is started, not from when a request
+// leaves the queue, so a request that waits too long for a free slot is
+// reported as "TIMEOUT" without being sent.
+
+typedef struct HttpClientBatch HttpClientBatch;
+
+typedef struct {
+    const char* url;        // Copied by http_client_batch_start
+    void*       context;    // Passed back with the result
+    uint64_t    timeout_ms; // 0 = the batch timeout
+} HttpClientBatchRequest;
+
+// Called once for every request, with its HttpClientBatchRequest context
+typedef void (*HttpClientBatchOnResult)(void*                   context,
+                                        const HttpClientResult* result);
+
+// Called once every request has been reported. The batch is freed right
+// after it returns.
+typedef void (*HttpClientBatchOnComplete)(HttpClientBatch* batch,
+                                          void*            context);
+
+typedef struct {
+    HttpClientBatch*       batch;
+    HttpClientBatchRequest request;
+    HttpClient*            client;    // While in flight
+    bool                   cancelled; // Cancelled before it was started
+    bool                   done;      // Result reported
+} HttpClientBatchSlot;
+
+struct HttpClientBatch {
+    SmwTask* task;
+
+    HttpClientBatchSlot* slots;
+    size_t               count;
+
+    size_t   max_concurrency;
+    uint64_t timeout_ms;
+    uint64_t started_ms; // 0 until the first tick
+
+    size_t next; // First request not yet started
+    size_t in_flight;
+    size_t completed;
+    bool   cancel_pending; // Queued requests wait to report "CANCELLED"
+
+    HttpClientBatchOnResult   on_result;
+    HttpClientBatchOnComplete on_complete;
+    void*                     context;
+};
+
+// Start a batch. requests is copied; max_concurrency 0 means no limit.
+// timeout_ms applies to requests that do not set their own. The batch pointer
+// stored in batch_ptr (can be NULL) stays valid until on_complete returns.
+// Returns 0 on success, -1 on invalid arguments, -2 if out of memory; no
+// callback is called when starting fails.
+int http_client_batch_start(const HttpClientBatchRequest* requests,
+                            size_t count, size_t max_concurrency,
+                            uint64_t timeout_ms,
+                            HttpClientBatchOnResult   on_result,
+                            HttpClientBatchOnComplete on_complete,
+                            void* context, HttpClientBatch** batch_ptr);
+
+// Cancel one request; it is reported "CANCELLED" on a later tick, so this is
+// safe to call from the callbacks. Does nothing once the request has reported.
+void http_client_batch_cancel_request(HttpClientBatch* batch, size_t index);
+
+// Cancel every request that has not reported yet
+void http_client_batch_cancel(HttpClientBatch* batch);
+
+#endif // HTTP_CLIENT_BATCH_H
@@ -1,12 +1,17 @@
 #include "http_server.h"
 
+#include "log.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 
 //-----------------Internal Functions-----------------
 
-void http_server_task_work(void* context, uint64_t mon_time);
-int  http_server_on_accept(int fd, void* context);
+void        http_server_task_work(void* context, uint64_t mon_time);
+static void http_server_update_admission(HTTPServer* server);
+static bool http_server_overloaded(HTTPServer* server, bool paused);
+int  http_server_on_accept(int fd, const struct sockaddr* peer,
+                           socklen_t peer_len, void* context);
 
 //----------------------------------------------------
 
@@ -14,10 +19,22 @@ int http_server_initiate(HTTPServer*            server,
                          HttpServerOnConnection on_connection) {
     server->onConnection = on_connection;
 
+    server->admission.max_connections = 0;
+    server->admission.max_loop_lag_us = 0;
+
+    server->metric_paused = metrics_register(
+        METRIC_GAUGE, "just_weather_http_accept_paused", NULL,
+        "1 while new connections are left in the listen backlog");
+    server->metric_pauses = metrics_register(
+        METRIC_COUNTER, "just_weather_http_accept_pauses_total", NULL,
+        "Times accepting was paused because the server was overloaded");
+
     tcp_server_initiate(&server->tcpServer, "10680", http_server_on_accept,
                         server);
 
-    server->task = smw_create_task(server, http_server_task_work);
+    // Decides whether the listener accepts, so it runs with the I/O tasks
+    server->task = smw_create_task_with_priority(server, http_server_task_work,
+                                                 SMW_PRIORITY_IO);
 
     return 0;
 }
@@ -44,23 +61,82 @@ int http_server_initiate_ptr(HttpServerOnConnection on_connection,
     return 0;
 }
 
-int http_server_on_accept(int fd, void* context) {
+int http_server_on_accept(int fd, const struct sockaddr* peer,
+                          socklen_t peer_len, void* context) {
     HTTPServer* server = (HTTPServer*)context;
 
     HTTPServerConnection* connection = NULL;
     int result = http_server_connection_initiate_ptr(fd, &connection);
     if (result != 0) {
-        printf("HTTPServer_OnAccept: Failed to initiate connection\n");
+        LOG_ERROR("http_server", "Failed to initiate connection");
         return -1;
     }
 
+    http_server_connection_set_peer(connection, peer, peer_len);
+
     server->onConnection(server, connection);
 
+    // Connections are accepted in batches; stop within one at the limit
+    http_server_update_admission(server);
+
     return 0;
 }
 
+void http_server_set_admission(HTTPServer*                server,
+                               const HttpServerAdmission* admission) {
+    server->admission = *admission;
+}
+
 void http_server_task_work(void* context, uint64_t mon_time) {
-    // HTTPServer* _Server = (HTTPServer*)_Context;
+    http_server_update_admission((HTTPServer*)context);
+}
+
+// Pause or resume accepting as the load crosses the admission limits
+static void http_server_update_admission(HTTPServer* server) {
+    bool paused     = server->tcpServer.paused;
+    bool overloaded = http_server_overloaded(server, paused);
+    if (overloaded == paused) {
+        return;
+    }
+
+    tcp_server_set_paused(&server->tcpServer, overloaded);
+    metrics_gauge_set(server->metric_paused, overloaded ? 1 : 0);
+    if (overloaded) {
+        metrics_inc(server->metric_pauses);
+        LOG_WARN("http_server",
+                 "Overloaded (%zu connections, %llu us loop lag), "
+                 "pausing accepts",
+                 http_server_connection_open_count(),
+                 (unsigned long long)smw_get_tick_us());
+    } else {
+        LOG_INFO("http_server", "Load back to normal, accepting again");
+    }
+}
+
+// While paused, resume only below 90% of the connection limit (at least one
+// connection below it, and never at 0) and half the lag limit, so accepting
+// does not flap around the thresholds
+static bool http_server_overloaded(HTTPServer* server, bool paused) {
+    size_t   connections = http_server_connection_open_count();
+    uint64_t lag         = smw_get_tick_us();
+
+    size_t   max_connections = server->admission.max_connections;
+    uint64_t max_lag         = server->admission.max_loop_lag_us;
+    if (paused) {
+        size_t margin   = max_connections / 10 > 0 ? max_connections / 10 : 1;
+        max_connections = max_connections > margin ? max_connections - margin
+                                                   : 1;
+        max_lag         = max_lag / 2;
+    }
+
+    if (server->admission.max_connections > 0 &&
+        connections >= max_connections) {
+        return true;
+    }
+    if (server->admission.max_loop_lag_us > 0 && lag > max_lag) {
+        return true;
+    }
+    return false;
 }
 
 void http_server_dispose(HTTPServer* server) {
@@ -9,12 +9,26 @@
 typedef int (*HttpServerOnConnection)(void*                 context,
                                       HTTPServerConnection* connection);
 
+// Accept back-pressure. Accepting pauses while either limit is exceeded and
+// resumes once both are comfortably below again, so excess clients wait in
+// the listen backlog instead of slowing down everyone already admitted.
+// A limit of 0 is disabled.
+typedef struct {
+    size_t   max_connections; // Open connections
+    uint64_t max_loop_lag_us; // Smoothed smw pass duration (smw_get_tick_us)
+} HttpServerAdmission;
+
 typedef struct {
     HttpServerOnConnection onConnection;
 
+    HttpServerAdmission admission;
+
     TCPServer tcpServer;
     SmwTask*  task;
 
+    MetricId metric_paused; // 1 while accepts are paused
+    MetricId metric_pauses; // Times accepting was paused
+
 } HTTPServer;
 
 int http_server_initiate(HTTPServer*            server,
@@ -22,6 +36,9 @@ int http_server_initiate(HTTPServer*            server,
 int http_server_initiate_ptr(HttpServerOnConnection on_connection,
                              HTTPServer**           server_ptr);
 
+void http_server_set_admission(HTTPServer*                server,
+                               const HttpServerAdmission* admission);
+
 void http_server_dispose(HTTPServer* server);
 void http_server_dispose_ptr(HTTPServer** server_ptr);
 
@@ -6,15 +6,71 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 //-----------------Internal Functions-----------------
 
 void http_server_connection_task_work(void* context, uint64_t mon_time);
+static int http_server_connection_stream_send(
+    HTTPServerConnection* connection);
+static int http_server_connection_stream_reserve(
+    HTTPServerConnection* connection, size_t extra);
+static int http_server_connection_parse_head(HTTPServerConnection* connection,
+                                             size_t                from);
+static int http_server_connection_reserve(HTTPServerConnection* connection,
+                                          size_t                extra);
+static void http_server_connection_reject(HTTPServerConnection* connection,
+                                          const char*           response);
+static void http_server_connection_set_deadline(
+    HTTPServerConnection* connection, HttpServerDeadline phase,
+    uint64_t timeout_us, uint64_t from_us);
+static void http_server_connection_body_deadline(
+    HTTPServerConnection* connection);
+static void http_server_connection_send_deadline(
+    HTTPServerConnection* connection, bool progressed);
+static void http_server_connection_timeout(void* context, uint64_t mon_time);
+static void http_server_connection_close(HTTPServerConnection* connection);
 
 //----------------------------------------------------
 
+// Only touched from the smw thread
+static size_t g_open_connections = 0;
+
+static HttpServerConnectionLimits g_limits = {
+    .max_header_size = HTTP_SERVER_MAX_HEADER_SIZE_DEFAULT,
+    .max_body_size   = HTTP_SERVER_MAX_BODY_SIZE_DEFAULT,
+
+    .idle_timeout_us     = HTTP_SERVER_IDLE_TIMEOUT_DEFAULT_US,
+    .header_timeout_us   = HTTP_SERVER_HEADER_TIMEOUT_DEFAULT_US,
+    .transfer_timeout_us = HTTP_SERVER_TRANSFER_TIMEOUT_DEFAULT_US,
+    .min_body_rate       = HTTP_SERVER_MIN_BODY_RATE_DEFAULT,
+};
+
+// Connections closed for missing a deadline, per phase
+static MetricId g_metric_timeouts[HTTP_SERVER_DEADLINE_COUNT];
+static bool     g_metrics_registered = false;
+
+// phase label of each deadline
+static const char* const DEADLINE_PHASES[HTTP_SERVER_DEADLINE_COUNT] = {
+    "idle", "header", "body", "send"};
+
+// Sent as is, after which the connection closes
+static const char RESPONSE_BAD_REQUEST[] = "HTTP/1.1 400 Bad Request\r\n"
+                                           "Content-Length: 0\r\n"
+                                           "Connection: close\r\n"
+                                           "\r\n";
+static const char RESPONSE_BODY_TOO_LARGE[] =
+    "HTTP/1.1 413 Content Too Large\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+static const char RESPONSE_HEADERS_TOO_LARGE[] =
+    "HTTP/1.1 431 Request Header Fields Too Large\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
 int http_server_connection_initiate(HTTPServerConnection* connection, int fd) {
-    tcp_client_initiate(&connection->tcpClient, fd);
     connection->read_buffer      = NULL;
     connection->method           = NULL;
     connection->request_path     = NULL;
@@ -22,14 +78,57 @@ int http_server_connection_initiate(HTTPServerConnection* connection, int fd) {
     connection->write_buffer     = NULL;
     connection->body             = NULL;
     connection->read_buffer_size = 0;
+    connection->read_capacity    = 0;
+    connection->body_received    = 0;
+    connection->onBody           = NULL;
     connection->content_len      = 0;
     connection->write_size       = 0;
     connection->write_offset     = 0;
     connection->body_start       = 0;
+    connection->peer_len         = 0;
+    connection->context          = NULL;
+    connection->onRequest        = NULL;
+    connection->onClose          = NULL;
+    connection->allocated        = false;
+    connection->accepted_us      = metrics_now_us();
+    connection->arrived_us       = connection->accepted_us;
     connection->state            = HTTP_SERVER_CONNECTION_STATE_RECEIVE;
 
-    connection->task =
-        smw_create_task(connection, http_server_connection_task_work);
+    connection->write_buffer_static = 0;
+    connection->streaming           = false;
+    connection->stream_ended        = false;
+    connection->write_capacity      = 0;
+    connection->onStream            = NULL;
+    connection->body_started_us     = 0;
+
+    if (!g_metrics_registered) {
+        for (int i = 0; i < HTTP_SERVER_DEADLINE_COUNT; i++) {
+            char labels[METRICS_LABELS_MAX];
+            snprintf(labels, sizeof(labels), "phase=\"%s\"",
+                     DEADLINE_PHASES[i]);
+            g_metric_timeouts[i] = metrics_register(
+                METRIC_COUNTER, "just_weather_http_timeouts_total", labels,
+                "Connections closed for missing a deadline");
+        }
+        g_metrics_registered = true;
+    }
+
+    connection->task = smw_create_task_with_priority(
+        connection, http_server_connection_task_work, SMW_PRIORITY_IO);
+    if (!connection->task) {
+        return -1; // The caller still owns the socket
+    }
+
+    smw_timer_init(&connection->deadline, connection,
+                   http_server_connection_timeout);
+    http_server_connection_set_deadline(connection, HTTP_SERVER_DEADLINE_IDLE,
+                                        g_limits.idle_timeout_us,
+                                        connection->accepted_us);
+
+    // Last, since with io_uring it starts receiving on the socket
+    tcp_client_initiate(&connection->tcpClient, fd);
+
+    g_open_connections++;
 
     return 0;
 }
@@ -52,11 +151,26 @@ int http_server_connection_initiate_ptr(int                    fd,
         return result;
     }
 
-    *(connection_ptr) = connection;
+    connection->allocated = true;
+    *(connection_ptr)     = connection;
 
     return 0;
 }
 
+size_t http_server_connection_open_count(void) { return g_open_connections; }
+
+void http_server_connection_set_peer(HTTPServerConnection*  connection,
+                                     const struct sockaddr* peer,
+                                     socklen_t              peer_len) {
+    if (!peer || peer_len > sizeof(connection->peer)) {
+        connection->peer_len = 0;
+        return;
+    }
+
+    memcpy(&connection->peer, peer, peer_len);
+    connection->peer_len = peer_len;
+}
+
 void http_server_connection_set_callback(
     HTTPServerConnection* connection, void* context,
     HttpServerConnectionOnRequest on_request) {
@@ -64,7 +178,26 @@ void http_server_connection_set_callback(
     connection->onRequest = on_request;
 }
 
+void http_server_connection_set_on_close(HTTPServerConnection*       connection,
+                                         HttpServerConnectionOnClose on_close) {
+    connection->onClose = on_close;
+}
+
+void http_server_connection_set_limits(
+    const HttpServerConnectionLimits* limits) {
+    g_limits = *limits;
+}
+
+void http_server_connection_set_on_body(HTTPServerConnection*      connection,
+                                        HttpServerConnectionOnBody on_body) {
+    connection->onBody = on_body;
+}
+
 int http_server_connection_send(HTTPServerConnection* connection) {
+    if (connection && connection->streaming) {
+        return http_server_connection_stream_send(connection);
+    }
+
     if (!connection || !connection->write_buffer ||
         connection->write_offset >= connection->write_size) {
         return 0;
@@ -87,113 +220,608 @@ int http_server_connection_send(HTTPServerConnection* connection) {
     // Finished sending
     if (connection->write_offset >= connection->write_size) {
         connection->state = HTTP_SERVER_CONNECTION_STATE_DISPOSE;
+    } else {
+        http_server_connection_send_deadline(connection, sent > 0);
+    }
+
+    return 0;
+}
+
+// Send what is buffered, then ask the handler for more while there is room
+static int http_server_connection_stream_send(
+    HTTPServerConnection* connection) {
+    ssize_t sent = 0;
+    if (connection->write_offset < connection->write_size) {
+        sent = tcp_client_write(
+            &connection->tcpClient,
+            connection->write_buffer + connection->write_offset,
+            connection->write_size - connection->write_offset);
+
+        if (sent > 0) {
+            connection->write_offset += sent;
+        } else if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            connection->state = HTTP_SERVER_CONNECTION_STATE_DISPOSE;
+            return -1;
+        }
+    }
+
+    if (connection->write_offset >= connection->write_size) {
+        connection->write_offset = 0;
+        connection->write_size   = 0;
+
+        if (connection->stream_ended) {
+            connection->state = HTTP_SERVER_CONNECTION_STATE_DISPOSE;
+            return 0;
+        }
+    }
+
+    // Checked before asking for more: chunks written now were not waiting
+    http_server_connection_send_deadline(connection, sent > 0);
+
+    if (!connection->stream_ended && connection->onStream &&
+        connection->write_size - connection->write_offset <
+            HTTP_SERVER_STREAM_BUFFER_MAX / 2) {
+        connection->onStream(connection->context);
+    }
+
+    return 0;
+}
+
+// Make room for extra more bytes at the end of the stream buffer, moving
+// what is still unsent to the front first
+static int http_server_connection_stream_reserve(
+    HTTPServerConnection* connection, size_t extra) {
+    if (connection->write_offset > 0) {
+        memmove(connection->write_buffer,
+                connection->write_buffer + connection->write_offset,
+                connection->write_size - connection->write_offset);
+        connection->write_size -= connection->write_offset;
+        connection->write_offset = 0;
+    }
+
+    size_t needed = connection->write_size + extra;
+    if (needed <= connection->write_capacity) {
+        return 0;
+    }
+
+    size_t capacity = connection->write_capacity ? connection->write_capacity :
+                                                   CHUNK_SIZE;
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+
+    uint8_t* buffer = realloc(connection->write_buffer, capacity);
+    if (!buffer) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    connection->write_buffer   = buffer;
+    connection->write_capacity = capacity;
+    return 0;
+}
+
+int http_server_connection_stream_start(
+    HTTPServerConnection* connection, int status_code, const char* reason,
+    const char* headers, HttpServerConnectionOnStream on_stream) {
+    if (connection->streaming ||
+        (connection->state != HTTP_SERVER_CONNECTION_STATE_SEND &&
+         connection->state != HTTP_SERVER_CONNECTION_STATE_WAIT)) {
+        return -1;
     }
 
+    if (!connection->write_buffer_static) {
+        free(connection->write_buffer);
+    }
+    connection->write_buffer        = NULL;
+    connection->write_buffer_static = 0;
+    connection->write_size          = 0;
+    connection->write_offset        = 0;
+    connection->write_capacity      = 0;
+
+    const char* format = "HTTP/1.1 %d %s\r\n"
+                         "%s"
+                         "Transfer-Encoding: chunked\r\n"
+                         "\r\n";
+    int length = snprintf(NULL, 0, format, status_code, reason, headers);
+    if (length < 0 ||
+        http_server_connection_stream_reserve(connection, length + 1) != 0) {
+        return -1;
+    }
+    snprintf((char*)connection->write_buffer, length + 1, format, status_code,
+             reason, headers);
+    connection->write_size = (size_t)length;
+
+    connection->streaming    = true;
+    connection->stream_ended = false;
+    connection->onStream     = on_stream;
+    connection->state        = HTTP_SERVER_CONNECTION_STATE_SEND;
     return 0;
 }
 
-// TODO: DIVIDE THIS FN UP INTO SMALLER PIECES FOR EASIER READING ETC
+int http_server_connection_stream_write(HTTPServerConnection* connection,
+                                        const uint8_t* data, size_t length) {
+    if (!connection->streaming || connection->stream_ended) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // An empty chunk would end the response
+    if (length == 0) {
+        return 0;
+    }
+
+    size_t pending = connection->write_size - connection->write_offset;
+    if (pending > 0 && pending + length > HTTP_SERVER_STREAM_BUFFER_MAX) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    char size_line[24];
+    int  size_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", length);
+    if (http_server_connection_stream_reserve(connection,
+                                              size_len + length + 2) != 0) {
+        return -1;
+    }
+
+    uint8_t* end = connection->write_buffer + connection->write_size;
+    memcpy(end, size_line, size_len);
+    memcpy(end + size_len, data, length);
+    memcpy(end + size_len + length, "\r\n", 2);
+    connection->write_size += size_len + length + 2;
+    return 0;
+}
+
+int http_server_connection_stream_end(HTTPServerConnection* connection) {
+    if (!connection->streaming || connection->stream_ended) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    static const char LAST_CHUNK[] = "0\r\n\r\n";
+    if (http_server_connection_stream_reserve(connection,
+                                              sizeof(LAST_CHUNK) - 1) != 0) {
+        return -1;
+    }
+
+    memcpy(connection->write_buffer + connection->write_size, LAST_CHUNK,
+           sizeof(LAST_CHUNK) - 1);
+    connection->write_size += sizeof(LAST_CHUNK) - 1;
+    connection->stream_ended = true;
+    return 0;
+}
+
+// Read straight into the request buffer, then parse what arrived
 int http_server_connection_receive(HTTPServerConnection* connection) {
     if (!connection) {
         return -1;
     }
 
-    uint8_t chunk_buffer[CHUNK_SIZE];
+    // While reading the headers, a chunk at a time; then the rest of the
+    // body at once, or a chunk at a time when it goes to onBody
+    size_t want = CHUNK_SIZE;
+    if (connection->body_start > 0) {
+        want = connection->content_len - connection->body_received;
+        if (connection->onBody && want > CHUNK_SIZE) {
+            want = CHUNK_SIZE;
+        }
+    }
+    if (http_server_connection_reserve(connection, want) != 0) {
+        connection->state = HTTP_SERVER_CONNECTION_STATE_DISPOSE;
+        return -1;
+    }
 
-    int bytes_read = tcp_client_read(&connection->tcpClient, chunk_buffer,
-                                     sizeof(chunk_buffer));
+    uint8_t* dest = connection->read_buffer + connection->read_buffer_size;
+
+    int bytes_read = 0;
+    if (connection->read_buffer_size == 0) {
+        // Stamp the start of the request with its kernel arrival time, which
+        // includes the time spent in the listen backlog
+        uint64_t age = UINT64_MAX;
+        bytes_read =
+            tcp_client_read_stamped(&connection->tcpClient, dest, want, &age);
+        uint64_t now = metrics_now_us();
+        if (bytes_read > 0 && age <= now) {
+            connection->arrived_us = now - age;
+        }
+    } else {
+        bytes_read = tcp_client_read(&connection->tcpClient, dest, want);
+    }
 
     if (bytes_read < 0) {
-        return -1; // real error
+        // Peer closed or real error, nothing more will arrive
+        connection->state = HTTP_SERVER_CONNECTION_STATE_DISPOSE;
+        return -1;
     } else if (bytes_read == 0) {
         return 0;
     }
 
-    size_t   new_size   = connection->read_buffer_size + bytes_read;
-    uint8_t* new_buffer = realloc(connection->read_buffer, new_size);
-    if (!new_buffer) {
+    size_t scanned = connection->read_buffer_size;
+    connection->read_buffer_size += bytes_read;
+
+    if (scanned == 0) {
+        http_server_connection_set_deadline(
+            connection, HTTP_SERVER_DEADLINE_HEADER, g_limits.header_timeout_us,
+            metrics_now_us());
+    }
+
+    if (connection->body_start == 0) {
+        // The terminator may straddle the previous read
+        size_t from = scanned > 3 ? scanned - 3 : 0;
+        int    result = http_server_connection_parse_head(connection, from);
+        if (result != 0) {
+            return result < 0 ? -1 : 0;
+        }
+    } else {
+        connection->body_received += bytes_read;
+    }
+
+    // Bytes past the declared length are ignored
+    if (connection->body_received > connection->content_len) {
+        connection->read_buffer_size -=
+            connection->body_received - connection->content_len;
+        connection->body_received = connection->content_len;
+    }
+
+    if (connection->onBody &&
+        connection->read_buffer_size > connection->body_start) {
+        if (connection->onBody(connection->context,
+                               connection->read_buffer +
+                                   connection->body_start,
+                               connection->read_buffer_size -
+                                   connection->body_start) != 0) {
+            http_server_connection_reject(connection, RESPONSE_BAD_REQUEST);
+            return 0;
+        }
+        connection->read_buffer_size = connection->body_start;
+    }
+
+    if (connection->body_received < connection->content_len) {
+        http_server_connection_body_deadline(connection);
+        return 0;
+    }
+
+    if (!connection->onBody && connection->content_len > 0) {
+        connection->body = connection->read_buffer + connection->body_start;
+    }
+
+    // The send deadline starts once there is something to send
+    smw_timer_cancel(&connection->deadline);
+    connection->state = HTTP_SERVER_CONNECTION_STATE_SEND;
+    connection->onRequest(connection->context);
+
+    return 0;
+}
+
+// Look for the end of the headers from offset from on and parse them once
+// it is there. Returns 0 once parsed, 1 while incomplete or rejected, -1 if
+// out of memory.
+static int http_server_connection_parse_head(HTTPServerConnection* connection,
+                                             size_t                from) {
+    size_t header_end = 0;
+    for (size_t i = from; i + 4 <= connection->read_buffer_size; i++) {
+        if (connection->read_buffer[i] == '\r' &&
+            connection->read_buffer[i + 1] == '\n' &&
+            connection->read_buffer[i + 2] == '\r' &&
+            connection->read_buffer[i + 3] == '\n') {
+            header_end = i + 4;
+            break;
+        }
+    }
+
+    size_t max_header = g_limits.max_header_size;
+    if (max_header > 0 &&
+        (header_end > max_header ||
+         (header_end == 0 && connection->read_buffer_size > max_header))) {
+        http_server_connection_reject(connection, RESPONSE_HEADERS_TOO_LARGE);
+        return 1;
+    }
+    if (header_end == 0) {
+        return 1;
+    }
+
+    char method[METHOD_MAX_LEN]             = {0};
+    char request_path[REQUEST_PATH_MAX_LEN] = {0};
+    char host[HOST_MAX_LEN]                 = {0};
+
+    char* headers = malloc(header_end + 1);
+    if (!headers) {
         return -1;
     }
 
-    connection->read_buffer = new_buffer;
-    memcpy(connection->read_buffer + connection->read_buffer_size, chunk_buffer,
-           bytes_read);
-    connection->read_buffer_size += bytes_read;
+    memcpy(headers, connection->read_buffer, header_end);
+    headers[header_end] = '\0';
 
-    if (connection->body_start == 0) {
+    sscanf(headers, "%7s %255s", method, request_path);
 
-        for (int i = 0; i <= connection->read_buffer_size - 4; i++) {
+    char* host_ptr = strstr(headers, "Host:");
+    if (host_ptr) {
+        sscanf(host_ptr, "Host: %255s", host);
+    }
 
-            // Checks if we have parsed all headers
-            if (connection->read_buffer[i] == '\r' &&
-                connection->read_buffer[i + 1] == '\n' &&
-                connection->read_buffer[i + 2] == '\r' &&
-                connection->read_buffer[i + 3] == '\n') {
+    free(headers);
+
+    connection->method          = strdup(method);
+    connection->request_path    = strdup(request_path);
+    connection->host            = strdup(host);
+    connection->body_start      = header_end;
+    connection->body_started_us = metrics_now_us();
+
+    size_t      length_len = 0;
+    const char* length     = http_server_connection_get_header(
+        connection, "Content-Length", &length_len);
+    if (length) {
+        size_t content_len = 0;
+        for (size_t i = 0; i < length_len; i++) {
+            if (length[i] < '0' || length[i] > '9' ||
+                content_len > (SIZE_MAX - 9) / 10) {
+                http_server_connection_reject(connection,
+                                              RESPONSE_BAD_REQUEST);
+                return 1;
+            }
+            content_len = content_len * 10 + (size_t)(length[i] - '0');
+        }
+        connection->content_len = content_len;
+    }
 
-                char   method[METHOD_MAX_LEN]             = {0};
-                char   request_path[REQUEST_PATH_MAX_LEN] = {0};
-                char   host[HOST_MAX_LEN]                 = {0};
-                size_t content_len                        = 0;
+    // Refused before any of the body is buffered
+    if (g_limits.max_body_size > 0 &&
+        connection->content_len > g_limits.max_body_size) {
+        http_server_connection_reject(connection, RESPONSE_BODY_TOO_LARGE);
+        return 1;
+    }
+
+    // Body bytes that came with the headers
+    connection->body_received = connection->read_buffer_size - header_end;
+    return 0;
+}
+
+// Grow the request buffer to hold extra more bytes
+static int http_server_connection_reserve(HTTPServerConnection* connection,
+                                          size_t                extra) {
+    size_t needed = connection->read_buffer_size + extra;
+    if (needed <= connection->read_capacity) {
+        return 0;
+    }
+
+    size_t capacity = connection->read_capacity * 2;
+    if (capacity < needed) {
+        capacity = needed;
+    }
+
+    uint8_t* buffer = realloc(connection->read_buffer, capacity);
+    if (!buffer) {
+        return -1;
+    }
+
+    connection->read_buffer   = buffer;
+    connection->read_capacity = capacity;
+    return 0;
+}
 
-                int   header_end = i + 4;
-                char* headers    = malloc(header_end + 1);
-                if (!headers) {
-                    return -1;
-                }
+// Answer with a fixed error and close without calling onRequest
+static void http_server_connection_reject(HTTPServerConnection* connection,
+                                          const char*           response) {
+    connection->write_buffer        = (uint8_t*)response;
+    connection->write_buffer_static = 1;
+    connection->write_offset        = 0;
+    connection->write_size          = strlen(response);
+    connection->state               = HTTP_SERVER_CONNECTION_STATE_SEND;
+    smw_timer_cancel(&connection->deadline);
+}
 
-                memcpy(headers, connection->read_buffer, header_end);
-                headers[header_end] = '\0';
+// Arm the deadline of a phase timeout_us after from_us, or disarm it when
+// the phase has no limit. Out of memory, the connection goes without one.
+static void http_server_connection_set_deadline(
+    HTTPServerConnection* connection, HttpServerDeadline phase,
+    uint64_t timeout_us, uint64_t from_us) {
+    if (timeout_us == 0) {
+        smw_timer_cancel(&connection->deadline);
+        return;
+    }
 
-                sscanf(headers, "%7s %255s", method, request_path);
+    connection->deadline_phase = phase;
+    smw_timer_set(&connection->deadline, from_us + timeout_us);
+}
 
-                char* host_ptr = strstr(headers, "Host:");
-                if (host_ptr) {
-                    sscanf(host_ptr, "Host: %255s", host);
-                }
+// The body deadline moves out by a second per min_body_rate bytes received,
+// so a client trickling the body falls behind however long it has been
+static void http_server_connection_body_deadline(
+    HTTPServerConnection* connection) {
+    if (g_limits.min_body_rate == 0) {
+        http_server_connection_set_deadline(
+            connection, HTTP_SERVER_DEADLINE_BODY, g_limits.transfer_timeout_us,
+            metrics_now_us());
+        return;
+    }
 
-                char* content_len_ptr = strstr(headers, "Content-Length:");
-                if (content_len_ptr) {
-                    sscanf(content_len_ptr, "Content-Length: %zu",
-                           &content_len);
-                }
+    uint64_t earned =
+        (uint64_t)connection->body_received * 1000000 / g_limits.min_body_rate;
+    http_server_connection_set_deadline(
+        connection, HTTP_SERVER_DEADLINE_BODY,
+        g_limits.transfer_timeout_us + earned, connection->body_started_us);
+}
 
-                free(headers);
+// While part of the response waits to be sent, the client must take more of
+// it within the transfer timeout of the last time it did
+static void http_server_connection_send_deadline(
+    HTTPServerConnection* connection, bool progressed) {
+    if (connection->write_offset >= connection->write_size) {
+        smw_timer_cancel(&connection->deadline);
+    } else if (progressed || !smw_timer_armed(&connection->deadline) ||
+               connection->deadline_phase != HTTP_SERVER_DEADLINE_SEND) {
+        http_server_connection_set_deadline(
+            connection, HTTP_SERVER_DEADLINE_SEND, g_limits.transfer_timeout_us,
+            metrics_now_us());
+    }
+}
 
-                connection->method       = strdup(method);
-                connection->request_path = strdup(request_path);
-                connection->host         = strdup(host);
-                connection->content_len  = content_len;
-                connection->body_start   = header_end;
+// Missed a deadline: close right away, no response
+static void http_server_connection_timeout(void* context, uint64_t mon_time) {
+    HTTPServerConnection* connection = (HTTPServerConnection*)context;
+    (void)mon_time;
 
-                break;
+    metrics_inc(g_metric_timeouts[connection->deadline_phase]);
+    http_server_connection_close(connection);
+}
+
+void http_server_connection_wait(HTTPServerConnection* connection) {
+    smw_timer_cancel(&connection->deadline);
+    connection->state = HTTP_SERVER_CONNECTION_STATE_WAIT;
+}
+
+void http_server_connection_resume(HTTPServerConnection* connection) {
+    if (connection->state == HTTP_SERVER_CONNECTION_STATE_WAIT) {
+        connection->state = HTTP_SERVER_CONNECTION_STATE_SEND;
+    }
+}
+
+const char* http_server_connection_get_header(HTTPServerConnection* connection,
+                                              const char*           name,
+                                              size_t*               value_len) {
+    if (!connection || !name || connection->body_start == 0) {
+        return NULL;
+    }
+
+    const char* headers  = (const char*)connection->read_buffer;
+    const char* end      = headers + connection->body_start;
+    size_t      name_len = strlen(name);
+
+    // Skip the request line
+    const char* line = memchr(headers, '\n', end - headers);
+    while (line && ++line < end) {
+        const char* line_end = memchr(line, '\n', end - line);
+        if (!line_end) {
+            break;
+        }
+
+        if ((size_t)(line_end - line) > name_len && line[name_len] == ':' &&
+            strncasecmp(line, name, name_len) == 0) {
+            const char* value = line + name_len + 1;
+            const char* stop  = line_end;
+            while (value < stop && (*value == ' ' || *value == '\t')) {
+                value++;
             }
+            while (stop > value && (stop[-1] == '\r' || stop[-1] == ' ' ||
+                                    stop[-1] == '\t')) {
+                stop--;
+            }
+
+            if (value_len) {
+                *value_len = stop - value;
+            }
+            return value;
         }
+
+        line = line_end;
     }
 
-    // checks if headers and body is done parsing
-    if (connection->read_buffer_size >=
-            connection->body_start + connection->content_len &&
-        connection->body_start > 0) {
+    return NULL;
+}
 
-        if (connection->method && strcmp(connection->method, "GET") == 0) {
-            connection->state = HTTP_SERVER_CONNECTION_STATE_SEND;
-            connection->onRequest(connection->context);
-            return 0;
+// Parse a qvalue ("q=0.5") from the parameters of one Accept-Encoding item
+static int http_server_connection_parse_q(const char* params, size_t len) {
+    const char* q = NULL;
+    for (size_t i = 0; i + 1 < len; i++) {
+        if ((params[i] == 'q' || params[i] == 'Q') && params[i + 1] == '=') {
+            q = params + i + 2;
+            break;
         }
-        connection->body = malloc(connection->content_len);
-        if (!connection->body) {
-            return -1;
+    }
+    if (!q) {
+        return 1000;
+    }
+
+    // Fixed point with three decimals, as allowed by RFC 9110
+    int value = (*q == '1') ? 1000 : 0;
+    if (*q == '0' && q[1] == '.') {
+        int scale = 100;
+        for (const char* d = q + 2; d < params + len && *d >= '0' && *d <= '9' &&
+                                    scale > 0;
+             d++, scale /= 10) {
+            value += (*d - '0') * scale;
+        }
+    }
+    return value;
+}
+
+HttpContentEncoding
+http_server_connection_get_encoding(HTTPServerConnection* connection) {
+    size_t      len    = 0;
+    const char* header = http_server_connection_get_header(
+        connection, "Accept-Encoding", &len);
+    if (!header) {
+        return HTTP_CONTENT_ENCODING_IDENTITY;
+    }
+
+    int gzip_q     = -1;
+    int deflate_q  = -1;
+    int identity_q = -1;
+    int any_q      = -1;
+
+    const char* end  = header + len;
+    const char* item = header;
+    while (item < end) {
+        const char* item_end = memchr(item, ',', end - item);
+        if (!item_end) {
+            item_end = end;
         }
 
-        memcpy(connection->body,
-               connection->read_buffer + connection->body_start,
-               connection->content_len);
+        while (item < item_end && (*item == ' ' || *item == '\t')) {
+            item++;
+        }
+        const char* name_end = item;
+        while (name_end < item_end && *name_end != ';' && *name_end != ' ') {
+            name_end++;
+        }
 
-        connection->state = HTTP_SERVER_CONNECTION_STATE_SEND;
-        connection->onRequest(connection->context);
+        size_t name_len = name_end - item;
+        int    q = http_server_connection_parse_q(name_end, item_end - name_end);
+
+        if ((name_len == 4 && strncasecmp(item, "gzip", 4) == 0) ||
+            (name_len == 6 && strncasecmp(item, "x-gzip", 6) == 0)) {
+            gzip_q = q;
+        } else if (name_len == 7 && strncasecmp(item, "deflate", 7) == 0) {
+            deflate_q = q;
+        } else if (name_len == 8 && strncasecmp(item, "identity", 8) == 0) {
+            identity_q = q;
+        } else if (name_len == 1 && *item == '*') {
+            any_q = q;
+        }
+
+        item = item_end + 1;
     }
 
-    return 0;
+    // Codings not listed fall back to "*"; identity is acceptable unless
+    // explicitly refused
+    if (gzip_q < 0) {
+        gzip_q = any_q > 0 ? any_q : 0;
+    }
+    if (deflate_q < 0) {
+        deflate_q = any_q > 0 ? any_q : 0;
+    }
+    if (identity_q < 0) {
+        identity_q = 1;
+    }
+
+    if (gzip_q > 0 && gzip_q >= deflate_q && gzip_q >= identity_q) {
+        return HTTP_CONTENT_ENCODING_GZIP;
+    }
+    if (deflate_q > 0 && deflate_q >= identity_q) {
+        return HTTP_CONTENT_ENCODING_DEFLATE;
+    }
+    return HTTP_CONTENT_ENCODING_IDENTITY;
+}
+
+const char* http_content_encoding_name(HttpContentEncoding encoding) {
+    switch (encoding) {
+    case HTTP_CONTENT_ENCODING_GZIP:
+        return "gzip";
+    case HTTP_CONTENT_ENCODING_DEFLATE:
+        return "deflate";
+    default:
+        return NULL;
+    }
 }
 
 void http_server_connection_task_work(void* context, uint64_t mon_time) {
@@ -206,7 +834,9 @@ void http_server_connection_task_work(void* context, uint64_t mon_time) {
         http_server_connection_send(connection);
         break;
     case HTTP_SERVER_CONNECTION_STATE_DISPOSE:
-        http_server_connection_dispose(connection);
+        http_server_connection_close(connection);
+        break;
+    case HTTP_SERVER_CONNECTION_STATE_WAIT:
         break;
     }
 }
@@ -220,16 +850,24 @@ void http_server_connection_dispose(HTTPServerConnection* connection) {
     if (connection->task) {
         smw_destroy_task(connection->task);
         connection->task = NULL;
+        g_open_connections--;
+        smw_timer_cancel(&connection->deadline);
     }
 
     // Dispose TCP client
     tcp_client_dispose(&connection->tcpClient);
 
+    // Let the owner release its state, only once
+    if (connection->onClose) {
+        HttpServerConnectionOnClose on_close = connection->onClose;
+        connection->onClose                  = NULL;
+        on_close(connection->context);
+    }
+
     // Free all dynamically allocated memory
     free(connection->read_buffer);
     connection->read_buffer = NULL;
 
-    free(connection->body);
     connection->body = NULL;
 
     free(connection->method);
@@ -241,16 +879,33 @@ void http_server_connection_dispose(HTTPServerConnection* connection) {
     free(connection->host);
     connection->host = NULL;
 
-    free(connection->write_buffer);
-    connection->write_buffer = NULL;
+    if (!connection->write_buffer_static) {
+        free(connection->write_buffer);
+    }
+    connection->write_buffer        = NULL;
+    connection->write_buffer_static = 0;
+    connection->write_capacity      = 0;
+    connection->streaming           = false;
+    connection->onStream            = NULL;
 
     connection->read_buffer_size = 0;
+    connection->read_capacity    = 0;
+    connection->body_received    = 0;
     connection->write_size       = 0;
     connection->write_offset     = 0;
     connection->body_start       = 0;
     connection->content_len      = 0;
 }
 
+// The connection ends itself here, so nothing else is left to free it. Only
+// called last in its own task or timer callback.
+static void http_server_connection_close(HTTPServerConnection* connection) {
+    http_server_connection_dispose(connection);
+    if (connection->allocated) {
+        free(connection);
+    }
+}
+
 void http_server_connection_dispose_ptr(HTTPServerConnection** connection_ptr) {
     if (connection_ptr == NULL || *(connection_ptr) == NULL) {
         return;
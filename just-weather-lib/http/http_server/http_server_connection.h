@@ -6,23 +6,86 @@
 #include "smw.h"
 #include "tcp_client.h"
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/socket.h>
 
-// Max chunks to read per iteration
-#define CHUNK_SIZE 256
+// Max bytes to read per iteration
+#define CHUNK_SIZE 4096
 
 // Headers max lengths
 #define METHOD_MAX_LEN 9
 #define REQUEST_PATH_MAX_LEN 256
 #define HOST_MAX_LEN 256
 
+// Request size limits until http_server_connection_set_limits
+#define HTTP_SERVER_MAX_HEADER_SIZE_DEFAULT (16 * 1024)
+#define HTTP_SERVER_MAX_BODY_SIZE_DEFAULT (1024 * 1024)
+
+// Deadline defaults until http_server_connection_set_limits
+#define HTTP_SERVER_IDLE_TIMEOUT_DEFAULT_US (10 * 1000 * 1000)
+#define HTTP_SERVER_HEADER_TIMEOUT_DEFAULT_US (10 * 1000 * 1000)
+#define HTTP_SERVER_TRANSFER_TIMEOUT_DEFAULT_US (10 * 1000 * 1000)
+#define HTTP_SERVER_MIN_BODY_RATE_DEFAULT 1024
+
+// Encoded chunks a streaming response buffers before
+// http_server_connection_stream_write refuses more
+#define HTTP_SERVER_STREAM_BUFFER_MAX (64 * 1024)
+
 typedef int (*HttpServerConnectionOnRequest)(void* context);
 
+// Called once when the connection is disposed, with the callback context
+typedef void (*HttpServerConnectionOnClose)(void* context);
+
+// Called with the callback context for each piece of a request body as it
+// arrives, once the headers are parsed. Returning non-zero rejects the
+// request with 400.
+typedef int (*HttpServerConnectionOnBody)(void* context, const uint8_t* data,
+                                          size_t length);
+
+// Called with the callback context while a streaming response has room for
+// more chunks, until it is ended
+typedef void (*HttpServerConnectionOnStream)(void* context);
+
+// Response content codings the server can produce
+typedef enum {
+    HTTP_CONTENT_ENCODING_IDENTITY,
+    HTTP_CONTENT_ENCODING_GZIP,
+    HTTP_CONTENT_ENCODING_DEFLATE,
+} HttpContentEncoding;
+
+// Larger requests are answered with 431 or 413 and never reach onRequest.
+// A connection that misses a deadline is closed without a response, which
+// bounds what slow clients hold. 0 disables a limit.
+typedef struct {
+    size_t max_header_size; // Request line and headers
+    size_t max_body_size;   // Content-Length
+
+    uint64_t idle_timeout_us;   // Accept to the first request byte
+    uint64_t header_timeout_us; // First request byte to the end of headers
+    // A body gets this long plus 1 s per min_body_rate bytes received, so
+    // it must keep up that rate on average. A response must be taken up
+    // again within this long whenever part of it is waiting to be sent.
+    uint64_t transfer_timeout_us;
+    size_t   min_body_rate; // Bytes per second; 0 only requires progress
+} HttpServerConnectionLimits;
+
+// Which part of the exchange the connection deadline covers
+typedef enum {
+    HTTP_SERVER_DEADLINE_IDLE,
+    HTTP_SERVER_DEADLINE_HEADER,
+    HTTP_SERVER_DEADLINE_BODY,
+    HTTP_SERVER_DEADLINE_SEND,
+    HTTP_SERVER_DEADLINE_COUNT,
+} HttpServerDeadline;
+
 typedef enum {
     HTTP_SERVER_CONNECTION_STATE_SEND,
     HTTP_SERVER_CONNECTION_STATE_RECEIVE,
     HTTP_SERVER_CONNECTION_STATE_DISPOSE,
+    // Request handled, response not ready yet (http_server_connection_wait)
+    HTTP_SERVER_CONNECTION_STATE_WAIT,
 } HttpServerConnectionState;
 
 typedef struct {
@@ -32,21 +95,61 @@ typedef struct {
     HttpServerConnectionState     state;
     void*                         context;
     HttpServerConnectionOnRequest onRequest;
+    HttpServerConnectionOnClose   onClose;
+
+    // Allocated by http_server_connection_initiate_ptr. Such a connection
+    // frees itself when it closes on its own (error, end of exchange or a
+    // missed deadline), after onClose.
+    bool allocated;
+
+    // Client address from accept, peer_len is 0 when unknown
+    struct sockaddr_storage peer;
+    socklen_t               peer_len;
+
+    // When the connection was accepted and when its first request bytes
+    // reached the kernel (metrics_now_us clock). The request has been queued
+    // in the server since arrived_us, which is accepted_us when the kernel
+    // gave no receive timestamp.
+    uint64_t accepted_us;
+    uint64_t arrived_us;
+
+    // Closes the connection when the current phase overruns its limit. Not
+    // armed while the response is being built (WAIT) or a stream has
+    // nothing to send.
+    SmwTimer           deadline;
+    HttpServerDeadline deadline_phase;
+    uint64_t           body_started_us; // Headers parsed
 
     char*  method;
     char*  request_path;
     char*  host;
     size_t content_len;
 
+    // The request as read, in read_capacity bytes. With onBody set only the
+    // headers are kept.
     uint8_t* read_buffer;
     size_t   read_buffer_size;
+    size_t   read_capacity;
 
-    uint8_t* body;
-    size_t   body_start;
+    // The body inside read_buffer, content_len bytes, not a copy. NULL when
+    // it went to onBody instead.
+    const uint8_t*             body;
+    size_t                     body_start;
+    size_t                     body_received; // Read so far
+    HttpServerConnectionOnBody onBody;
 
     uint8_t* write_buffer;
     size_t   write_size;
     size_t   write_offset;
+    // Set when write_buffer is shared static data that must not be freed
+    int write_buffer_static;
+
+    // Streaming response: write_buffer holds the encoded chunks not sent
+    // yet, in write_capacity bytes
+    bool                         streaming;
+    bool                         stream_ended; // Last chunk queued
+    size_t                       write_capacity;
+    HttpServerConnectionOnStream onStream;
 
 } HTTPServerConnection;
 
@@ -54,10 +157,87 @@ int http_server_connection_initiate(HTTPServerConnection* connection, int fd);
 int http_server_connection_initiate_ptr(int                    fd,
                                         HTTPServerConnection** connection_ptr);
 
+/// Number of connections initiated and not yet disposed
+size_t http_server_connection_open_count(void);
+
+/// Remember the client address the connection was accepted from
+void http_server_connection_set_peer(HTTPServerConnection*  connection,
+                                     const struct sockaddr* peer,
+                                     socklen_t              peer_len);
+
 void http_server_connection_set_callback(
     HTTPServerConnection* connection, void* context,
     HttpServerConnectionOnRequest on_request);
 
+/// Set a callback run once when the connection is disposed, so the owner of
+/// the callback context can release what it holds for the connection.
+void http_server_connection_set_on_close(HTTPServerConnection*       connection,
+                                         HttpServerConnectionOnClose on_close);
+
+/// Set the request size limits and deadlines of all connections. Deadlines
+/// apply to connections from the next phase they enter on.
+void http_server_connection_set_limits(
+    const HttpServerConnectionLimits* limits);
+
+/// Pass request bodies to on_body as they arrive instead of buffering them,
+/// so they can be parsed incrementally. onRequest is called once the whole
+/// body has been passed on, with body NULL.
+void http_server_connection_set_on_body(HTTPServerConnection*      connection,
+                                        HttpServerConnectionOnBody on_body);
+
+/// Read what is available from the socket and parse it. Calls onRequest and
+/// moves to the SEND state once the whole request is buffered. Called by the
+/// connection task; returns -1 on socket or allocation errors.
+int http_server_connection_receive(HTTPServerConnection* connection);
+
+/// Hold the response back, from inside onRequest, while it is being built
+/// elsewhere (e.g. on a worker thread). The connection neither reads nor
+/// sends until http_server_connection_resume; the request fields and
+/// headers stay valid meanwhile.
+void http_server_connection_wait(HTTPServerConnection* connection);
+
+/// Start sending the response put in write_buffer since
+/// http_server_connection_wait
+void http_server_connection_resume(HTTPServerConnection* connection);
+
+/// Answer with a chunked response written piece by piece, instead of
+/// setting write_buffer. Call from onRequest or while the connection waits.
+/// headers are extra header lines, each ending in "\r\n". on_stream (can be
+/// NULL) is called from the connection task whenever less than half of
+/// HTTP_SERVER_STREAM_BUFFER_MAX is waiting to be sent; data arriving from
+/// elsewhere can be written at any time instead. Returns 0, or -1 if out of
+/// memory or the connection is not handling a request.
+int http_server_connection_stream_start(
+    HTTPServerConnection* connection, int status_code, const char* reason,
+    const char* headers, HttpServerConnectionOnStream on_stream);
+
+/// Queue one chunk. Returns 0, or -1 with errno set: EAGAIN while the
+/// buffered chunks would exceed HTTP_SERVER_STREAM_BUFFER_MAX (write it
+/// again later, e.g. from on_stream), EINVAL when no stream is open, ENOMEM.
+/// A chunk larger than the limit is taken once the buffer is empty.
+int http_server_connection_stream_write(HTTPServerConnection* connection,
+                                        const uint8_t* data, size_t length);
+
+/// Queue the terminating chunk. The connection closes once it is sent.
+int http_server_connection_stream_end(HTTPServerConnection* connection);
+
+/// Look up a request header by name (case-insensitive). Only valid once the
+/// headers are parsed, i.e. inside the onRequest callback. Returns a pointer
+/// into the read buffer (not NUL-terminated) and its length in value_len, or
+/// NULL if the header is not present.
+const char* http_server_connection_get_header(HTTPServerConnection* connection,
+                                              const char*           name,
+                                              size_t*               value_len);
+
+/// Pick the best content coding the client accepts according to its
+/// Accept-Encoding header (q-values honoured, gzip preferred on ties).
+/// Returns HTTP_CONTENT_ENCODING_IDENTITY when nothing else is acceptable.
+HttpContentEncoding
+http_server_connection_get_encoding(HTTPServerConnection* connection);
+
+/// Token used in the Content-Encoding header, NULL for identity
+const char* http_content_encoding_name(HttpContentEncoding encoding);
+
 void http_server_connection_dispose(HTTPServerConnection* connection);
 void http_server_connection_dispose_ptr(HTTPServerConnection** connection_ptr);
 
@@ -1,25 +1,41 @@
 #include "tcp_client.h"
 
+#include "log.h"
+
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
+//-----------------Internal Functions-----------------
+
+static void     tcp_client_race_order(TCPClientRace* race, struct addrinfo* res);
+static int      tcp_client_race_attempt(TCPClientRace* race, uint64_t now_ms);
+static void     tcp_client_race_dispose(TCPClient* c);
+static uint64_t tcp_client_now_ms(void);
+
+//----------------------------------------------------
+
 int tcp_client_initiate(TCPClient* c, int fd) {
-    c->fd = fd;
+    c->fd    = fd;
+    c->race  = NULL;
+    c->uring = fd >= 0 ? tcp_uring_attach(fd) : NULL;
     return 0;
 }
 
 int tcp_client_connect(TCPClient* c, const char* host, const char* port) {
-    printf("TCP_DEBUG: tcp_client_connect called with host='%s', port='%s'\n",
-           host, port);
+    LOG_DEBUG("tcp", "Connecting to %s:%s", host, port);
 
-    if (c->fd >= 0) {
-        printf("TCP_DEBUG: Socket already connected (fd=%d)\n", c->fd);
+    if (c->fd >= 0 || c->race != NULL) {
+        LOG_WARN("tcp", "Socket already connected (fd=%d)", c->fd);
         return -1;
     }
 
@@ -30,61 +46,212 @@ int tcp_client_connect(TCPClient* c, const char* host, const char* port) {
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_protocol = IPPROTO_TCP;
 
-    printf("TCP_DEBUG: Calling getaddrinfo...\n");
     int gai_result = getaddrinfo(host, port, &hints, &res);
     if (gai_result != 0) {
-        printf("TCP_DEBUG: getaddrinfo failed: %s\n", gai_strerror(gai_result));
+        LOG_WARN("tcp", "getaddrinfo(%s) failed: %s", host,
+                 gai_strerror(gai_result));
+        return -1;
+    }
+
+    TCPClientRace* race = (TCPClientRace*)calloc(1, sizeof(TCPClientRace));
+    if (race == NULL) {
+        freeaddrinfo(res);
+        return -1;
+    }
+
+    tcp_client_race_order(race, res);
+    freeaddrinfo(res);
+
+    c->race = race;
+    if (tcp_client_race_attempt(race, tcp_client_now_ms()) != 0) {
+        LOG_WARN("tcp", "All connection attempts to %s:%s failed", host, port);
+        tcp_client_race_dispose(c);
         return -1;
     }
-    printf("TCP_DEBUG: getaddrinfo succeeded\n");
 
-    int fd = -1;
+    return 0;
+}
+
+int tcp_client_connect_poll(TCPClient* c) {
+    TCPClientRace* race = c->race;
+    if (race == NULL) {
+        return c->fd >= 0 ? 1 : -1;
+    }
+
+    struct pollfd polls[TCP_CLIENT_MAX_ATTEMPTS];
+    int           errors[TCP_CLIENT_MAX_ATTEMPTS];
+    size_t        polled = race->pending;
+    for (size_t i = 0; i < polled; i++) {
+        polls[i].fd      = race->fds[i];
+        polls[i].events  = POLLOUT;
+        polls[i].revents = 0;
+    }
+
+    if (poll(polls, polled, 0) < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    // The earliest attempt that completed wins
+    for (size_t i = 0; i < polled; i++) {
+        errors[i] = 0;
+        if (polls[i].revents == 0) {
+            continue;
+        }
+
+        socklen_t len = sizeof(errors[i]);
+        if (getsockopt(race->fds[i], SOL_SOCKET, SO_ERROR, &errors[i], &len) <
+            0) {
+            errors[i] = errno;
+        }
+
+        if (errors[i] == 0) {
+            c->fd          = race->fds[i];
+            race->fds[i]   = -1;
+            LOG_TRACE("tcp", "Connected (fd=%d) after %zu attempt(s)", c->fd,
+                      race->next);
+            tcp_client_race_dispose(c);
+            return 1;
+        }
+    }
+
+    // Drop failed attempts, walking backwards so the swap stays behind us
+    for (size_t i = polled; i-- > 0;) {
+        if (polls[i].revents == 0) {
+            continue;
+        }
+
+        LOG_DEBUG("tcp", "connect attempt failed: %s, trying next address",
+                  strerror(errors[i]));
+        close(race->fds[i]);
+        race->fds[i] = race->fds[--race->pending];
+    }
+
+    // Start the next address when the current attempts are slow or failed
+    uint64_t now_ms = tcp_client_now_ms();
+    if (race->next < race->count &&
+        (race->pending == 0 || now_ms >= race->next_attempt_ms)) {
+        tcp_client_race_attempt(race, now_ms);
+    }
+
+    if (race->pending == 0) {
+        LOG_WARN("tcp", "All connection attempts failed");
+        tcp_client_race_dispose(c);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Copy the resolved addresses, alternating between address families and
+// starting with the one the resolver preferred
+static void tcp_client_race_order(TCPClientRace* race, struct addrinfo* res) {
+    struct addrinfo* preferred[TCP_CLIENT_MAX_ATTEMPTS];
+    struct addrinfo* other[TCP_CLIENT_MAX_ATTEMPTS];
+    size_t           preferred_count = 0;
+    size_t           other_count     = 0;
+
     for (struct addrinfo* rp = res; rp; rp = rp->ai_next) {
-        printf("TCP_DEBUG: Creating socket with family=%d\n", rp->ai_family);
-        fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        printf("TCP_DEBUG: socket() returned fd=%d\n", fd);
+        if (rp->ai_addrlen > sizeof(struct sockaddr_storage)) {
+            continue;
+        }
+
+        if (rp->ai_family == res->ai_family) {
+            if (preferred_count < TCP_CLIENT_MAX_ATTEMPTS) {
+                preferred[preferred_count++] = rp;
+            }
+        } else if (other_count < TCP_CLIENT_MAX_ATTEMPTS) {
+            other[other_count++] = rp;
+        }
+    }
 
+    for (size_t i = 0; i < preferred_count || i < other_count; i++) {
+        struct addrinfo* turn[2] = {i < preferred_count ? preferred[i] : NULL,
+                                    i < other_count ? other[i] : NULL};
+
+        for (int t = 0; t < 2; t++) {
+            if (turn[t] == NULL || race->count == TCP_CLIENT_MAX_ATTEMPTS) {
+                continue;
+            }
+
+            memcpy(&race->addresses[race->count], turn[t]->ai_addr,
+                   turn[t]->ai_addrlen);
+            race->lengths[race->count] = turn[t]->ai_addrlen;
+            race->count++;
+        }
+    }
+}
+
+// Start connecting to the next address that accepts a connect() call
+static int tcp_client_race_attempt(TCPClientRace* race, uint64_t now_ms) {
+    while (race->next < race->count) {
+        struct sockaddr* address =
+            (struct sockaddr*)&race->addresses[race->next];
+        socklen_t length = race->lengths[race->next];
+        race->next++;
+
+        int fd = socket(address->sa_family, SOCK_STREAM, IPPROTO_TCP);
         if (fd < 0) {
-            printf("TCP_DEBUG: socket() failed: %s\n", strerror(errno));
+            LOG_WARN("tcp", "socket(family=%d) failed: %s", address->sa_family,
+                     strerror(errno));
             continue;
         }
 
-        printf("TCP_DEBUG: Setting non-blocking mode\n");
         int flags = fcntl(fd, F_GETFL, 0);
         fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 
-        printf("TCP_DEBUG: Calling connect()...\n");
-        int connect_result = connect(fd, rp->ai_addr, rp->ai_addrlen);
-        printf("TCP_DEBUG: connect() returned %d, errno=%d (%s)\n",
-               connect_result, errno, strerror(errno));
-
+        int connect_result = connect(fd, address, length);
         if (connect_result == 0 || errno == EINPROGRESS) {
-            printf("TCP_DEBUG: Connection initiated successfully\n");
-            break;
+            LOG_TRACE("tcp", "Connect initiated (fd=%d, family=%d)", fd,
+                      address->sa_family);
+            race->fds[race->pending++] = fd;
+            race->next_attempt_ms      = now_ms + TCP_CLIENT_ATTEMPT_DELAY_MS;
+            return 0;
         }
 
-        printf("TCP_DEBUG: Connection failed, trying next address\n");
+        LOG_DEBUG("tcp", "connect(family=%d) failed: %s, trying next address",
+                  address->sa_family, strerror(errno));
         close(fd);
-        fd = -1;
     }
 
-    freeaddrinfo(res);
+    return -1;
+}
 
-    if (fd < 0) {
-        printf("TCP_DEBUG: All connection attempts failed\n");
-        return -1;
+// Close the attempts still in progress and forget the race
+static void tcp_client_race_dispose(TCPClient* c) {
+    TCPClientRace* race = c->race;
+    if (race == NULL) {
+        return;
     }
 
-    c->fd = fd;
-    printf("TCP_DEBUG: Success! Stored fd=%d in TCPClient\n", fd);
-    return 0;
+    for (size_t i = 0; i < race->pending; i++) {
+        if (race->fds[i] >= 0) {
+            close(race->fds[i]);
+        }
+    }
+
+    free(race);
+    c->race = NULL;
+}
+
+static uint64_t tcp_client_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
 }
 
 int tcp_client_write(TCPClient* c, const uint8_t* buf, size_t len) {
+    if (c->uring) {
+        return tcp_uring_write(c->uring, buf, len);
+    }
+
     return send(c->fd, buf, len, MSG_NOSIGNAL);
 }
 
 int tcp_client_read(TCPClient* c, uint8_t* buf, size_t len) {
+    if (c->uring) {
+        return tcp_uring_read(c->uring, buf, len, NULL);
+    }
+
     /* Clear errno so we can distinguish EOF (recv==0) from previous errors */
     errno = 0;
     int n = recv(c->fd, buf, len, 0);
@@ -102,7 +269,72 @@ int tcp_client_read(TCPClient* c, uint8_t* buf, size_t len) {
     return n;
 }
 
+int tcp_client_read_stamped(TCPClient* c, uint8_t* buf, size_t len,
+                            uint64_t* age_us) {
+    if (c->uring) {
+        // No kernel stamp here; when the data was reaped is close to it
+        uint64_t received = 0;
+        int      n        = tcp_uring_read(c->uring, buf, len, &received);
+        uint64_t now      = metrics_now_us();
+        if (n > 0 && received <= now) {
+            *age_us = now - received;
+        }
+        return n;
+    }
+
+    char          control[CMSG_SPACE(sizeof(struct timeval))];
+    struct iovec  iov     = {.iov_base = buf, .iov_len = len};
+    struct msghdr message = {0};
+    message.msg_iov        = &iov;
+    message.msg_iovlen     = 1;
+    message.msg_control    = control;
+    message.msg_controllen = sizeof(control);
+
+    errno = 0;
+    int n = recvmsg(c->fd, &message, 0);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0; // no data available right now
+        }
+        return -1; // real error
+    }
+
+    if (n == 0) {
+        return -2; // EOF (peer closed connection)
+    }
+
+    for (struct cmsghdr* header = CMSG_FIRSTHDR(&message); header;
+         header                 = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level != SOL_SOCKET ||
+            header->cmsg_type != SCM_TIMESTAMP) {
+            continue;
+        }
+
+        // The stamp is wall-clock time, so compare it with wall-clock time
+        struct timeval  received;
+        struct timespec now;
+        memcpy(&received, CMSG_DATA(header), sizeof(received));
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        int64_t age = ((int64_t)now.tv_sec - received.tv_sec) * 1000000 +
+                      now.tv_nsec / 1000 - received.tv_usec;
+        *age_us     = age > 0 ? (uint64_t)age : 0;
+    }
+
+    return n;
+}
+
 void tcp_client_disconnect(TCPClient* c) {
+    tcp_client_race_dispose(c);
+
+    // Closes the socket once what was written has been sent
+    if (c->uring) {
+        tcp_uring_close(c->uring);
+        c->uring = NULL;
+        c->fd    = -1;
+        return;
+    }
+
     if (c->fd >= 0) {
         close(c->fd);
     }
@@ -1,6 +1,8 @@
 #ifndef TCP_CLIENT_H
 #define TCP_CLIENT_H
 
+#include "tcp_uring.h"
+
 #include <stddef.h>
 #define POSIX_C_SOURCE 200809L
 #include <fcntl.h>
@@ -10,17 +12,52 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+// Addresses tried per connect, and the delay before the next one is tried
+// while earlier attempts are still pending (RFC 8305 "Happy Eyeballs")
+#define TCP_CLIENT_MAX_ATTEMPTS 8
+#define TCP_CLIENT_ATTEMPT_DELAY_MS 250
+
 typedef struct {
-    int fd;
+    struct sockaddr_storage addresses[TCP_CLIENT_MAX_ATTEMPTS];
+    socklen_t               lengths[TCP_CLIENT_MAX_ATTEMPTS];
+    size_t                  count;
+    size_t                  next; // Next address to try
+
+    int      fds[TCP_CLIENT_MAX_ATTEMPTS]; // Attempts in progress
+    size_t   pending;
+    uint64_t next_attempt_ms;
+} TCPClientRace;
+
+typedef struct {
+    int             fd;
+    TCPClientRace*  race;  // Set while an outgoing connect is in progress
+    TcpUringSocket* uring; // Set when reads and writes go through io_uring
 } TCPClient;
 
+// Wrap a connected socket (fd >= 0), whose I/O then goes through io_uring
+// when that is active, or prepare a client for tcp_client_connect (fd -1)
 int tcp_client_initiate(TCPClient* c, int fd);
 
+// Resolve host and start connecting. Addresses are tried in turn,
+// alternating between IPv6 and IPv4, with a new attempt started every
+// TCP_CLIENT_ATTEMPT_DELAY_MS (or as soon as the others have failed) until
+// one succeeds. Drive it with tcp_client_connect_poll. Returns 0 on success,
+// -1 if the host does not resolve or no attempt could be started.
 int tcp_client_connect(TCPClient* c, const char* host, const char* port);
 
+// Returns 1 once connected (c->fd is the winning socket and the other
+// attempts are closed), 0 while still connecting, -1 when every address
+// failed
+int tcp_client_connect_poll(TCPClient* c);
+
 int tcp_client_write(TCPClient* c, const uint8_t* buf, size_t len);
 int tcp_client_read(TCPClient* c, uint8_t* buf, size_t len);
 
+// Like tcp_client_read, and sets age_us to how long ago the kernel received
+// the data when the socket has SO_TIMESTAMP enabled (left as is otherwise)
+int tcp_client_read_stamped(TCPClient* c, uint8_t* buf, size_t len,
+                            uint64_t* age_us);
+
 void tcp_client_disconnect(TCPClient* c);
 
 void tcp_client_dispose(TCPClient* c);
@@ -1,19 +1,43 @@
+#define _GNU_SOURCE // accept4
 #include "tcp_server.h"
 
+#include "log.h"
+
 #include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 //-----------------Internal Functions-----------------
 
-void tcp_server_task_work(void* context, uint64_t mon_time);
+void       tcp_server_task_work(void* context, uint64_t mon_time);
+static void tcp_server_tune(TCPServer* server, int fd);
+static int tcp_server_hand_over(TCPServer* server, int socket_fd,
+                                struct sockaddr_storage* peer,
+                                socklen_t                peer_len);
+static void tcp_server_accept_uring(TCPServer* server);
 
 //----------------------------------------------------
 
+static TcpServerOptions g_options = {
+    .accept_batch = TCP_SERVER_ACCEPT_BATCH_DEFAULT,
+};
+
+void tcp_server_set_options(const TcpServerOptions* options) {
+    g_options = *options;
+    if (g_options.accept_batch == 0) {
+        g_options.accept_batch = 1;
+    }
+}
+
 int tcp_server_initiate(TCPServer* server, const char* port,
                         TcpServerOnAccept on_accept, void* context) {
     server->onAccept = on_accept;
     server->context  = context;
+    server->paused   = false;
+    server->options  = g_options;
 
     struct addrinfo hints = {0}, *res = NULL;
     hints.ai_family   = AF_UNSPEC;
@@ -46,6 +70,9 @@ int tcp_server_initiate(TCPServer* server, const char* port,
         return -1;
     }
 
+    // Fast open has to be enabled before listening
+    tcp_server_tune(server, fd);
+
     if (listen(fd, MAX_CLIENTS) < 0) {
         close(fd);
         return -1;
@@ -53,9 +80,16 @@ int tcp_server_initiate(TCPServer* server, const char* port,
 
     tcp_server_nonblocking(fd);
 
+    // Accepted sockets inherit this, which lets the server tell how long a
+    // request waited in the kernel before it was read
+    int stamp = 1;
+    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMP, &stamp, sizeof(stamp));
+
     server->listen_fd = fd;
+    server->uring     = tcp_uring_listen(fd);
 
-    server->task = smw_create_task(server, tcp_server_task_work);
+    server->task = smw_create_task_with_priority(server, tcp_server_task_work,
+                                                 SMW_PRIORITY_IO);
 
     return 0;
 }
@@ -82,20 +116,74 @@ int tcp_server_initiate_ptr(const char* port, TcpServerOnAccept on_accept,
     return 0;
 }
 
+// Returns 1 when a connection was taken, 0 when none is waiting, -1 on error
 int tcp_server_accept(TCPServer* server) {
-    int socket_fd = accept(server->listen_fd, NULL, NULL);
+    struct sockaddr_storage peer;
+    socklen_t               peer_len = sizeof(peer);
+
+    // Nonblocking from the start, which saves two fcntl calls
+    int socket_fd = accept4(server->listen_fd, (struct sockaddr*)&peer,
+                            &peer_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
     if (socket_fd < 0) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             return 0; // ingen ny klient
         }
+        if (errno == ECONNABORTED) {
+            return 1; // Gone before it was taken, look at the next one
+        }
 
-        perror("accept");
+        LOG_ERROR("tcp", "accept failed: %s", strerror(errno));
         return -1;
     }
 
-    tcp_server_nonblocking(socket_fd);
+    tcp_server_hand_over(server, socket_fd, &peer, peer_len);
+    return 1;
+}
 
-    int result = server->onAccept(socket_fd, server->context);
+void tcp_server_task_work(void* context, uint64_t mon_time) {
+    TCPServer* server = (TCPServer*)context;
+
+    if (server->uring) {
+        tcp_server_accept_uring(server);
+        return;
+    }
+
+    // The accepted connection may pause the server, e.g. at its limit
+    for (size_t i = 0; i < server->options.accept_batch && !server->paused;
+         i++) {
+        if (tcp_server_accept(server) <= 0) {
+            break;
+        }
+    }
+}
+
+static void tcp_server_tune(TCPServer* server, int fd) {
+    const TcpServerOptions* options = &server->options;
+
+    if (options->defer_accept_s > 0 &&
+        setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &options->defer_accept_s,
+                   sizeof(options->defer_accept_s)) != 0) {
+        LOG_WARN("tcp", "TCP_DEFER_ACCEPT failed: %s", strerror(errno));
+    }
+
+    if (options->fastopen_queue > 0 &&
+        setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &options->fastopen_queue,
+                   sizeof(options->fastopen_queue)) != 0) {
+        LOG_WARN("tcp", "TCP_FASTOPEN failed: %s", strerror(errno));
+    }
+
+    int yes = 1;
+    if (options->nodelay &&
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) != 0) {
+        LOG_WARN("tcp", "TCP_NODELAY failed: %s", strerror(errno));
+    }
+}
+
+static int tcp_server_hand_over(TCPServer* server, int socket_fd,
+                                struct sockaddr_storage* peer,
+                                socklen_t                peer_len) {
+    int result = server->onAccept(socket_fd, (struct sockaddr*)peer, peer_len,
+                                  server->context);
     if (result != 0) {
         close(socket_fd);
     }
@@ -103,13 +191,35 @@ int tcp_server_accept(TCPServer* server) {
     return 0;
 }
 
-void tcp_server_task_work(void* context, uint64_t mon_time) {
-    TCPServer* server = (TCPServer*)context;
+// Take up to a batch of the connections the ring accepted since the last
+// pass. Their sockets are already nonblocking; the peer address is looked
+// up since a multishot accept cannot return it.
+static void tcp_server_accept_uring(TCPServer* server) {
+    int socket_fd;
+    for (size_t i = 0;
+         i < server->options.accept_batch &&
+         (socket_fd = tcp_uring_accept(server->uring, server->paused)) >= 0;
+         i++) {
+        struct sockaddr_storage peer;
+        socklen_t               peer_len = sizeof(peer);
+        if (getpeername(socket_fd, (struct sockaddr*)&peer, &peer_len) != 0) {
+            peer_len = 0;
+        }
 
-    tcp_server_accept(server);
+        tcp_server_hand_over(server, socket_fd, &peer, peer_len);
+    }
 }
 
-void tcp_server_dispose(TCPServer* server) { smw_destroy_task(server->task); }
+void tcp_server_set_paused(TCPServer* server, bool paused) {
+    server->paused = paused;
+}
+
+void tcp_server_dispose(TCPServer* server) {
+    smw_destroy_task(server->task);
+
+    tcp_uring_close(server->uring);
+    server->uring = NULL;
+}
 
 void tcp_server_dispose_ptr(TCPServer** server_ptr) {
     if (server_ptr == NULL || *(server_ptr) == NULL) {
@@ -3,23 +3,51 @@
 
 #define POSIX_C_SOURCE 200809L
 #include "smw.h"
+#include "tcp_uring.h"
 
 #include <fcntl.h>
 #include <netdb.h>
+#include <stdbool.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #define MAX_CLIENTS 512
 
-typedef int (*TcpServerOnAccept)(int client_fd, void* context);
+// Connections accepted per pass until tcp_server_set_options
+#define TCP_SERVER_ACCEPT_BATCH_DEFAULT 64
+
+// peer is the client address as returned by accept
+typedef int (*TcpServerOnAccept)(int client_fd, const struct sockaddr* peer,
+                                 socklen_t peer_len, void* context);
+
+// Listener tuning. 0 leaves an option off.
+typedef struct {
+    // Most connections taken from the backlog per pass; a burst is drained
+    // as fast as the kernel hands it over without starving the other tasks
+    size_t accept_batch;
+    // TCP_DEFER_ACCEPT: hand over a connection only once its first data
+    // arrived, waiting up to this many seconds for it
+    int defer_accept_s;
+    // TCP_FASTOPEN: fast open connections waiting to be accepted at most
+    int fastopen_queue;
+    // TCP_NODELAY, inherited by accepted sockets
+    bool nodelay;
+} TcpServerOptions;
 
 typedef struct {
     int listen_fd;
 
+    TcpServerOptions options;
+
     TcpServerOnAccept onAccept;
     void*             context;
 
+    // New connections wait in the listen backlog while set
+    bool paused;
+
+    TcpUringSocket* uring; // Accepting through io_uring when set
+
     SmwTask* task;
 
 } TCPServer;
@@ -29,6 +57,12 @@ int tcp_server_initiate(TCPServer* server, const char* port,
 int tcp_server_initiate_ptr(const char* port, TcpServerOnAccept on_accept,
                             void* context, TCPServer** server_ptr);
 
+// Set the options servers initiated from now on use
+void tcp_server_set_options(const TcpServerOptions* options);
+
+// Stop or resume accepting connections
+void tcp_server_set_paused(TCPServer* server, bool paused);
+
 void tcp_server_dispose(TCPServer* server);
 void tcp_server_dispose_ptr(TCPServer** server_ptr);
 
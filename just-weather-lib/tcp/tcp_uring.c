@@ -0,0 +1,855 @@
+#include "tcp_uring.h"
+
+#include "log.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if TCP_URING
+
+#    include <linux/io_uring.h>
+#    include <sys/mman.h>
+#    include <sys/socket.h>
+#    include <sys/syscall.h>
+
+// Operation of a completion, kept in the low bits of its user_data next to
+// the socket pointer. 0 marks completions nobody waits for (cancel, close).
+#    define TCP_URING_OP_ACCEPT 1
+#    define TCP_URING_OP_RECV 2
+#    define TCP_URING_OP_SEND 3
+#    define TCP_URING_OP_MASK 7
+
+// Buffer group id of the provided receive buffers
+#    define TCP_URING_GROUP 0
+
+typedef struct {
+    int fd;
+
+    void*                ring; // SQ and CQ rings, mapped together
+    size_t               ring_size;
+    struct io_uring_sqe* sqes;
+    size_t               sqes_size;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_flags;
+    unsigned* sq_array;
+    unsigned  sq_mask;
+    unsigned  sq_entries;
+    unsigned  sq_prepared; // Tail including entries not yet published
+
+    unsigned*            cq_head;
+    unsigned*            cq_tail;
+    unsigned             cq_mask;
+    struct io_uring_cqe* cqes;
+
+    struct io_uring_buf_ring* buffer_ring;
+    uint8_t*                  buffers;
+    uint16_t                  buffer_tail;
+
+    TcpUringSocket* sockets; // Every socket not yet released
+    SmwTask*        task;
+
+    MetricId metric_submits;
+    MetricId metric_completions;
+} TcpUring;
+
+static TcpUring g_uring = {.fd = -1};
+
+//-----------------Internal Functions-----------------
+
+static int  tcp_uring_map(const struct io_uring_params* params);
+static int  tcp_uring_buffers_init(void);
+static int  tcp_uring_probe(void);
+static int  tcp_uring_wait(struct io_uring_cqe* cqe);
+static void tcp_uring_task_work(void* context, uint64_t mon_time);
+static void tcp_uring_submit(void);
+static void tcp_uring_reap(void);
+static struct io_uring_sqe* tcp_uring_get_sqe(void);
+static void tcp_uring_recycle(uint16_t bid);
+static void tcp_uring_publish_buffers(void);
+static TcpUringSocket* tcp_uring_socket_new(int fd, bool listener);
+static void tcp_uring_update(TcpUringSocket* sock);
+static bool tcp_uring_arm(TcpUringSocket* sock);
+static void tcp_uring_send_next(TcpUringSocket* sock);
+static void tcp_uring_release(TcpUringSocket* sock);
+static void tcp_uring_on_accept(TcpUringSocket* sock, int result);
+static void tcp_uring_on_recv(TcpUringSocket*            sock,
+                              const struct io_uring_cqe* cqe, uint64_t now_us);
+static void tcp_uring_on_send(TcpUringSocket* sock, int result);
+static int  tcp_uring_accepted_reserve(TcpUringSocket* sock);
+static int  tcp_uring_buffer_append(TcpUringBuffer* buffer,
+                                    const uint8_t* data, size_t len);
+
+//----------------------------------------------------
+
+int tcp_uring_init(void) {
+    if (g_uring.fd >= 0) {
+        return 0;
+    }
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags      = IORING_SETUP_CQSIZE;
+    params.cq_entries = TCP_URING_COMPLETIONS;
+
+    int fd = (int)syscall(__NR_io_uring_setup, TCP_URING_ENTRIES, &params);
+    if (fd < 0) {
+        LOG_INFO("tcp", "io_uring unavailable: %s", strerror(errno));
+        return -1;
+    }
+    g_uring.fd = fd;
+
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0 ||
+        (params.features & IORING_FEAT_NODROP) == 0) {
+        LOG_INFO("tcp", "io_uring unavailable: kernel too old");
+        tcp_uring_dispose();
+        return -1;
+    }
+
+    if (tcp_uring_map(&params) != 0 || tcp_uring_buffers_init() != 0 ||
+        tcp_uring_probe() != 0) {
+        tcp_uring_dispose();
+        return -1;
+    }
+
+    g_uring.task = smw_create_task_with_priority(NULL, tcp_uring_task_work,
+                                                 SMW_PRIORITY_IO);
+    if (!g_uring.task) {
+        tcp_uring_dispose();
+        return -1;
+    }
+
+    g_uring.metric_submits = metrics_register(
+        METRIC_COUNTER, "just_weather_io_uring_submits_total", NULL,
+        "io_uring_enter calls made to submit socket operations");
+    g_uring.metric_completions = metrics_register(
+        METRIC_COUNTER, "just_weather_io_uring_completions_total", NULL,
+        "Socket operation completions reaped from io_uring");
+
+    LOG_INFO("tcp", "Using io_uring for socket I/O");
+    return 0;
+}
+
+bool tcp_uring_active(void) { return g_uring.task != NULL; }
+
+TcpUringSocket* tcp_uring_attach(int fd) {
+    if (!tcp_uring_active()) {
+        return NULL;
+    }
+
+    return tcp_uring_socket_new(fd, false);
+}
+
+int tcp_uring_read(TcpUringSocket* sock, uint8_t* buf, size_t len,
+                   uint64_t* received_us) {
+    TcpUringBuffer* received  = &sock->received;
+    size_t          available = received->size - received->offset;
+
+    if (available > 0) {
+        size_t count = available < len ? available : len;
+        memcpy(buf, received->data + received->offset, count);
+        received->offset += count;
+        if (received_us) {
+            *received_us = sock->received_us;
+        }
+
+        // Receiving may have stopped for lack of room
+        tcp_uring_update(sock);
+        return (int)count;
+    }
+
+    if (sock->error != 0) {
+        errno = sock->error;
+        return -1;
+    }
+
+    if (sock->eof) {
+        return -2;
+    }
+
+    // Re-arms a recv that ran out of buffers
+    tcp_uring_update(sock);
+    return 0;
+}
+
+int tcp_uring_write(TcpUringSocket* sock, const uint8_t* buf, size_t len) {
+    if (sock->error != 0) {
+        errno = sock->error;
+        return -1;
+    }
+
+    size_t pending = sock->sending.size - sock->sending.offset +
+                     sock->queued.size - sock->queued.offset;
+    if (pending >= TCP_URING_SEND_MAX) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    size_t count = TCP_URING_SEND_MAX - pending;
+    if (count > len) {
+        count = len;
+    }
+
+    if (tcp_uring_buffer_append(&sock->queued, buf, count) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    tcp_uring_send_next(sock);
+    return (int)count;
+}
+
+TcpUringSocket* tcp_uring_listen(int fd) {
+    if (!tcp_uring_active()) {
+        return NULL;
+    }
+
+    return tcp_uring_socket_new(fd, true);
+}
+
+int tcp_uring_accept(TcpUringSocket* listener, bool paused) {
+    listener->paused = paused;
+
+    int fd = -1;
+    if (!paused && listener->accepted_head < listener->accepted_count) {
+        fd = listener->accepted[listener->accepted_head++];
+        if (listener->accepted_head == listener->accepted_count) {
+            listener->accepted_head  = 0;
+            listener->accepted_count = 0;
+        }
+    }
+
+    tcp_uring_update(listener);
+    return fd;
+}
+
+void tcp_uring_close(TcpUringSocket* sock) {
+    if (!sock || sock->closed) {
+        return;
+    }
+    sock->closed = true;
+
+    for (size_t i = sock->accepted_head; i < sock->accepted_count; i++) {
+        close(sock->accepted[i]);
+    }
+    sock->accepted_head  = 0;
+    sock->accepted_count = 0;
+
+    tcp_uring_update(sock);
+    tcp_uring_send_next(sock);
+    tcp_uring_release(sock);
+}
+
+void tcp_uring_dispose(void) {
+    smw_destroy_task(g_uring.task);
+    g_uring.task = NULL;
+
+    // Closing the ring cancels whatever is still in flight
+    if (g_uring.fd >= 0) {
+        close(g_uring.fd);
+        g_uring.fd = -1;
+    }
+
+    // Sockets still owned by a client or server fall back to close() when
+    // they are closed; the others only waited for the ring
+    TcpUringSocket* sock = g_uring.sockets;
+    while (sock) {
+        TcpUringSocket* next = sock->next;
+        sock->prev           = NULL;
+        sock->next           = NULL;
+        sock->armed          = false;
+        sock->send_busy      = false;
+        sock->refs           = 1;
+        if (sock->closed) {
+            tcp_uring_release(sock);
+        }
+        sock = next;
+    }
+    g_uring.sockets = NULL;
+
+    if (g_uring.ring) {
+        munmap(g_uring.ring, g_uring.ring_size);
+    }
+    if (g_uring.sqes) {
+        munmap(g_uring.sqes, g_uring.sqes_size);
+    }
+    if (g_uring.buffer_ring) {
+        munmap(g_uring.buffer_ring,
+               TCP_URING_BUFFERS * sizeof(struct io_uring_buf));
+    }
+    free(g_uring.buffers);
+
+    memset(&g_uring, 0, sizeof(g_uring));
+    g_uring.fd = -1;
+}
+
+static int tcp_uring_map(const struct io_uring_params* params) {
+    size_t sq_size =
+        params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    size_t cq_size = params->cq_off.cqes +
+                     params->cq_entries * sizeof(struct io_uring_cqe);
+
+    g_uring.ring_size = sq_size > cq_size ? sq_size : cq_size;
+    void* ring =
+        mmap(NULL, g_uring.ring_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, g_uring.fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        LOG_ERROR("tcp", "Cannot map io_uring: %s", strerror(errno));
+        return -1;
+    }
+    g_uring.ring = ring;
+
+    g_uring.sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(NULL, g_uring.sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, g_uring.fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        LOG_ERROR("tcp", "Cannot map io_uring: %s", strerror(errno));
+        return -1;
+    }
+    g_uring.sqes = sqes;
+
+    uint8_t* base       = ring;
+    g_uring.sq_head     = (unsigned*)(base + params->sq_off.head);
+    g_uring.sq_tail     = (unsigned*)(base + params->sq_off.tail);
+    g_uring.sq_flags    = (unsigned*)(base + params->sq_off.flags);
+    g_uring.sq_array    = (unsigned*)(base + params->sq_off.array);
+    g_uring.sq_mask     = *(unsigned*)(base + params->sq_off.ring_mask);
+    g_uring.sq_entries  = params->sq_entries;
+    g_uring.sq_prepared = *g_uring.sq_tail;
+
+    g_uring.cq_head = (unsigned*)(base + params->cq_off.head);
+    g_uring.cq_tail = (unsigned*)(base + params->cq_off.tail);
+    g_uring.cq_mask = *(unsigned*)(base + params->cq_off.ring_mask);
+    g_uring.cqes    = (struct io_uring_cqe*)(base + params->cq_off.cqes);
+
+    return 0;
+}
+
+static int tcp_uring_buffers_init(void) {
+    size_t ring_size = TCP_URING_BUFFERS * sizeof(struct io_uring_buf);
+    void*  ring      = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        return -1;
+    }
+    g_uring.buffer_ring = ring;
+
+    g_uring.buffers = malloc((size_t)TCP_URING_BUFFERS * TCP_URING_BUFFER_SIZE);
+    if (!g_uring.buffers) {
+        return -1;
+    }
+
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr    = (uint64_t)(uintptr_t)ring;
+    registration.ring_entries = TCP_URING_BUFFERS;
+    registration.bgid         = TCP_URING_GROUP;
+
+    if (syscall(__NR_io_uring_register, g_uring.fd, IORING_REGISTER_PBUF_RING,
+                &registration, 1) != 0) {
+        LOG_INFO("tcp", "io_uring unavailable: no provided buffer rings (%s)",
+                 strerror(errno));
+        return -1;
+    }
+
+    for (uint16_t bid = 0; bid < TCP_URING_BUFFERS; bid++) {
+        tcp_uring_recycle(bid);
+    }
+    tcp_uring_publish_buffers();
+
+    return 0;
+}
+
+// Multishot recv on a socket pair: the first completion must carry the byte
+// written and promise more. Older kernels reject the flag instead.
+static int tcp_uring_probe(void) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+                   pair) != 0) {
+        return -1;
+    }
+
+    TcpUringSocket probe;
+    memset(&probe, 0, sizeof(probe));
+    probe.fd = pair[0];
+
+    int result = -1;
+    if (tcp_uring_arm(&probe) && write(pair[1], "x", 1) == 1) {
+        struct io_uring_cqe cqe;
+        if (tcp_uring_wait(&cqe) == 0) {
+            if (cqe.flags & IORING_CQE_F_BUFFER) {
+                tcp_uring_recycle(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                tcp_uring_publish_buffers();
+            }
+            if (cqe.res == 1 && (cqe.flags & IORING_CQE_F_MORE)) {
+                result = 0;
+            }
+
+            // Let the recv end before the stack copy of the socket goes
+            close(pair[1]);
+            pair[1] = -1;
+            while ((cqe.flags & IORING_CQE_F_MORE) &&
+                   tcp_uring_wait(&cqe) == 0) {
+            }
+        }
+    }
+
+    if (pair[1] >= 0) {
+        close(pair[1]);
+    }
+    close(pair[0]);
+
+    if (result != 0) {
+        LOG_INFO("tcp", "io_uring unavailable: no multishot recv");
+    }
+    return result;
+}
+
+// Submit and wait for one completion; only used before the task runs
+static int tcp_uring_wait(struct io_uring_cqe* cqe) {
+    unsigned pending = g_uring.sq_prepared -
+                       __atomic_load_n(g_uring.sq_head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(g_uring.sq_tail, g_uring.sq_prepared, __ATOMIC_RELEASE);
+
+    if (syscall(__NR_io_uring_enter, g_uring.fd, pending, 1,
+                IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+        return -1;
+    }
+
+    unsigned head = *g_uring.cq_head;
+    if (head == __atomic_load_n(g_uring.cq_tail, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+
+    *cqe = g_uring.cqes[head & g_uring.cq_mask];
+    __atomic_store_n(g_uring.cq_head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Runs first among the I/O tasks: completions reaped here are seen by the
+// connections in the same pass, and what they queued in the previous pass
+// goes out together
+static void tcp_uring_task_work(void* context, uint64_t mon_time) {
+    (void)context;
+    (void)mon_time;
+
+    tcp_uring_reap();
+    tcp_uring_submit();
+}
+
+static void tcp_uring_submit(void) {
+    unsigned pending = g_uring.sq_prepared -
+                       __atomic_load_n(g_uring.sq_head, __ATOMIC_ACQUIRE);
+
+    // With a full completion queue the kernel holds back completions until
+    // asked for them
+    unsigned flags = 0;
+    if (__atomic_load_n(g_uring.sq_flags, __ATOMIC_RELAXED) &
+        IORING_SQ_CQ_OVERFLOW) {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+
+    if (pending == 0 && flags == 0) {
+        return;
+    }
+
+    __atomic_store_n(g_uring.sq_tail, g_uring.sq_prepared, __ATOMIC_RELEASE);
+
+    long result;
+    do {
+        result = syscall(__NR_io_uring_enter, g_uring.fd, pending, 0, flags,
+                         NULL, 0);
+    } while (result < 0 && errno == EINTR);
+    metrics_inc(g_uring.metric_submits);
+
+    // EBUSY/EAGAIN leave the entries queued for the next pass
+    if (result < 0 && errno != EBUSY && errno != EAGAIN) {
+        LOG_ERROR("tcp", "io_uring_enter failed: %s", strerror(errno));
+    }
+}
+
+static void tcp_uring_reap(void) {
+    unsigned head = *g_uring.cq_head;
+    unsigned tail = __atomic_load_n(g_uring.cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return;
+    }
+
+    uint64_t now_us = metrics_now_us();
+    size_t   count  = 0;
+    for (; head != tail; head++, count++) {
+        struct io_uring_cqe* cqe = &g_uring.cqes[head & g_uring.cq_mask];
+
+        int             op   = (int)(cqe->user_data & TCP_URING_OP_MASK);
+        TcpUringSocket* sock = (TcpUringSocket*)(uintptr_t)(
+            cqe->user_data & ~(uint64_t)TCP_URING_OP_MASK);
+        if (op == 0 || !sock) {
+            continue;
+        }
+
+        bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+        switch (op) {
+        case TCP_URING_OP_ACCEPT:
+            tcp_uring_on_accept(sock, cqe->res);
+            break;
+        case TCP_URING_OP_RECV:
+            tcp_uring_on_recv(sock, cqe, now_us);
+            break;
+        case TCP_URING_OP_SEND:
+            tcp_uring_on_send(sock, cqe->res);
+            continue;
+        }
+
+        // The multishot operation has ended (finished, failed or cancelled)
+        if (!more) {
+            sock->armed     = false;
+            sock->cancelled = false;
+            tcp_uring_update(sock);
+            tcp_uring_release(sock);
+        }
+    }
+
+    __atomic_store_n(g_uring.cq_head, head, __ATOMIC_RELEASE);
+    tcp_uring_publish_buffers();
+    metrics_add(g_uring.metric_completions, count);
+}
+
+// NULL only when the kernel takes no entries even after a submit
+static struct io_uring_sqe* tcp_uring_get_sqe(void) {
+    if (g_uring.fd < 0) {
+        return NULL;
+    }
+
+    unsigned head = __atomic_load_n(g_uring.sq_head, __ATOMIC_ACQUIRE);
+    if (g_uring.sq_prepared - head >= g_uring.sq_entries) {
+        tcp_uring_submit();
+        head = __atomic_load_n(g_uring.sq_head, __ATOMIC_ACQUIRE);
+        if (g_uring.sq_prepared - head >= g_uring.sq_entries) {
+            return NULL;
+        }
+    }
+
+    unsigned             index = g_uring.sq_prepared & g_uring.sq_mask;
+    struct io_uring_sqe* sqe   = &g_uring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    g_uring.sq_array[index] = index;
+    g_uring.sq_prepared++;
+
+    return sqe;
+}
+
+// Hand a receive buffer back; the kernel sees it after the next publish
+static void tcp_uring_recycle(uint16_t bid) {
+    struct io_uring_buf* buf =
+        &g_uring.buffer_ring
+             ->bufs[g_uring.buffer_tail & (TCP_URING_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(g_uring.buffers +
+                                      (size_t)bid * TCP_URING_BUFFER_SIZE);
+    buf->len = TCP_URING_BUFFER_SIZE;
+    buf->bid = bid;
+    g_uring.buffer_tail++;
+}
+
+static void tcp_uring_publish_buffers(void) {
+    __atomic_store_n(&g_uring.buffer_ring->tail, g_uring.buffer_tail,
+                     __ATOMIC_RELEASE);
+}
+
+static TcpUringSocket* tcp_uring_socket_new(int fd, bool listener) {
+    TcpUringSocket* sock = calloc(1, sizeof(TcpUringSocket));
+    if (!sock) {
+        return NULL;
+    }
+
+    sock->fd       = fd;
+    sock->refs     = 1;
+    sock->listener = listener;
+
+    sock->next = g_uring.sockets;
+    if (g_uring.sockets) {
+        g_uring.sockets->prev = sock;
+    }
+    g_uring.sockets = sock;
+
+    tcp_uring_update(sock);
+    return sock;
+}
+
+// Start or cancel the multishot operation to match what the socket needs
+static void tcp_uring_update(TcpUringSocket* sock) {
+    bool wanted;
+    if (sock->listener) {
+        wanted = !sock->closed && !sock->paused &&
+                 sock->accepted_count - sock->accepted_head <
+                     TCP_URING_ACCEPT_BACKLOG / 2;
+    } else {
+        wanted = !sock->closed && !sock->eof && sock->error == 0 &&
+                 sock->received.size - sock->received.offset <
+                     TCP_URING_RECEIVE_MAX;
+    }
+
+    if (wanted && !sock->armed) {
+        if (tcp_uring_arm(sock)) {
+            sock->refs++;
+        }
+    } else if (!wanted && sock->armed && !sock->cancelled) {
+        struct io_uring_sqe* sqe = tcp_uring_get_sqe();
+        if (sqe) {
+            uint64_t op = sock->listener ? TCP_URING_OP_ACCEPT
+                                           : TCP_URING_OP_RECV;
+            sqe->opcode     = IORING_OP_ASYNC_CANCEL;
+            sqe->fd         = -1;
+            sqe->addr       = (uint64_t)(uintptr_t)sock | op;
+            sqe->user_data  = 0;
+            sock->cancelled = true;
+        }
+    }
+}
+
+static bool tcp_uring_arm(TcpUringSocket* sock) {
+    struct io_uring_sqe* sqe = tcp_uring_get_sqe();
+    if (!sqe) {
+        return false;
+    }
+
+    sqe->fd = sock->fd;
+    if (sock->listener) {
+        sqe->opcode       = IORING_OP_ACCEPT;
+        sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data    = (uint64_t)(uintptr_t)sock | TCP_URING_OP_ACCEPT;
+    } else {
+        sqe->opcode    = IORING_OP_RECV;
+        sqe->ioprio    = IORING_RECV_MULTISHOT;
+        sqe->flags     = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = TCP_URING_GROUP;
+        sqe->user_data = (uint64_t)(uintptr_t)sock | TCP_URING_OP_RECV;
+    }
+
+    sock->armed = true;
+    return true;
+}
+
+// Send what was queued once the previous send has completed
+static void tcp_uring_send_next(TcpUringSocket* sock) {
+    if (g_uring.fd < 0 || sock->send_busy || sock->error != 0) {
+        return;
+    }
+
+    TcpUringBuffer* sending = &sock->sending;
+    if (sending->offset == sending->size) {
+        TcpUringBuffer done = *sending;
+        *sending            = sock->queued;
+        sock->queued        = done;
+        sock->queued.offset = 0;
+        sock->queued.size   = 0;
+    }
+
+    if (sending->offset == sending->size) {
+        return;
+    }
+
+    struct io_uring_sqe* sqe = tcp_uring_get_sqe();
+    if (!sqe) {
+        LOG_ERROR("tcp", "io_uring submission queue stuck, send dropped");
+        sock->error = EBUSY;
+        return;
+    }
+
+    sqe->opcode    = IORING_OP_SEND;
+    sqe->fd        = sock->fd;
+    sqe->addr      = (uint64_t)(uintptr_t)(sending->data + sending->offset);
+    sqe->len       = (uint32_t)(sending->size - sending->offset);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)sock | TCP_URING_OP_SEND;
+
+    sock->send_busy = true;
+    sock->refs++;
+}
+
+// Drop a reference; the last one closes the socket, through the ring when
+// it can
+static void tcp_uring_release(TcpUringSocket* sock) {
+    if (--sock->refs > 0) {
+        return;
+    }
+
+    struct io_uring_sqe* sqe = tcp_uring_get_sqe();
+    if (sqe) {
+        sqe->opcode    = IORING_OP_CLOSE;
+        sqe->fd        = sock->fd;
+        sqe->user_data = 0;
+    } else {
+        close(sock->fd);
+    }
+
+    if (sock->prev) {
+        sock->prev->next = sock->next;
+    } else if (g_uring.sockets == sock) {
+        g_uring.sockets = sock->next;
+    }
+    if (sock->next) {
+        sock->next->prev = sock->prev;
+    }
+
+    free(sock->received.data);
+    free(sock->sending.data);
+    free(sock->queued.data);
+    free(sock->accepted);
+    free(sock);
+}
+
+static void tcp_uring_on_accept(TcpUringSocket* sock, int result) {
+    if (result >= 0) {
+        // A burst completes many accepts before the cancel reaches the
+        // kernel; those connections are kept rather than dropped
+        if (sock->closed || tcp_uring_accepted_reserve(sock) != 0) {
+            close(result);
+            return;
+        }
+
+        sock->accepted[sock->accepted_count++] = result;
+        if (sock->accepted_count - sock->accepted_head >=
+            TCP_URING_ACCEPT_BACKLOG / 2) {
+            tcp_uring_update(sock);
+        }
+    } else if (result != -ECANCELED) {
+        LOG_WARN("tcp", "accept failed: %s", strerror(-result));
+    }
+}
+
+// Make room for one more accepted socket, reusing the slots already taken
+// before growing the queue
+static int tcp_uring_accepted_reserve(TcpUringSocket* sock) {
+    if (sock->accepted_count < sock->accepted_capacity) {
+        return 0;
+    }
+
+    if (sock->accepted_head > 0) {
+        sock->accepted_count -= sock->accepted_head;
+        memmove(sock->accepted, sock->accepted + sock->accepted_head,
+                sock->accepted_count * sizeof(int));
+        sock->accepted_head = 0;
+        return 0;
+    }
+
+    size_t capacity = sock->accepted_capacity ? sock->accepted_capacity * 2 :
+                                                TCP_URING_ACCEPT_BACKLOG;
+    int*   accepted = realloc(sock->accepted, capacity * sizeof(int));
+    if (!accepted) {
+        return -1;
+    }
+
+    sock->accepted          = accepted;
+    sock->accepted_capacity = capacity;
+    return 0;
+}
+
+static void tcp_uring_on_recv(TcpUringSocket*            sock,
+                              const struct io_uring_cqe* cqe, uint64_t now_us) {
+    int result = cqe->res;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (result > 0 && !sock->closed) {
+            TcpUringBuffer* received = &sock->received;
+            if (received->offset == received->size) {
+                sock->received_us = now_us;
+            }
+
+            const uint8_t* data =
+                g_uring.buffers + (size_t)bid * TCP_URING_BUFFER_SIZE;
+            if (tcp_uring_buffer_append(received, data, (size_t)result) != 0) {
+                sock->error = ENOMEM;
+            } else if (received->size - received->offset >=
+                       TCP_URING_RECEIVE_MAX) {
+                tcp_uring_update(sock);
+            }
+        }
+        tcp_uring_recycle(bid);
+    } else if (result == 0) {
+        sock->eof = true;
+    } else if (result < 0 && result != -ECANCELED && result != -ENOBUFS) {
+        // ENOBUFS: every buffer was taken; the recv is armed again
+        sock->error = -result;
+    }
+}
+
+static void tcp_uring_on_send(TcpUringSocket* sock, int result) {
+    sock->send_busy = false;
+
+    if (result < 0) {
+        sock->error = -result;
+    } else {
+        sock->sending.offset += (size_t)result;
+        tcp_uring_send_next(sock);
+    }
+
+    tcp_uring_release(sock);
+}
+
+static int tcp_uring_buffer_append(TcpUringBuffer* buffer,
+                                   const uint8_t* data, size_t len) {
+    if (buffer->offset == buffer->size) {
+        buffer->offset = 0;
+        buffer->size   = 0;
+    }
+
+    if (buffer->size + len > buffer->capacity && buffer->offset > 0) {
+        memmove(buffer->data, buffer->data + buffer->offset,
+                buffer->size - buffer->offset);
+        buffer->size -= buffer->offset;
+        buffer->offset = 0;
+    }
+
+    if (buffer->size + len > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2
+                                           : TCP_URING_BUFFER_SIZE;
+        while (capacity < buffer->size + len) {
+            capacity *= 2;
+        }
+
+        uint8_t* grown = realloc(buffer->data, capacity);
+        if (!grown) {
+            return -1;
+        }
+        buffer->data     = grown;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + buffer->size, data, len);
+    buffer->size += len;
+    return 0;
+}
+
+#else // TCP_URING
+
+int tcp_uring_init(void) { return -1; }
+
+bool tcp_uring_active(void) { return false; }
+
+TcpUringSocket* tcp_uring_attach(int fd) { return NULL; }
+
+int tcp_uring_read(TcpUringSocket* sock, uint8_t* buf, size_t len,
+                   uint64_t* received_us) {
+    errno = EBADF;
+    return -1;
+}
+
+int tcp_uring_write(TcpUringSocket* sock, const uint8_t* buf, size_t len) {
+    errno = EBADF;
+    return -1;
+}
+
+TcpUringSocket* tcp_uring_listen(int fd) { return NULL; }
+
+int tcp_uring_accept(TcpUringSocket* listener, bool paused) { return -1; }
+
+void tcp_uring_close(TcpUringSocket* sock) {}
+
+void tcp_uring_dispose(void) {}
+
+#endif // TCP_URING
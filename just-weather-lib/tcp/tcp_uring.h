@@ -0,0 +1,129 @@
+#ifndef TCP_URING_H
+#define TCP_URING_H
+
+// Socket I/O through io_uring, for the server side of tcp_server and
+// tcp_client. The listener gets a multishot accept and every connection a
+// multishot recv filling buffers from a shared provided-buffer ring, so
+// waiting for data costs no syscalls. Sends are queued and everything is
+// submitted once per smw pass, by one I/O-class task, with one
+// io_uring_enter. Completions are read from the shared ring without one.
+//
+// Received data is copied out of the ring buffers as it arrives, so they
+// are free again right away. Sends are copied too, which keeps the
+// tcp_client_write contract: a write is done once it returns.
+//
+// Needs Linux 6.0 (multishot recv); tcp_uring_init probes the kernel and
+// fails otherwise, which leaves tcp_client and tcp_server on plain
+// nonblocking syscalls. Build with -DTCP_URING=0 to leave it out.
+// Only used from the smw thread.
+
+#include "metrics.h"
+#include "smw.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef TCP_URING
+#    if defined(__linux__) && defined(__has_include)
+#        if __has_include(<linux/io_uring.h>)
+#            define TCP_URING 1
+#        endif
+#    endif
+#endif
+#ifndef TCP_URING
+#    define TCP_URING 0
+#endif
+
+// Submission queue size; a full queue is submitted early
+#define TCP_URING_ENTRIES 256
+#define TCP_URING_COMPLETIONS 4096
+
+// Provided receive buffers shared by all connections (power of two)
+#define TCP_URING_BUFFERS 512
+#define TCP_URING_BUFFER_SIZE 4096
+
+// Unread data per connection before receiving stops until it is read
+#define TCP_URING_RECEIVE_MAX (1024 * 1024)
+// Unsent data per connection before writes are refused with EAGAIN
+#define TCP_URING_SEND_MAX (1024 * 1024)
+
+// Accepted connections held for tcp_server before accepting stops. Accepts
+// already completing then are still kept, however many there are.
+#define TCP_URING_ACCEPT_BACKLOG 64
+
+typedef struct TcpUringSocket TcpUringSocket;
+
+typedef struct {
+    uint8_t* data;
+    size_t   offset; // Consumed (sent or read) so far
+    size_t   size;
+    size_t   capacity;
+} TcpUringBuffer;
+
+struct TcpUringSocket {
+    int  fd;
+    int  refs;      // Operations in flight, plus one until closed
+    bool listener;  // Accepts instead of receiving
+    bool armed;     // Multishot accept or recv in flight
+    bool cancelled; // Cancel requested for it
+    bool closed;    // Owner is done; fd closes when refs reaches 0
+    bool paused;    // Listeners: leave connections in the backlog
+    bool eof;
+    int  error; // errno of a failed recv or send, 0 if none
+
+    // Connections: received data not yet read, and when the oldest byte
+    // of it was reaped
+    TcpUringBuffer received;
+    uint64_t       received_us;
+
+    // Connections: sending holds the bytes in flight, queued the bytes
+    // written meanwhile
+    TcpUringBuffer sending;
+    TcpUringBuffer queued;
+    bool           send_busy;
+
+    // Listeners: accepted sockets not yet taken, from accepted_head to
+    // accepted_count
+    int*   accepted;
+    size_t accepted_head;
+    size_t accepted_count;
+    size_t accepted_capacity;
+
+    TcpUringSocket* prev;
+    TcpUringSocket* next;
+};
+
+// Set up the ring and start its task. Returns 0 on success, -1 when
+// io_uring is compiled out, disabled, or the kernel lacks a needed feature.
+int tcp_uring_init(void);
+
+bool tcp_uring_active(void);
+
+// Receive on a connected nonblocking socket. Returns NULL when the backend
+// is not active or out of memory; the caller then uses syscalls.
+TcpUringSocket* tcp_uring_attach(int fd);
+
+// Same results as tcp_client_read. received_us (can be NULL) is set to when
+// the returned data was reaped, on the metrics_now_us clock.
+int tcp_uring_read(TcpUringSocket* sock, uint8_t* buf, size_t len,
+                   uint64_t* received_us);
+
+// Queue data to send. Returns how much was taken, or -1 with errno set
+// (EAGAIN when the send queue is full).
+int tcp_uring_write(TcpUringSocket* sock, const uint8_t* buf, size_t len);
+
+// Accept on a listening socket
+TcpUringSocket* tcp_uring_listen(int fd);
+
+// Take an accepted socket, -1 when there is none. While paused, new
+// connections are left in the listen backlog.
+int tcp_uring_accept(TcpUringSocket* listener, bool paused);
+
+// Stop receiving or accepting. Queued sends still go out; the socket and fd
+// are released after the last operation completes.
+void tcp_uring_close(TcpUringSocket* sock);
+
+void tcp_uring_dispose(void);
+
+#endif // TCP_URING_H
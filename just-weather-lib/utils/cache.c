@@ -19,7 +19,18 @@ static int is_expired(CacheEntry* entry) {
     return (time(NULL) > entry->expiry);
 }
 
+// Helper function to keep the size gauges in step with an entry
+static void account_entry(Cache* cache, CacheEntry* entry, int sign) {
+    metrics_gauge_add(cache->metric_bytes, sign * (int64_t)entry->data_size);
+    metrics_gauge_add(cache->metric_entries, sign);
+}
+
 Cache* cache_create(size_t max_size, time_t default_ttl) {
+    return cache_create_named("default", max_size, default_ttl);
+}
+
+Cache* cache_create_named(const char* name, size_t max_size,
+                          time_t default_ttl) {
     Cache* cache = (Cache*)malloc(sizeof(Cache));
     if (!cache) {
         return NULL;
@@ -33,6 +44,24 @@ Cache* cache_create(size_t max_size, time_t default_ttl) {
 
     cache->max_size    = max_size;
     cache->default_ttl = default_ttl;
+
+    char labels[METRICS_LABELS_MAX];
+    snprintf(labels, sizeof(labels), "cache=\"%s\"", name ? name : "default");
+    cache->metric_hits =
+        metrics_register(METRIC_COUNTER, "just_weather_cache_hits_total",
+                         labels, "Cache lookups that found a live entry");
+    cache->metric_misses =
+        metrics_register(METRIC_COUNTER, "just_weather_cache_misses_total",
+                         labels, "Cache lookups that found nothing or expired");
+    cache->metric_evictions = metrics_register(
+        METRIC_COUNTER, "just_weather_cache_evictions_total", labels,
+        "Entries dropped to make room for new ones");
+    cache->metric_bytes =
+        metrics_register(METRIC_GAUGE, "just_weather_cache_bytes", labels,
+                         "Bytes of cached data");
+    cache->metric_entries =
+        metrics_register(METRIC_GAUGE, "just_weather_cache_entries", labels,
+                         "Number of cached entries");
     return cache;
 }
 
@@ -40,7 +69,7 @@ void cache_destroy(Cache* cache) {
     if (!cache) {
         return;
     }
-    linked_list_clear(cache->entries, (void (*)(void*))free_cache_entry);
+    cache_clear(cache);
     linked_list_dispose(&cache->entries, NULL);
     free(cache);
 }
@@ -60,6 +89,7 @@ int cache_set(Cache* cache, const char* key, void* data, size_t data_size,
         if (cache->entries->head) {
             CacheEntry* oldest = (CacheEntry*)cache->entries->head->item;
             cache_remove(cache, oldest->key);
+            metrics_inc(cache->metric_evictions);
         }
     }
 
@@ -86,6 +116,7 @@ int cache_set(Cache* cache, const char* key, void* data, size_t data_size,
         free_cache_entry(entry);
         return -1;
     }
+    account_entry(cache, entry, 1);
 
     return 0;
 }
@@ -100,8 +131,10 @@ void* cache_get(Cache* cache, const char* key, size_t* data_size) {
         if (strcmp(entry->key, key) == 0) {
             if (is_expired(entry)) {
                 cache_remove(cache, key);
+                metrics_inc(cache->metric_misses);
                 return NULL;
             }
+            metrics_inc(cache->metric_hits);
             if (data_size) {
                 *data_size = entry->data_size;
             }
@@ -113,6 +146,36 @@ void* cache_get(Cache* cache, const char* key, size_t* data_size) {
         }
     }
 
+    metrics_inc(cache->metric_misses);
+    return NULL;
+}
+
+const void* cache_peek(Cache* cache, const char* key, size_t* data_size,
+                       time_t* expiry) {
+    if (!cache || !key) {
+        return NULL;
+    }
+
+    LinkedList_foreach(cache->entries, node) {
+        CacheEntry* entry = (CacheEntry*)node->item;
+        if (strcmp(entry->key, key) == 0) {
+            if (is_expired(entry)) {
+                cache_remove(cache, key);
+                metrics_inc(cache->metric_misses);
+                return NULL;
+            }
+            metrics_inc(cache->metric_hits);
+            if (data_size) {
+                *data_size = entry->data_size;
+            }
+            if (expiry) {
+                *expiry = entry->expiry;
+            }
+            return entry->data;
+        }
+    }
+
+    metrics_inc(cache->metric_misses);
     return NULL;
 }
 
@@ -125,6 +188,7 @@ void cache_remove(Cache* cache, const char* key) {
     LinkedList_foreach(cache->entries, node) {
         CacheEntry* entry = (CacheEntry*)node->item;
         if (strcmp(entry->key, key) == 0) {
+            account_entry(cache, entry, -1);
             linked_list_pop(cache->entries, index,
                             (void (*)(void*))free_cache_entry);
             return;
@@ -137,5 +201,8 @@ void cache_clear(Cache* cache) {
     if (!cache) {
         return;
     }
+    LinkedList_foreach(cache->entries, node) {
+        account_entry(cache, (CacheEntry*)node->item, -1);
+    }
     linked_list_clear(cache->entries, (void (*)(void*))free_cache_entry);
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define CACHE_H
 
 #include "linked_list.h"
+#include "metrics.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -21,14 +22,28 @@ typedef struct {
     LinkedList* entries;     // List of cache entries
     size_t      max_size;    // Maximum number of entries
     time_t      default_ttl; // Default time-to-live in seconds
+
+    // Metrics, labelled with the cache name
+    MetricId metric_hits;
+    MetricId metric_misses;
+    MetricId metric_evictions;
+    MetricId metric_bytes;
+    MetricId metric_entries;
 } Cache;
 
 // Function declarations
 Cache* cache_create(size_t max_size, time_t default_ttl);
+// Like cache_create, with a name to tell caches apart in /metrics
+Cache* cache_create_named(const char* name, size_t max_size,
+                          time_t default_ttl);
 void   cache_destroy(Cache* cache);
 int    cache_set(Cache* cache, const char* key, void* data, size_t data_size,
                  time_t ttl);
 void*  cache_get(Cache* cache, const char* key, size_t* data_size);
+/* Like cache_get, but returns the stored data itself instead of a copy. The
+ * pointer is only valid until the cache is modified. */
+const void* cache_peek(Cache* cache, const char* key, size_t* data_size,
+                       time_t* expiry);
 void   cache_remove(Cache* cache, const char* key);
 void   cache_clear(Cache* cache);
 
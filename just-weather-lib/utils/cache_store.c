@@ -0,0 +1,898 @@
+/**
+ * cache_store.c - Implementation of the persistent cache store
+ */
+
+#include "cache_store.h"
+
+#include "deflate.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LOG_MAGIC "JWLOG001"
+#define INDEX_MAGIC "JWIDX001"
+
+#define RECORD_TOMBSTONE 1u
+
+/* Longest key and value a record may claim; anything larger is corrupt */
+#define RECORD_KEY_MAX 4096
+#define RECORD_VALUE_MAX (64u * 1024 * 1024)
+
+#define INDEX_MAX_LOAD (CACHE_STORE_INDEX_CAPACITY / 4 * 3)
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/* Start of the log file */
+typedef struct {
+    char     magic[8];
+    uint64_t log_id;
+} LogHeader;
+
+/* Start of every record, followed by the NUL-terminated key, the value and
+ * padding up to a multiple of 8 bytes */
+typedef struct {
+    uint32_t crc;       /* CRC-32 of the rest of the header, key and value */
+    uint32_t flags;     /* RECORD_TOMBSTONE for removals */
+    uint32_t key_len;   /* Including the NUL */
+    uint32_t value_len; /* 0 for removals */
+    int64_t  expiry;    /* Absolute time */
+} RecordHeader;
+
+typedef struct {
+    uint64_t hash;   /* Key hash, never 0 */
+    uint64_t offset; /* Record offset in the log, 0 for an empty slot */
+} IndexSlot;
+
+struct CacheStoreIndex {
+    char     magic[8];
+    uint64_t log_id;     /* Log the slots belong to */
+    uint64_t log_size;   /* Log bytes reflected in the slots */
+    uint64_t live_bytes; /* Size of the records the slots point to */
+    uint32_t capacity;
+    uint32_t count;
+    uint32_t clean; /* Set on close; an index left dirty is rebuilt */
+    uint32_t reserved;
+
+    IndexSlot slots[];
+};
+
+#define INDEX_FILE_SIZE                                                        \
+    (sizeof(CacheStoreIndex) + CACHE_STORE_INDEX_CAPACITY * sizeof(IndexSlot))
+
+/* ============= Internal Functions ============= */
+
+static uint64_t     new_log_id(void);
+static uint64_t     hash_key(const char* key);
+static size_t       record_size(size_t key_len, size_t value_len);
+static uint32_t     record_crc(const RecordHeader* header, const char* key,
+                               const void* value);
+static const RecordHeader* record_at(const CacheStore* store, uint64_t offset);
+static bool         record_valid(const CacheStore* store, uint64_t offset,
+                                 uint64_t limit, uint64_t* size);
+static int          append_record(CacheStore* store, uint32_t flags,
+                                  const char* key, const void* value,
+                                  size_t length, time_t expiry,
+                                  uint64_t* offset, uint64_t* size);
+static int          write_all(int fd, const void* data, size_t length);
+static IndexSlot*   index_find(CacheStore* store, const char* key,
+                               uint64_t hash);
+static int          index_set(CacheStore* store, const char* key,
+                              uint64_t hash, uint64_t offset, uint64_t size);
+static void         index_place(CacheStoreIndex* index, uint64_t hash,
+                                uint64_t offset);
+static void         index_delete(CacheStore* store, IndexSlot* slot);
+static void         index_reset(CacheStore* store);
+static void         replay(CacheStore* store, uint64_t file_size);
+static int          compact_start(CacheStore* store);
+static int          compact_finish(CacheStore* store);
+static void         compact_backoff(CacheStore* store);
+static void*        compact_run(void* context);
+static void         compact_path(const CacheStore* store, char* out,
+                                 size_t out_size);
+static void         compact_index_path(const CacheStore* store, char* out,
+                                       size_t out_size);
+static void         compact_discard(const CacheStore* store);
+static void         store_release(CacheStore* store);
+static void         update_gauges(CacheStore* store);
+
+/* ============= Public API Implementation ============= */
+
+int cache_store_open(CacheStore* store, const char* path) {
+    if (!store || !path) {
+        return -1;
+    }
+
+    memset(store, 0, sizeof(*store));
+    store->fd       = -1;
+    store->index_fd = -1;
+    store->map      = MAP_FAILED;
+    atomic_init(&store->compact_done, false);
+
+    int len = snprintf(store->path, sizeof(store->path), "%s", path);
+    if (len < 0 || (size_t)len + 8 >= sizeof(store->path)) {
+        return -1;
+    }
+
+    store->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (store->fd < 0) {
+        LOG_WARN("store", "Cannot open %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat info;
+    if (fstat(store->fd, &info) != 0) {
+        store_release(store);
+        return -1;
+    }
+
+    uint64_t  file_size = (uint64_t)info.st_size;
+    LogHeader header;
+    if (file_size == 0) {
+        memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+        header.log_id = new_log_id();
+        if (write_all(store->fd, &header, sizeof(header)) != 0) {
+            store_release(store);
+            return -1;
+        }
+        file_size = sizeof(header);
+    } else if (file_size < sizeof(header) ||
+               pread(store->fd, &header, sizeof(header), 0) !=
+                   (ssize_t)sizeof(header) ||
+               memcmp(header.magic, LOG_MAGIC, sizeof(header.magic)) != 0) {
+        LOG_WARN("store", "%s is not a cache log", path);
+        store_release(store);
+        return -1;
+    }
+    store->log_id = header.log_id;
+
+    if (file_size > CACHE_STORE_MAX_SIZE) {
+        LOG_WARN("store", "%s is larger than the store limit", path);
+        store_release(store);
+        return -1;
+    }
+
+    /* Reserve the whole address range once, so value pointers stay valid
+     * while the log grows */
+    store->map = mmap(NULL, CACHE_STORE_MAX_SIZE, PROT_READ, MAP_SHARED,
+                      store->fd, 0);
+    if (store->map == MAP_FAILED) {
+        store_release(store);
+        return -1;
+    }
+
+    char index_path[CACHE_STORE_PATH_MAX];
+    snprintf(index_path, sizeof(index_path), "%s.idx", path);
+    store->index_fd = open(index_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (store->index_fd < 0 || fstat(store->index_fd, &info) != 0) {
+        store_release(store);
+        return -1;
+    }
+    if ((size_t)info.st_size != INDEX_FILE_SIZE &&
+        ftruncate(store->index_fd, INDEX_FILE_SIZE) != 0) {
+        store_release(store);
+        return -1;
+    }
+
+    void* index = mmap(NULL, INDEX_FILE_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, store->index_fd, 0);
+    if (index == MAP_FAILED) {
+        store_release(store);
+        return -1;
+    }
+    store->index = (CacheStoreIndex*)index;
+
+    CacheStoreIndex* idx     = store->index;
+    bool             trusted = memcmp(idx->magic, INDEX_MAGIC, 8) == 0 &&
+                   idx->log_id == store->log_id &&
+                   idx->capacity == CACHE_STORE_INDEX_CAPACITY && idx->clean &&
+                   idx->log_size >= sizeof(LogHeader) &&
+                   idx->log_size <= file_size;
+    if (!trusted) {
+        LOG_INFO("store", "Rebuilding index of %s", path);
+        index_reset(store);
+    }
+    idx->clean = 0;
+
+    /* Pick up records the index does not cover and cut off a torn tail */
+    replay(store, file_size);
+
+    store->metric_bytes =
+        metrics_register(METRIC_GAUGE, "just_weather_store_bytes", NULL,
+                         "Size of the persistent cache log");
+    store->metric_live_bytes =
+        metrics_register(METRIC_GAUGE, "just_weather_store_live_bytes", NULL,
+                         "Log bytes holding current entries");
+    store->metric_compactions = metrics_register(
+        METRIC_COUNTER, "just_weather_store_compactions_total", NULL,
+        "Completed compactions of the persistent cache log");
+    update_gauges(store);
+
+    LOG_INFO("store", "Opened %s: %u entries, %llu bytes", path, idx->count,
+             (unsigned long long)store->log_size);
+    return 0;
+}
+
+int cache_store_put(CacheStore* store, const char* key, const void* value,
+                    size_t length, time_t expiry) {
+    if (!store || !store->index || !key || (!value && length > 0)) {
+        return -1;
+    }
+
+    /* Refuse before writing, so the log never holds unindexed entries */
+    uint64_t hash = hash_key(key);
+    if (!index_find(store, key, hash) &&
+        store->index->count >= INDEX_MAX_LOAD) {
+        return -1;
+    }
+
+    uint64_t offset = 0;
+    uint64_t size   = 0;
+    if (append_record(store, 0, key, value, length, expiry, &offset, &size) !=
+        0) {
+        return -1;
+    }
+
+    index_set(store, key, hash, offset, size);
+    store->index->log_size = store->log_size;
+    update_gauges(store);
+    return 0;
+}
+
+const void* cache_store_get(CacheStore* store, const char* key,
+                            size_t* length, time_t* expiry) {
+    if (!store || !store->index || !key || !length) {
+        return NULL;
+    }
+
+    IndexSlot* slot = index_find(store, key, hash_key(key));
+    if (!slot) {
+        return NULL;
+    }
+
+    const RecordHeader* header = record_at(store, slot->offset);
+    if (time(NULL) > (time_t)header->expiry) {
+        return NULL;
+    }
+
+    *length = header->value_len;
+    if (expiry) {
+        *expiry = (time_t)header->expiry;
+    }
+    return (const uint8_t*)(header + 1) + header->key_len;
+}
+
+int cache_store_remove(CacheStore* store, const char* key) {
+    if (!store || !store->index || !key) {
+        return -1;
+    }
+
+    IndexSlot* slot = index_find(store, key, hash_key(key));
+    if (!slot) {
+        return 0;
+    }
+
+    uint64_t offset = 0;
+    uint64_t size   = 0;
+    if (append_record(store, RECORD_TOMBSTONE, key, NULL, 0, 0, &offset,
+                      &size) != 0) {
+        return -1;
+    }
+
+    index_delete(store, slot);
+    store->index->log_size = store->log_size;
+    update_gauges(store);
+    return 0;
+}
+
+size_t cache_store_foreach(CacheStore* store, CacheStoreVisitor visitor,
+                           void* context) {
+    if (!store || !store->index || !visitor) {
+        return 0;
+    }
+
+    time_t now     = time(NULL);
+    size_t visited = 0;
+    for (size_t i = 0; i < CACHE_STORE_INDEX_CAPACITY; i++) {
+        IndexSlot* slot = &store->index->slots[i];
+        if (slot->offset == 0) {
+            continue;
+        }
+
+        const RecordHeader* header = record_at(store, slot->offset);
+        if (now > (time_t)header->expiry) {
+            continue;
+        }
+
+        const char* key = (const char*)(header + 1);
+        visitor(key, key + header->key_len, header->value_len,
+                (time_t)header->expiry, context);
+        visited++;
+    }
+
+    return visited;
+}
+
+void cache_store_maintain(CacheStore* store) {
+    if (!store || !store->index) {
+        return;
+    }
+
+    if (store->compacting) {
+        if (atomic_load_explicit(&store->compact_done, memory_order_acquire) &&
+            compact_finish(store) != 0) {
+            compact_backoff(store);
+        }
+        return;
+    }
+
+    if (store->compact_retry_us != 0 &&
+        metrics_now_us() < store->compact_retry_us) {
+        return;
+    }
+
+    /* Only worth it for the space it frees, so a mostly live log is left
+     * alone however large it is */
+    uint64_t live = store->index->live_bytes;
+    uint64_t dead = store->log_size - sizeof(LogHeader) - live;
+    bool mostly_dead = dead > live && dead >= CACHE_STORE_COMPACT_MIN_DEAD;
+    bool full = store->log_size > CACHE_STORE_COMPACT_FULL_SIZE &&
+                dead >= store->log_size / 4;
+    if ((mostly_dead || full) && compact_start(store) != 0) {
+        compact_backoff(store);
+    }
+}
+
+int cache_store_compact(CacheStore* store) {
+    if (!store || !store->index) {
+        return -1;
+    }
+
+    if (!store->compacting && compact_start(store) != 0) {
+        return -1;
+    }
+    return compact_finish(store);
+}
+
+void cache_store_close(CacheStore* store) {
+    if (!store) {
+        return;
+    }
+
+    if (store->compacting) {
+        pthread_join(store->compactor, NULL);
+        store->compacting = false;
+        compact_discard(store);
+
+        free(store->compact_offsets);
+        store->compact_offsets = NULL;
+    }
+
+    if (store->index && store->fd >= 0) {
+        fdatasync(store->fd);
+        store->index->clean = 1;
+        msync(store->index, INDEX_FILE_SIZE, MS_SYNC);
+    }
+
+    store_release(store);
+}
+
+/* ============= Internal Functions Implementation ============= */
+
+static uint64_t new_log_id(void) {
+    uint64_t id = 0;
+    if (getrandom(&id, sizeof(id), 0) != (ssize_t)sizeof(id)) {
+        id = metrics_now_us() ^ ((uint64_t)getpid() << 32);
+    }
+    return id;
+}
+
+/* FNV-1a, with 0 reserved for empty slots */
+static uint64_t hash_key(const char* key) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (const char* p = key; *p; p++) {
+        hash ^= (uint8_t)*p;
+        hash *= FNV_PRIME;
+    }
+    return hash ? hash : 1;
+}
+
+static size_t record_size(size_t key_len, size_t value_len) {
+    return (sizeof(RecordHeader) + key_len + value_len + 7) & ~(size_t)7;
+}
+
+static uint32_t record_crc(const RecordHeader* header, const char* key,
+                           const void* value) {
+    const uint8_t* fields = (const uint8_t*)header + sizeof(header->crc);
+    uint32_t       crc =
+        deflate_crc32(0, fields, sizeof(*header) - sizeof(header->crc));
+    crc = deflate_crc32(crc, (const uint8_t*)key, header->key_len);
+    if (header->value_len > 0) {
+        crc = deflate_crc32(crc, (const uint8_t*)value, header->value_len);
+    }
+    return crc;
+}
+
+static const RecordHeader* record_at(const CacheStore* store, uint64_t offset) {
+    return (const RecordHeader*)(store->map + offset);
+}
+
+static bool record_valid(const CacheStore* store, uint64_t offset,
+                         uint64_t limit, uint64_t* size) {
+    if (offset + sizeof(RecordHeader) > limit) {
+        return false;
+    }
+
+    const RecordHeader* header = record_at(store, offset);
+    if (header->key_len == 0 || header->key_len > RECORD_KEY_MAX ||
+        header->value_len > RECORD_VALUE_MAX ||
+        (header->flags & ~RECORD_TOMBSTONE) != 0) {
+        return false;
+    }
+
+    uint64_t total = record_size(header->key_len, header->value_len);
+    if (offset + total > limit) {
+        return false;
+    }
+
+    const char* key = (const char*)(header + 1);
+    if (key[header->key_len - 1] != '\0') {
+        return false;
+    }
+
+    if (record_crc(header, key, key + header->key_len) != header->crc) {
+        return false;
+    }
+
+    *size = total;
+    return true;
+}
+
+static int append_record(CacheStore* store, uint32_t flags, const char* key,
+                         const void* value, size_t length, time_t expiry,
+                         uint64_t* offset, uint64_t* size) {
+    size_t key_len = strlen(key) + 1;
+    if (key_len > RECORD_KEY_MAX || length > RECORD_VALUE_MAX) {
+        return -1;
+    }
+
+    size_t total = record_size(key_len, length);
+    if (store->log_size + total > CACHE_STORE_MAX_SIZE) {
+        return -1;
+    }
+
+    uint8_t* record = calloc(1, total);
+    if (!record) {
+        return -1;
+    }
+
+    RecordHeader header = {.flags     = flags,
+                           .key_len   = (uint32_t)key_len,
+                           .value_len = (uint32_t)length,
+                           .expiry    = (int64_t)expiry};
+    header.crc          = record_crc(&header, key, value);
+
+    memcpy(record, &header, sizeof(header));
+    memcpy(record + sizeof(header), key, key_len);
+    if (length > 0) {
+        memcpy(record + sizeof(header) + key_len, value, length);
+    }
+
+    size_t written = 0;
+    while (written < total) {
+        ssize_t n = pwrite(store->fd, record + written, total - written,
+                           (off_t)(store->log_size + written));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            /* Leave no partial record behind */
+            if (ftruncate(store->fd, (off_t)store->log_size) != 0) {
+                LOG_WARN("store", "Cannot truncate %s", store->path);
+            }
+            free(record);
+            return -1;
+        }
+        written += (size_t)n;
+    }
+    free(record);
+
+    *offset = store->log_size;
+    *size   = total;
+    store->log_size += total;
+    return 0;
+}
+
+static int write_all(int fd, const void* data, size_t length) {
+    const uint8_t* p = (const uint8_t*)data;
+    while (length > 0) {
+        ssize_t n = write(fd, p, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        length -= (size_t)n;
+    }
+    return 0;
+}
+
+static IndexSlot* index_find(CacheStore* store, const char* key,
+                             uint64_t hash) {
+    size_t mask = CACHE_STORE_INDEX_CAPACITY - 1;
+    size_t slot = (size_t)hash & mask;
+    for (size_t probe = 0; probe < CACHE_STORE_INDEX_CAPACITY; probe++) {
+        IndexSlot* entry = &store->index->slots[slot];
+        if (entry->offset == 0) {
+            return NULL;
+        }
+        if (entry->hash == hash) {
+            const RecordHeader* header = record_at(store, entry->offset);
+            if (strcmp((const char*)(header + 1), key) == 0) {
+                return entry;
+            }
+        }
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
+
+static int index_set(CacheStore* store, const char* key, uint64_t hash,
+                     uint64_t offset, uint64_t size) {
+    CacheStoreIndex* index = store->index;
+
+    IndexSlot* slot = index_find(store, key, hash);
+    if (slot) {
+        const RecordHeader* old = record_at(store, slot->offset);
+        index->live_bytes -= record_size(old->key_len, old->value_len);
+    } else {
+        if (index->count >= INDEX_MAX_LOAD) {
+            return -1;
+        }
+
+        index_place(index, hash, offset);
+        index->live_bytes += size;
+        return 0;
+    }
+
+    slot->offset = offset;
+    index->live_bytes += size;
+    return 0;
+}
+
+/* Add a key known not to be in the index */
+static void index_place(CacheStoreIndex* index, uint64_t hash,
+                        uint64_t offset) {
+    size_t mask = CACHE_STORE_INDEX_CAPACITY - 1;
+    size_t i    = (size_t)hash & mask;
+    while (index->slots[i].offset != 0) {
+        i = (i + 1) & mask;
+    }
+
+    index->slots[i].hash   = hash;
+    index->slots[i].offset = offset;
+    index->count++;
+}
+
+/* Backward-shift deletion keeps probe sequences intact without tombstones */
+static void index_delete(CacheStore* store, IndexSlot* slot) {
+    CacheStoreIndex* index = store->index;
+    size_t           mask  = CACHE_STORE_INDEX_CAPACITY - 1;
+
+    const RecordHeader* old = record_at(store, slot->offset);
+    index->live_bytes -= record_size(old->key_len, old->value_len);
+
+    size_t hole = (size_t)(slot - index->slots);
+    size_t next = (hole + 1) & mask;
+    while (index->slots[next].offset != 0) {
+        size_t home = (size_t)index->slots[next].hash & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            index->slots[hole] = index->slots[next];
+            hole               = next;
+        }
+        next = (next + 1) & mask;
+    }
+
+    index->slots[hole].hash   = 0;
+    index->slots[hole].offset = 0;
+    index->count--;
+}
+
+static void index_reset(CacheStore* store) {
+    CacheStoreIndex* index = store->index;
+
+    memset(index, 0, INDEX_FILE_SIZE);
+    memcpy(index->magic, INDEX_MAGIC, sizeof(index->magic));
+    index->log_id   = store->log_id;
+    index->log_size = sizeof(LogHeader);
+    index->capacity = CACHE_STORE_INDEX_CAPACITY;
+}
+
+static void replay(CacheStore* store, uint64_t file_size) {
+    uint64_t offset = store->index->log_size;
+    uint64_t size   = 0;
+    size_t   count  = 0;
+
+    while (record_valid(store, offset, file_size, &size)) {
+        const RecordHeader* header = record_at(store, offset);
+        const char*         key    = (const char*)(header + 1);
+        uint64_t            hash   = hash_key(key);
+
+        if (header->flags & RECORD_TOMBSTONE) {
+            IndexSlot* slot = index_find(store, key, hash);
+            if (slot) {
+                index_delete(store, slot);
+            }
+        } else if (index_set(store, key, hash, offset, size) != 0) {
+            LOG_WARN("store", "Index of %s is full, dropping %s",
+                     store->path, key);
+        }
+
+        offset += size;
+        count++;
+    }
+
+    if (offset < file_size) {
+        LOG_WARN("store", "Dropping %llu bytes of torn or corrupt records "
+                 "at the end of %s",
+                 (unsigned long long)(file_size - offset), store->path);
+        if (ftruncate(store->fd, (off_t)offset) != 0) {
+            LOG_WARN("store", "Cannot truncate %s", store->path);
+        }
+    }
+
+    if (count > 0) {
+        LOG_DEBUG("store", "Replayed %zu records of %s", count, store->path);
+    }
+
+    store->log_size        = offset;
+    store->index->log_size = offset;
+}
+
+/* Snapshot the offsets of the current entries; the records themselves never
+ * change, so the compactor can copy them while new ones are appended */
+static int compact_start(CacheStore* store) {
+    size_t    count   = store->index->count;
+    uint64_t* offsets = malloc((count ? count : 1) * sizeof(uint64_t));
+    if (!offsets) {
+        return -1;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < CACHE_STORE_INDEX_CAPACITY && n < count; i++) {
+        if (store->index->slots[i].offset != 0) {
+            offsets[n++] = store->index->slots[i].offset;
+        }
+    }
+
+    /* Copy in log order: sequential reads, and a stable layout */
+    for (size_t i = 1; i < n; i++) {
+        uint64_t value = offsets[i];
+        size_t   j     = i;
+        while (j > 0 && offsets[j - 1] > value) {
+            offsets[j] = offsets[j - 1];
+            j--;
+        }
+        offsets[j] = value;
+    }
+
+    store->compact_offsets = offsets;
+    store->compact_count   = n;
+    store->compact_end     = store->log_size;
+    store->compact_result  = -1;
+    atomic_store_explicit(&store->compact_done, false, memory_order_relaxed);
+
+    if (pthread_create(&store->compactor, NULL, compact_run, store) != 0) {
+        free(offsets);
+        store->compact_offsets = NULL;
+        return -1;
+    }
+
+    store->compacting = true;
+    LOG_INFO("store", "Compacting %s (%llu of %llu bytes live)", store->path,
+             (unsigned long long)store->index->live_bytes,
+             (unsigned long long)store->log_size);
+    return 0;
+}
+
+/* Append what was written during the copy and swap the logs and indexes.
+ * The compactor indexed the copied records, so reopening only replays the
+ * records appended meanwhile. */
+static int compact_finish(CacheStore* store) {
+    pthread_join(store->compactor, NULL);
+    store->compacting = false;
+
+    free(store->compact_offsets);
+    store->compact_offsets = NULL;
+
+    char path[CACHE_STORE_PATH_MAX + 8];
+    char index_path[CACHE_STORE_PATH_MAX + 16];
+    compact_path(store, path, sizeof(path));
+    compact_index_path(store, index_path, sizeof(index_path));
+
+    if (store->compact_result != 0) {
+        LOG_WARN("store", "Compaction of %s failed", store->path);
+        compact_discard(store);
+        return -1;
+    }
+
+    int fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd < 0) {
+        compact_discard(store);
+        return -1;
+    }
+
+    int result = write_all(fd, store->map + store->compact_end,
+                           store->log_size - store->compact_end);
+    if (result == 0) {
+        result = fdatasync(fd);
+    }
+    close(fd);
+
+    if (result != 0 || rename(path, store->path) != 0) {
+        LOG_WARN("store", "Cannot replace %s: %s", store->path,
+                 strerror(errno));
+        compact_discard(store);
+        return -1;
+    }
+
+    /* Without the new index, the old one no longer matches the log id and
+     * the index is rebuilt on open */
+    char current_index[CACHE_STORE_PATH_MAX + 8];
+    snprintf(current_index, sizeof(current_index), "%s.idx", store->path);
+    if (rename(index_path, current_index) != 0) {
+        LOG_WARN("store", "Cannot replace %s: %s", current_index,
+                 strerror(errno));
+        unlink(index_path);
+    }
+
+    char     log_path[CACHE_STORE_PATH_MAX];
+    MetricId compactions = store->metric_compactions;
+    snprintf(log_path, sizeof(log_path), "%s", store->path);
+    store_release(store);
+
+    metrics_inc(compactions);
+    return cache_store_open(store, log_path);
+}
+
+/* Put off the next attempt; a successful one reopens the store, which
+ * clears the backoff */
+static void compact_backoff(CacheStore* store) {
+    uint64_t backoff = store->compact_backoff_us * 2;
+    if (backoff < CACHE_STORE_COMPACT_RETRY_US) {
+        backoff = CACHE_STORE_COMPACT_RETRY_US;
+    }
+    if (backoff > CACHE_STORE_COMPACT_RETRY_MAX_US) {
+        backoff = CACHE_STORE_COMPACT_RETRY_MAX_US;
+    }
+
+    store->compact_backoff_us = backoff;
+    store->compact_retry_us   = metrics_now_us() + backoff;
+    LOG_WARN("store", "Next compaction of %s in %llu s", store->path,
+             (unsigned long long)(backoff / 1000000));
+}
+
+static void* compact_run(void* context) {
+    CacheStore* store = (CacheStore*)context;
+
+    char path[CACHE_STORE_PATH_MAX + 8];
+    compact_path(store, path, sizeof(path));
+
+    CacheStoreIndex* index = calloc(1, INDEX_FILE_SIZE);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (!index || fd < 0) {
+        free(index);
+        if (fd >= 0) {
+            close(fd);
+        }
+        atomic_store_explicit(&store->compact_done, true,
+                              memory_order_release);
+        return NULL;
+    }
+
+    LogHeader header;
+    memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+    header.log_id = new_log_id();
+
+    /* The snapshot holds each key once, so records are indexed without
+     * comparing keys */
+    memcpy(index->magic, INDEX_MAGIC, sizeof(index->magic));
+    index->log_id   = header.log_id;
+    index->capacity = CACHE_STORE_INDEX_CAPACITY;
+
+    int      result = write_all(fd, &header, sizeof(header));
+    uint64_t offset = sizeof(header);
+    time_t   now    = time(NULL);
+    for (size_t i = 0; i < store->compact_count && result == 0; i++) {
+        const RecordHeader* record = record_at(store, store->compact_offsets[i]);
+        if (now > (time_t)record->expiry) {
+            continue;
+        }
+
+        uint64_t size = record_size(record->key_len, record->value_len);
+        result        = write_all(fd, record, size);
+        index_place(index, hash_key((const char*)(record + 1)), offset);
+        index->live_bytes += size;
+        offset += size;
+    }
+
+    if (result == 0) {
+        result = fdatasync(fd);
+    }
+    close(fd);
+
+    /* Written clean and covering the copy, so opening the new log trusts it
+     * and replays only what compact_finish appends */
+    if (result == 0) {
+        index->log_size = offset;
+        index->clean    = 1;
+
+        char index_path[CACHE_STORE_PATH_MAX + 16];
+        compact_index_path(store, index_path, sizeof(index_path));
+        fd = open(index_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        result = fd >= 0 ? write_all(fd, index, INDEX_FILE_SIZE) : -1;
+        if (result == 0) {
+            result = fdatasync(fd);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    free(index);
+
+    store->compact_result = result;
+    atomic_store_explicit(&store->compact_done, true, memory_order_release);
+    return NULL;
+}
+
+static void compact_path(const CacheStore* store, char* out, size_t out_size) {
+    snprintf(out, out_size, "%s.compact", store->path);
+}
+
+static void compact_index_path(const CacheStore* store, char* out,
+                               size_t out_size) {
+    snprintf(out, out_size, "%s.compact.idx", store->path);
+}
+
+static void compact_discard(const CacheStore* store) {
+    char path[CACHE_STORE_PATH_MAX + 16];
+    compact_path(store, path, sizeof(path));
+    unlink(path);
+    compact_index_path(store, path, sizeof(path));
+    unlink(path);
+}
+
+static void store_release(CacheStore* store) {
+    if (store->index) {
+        munmap(store->index, INDEX_FILE_SIZE);
+        store->index = NULL;
+    }
+    if (store->index_fd >= 0) {
+        close(store->index_fd);
+        store->index_fd = -1;
+    }
+    if (store->map != MAP_FAILED && store->map) {
+        munmap(store->map, CACHE_STORE_MAX_SIZE);
+    }
+    store->map = MAP_FAILED;
+    if (store->fd >= 0) {
+        close(store->fd);
+        store->fd = -1;
+    }
+}
+
+static void update_gauges(CacheStore* store) {
+    metrics_gauge_set(store->metric_bytes, (int64_t)store->log_size);
+    metrics_gauge_set(store->metric_live_bytes,
+                      (int64_t)store->index->live_bytes);
+}
@@ -0,0 +1,167 @@
+/**
+ * cache_store.h - Persistent log-structured key/value store
+ *
+ * Entries are appended to a single log file as CRC-checked records carrying
+ * an absolute expiry time; replacing or removing a key appends a new record
+ * and leaves the old one dead. The log is memory-mapped, so lookups return
+ * pointers straight into the page cache.
+ *
+ * Keys are found through an open-addressing hash index kept in a second,
+ * memory-mapped file next to the log ("<path>.idx"). The index records how
+ * much of the log it covers, so on open only records appended after that
+ * point are replayed; a missing or stale index is rebuilt by scanning the
+ * log. A torn record at the end of the log (crash during an append) fails
+ * its CRC and is cut off.
+ *
+ * Compaction copies the live, unexpired records into a new log, and builds
+ * its index, on a background thread while appends continue.
+ * cache_store_maintain starts it once enough of the log is dead, and later
+ * swaps the new log and index in after copying the records appended in the
+ * meantime, so only those are replayed on the calling thread.
+ *
+ * A store must only be used from one thread.
+ */
+
+#ifndef CACHE_STORE_H
+#define CACHE_STORE_H
+
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Address space reserved for the log; appends beyond it fail */
+#define CACHE_STORE_MAX_SIZE (256UL * 1024 * 1024)
+
+/* Index slots, must be a power of two. Keys beyond 3/4 of it are refused. */
+#define CACHE_STORE_INDEX_CAPACITY 16384
+
+/* Compact once dead records outweigh live ones and exceed this size */
+#define CACHE_STORE_COMPACT_MIN_DEAD (1024 * 1024)
+
+/* Past this log size, compact once a quarter of the log is dead */
+#define CACHE_STORE_COMPACT_FULL_SIZE (CACHE_STORE_MAX_SIZE / 4 * 3)
+
+/* Wait after a failed compaction before trying again, twice as long after
+ * each further failure, up to the maximum */
+#define CACHE_STORE_COMPACT_RETRY_US (1000ULL * 1000)
+#define CACHE_STORE_COMPACT_RETRY_MAX_US (300ULL * 1000 * 1000)
+
+#define CACHE_STORE_PATH_MAX 256
+
+typedef struct CacheStoreIndex CacheStoreIndex;
+
+typedef struct {
+    char path[CACHE_STORE_PATH_MAX];
+
+    int      fd;
+    uint8_t* map;      /* CACHE_STORE_MAX_SIZE bytes, valid up to log_size */
+    uint64_t log_size; /* End of the last valid record */
+    uint64_t log_id;   /* Random id tying the index to this log */
+
+    int              index_fd;
+    CacheStoreIndex* index;
+
+    /* Background compaction */
+    pthread_t   compactor;
+    bool        compacting;
+    atomic_bool compact_done;
+    int         compact_result;
+    uint64_t    compact_end; /* Log size when compaction started */
+    uint64_t*   compact_offsets;
+    size_t      compact_count;
+    uint64_t    compact_backoff_us; /* 0 unless the last attempt failed */
+    uint64_t    compact_retry_us;   /* No attempt before, metrics_now_us */
+
+    MetricId metric_bytes;
+    MetricId metric_live_bytes;
+    MetricId metric_compactions;
+} CacheStore;
+
+/**
+ * Visitor for cache_store_foreach
+ *
+ * @param key Entry key
+ * @param value Entry value
+ * @param length Value length
+ * @param expiry Absolute expiry time
+ * @param context Caller context
+ */
+typedef void (*CacheStoreVisitor)(const char* key, const void* value,
+                                  size_t length, time_t expiry,
+                                  void* context);
+
+/**
+ * Open a store, creating the log if it does not exist
+ *
+ * @param store Store to initialize
+ * @param path Log file path
+ * @return 0 on success, -1 on error
+ */
+int cache_store_open(CacheStore* store, const char* path);
+
+/**
+ * Append an entry, replacing any previous value of the key
+ *
+ * @param store Store
+ * @param key Entry key
+ * @param value Entry value
+ * @param length Value length
+ * @param expiry Absolute expiry time
+ * @return 0 on success, -1 on error (log or index full, write failed)
+ */
+int cache_store_put(CacheStore* store, const char* key, const void* value,
+                    size_t length, time_t expiry);
+
+/**
+ * Look up an unexpired entry. The returned pointer stays valid until the
+ * store is compacted or closed.
+ *
+ * @param store Store
+ * @param key Entry key
+ * @param length Output value length
+ * @param expiry Output absolute expiry time (can be NULL)
+ * @return Value, or NULL when the key is missing or expired
+ */
+const void* cache_store_get(CacheStore* store, const char* key,
+                            size_t* length, time_t* expiry);
+
+/**
+ * Remove an entry
+ *
+ * @return 0 on success (also when the key was missing), -1 on error
+ */
+int cache_store_remove(CacheStore* store, const char* key);
+
+/**
+ * Call a visitor for every unexpired entry, in no particular order
+ *
+ * @return Number of entries visited
+ */
+size_t cache_store_foreach(CacheStore* store, CacheStoreVisitor visitor,
+                           void* context);
+
+/**
+ * Start a background compaction when enough of the log is dead, and finish
+ * one that is done. Cheap when there is nothing to do; call it regularly.
+ * After a failure it waits before trying again.
+ */
+void cache_store_maintain(CacheStore* store);
+
+/**
+ * Compact the log now, waiting for the result
+ *
+ * @return 0 on success, -1 on error
+ */
+int cache_store_compact(CacheStore* store);
+
+/**
+ * Flush and close a store, waiting for a running compaction
+ */
+void cache_store_close(CacheStore* store);
+
+#endif /* CACHE_STORE_H */
@@ -0,0 +1,309 @@
+/**
+ * deflate.c - Implementation of the DEFLATE encoder
+ */
+
+#include "deflate.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFLATE_WINDOW_SIZE 32768
+#define DEFLATE_WINDOW_MASK (DEFLATE_WINDOW_SIZE - 1)
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_HASH_SIZE (1 << DEFLATE_HASH_BITS)
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_MAX_CHAIN 64 /* Candidates checked per position */
+
+#define DEFLATE_END_OF_BLOCK 256
+
+/* Length codes 257..285: base length and extra bits */
+static const uint16_t LENGTH_BASE[29] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                         1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                         4, 4, 4, 4, 5, 5, 5, 5, 0};
+
+/* Distance codes 0..29: base distance and extra bits */
+static const uint16_t DIST_BASE[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+static const uint8_t DIST_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                       4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                       9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+/* Fixed Huffman code, already bit-reversed for the LSB-first stream */
+typedef struct {
+    uint16_t literal_code[288];
+    uint8_t  literal_bits[288];
+    uint16_t dist_code[30];
+} FixedCodes;
+
+typedef struct {
+    uint8_t* out;
+    size_t   pos;
+    uint64_t bits;
+    int      count;
+} BitWriter;
+
+/* ============= Internal Functions ============= */
+
+static uint16_t reverse_bits(uint16_t code, int length);
+static void     build_fixed_codes(FixedCodes* codes);
+static void     put_bits(BitWriter* writer, uint32_t value, int count);
+static void     flush_bits(BitWriter* writer);
+static void     put_match(BitWriter* writer, const FixedCodes* codes,
+                          int length, int distance);
+static int      encode_block(const uint8_t* input, size_t input_len,
+                             BitWriter* writer);
+static uint32_t adler32(const uint8_t* data, size_t len);
+
+/* ============= Public API Implementation ============= */
+
+int deflate_compress(const uint8_t* input, size_t input_len,
+                     DeflateFormat format, uint8_t** output,
+                     size_t* output_len) {
+    if ((!input && input_len > 0) || !output || !output_len) {
+        return -1;
+    }
+
+    /* Fixed Huffman never needs more than 9 bits per input byte */
+    size_t   bound = input_len + input_len / 8 + 64;
+    uint8_t* out   = malloc(bound);
+    if (!out) {
+        return -2;
+    }
+
+    BitWriter writer = {.out = out, .pos = 0, .bits = 0, .count = 0};
+
+    if (format == DEFLATE_FORMAT_ZLIB) {
+        out[writer.pos++] = 0x78; /* 32K window, deflate */
+        out[writer.pos++] = 0x01; /* No dictionary, check bits */
+    } else if (format == DEFLATE_FORMAT_GZIP) {
+        static const uint8_t GZIP_HEADER[10] = {0x1f, 0x8b, 8, 0, 0,
+                                                0,    0,    0, 0, 3};
+        memcpy(out, GZIP_HEADER, sizeof(GZIP_HEADER));
+        writer.pos += sizeof(GZIP_HEADER);
+    }
+
+    if (encode_block(input, input_len, &writer) != 0) {
+        free(out);
+        return -3;
+    }
+    flush_bits(&writer);
+
+    if (format == DEFLATE_FORMAT_ZLIB) {
+        uint32_t check    = adler32(input, input_len);
+        out[writer.pos++] = (uint8_t)(check >> 24);
+        out[writer.pos++] = (uint8_t)(check >> 16);
+        out[writer.pos++] = (uint8_t)(check >> 8);
+        out[writer.pos++] = (uint8_t)check;
+    } else if (format == DEFLATE_FORMAT_GZIP) {
+        uint32_t crc  = deflate_crc32(0, input, input_len);
+        uint32_t size = (uint32_t)input_len;
+        for (int i = 0; i < 4; i++) {
+            out[writer.pos++] = (uint8_t)(crc >> (8 * i));
+        }
+        for (int i = 0; i < 4; i++) {
+            out[writer.pos++] = (uint8_t)(size >> (8 * i));
+        }
+    }
+
+    *output     = out;
+    *output_len = writer.pos;
+    return 0;
+}
+
+uint32_t deflate_crc32(uint32_t crc, const uint8_t* data, size_t len) {
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1u)));
+        }
+    }
+    return ~crc;
+}
+
+/* ============= Internal Functions Implementation ============= */
+
+static uint16_t reverse_bits(uint16_t code, int length) {
+    uint16_t reversed = 0;
+    for (int i = 0; i < length; i++) {
+        reversed = (uint16_t)((reversed << 1) | (code & 1));
+        code >>= 1;
+    }
+    return reversed;
+}
+
+static void build_fixed_codes(FixedCodes* codes) {
+    for (int symbol = 0; symbol < 288; symbol++) {
+        uint16_t code   = 0;
+        int      length = 0;
+        if (symbol < 144) {
+            code   = (uint16_t)(0x30 + symbol);
+            length = 8;
+        } else if (symbol < 256) {
+            code   = (uint16_t)(0x190 + symbol - 144);
+            length = 9;
+        } else if (symbol < 280) {
+            code   = (uint16_t)(symbol - 256);
+            length = 7;
+        } else {
+            code   = (uint16_t)(0xC0 + symbol - 280);
+            length = 8;
+        }
+        codes->literal_code[symbol] = reverse_bits(code, length);
+        codes->literal_bits[symbol] = (uint8_t)length;
+    }
+
+    for (int symbol = 0; symbol < 30; symbol++) {
+        codes->dist_code[symbol] = reverse_bits((uint16_t)symbol, 5);
+    }
+}
+
+static void put_bits(BitWriter* writer, uint32_t value, int count) {
+    writer->bits |= (uint64_t)value << writer->count;
+    writer->count += count;
+    while (writer->count >= 8) {
+        writer->out[writer->pos++] = (uint8_t)writer->bits;
+        writer->bits >>= 8;
+        writer->count -= 8;
+    }
+}
+
+static void flush_bits(BitWriter* writer) {
+    if (writer->count > 0) {
+        writer->out[writer->pos++] = (uint8_t)writer->bits;
+    }
+    writer->bits  = 0;
+    writer->count = 0;
+}
+
+static void put_match(BitWriter* writer, const FixedCodes* codes, int length,
+                      int distance) {
+    int code = 28;
+    while (LENGTH_BASE[code] > length) {
+        code--;
+    }
+    put_bits(writer, codes->literal_code[257 + code],
+             codes->literal_bits[257 + code]);
+    put_bits(writer, (uint32_t)(length - LENGTH_BASE[code]),
+             LENGTH_EXTRA[code]);
+
+    code = 29;
+    while (DIST_BASE[code] > distance) {
+        code--;
+    }
+    put_bits(writer, codes->dist_code[code], 5);
+    put_bits(writer, (uint32_t)(distance - DIST_BASE[code]), DIST_EXTRA[code]);
+}
+
+static inline uint32_t hash3(const uint8_t* p) {
+    uint32_t value = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+    return (value * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+static int encode_block(const uint8_t* input, size_t input_len,
+                        BitWriter* writer) {
+    FixedCodes codes;
+    build_fixed_codes(&codes);
+
+    int32_t* head = malloc(DEFLATE_HASH_SIZE * sizeof(int32_t));
+    int32_t* prev = malloc(DEFLATE_WINDOW_SIZE * sizeof(int32_t));
+    if (!head || !prev) {
+        free(head);
+        free(prev);
+        return -1;
+    }
+    memset(head, 0xff, DEFLATE_HASH_SIZE * sizeof(int32_t)); /* All -1 */
+
+    put_bits(writer, 1, 1); /* BFINAL */
+    put_bits(writer, 1, 2); /* BTYPE = fixed Huffman */
+
+    size_t pos = 0;
+    while (pos < input_len) {
+        int best_length   = 0;
+        int best_distance = 0;
+
+        if (pos + DEFLATE_MIN_MATCH <= input_len) {
+            uint32_t hash      = hash3(input + pos);
+            int32_t  candidate = head[hash];
+            size_t   max_length = input_len - pos;
+            if (max_length > DEFLATE_MAX_MATCH) {
+                max_length = DEFLATE_MAX_MATCH;
+            }
+
+            for (int chain = 0; candidate >= 0 && chain < DEFLATE_MAX_CHAIN;
+                 chain++) {
+                size_t distance = pos - (size_t)candidate;
+                if (distance > DEFLATE_WINDOW_SIZE) {
+                    break;
+                }
+
+                const uint8_t* a = input + pos;
+                const uint8_t* b = input + candidate;
+                if (b[best_length] == a[best_length]) {
+                    size_t length = 0;
+                    while (length < max_length && a[length] == b[length]) {
+                        length++;
+                    }
+                    if ((int)length > best_length) {
+                        best_length   = (int)length;
+                        best_distance = (int)distance;
+                        if (length == max_length) {
+                            break;
+                        }
+                    }
+                }
+                candidate = prev[candidate & DEFLATE_WINDOW_MASK];
+            }
+
+            prev[pos & DEFLATE_WINDOW_MASK] = head[hash];
+            head[hash]                      = (int32_t)pos;
+        }
+
+        if (best_length >= DEFLATE_MIN_MATCH) {
+            put_match(writer, &codes, best_length, best_distance);
+
+            /* Index the positions covered by the match as well */
+            size_t end = pos + (size_t)best_length;
+            for (pos++; pos < end; pos++) {
+                if (pos + DEFLATE_MIN_MATCH <= input_len) {
+                    uint32_t hash                   = hash3(input + pos);
+                    prev[pos & DEFLATE_WINDOW_MASK] = head[hash];
+                    head[hash]                      = (int32_t)pos;
+                }
+            }
+        } else {
+            put_bits(writer, codes.literal_code[input[pos]],
+                     codes.literal_bits[input[pos]]);
+            pos++;
+        }
+    }
+
+    put_bits(writer, codes.literal_code[DEFLATE_END_OF_BLOCK],
+             codes.literal_bits[DEFLATE_END_OF_BLOCK]);
+
+    free(head);
+    free(prev);
+    return 0;
+}
+
+static uint32_t adler32(const uint8_t* data, size_t len) {
+    uint32_t a = 1;
+    uint32_t b = 0;
+    while (len > 0) {
+        size_t block = len < 5552 ? len : 5552; /* No overflow before mod */
+        len -= block;
+        while (block--) {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
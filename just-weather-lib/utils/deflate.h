@@ -0,0 +1,49 @@
+/**
+ * deflate.h - Small in-tree DEFLATE encoder (RFC 1951)
+ *
+ * Used to compress HTTP response bodies without depending on zlib. The
+ * encoder does LZ77 matching over a 32 KiB window with hash chains and emits
+ * a single block with the fixed Huffman code, which is fast and compresses
+ * repetitive JSON and HTML well. Output can be wrapped as zlib (RFC 1950,
+ * HTTP "deflate") or gzip (RFC 1952).
+ *
+ * All functions are reentrant and can be used from any thread.
+ */
+
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    DEFLATE_FORMAT_RAW,  /* Bare DEFLATE stream */
+    DEFLATE_FORMAT_ZLIB, /* zlib wrapper, Content-Encoding: deflate */
+    DEFLATE_FORMAT_GZIP, /* gzip wrapper, Content-Encoding: gzip */
+} DeflateFormat;
+
+/**
+ * Compress a buffer
+ *
+ * @param input Data to compress
+ * @param input_len Length of the data
+ * @param format Container format of the output
+ * @param output Output buffer (caller must free)
+ * @param output_len Output length
+ * @return 0 on success, negative on error
+ */
+int deflate_compress(const uint8_t* input, size_t input_len,
+                     DeflateFormat format, uint8_t** output,
+                     size_t* output_len);
+
+/**
+ * Update a CRC-32 (IEEE 802.3, as used by gzip) with more data
+ *
+ * @param crc Previous value, 0 to start
+ * @param data Data to add
+ * @param len Length of the data
+ * @return Updated CRC
+ */
+uint32_t deflate_crc32(uint32_t crc, const uint8_t* data, size_t len);
+
+#endif /* DEFLATE_H */
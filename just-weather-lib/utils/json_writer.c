@@ -0,0 +1,409 @@
+/**
+ * json_writer.c - Implementation of the streaming JSON writer
+ */
+
+#include "json_writer.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define JSON_WRITER_INITIAL_CAPACITY 1024
+
+/* Fast path bounds for json_writer_number: |value| * 10^6 stays well below
+ * 2^53, so the scaled value is an exact integer candidate */
+#define JSON_NUMBER_FAST_MAX 1e9
+#define JSON_NUMBER_FAST_DIGITS 6
+
+/* ============= Internal Functions ============= */
+
+static int  ensure_capacity(JsonWriter* writer, size_t extra);
+static void append(JsonWriter* writer, const char* data, size_t length);
+static void append_char(JsonWriter* writer, char c);
+static void append_indent(JsonWriter* writer);
+static void begin_value(JsonWriter* writer);
+static void begin_scope(JsonWriter* writer, char open);
+static void end_scope(JsonWriter* writer, char close);
+static void append_escaped(JsonWriter* writer, const char* value);
+static size_t format_integer(char* out, unsigned long long value);
+static size_t format_double(char* out, double value);
+
+/* ============= Public API Implementation ============= */
+
+int json_writer_init(JsonWriter* writer, size_t head_room, bool pretty) {
+    if (!writer) {
+        return -1;
+    }
+
+    memset(writer, 0, sizeof(JsonWriter));
+
+    writer->capacity = head_room + JSON_WRITER_INITIAL_CAPACITY;
+    writer->buffer   = malloc(writer->capacity);
+    if (!writer->buffer) {
+        writer->capacity = 0;
+        writer->failed   = true;
+        return -1;
+    }
+
+    writer->start  = head_room;
+    writer->size   = head_room;
+    writer->pretty = pretty;
+    return 0;
+}
+
+void json_writer_reset(JsonWriter* writer) {
+    writer->size      = writer->start;
+    writer->depth     = 0;
+    writer->after_key = false;
+    writer->failed    = writer->buffer == NULL;
+}
+
+void json_writer_begin_object(JsonWriter* writer) {
+    begin_scope(writer, '{');
+}
+
+void json_writer_end_object(JsonWriter* writer) { end_scope(writer, '}'); }
+
+void json_writer_begin_array(JsonWriter* writer) { begin_scope(writer, '['); }
+
+void json_writer_end_array(JsonWriter* writer) { end_scope(writer, ']'); }
+
+void json_writer_key(JsonWriter* writer, const char* key) {
+    begin_value(writer);
+    append_escaped(writer, key);
+    if (writer->pretty) {
+        append(writer, ": ", 2);
+    } else {
+        append_char(writer, ':');
+    }
+    writer->after_key = true;
+}
+
+void json_writer_string(JsonWriter* writer, const char* value) {
+    if (!value) {
+        json_writer_null(writer);
+        return;
+    }
+    begin_value(writer);
+    append_escaped(writer, value);
+}
+
+void json_writer_integer(JsonWriter* writer, long long value) {
+    char   digits[24];
+    size_t length = 0;
+
+    begin_value(writer);
+    if (value < 0) {
+        append_char(writer, '-');
+        length = format_integer(digits, 0ULL - (unsigned long long)value);
+    } else {
+        length = format_integer(digits, (unsigned long long)value);
+    }
+    append(writer, digits, length);
+}
+
+void json_writer_bool(JsonWriter* writer, bool value) {
+    begin_value(writer);
+    if (value) {
+        append(writer, "true", 4);
+    } else {
+        append(writer, "false", 5);
+    }
+}
+
+void json_writer_null(JsonWriter* writer) {
+    begin_value(writer);
+    append(writer, "null", 4);
+}
+
+void json_writer_number(JsonWriter* writer, double value) {
+    if (!isfinite(value)) {
+        json_writer_null(writer); /* Not representable in JSON */
+        return;
+    }
+
+    char number[40];
+    begin_value(writer);
+    append(writer, number, format_double(number, value));
+}
+
+int json_writer_finish(JsonWriter* writer) {
+    if (!writer || writer->failed || writer->depth != 0 ||
+        writer->after_key || writer->size == writer->start) {
+        return -1;
+    }
+    return 0;
+}
+
+const char* json_writer_data(const JsonWriter* writer, size_t* length) {
+    if (length) {
+        *length = writer->buffer ? writer->size - writer->start : 0;
+    }
+    if (!writer->buffer) {
+        return NULL;
+    }
+    return (const char*)writer->buffer + writer->start;
+}
+
+uint8_t* json_writer_detach(JsonWriter* writer, size_t* size) {
+    if (!writer || writer->failed || ensure_capacity(writer, 1) != 0) {
+        return NULL;
+    }
+
+    writer->buffer[writer->size] = '\0';
+
+    uint8_t* buffer = writer->buffer;
+    if (size) {
+        *size = writer->size;
+    }
+
+    writer->buffer   = NULL;
+    writer->capacity = 0;
+    writer->size     = writer->start;
+    writer->failed   = true; /* Writing again requires json_writer_init */
+    return buffer;
+}
+
+void json_writer_dispose(JsonWriter* writer) {
+    if (!writer) {
+        return;
+    }
+    free(writer->buffer);
+    writer->buffer   = NULL;
+    writer->capacity = 0;
+    writer->size     = 0;
+}
+
+/* ============= Internal Functions Implementation ============= */
+
+static int ensure_capacity(JsonWriter* writer, size_t extra) {
+    if (writer->failed) {
+        return -1;
+    }
+    if (writer->size + extra <= writer->capacity) {
+        return 0;
+    }
+
+    size_t capacity = writer->capacity ? writer->capacity : 64;
+    while (writer->size + extra > capacity) {
+        capacity *= 2;
+    }
+
+    uint8_t* buffer = realloc(writer->buffer, capacity);
+    if (!buffer) {
+        writer->failed = true;
+        return -1;
+    }
+
+    writer->buffer   = buffer;
+    writer->capacity = capacity;
+    return 0;
+}
+
+static void append(JsonWriter* writer, const char* data, size_t length) {
+    if (ensure_capacity(writer, length) != 0) {
+        return;
+    }
+    memcpy(writer->buffer + writer->size, data, length);
+    writer->size += length;
+}
+
+static void append_char(JsonWriter* writer, char c) {
+    if (ensure_capacity(writer, 1) != 0) {
+        return;
+    }
+    writer->buffer[writer->size++] = (uint8_t)c;
+}
+
+static void append_indent(JsonWriter* writer) {
+    size_t spaces = (size_t)writer->depth * 2;
+    if (ensure_capacity(writer, spaces + 1) != 0) {
+        return;
+    }
+    writer->buffer[writer->size++] = '\n';
+    memset(writer->buffer + writer->size, ' ', spaces);
+    writer->size += spaces;
+}
+
+/* Emit the separator that goes in front of a value or member name */
+static void begin_value(JsonWriter* writer) {
+    if (writer->after_key) {
+        writer->after_key = false; /* Value of a member, separator written */
+        return;
+    }
+    if (writer->depth == 0) {
+        return;
+    }
+
+    bool* empty = &writer->empty[writer->depth - 1];
+    if (!*empty) {
+        append_char(writer, ',');
+    }
+    *empty = false;
+
+    if (writer->pretty) {
+        append_indent(writer);
+    }
+}
+
+static void begin_scope(JsonWriter* writer, char open) {
+    begin_value(writer);
+    if (writer->depth >= JSON_WRITER_MAX_DEPTH) {
+        writer->failed = true;
+        return;
+    }
+    append_char(writer, open);
+    writer->empty[writer->depth] = true;
+    writer->depth++;
+}
+
+static void end_scope(JsonWriter* writer, char close) {
+    if (writer->depth == 0) {
+        writer->failed = true;
+        return;
+    }
+    writer->depth--;
+    if (writer->pretty && !writer->empty[writer->depth]) {
+        append_indent(writer);
+    }
+    append_char(writer, close);
+}
+
+static void append_escaped(JsonWriter* writer, const char* value) {
+    static const char HEX[] = "0123456789abcdef";
+
+    append_char(writer, '"');
+
+    const char* run = value;
+    for (const char* p = value; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue; /* Copied in bulk with the rest of the run */
+        }
+
+        append(writer, run, (size_t)(p - run));
+        run = p + 1;
+
+        char   escape[6] = {'\\', 0, 0, 0, 0, 0};
+        size_t length    = 2;
+        switch (c) {
+        case '"':
+            escape[1] = '"';
+            break;
+        case '\\':
+            escape[1] = '\\';
+            break;
+        case '\b':
+            escape[1] = 'b';
+            break;
+        case '\f':
+            escape[1] = 'f';
+            break;
+        case '\n':
+            escape[1] = 'n';
+            break;
+        case '\r':
+            escape[1] = 'r';
+            break;
+        case '\t':
+            escape[1] = 't';
+            break;
+        default:
+            escape[1] = 'u';
+            escape[2] = '0';
+            escape[3] = '0';
+            escape[4] = HEX[c >> 4];
+            escape[5] = HEX[c & 0x0f];
+            length    = 6;
+            break;
+        }
+        append(writer, escape, length);
+    }
+
+    append(writer, run, strlen(run));
+    append_char(writer, '"');
+}
+
+static size_t format_integer(char* out, unsigned long long value) {
+    char   reversed[24];
+    size_t length = 0;
+
+    do {
+        reversed[length++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+
+    for (size_t i = 0; i < length; i++) {
+        out[i] = reversed[length - 1 - i];
+    }
+    return length;
+}
+
+/* Shortest round-trip formatting. Most values we emit (coordinates,
+ * temperatures, pressures) have few decimals, so first look for the
+ * smallest number of fraction digits whose decimal value maps back to the
+ * same double; only fall back to printf for everything else. */
+static size_t format_double(char* out, double value) {
+    if (fabs(value) < JSON_NUMBER_FAST_MAX) {
+        double scale = 1.0;
+        for (int digits = 0; digits <= JSON_NUMBER_FAST_DIGITS; digits++) {
+            double    scaled = value * scale;
+            long long mantissa =
+                (long long)(scaled < 0 ? scaled - 0.5 : scaled + 0.5);
+
+            /* Division by an exact power of ten is correctly rounded, just
+             * like parsing the decimal string, so equality means the
+             * printed value round-trips */
+            if ((double)mantissa / scale == value) {
+                size_t length = 0;
+                if (mantissa < 0 || (mantissa == 0 && signbit(value))) {
+                    out[length++] = '-';
+                }
+
+                char      digits_buffer[24];
+                long long magnitude = mantissa < 0 ? -mantissa : mantissa;
+                size_t    count =
+                    format_integer(digits_buffer, (unsigned long long)magnitude);
+
+                /* Pad so there is at least one digit before the point */
+                while (count <= (size_t)digits) {
+                    memmove(digits_buffer + 1, digits_buffer, count);
+                    digits_buffer[0] = '0';
+                    count++;
+                }
+
+                size_t integer_part = count - (size_t)digits;
+                memcpy(out + length, digits_buffer, integer_part);
+                length += integer_part;
+                out[length++] = '.';
+                if (digits == 0) {
+                    out[length++] = '0';
+                } else {
+                    memcpy(out + length, digits_buffer + integer_part,
+                           (size_t)digits);
+                    length += (size_t)digits;
+                }
+                out[length] = '\0';
+                return length;
+            }
+            scale *= 10.0;
+        }
+    }
+
+    int length = 0;
+    for (int precision = 15; precision <= 17; precision++) {
+        length = snprintf(out, 32, "%.*g", precision, value);
+        if (strtod(out, NULL) == value) {
+            break;
+        }
+    }
+
+    /* Keep the value a real, as jansson does */
+    if (!strpbrk(out, ".eE")) {
+        out[length++] = '.';
+        out[length++] = '0';
+        out[length]   = '\0';
+    }
+    return (size_t)length;
+}
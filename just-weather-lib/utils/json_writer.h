@@ -0,0 +1,102 @@
+/**
+ * json_writer.h - Streaming JSON writer
+ *
+ * Writes JSON text directly into a growable byte buffer without building a
+ * jansson tree first. The buffer can reserve head room in front of the JSON
+ * text so HTTP headers can be placed there once the body length is known,
+ * and then be handed to the connection as its write buffer without copying.
+ *
+ * Errors (allocation failure, too deep nesting) are sticky and reported by
+ * json_writer_finish(), so call sites can write a whole document without
+ * checking every call.
+ */
+
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef JSON_WRITER_MAX_DEPTH
+#    define JSON_WRITER_MAX_DEPTH 32
+#endif
+
+typedef struct {
+    uint8_t* buffer;
+    size_t   size;     /* Bytes used, including the head room */
+    size_t   capacity; /* Bytes allocated */
+    size_t   start;    /* Offset of the JSON text (size of the head room) */
+
+    bool pretty; /* Two-space indentation, same layout as JSON_INDENT(2) */
+    bool failed;
+    bool after_key;
+    int  depth;
+    bool empty[JSON_WRITER_MAX_DEPTH]; /* No member written yet per level */
+} JsonWriter;
+
+/**
+ * Initialize a writer
+ *
+ * @param writer Writer to initialize
+ * @param head_room Bytes reserved in front of the JSON text
+ * @param pretty Indent the output (opt-in, compact otherwise)
+ * @return 0 on success, -1 on allocation failure
+ */
+int json_writer_init(JsonWriter* writer, size_t head_room, bool pretty);
+
+/**
+ * Discard everything written so far, keeping the buffer and settings
+ */
+void json_writer_reset(JsonWriter* writer);
+
+void json_writer_begin_object(JsonWriter* writer);
+void json_writer_end_object(JsonWriter* writer);
+void json_writer_begin_array(JsonWriter* writer);
+void json_writer_end_array(JsonWriter* writer);
+
+/**
+ * Write an object member name; the next value call writes its value
+ */
+void json_writer_key(JsonWriter* writer, const char* key);
+
+void json_writer_string(JsonWriter* writer, const char* value);
+void json_writer_integer(JsonWriter* writer, long long value);
+void json_writer_bool(JsonWriter* writer, bool value);
+void json_writer_null(JsonWriter* writer);
+
+/**
+ * Write a real number using the shortest representation that round-trips.
+ * Integral values keep a ".0" suffix (as jansson does); NaN and infinity
+ * are written as null.
+ */
+void json_writer_number(JsonWriter* writer, double value);
+
+/**
+ * Check that the document is complete and no error occurred
+ *
+ * @return 0 on success, -1 on error or unbalanced nesting
+ */
+int json_writer_finish(JsonWriter* writer);
+
+/**
+ * Get the JSON text written so far (not NUL-terminated)
+ */
+const char* json_writer_data(const JsonWriter* writer, size_t* length);
+
+/**
+ * Take ownership of the buffer, head room included. The JSON text starts at
+ * writer->start and is followed by a NUL byte. The writer is left empty.
+ *
+ * @param writer Writer to detach from
+ * @param size Output total size in bytes (head room + JSON text)
+ * @return Buffer (caller must free), or NULL on error
+ */
+uint8_t* json_writer_detach(JsonWriter* writer, size_t* size);
+
+/**
+ * Free the buffer if it was not detached
+ */
+void json_writer_dispose(JsonWriter* writer);
+
+#endif /* JSON_WRITER_H */
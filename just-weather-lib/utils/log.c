@@ -0,0 +1,496 @@
+/**
+ * log.c - Implementation of asynchronous logging
+ */
+
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+#define LOG_WRITER_IDLE_MS 10
+#define LOG_OUTPUT_SIZE (64 * 1024)
+#define LOG_LINE_MAX (4 * LOG_MESSAGE_MAX + 256) /* Worst case escaping */
+#define LOG_RECORD_PADDING 0xFF
+
+/* Record in a ring, followed by the message bytes. The first 8 bytes are
+ * also the layout of a padding record that skips the tail of the ring. */
+typedef struct {
+    uint32_t    length; /* Record size including this header, 8-aligned */
+    uint8_t     level;  /* LogLevel, or LOG_RECORD_PADDING */
+    uint8_t     truncated;
+    uint16_t    reserved;
+    uint32_t    suppressed;
+    uint32_t    message_len;
+    uint64_t    timestamp_ns;
+    const char* module;
+} LogRecord;
+
+/* One per thread; the thread is the only producer, the writer thread the
+ * only consumer. A ring outlives its thread until the writer has written out
+ * what is left in it. Threads only push rings onto the list; only the
+ * writer unlinks them. */
+typedef struct LogRing {
+    _Alignas(64) uint8_t data[LOG_RING_SIZE];
+    _Atomic uint64_t head; /* Bytes ever written */
+    _Atomic uint64_t tail; /* Bytes ever consumed */
+    _Atomic uint64_t dropped;
+    _Atomic bool     dead; /* The thread exited, nothing more is written */
+    uint64_t         dropped_reported; /* Writer thread only */
+    uint32_t         thread_id;
+    struct LogRing*  next;
+} LogRing;
+
+typedef struct {
+    pthread_once_t    once;
+    pthread_t         writer;
+    bool              started;
+    _Atomic bool      running;
+    pthread_mutex_t   output_lock;
+    int               fd;
+    bool              own_fd;
+    _Atomic(LogRing*) rings;
+    _Atomic uint32_t  next_thread_id;
+    pthread_key_t     ring_key; /* Marks the ring dead as its thread exits */
+    bool              ring_key_ready;
+
+    /* Writer thread only */
+    char   output[LOG_OUTPUT_SIZE];
+    size_t output_len;
+    time_t cached_second;
+    char   cached_time[32];
+} LogService;
+
+_Atomic int g_log_level = LOG_LEVEL_INFO;
+
+static LogService g_log = {.once          = PTHREAD_ONCE_INIT,
+                           .output_lock   = PTHREAD_MUTEX_INITIALIZER,
+                           .fd            = STDERR_FILENO,
+                           .cached_second = -1};
+
+static _Thread_local LogRing* t_ring = NULL;
+
+static const char* const LEVEL_NAMES[] = {"trace", "debug", "info",
+                                          "warn",  "error", "off"};
+
+/* ============= Internal Functions ============= */
+
+static void     log_start(void);
+static void*    writer_thread(void* arg);
+static LogRing* current_ring(void);
+static void     ring_thread_exit(void* ring);
+static bool     unlink_ring(LogRing* previous, LogRing* ring);
+static bool     rate_limited(LogSite* site, uint64_t second,
+                             uint32_t* suppressed);
+static bool     drain_ring(LogRing* ring);
+static void     format_record(const LogRing* ring, const LogRecord* record);
+static void     append_text(const char* text, size_t length);
+static void     append_escaped(const char* text, size_t length);
+static void     append_timestamp(uint64_t timestamp_ns);
+static void     flush_output(void);
+
+/* ============= Public API Implementation ============= */
+
+int log_init(const char* path, LogLevel level) {
+    int fd = STDERR_FILENO;
+    if (path) {
+        fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&g_log.output_lock);
+    if (g_log.own_fd) {
+        close(g_log.fd);
+    }
+    g_log.fd     = fd;
+    g_log.own_fd = path != NULL;
+    pthread_mutex_unlock(&g_log.output_lock);
+
+    log_set_level(level);
+    pthread_once(&g_log.once, log_start);
+    return 0;
+}
+
+int log_init_from_env(void) {
+    int level = log_level_from_string(getenv("JUST_WEATHER_LOG_LEVEL"));
+    return log_init(getenv("JUST_WEATHER_LOG_FILE"),
+                    level >= 0 ? (LogLevel)level : LOG_LEVEL_INFO);
+}
+
+void log_set_level(LogLevel level) {
+    atomic_store_explicit(&g_log_level, (int)level, memory_order_relaxed);
+}
+
+int log_level_from_string(const char* name) {
+    if (!name) {
+        return -1;
+    }
+    for (int i = 0; i <= LOG_LEVEL_OFF; i++) {
+        if (strcasecmp(name, LEVEL_NAMES[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void log_write(LogLevel level, const char* module, LogSite* site,
+               const char* format, ...) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t timestamp_ns =
+        (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+
+    uint32_t suppressed = 0;
+    if (site && rate_limited(site, (uint64_t)now.tv_sec, &suppressed)) {
+        return;
+    }
+
+    char    message[LOG_MESSAGE_MAX];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    if (length < 0) {
+        return;
+    }
+
+    bool truncated = (size_t)length >= sizeof(message);
+    if (truncated) {
+        length = sizeof(message) - 1;
+    }
+
+    pthread_once(&g_log.once, log_start);
+
+    LogRing* ring = current_ring();
+    if (!ring) {
+        return;
+    }
+
+    size_t   needed = (sizeof(LogRecord) + (size_t)length + 7) & ~(size_t)7;
+    uint64_t head   = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail   = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    /* Records are contiguous; skip the end of the ring if it is too short */
+    size_t position   = head & LOG_RING_MASK;
+    size_t contiguous = LOG_RING_SIZE - position;
+    size_t padding    = contiguous < needed ? contiguous : 0;
+
+    if (LOG_RING_SIZE - (head - tail) < padding + needed) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    if (padding > 0) {
+        LogRecord* pad = (LogRecord*)(ring->data + position);
+        pad->length    = (uint32_t)padding;
+        pad->level     = LOG_RECORD_PADDING;
+        head += padding;
+        position = 0;
+    }
+
+    LogRecord* record    = (LogRecord*)(ring->data + position);
+    record->length       = (uint32_t)needed;
+    record->level        = (uint8_t)level;
+    record->truncated    = truncated;
+    record->reserved     = 0;
+    record->suppressed   = suppressed;
+    record->message_len  = (uint32_t)length;
+    record->timestamp_ns = timestamp_ns;
+    record->module       = module;
+    memcpy(record + 1, message, (size_t)length);
+
+    atomic_store_explicit(&ring->head, head + needed, memory_order_release);
+}
+
+void log_shutdown(void) {
+    if (!g_log.started) {
+        return;
+    }
+
+    atomic_store(&g_log.running, false);
+    pthread_join(g_log.writer, NULL);
+    g_log.started = false;
+
+    pthread_mutex_lock(&g_log.output_lock);
+    if (g_log.own_fd) {
+        close(g_log.fd);
+        g_log.fd     = STDERR_FILENO;
+        g_log.own_fd = false;
+    }
+    pthread_mutex_unlock(&g_log.output_lock);
+}
+
+/* ============= Internal Functions Implementation ============= */
+
+static void log_start(void) {
+    g_log.ring_key_ready =
+        pthread_key_create(&g_log.ring_key, ring_thread_exit) == 0;
+
+    atomic_store(&g_log.running, true);
+    if (pthread_create(&g_log.writer, NULL, writer_thread, NULL) != 0) {
+        atomic_store(&g_log.running, false);
+        return;
+    }
+
+    g_log.started = true;
+    atexit(log_shutdown);
+}
+
+static void* writer_thread(void* arg) {
+    (void)arg;
+
+    bool running = true;
+    while (running) {
+        running = atomic_load(&g_log.running);
+
+        bool     busy     = false;
+        LogRing* previous = NULL;
+        LogRing* ring     = atomic_load(&g_log.rings);
+        while (ring) {
+            LogRing* next = ring->next;
+
+            /* Checked first: once dead, this drain takes the last records */
+            bool dead = atomic_load_explicit(&ring->dead, memory_order_acquire);
+            busy |= drain_ring(ring);
+            if (dead && unlink_ring(previous, ring)) {
+                free(ring);
+            } else {
+                previous = ring;
+            }
+
+            ring = next;
+        }
+        flush_output();
+
+        if (!busy && running) {
+            struct timespec idle = {0, LOG_WRITER_IDLE_MS * 1000000L};
+            nanosleep(&idle, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+static LogRing* current_ring(void) {
+    if (t_ring) {
+        return t_ring;
+    }
+
+    LogRing* ring = calloc(1, sizeof(LogRing));
+    if (!ring) {
+        return NULL;
+    }
+    ring->thread_id = atomic_fetch_add(&g_log.next_thread_id, 1) + 1;
+
+    ring->next = atomic_load_explicit(&g_log.rings, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&g_log.rings, &ring->next,
+                                                  ring, memory_order_release,
+                                                  memory_order_relaxed)) {
+    }
+
+    t_ring = ring;
+    if (g_log.ring_key_ready) {
+        pthread_setspecific(g_log.ring_key, ring);
+    }
+    return ring;
+}
+
+/* Runs as a thread that logged exits. Logging again from a later destructor
+ * of the thread starts a new ring. */
+static void ring_thread_exit(void* ring) {
+    t_ring = NULL;
+    atomic_store_explicit(&((LogRing*)ring)->dead, true, memory_order_release);
+}
+
+/* Writer thread only. The head can only be unlinked while no thread is
+ * pushing a new one; otherwise it is left for the next pass. */
+static bool unlink_ring(LogRing* previous, LogRing* ring) {
+    if (previous) {
+        previous->next = ring->next;
+        return true;
+    }
+
+    LogRing* expected = ring;
+    return atomic_compare_exchange_strong(&g_log.rings, &expected, ring->next);
+}
+
+static bool rate_limited(LogSite* site, uint64_t second,
+                         uint32_t* suppressed) {
+    uint64_t window = atomic_load_explicit(&site->window, memory_order_relaxed);
+    if (window != second &&
+        atomic_compare_exchange_strong(&site->window, &window, second)) {
+        atomic_store_explicit(&site->count, 0, memory_order_relaxed);
+        *suppressed = atomic_exchange(&site->suppressed, 0);
+    }
+
+    if (atomic_fetch_add_explicit(&site->count, 1, memory_order_relaxed) >=
+        LOG_RATE_LIMIT) {
+        atomic_fetch_add_explicit(&site->suppressed, 1, memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+/* Returns true if there was anything to write */
+static bool drain_ring(LogRing* ring) {
+    uint64_t tail  = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head  = atomic_load_explicit(&ring->head, memory_order_acquire);
+    bool     drained = tail != head;
+
+    while (tail != head) {
+        const LogRecord* record =
+            (const LogRecord*)(ring->data + (tail & LOG_RING_MASK));
+        if (record->level != LOG_RECORD_PADDING) {
+            format_record(ring, record);
+        }
+        tail += record->length;
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    uint64_t dropped = atomic_load_explicit(&ring->dropped,
+                                            memory_order_relaxed);
+    if (dropped != ring->dropped_reported) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        append_timestamp((uint64_t)now.tv_sec * 1000000000ULL +
+                         (uint64_t)now.tv_nsec);
+
+        char line[160];
+        int  length = snprintf(
+            line, sizeof(line),
+            " level=warn module=log thread=%u msg=\"ring full\" dropped=%llu\n",
+            ring->thread_id,
+            (unsigned long long)(dropped - ring->dropped_reported));
+        append_text(line, (size_t)length);
+        ring->dropped_reported = dropped;
+    }
+
+    return drained;
+}
+
+static void format_record(const LogRing* ring, const LogRecord* record) {
+    if (g_log.output_len + LOG_LINE_MAX > sizeof(g_log.output)) {
+        flush_output();
+    }
+
+    append_timestamp(record->timestamp_ns);
+
+    char fields[128];
+    int  length = snprintf(fields, sizeof(fields),
+                           " level=%s module=%s thread=%u msg=",
+                           LEVEL_NAMES[record->level], record->module,
+                           ring->thread_id);
+    append_text(fields, (size_t)length);
+    append_escaped((const char*)(record + 1), record->message_len);
+
+    if (record->suppressed > 0) {
+        length = snprintf(fields, sizeof(fields), " suppressed=%u",
+                          record->suppressed);
+        append_text(fields, (size_t)length);
+    }
+    if (record->truncated) {
+        append_text(" truncated=true", 15);
+    }
+    append_text("\n", 1);
+}
+
+static void append_text(const char* text, size_t length) {
+    if (g_log.output_len + length > sizeof(g_log.output)) {
+        flush_output();
+    }
+    memcpy(g_log.output + g_log.output_len, text, length);
+    g_log.output_len += length;
+}
+
+/* Quote a value so no byte of it can end the field or the line */
+static void append_escaped(const char* text, size_t length) {
+    static const char HEX[] = "0123456789abcdef";
+
+    char* out = g_log.output + g_log.output_len;
+    *out++    = '"';
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)text[i];
+        switch (c) {
+        case '"':
+        case '\\':
+            *out++ = '\\';
+            *out++ = (char)c;
+            break;
+        case '\n':
+            *out++ = '\\';
+            *out++ = 'n';
+            break;
+        case '\r':
+            *out++ = '\\';
+            *out++ = 'r';
+            break;
+        case '\t':
+            *out++ = '\\';
+            *out++ = 't';
+            break;
+        default:
+            if (c < 0x20 || c == 0x7f) {
+                *out++ = '\\';
+                *out++ = 'x';
+                *out++ = HEX[c >> 4];
+                *out++ = HEX[c & 0x0f];
+            } else {
+                *out++ = (char)c;
+            }
+            break;
+        }
+    }
+    *out++ = '"';
+
+    g_log.output_len = (size_t)(out - g_log.output);
+}
+
+static void append_timestamp(uint64_t timestamp_ns) {
+    time_t second = (time_t)(timestamp_ns / 1000000000ULL);
+    if (second != g_log.cached_second) {
+        struct tm utc;
+        gmtime_r(&second, &utc);
+        strftime(g_log.cached_time, sizeof(g_log.cached_time),
+                 "%Y-%m-%dT%H:%M:%S", &utc);
+        g_log.cached_second = second;
+    }
+
+    char text[64];
+    int  length = snprintf(text, sizeof(text), "ts=%s.%06uZ", g_log.cached_time,
+                           (unsigned)(timestamp_ns % 1000000000ULL / 1000));
+    append_text(text, (size_t)length);
+}
+
+static void flush_output(void) {
+    if (g_log.output_len == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_log.output_lock);
+    size_t written = 0;
+    while (written < g_log.output_len) {
+        ssize_t result = write(g_log.fd, g_log.output + written,
+                               g_log.output_len - written);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break; /* Nowhere to report it; drop the batch */
+        }
+        written += (size_t)result;
+    }
+    pthread_mutex_unlock(&g_log.output_lock);
+
+    g_log.output_len = 0;
+}
@@ -0,0 +1,127 @@
+/**
+ * log.h - Asynchronous leveled logging
+ *
+ * Log calls format the message on the calling thread and append a binary
+ * record to a per-thread single-producer ring; no locks and no system calls
+ * on the logging path. A background writer thread drains all rings in
+ * batches and writes one logfmt line per record to stderr or a file:
+ *
+ *   ts=2026-01-01T12:00:00.123456Z level=info module=weather thread=1
+ *   msg="Handling /v1/weather request"
+ *
+ * The message is quoted and escaped (quotes, backslashes, control bytes as
+ * \xNN), so arbitrary message bytes can never break the line format.
+ *
+ * Levels below LOG_COMPILE_LEVEL are compiled out; the runtime level
+ * (log_set_level) filters the rest with a single relaxed load. Every call
+ * site is limited to LOG_RATE_LIMIT messages per second; the number of
+ * suppressed messages is reported on the next message from that site. A
+ * full ring drops messages and the writer reports how many.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+typedef enum {
+    LOG_LEVEL_TRACE,
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_OFF,
+} LogLevel;
+
+#ifndef LOG_COMPILE_LEVEL
+#    define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+/* Messages per call site per second */
+#ifndef LOG_RATE_LIMIT
+#    define LOG_RATE_LIMIT 20
+#endif
+
+/* Longest message; longer ones are truncated */
+#define LOG_MESSAGE_MAX 1024
+
+/* Bytes per thread ring, must be a power of two */
+#define LOG_RING_SIZE (64 * 1024)
+
+/* Rate limiting state of one call site */
+typedef struct {
+    _Atomic uint64_t window;     /* Second the count belongs to */
+    _Atomic uint32_t count;      /* Messages in the current window */
+    _Atomic uint32_t suppressed; /* Messages dropped since the last one */
+} LogSite;
+
+extern _Atomic int g_log_level;
+
+#define LOG_AT(level, module, ...)                                             \
+    do {                                                                       \
+        if ((level) >= LOG_COMPILE_LEVEL &&                                    \
+            (int)(level) >=                                                    \
+                atomic_load_explicit(&g_log_level, memory_order_relaxed)) {    \
+            static LogSite log_site_;                                          \
+            log_write((level), (module), &log_site_, __VA_ARGS__);             \
+        }                                                                      \
+    } while (0)
+
+#define LOG_TRACE(module, ...) LOG_AT(LOG_LEVEL_TRACE, module, __VA_ARGS__)
+#define LOG_DEBUG(module, ...) LOG_AT(LOG_LEVEL_DEBUG, module, __VA_ARGS__)
+#define LOG_INFO(module, ...) LOG_AT(LOG_LEVEL_INFO, module, __VA_ARGS__)
+#define LOG_WARN(module, ...) LOG_AT(LOG_LEVEL_WARN, module, __VA_ARGS__)
+#define LOG_ERROR(module, ...) LOG_AT(LOG_LEVEL_ERROR, module, __VA_ARGS__)
+
+/**
+ * Configure the output and level
+ *
+ * Optional: without it the first message starts logging to stderr at INFO.
+ *
+ * @param path File to append to, or NULL for stderr
+ * @param level Runtime level
+ * @return 0 on success, -1 if the file cannot be opened
+ */
+int log_init(const char* path, LogLevel level);
+
+/**
+ * Configure from JUST_WEATHER_LOG_FILE (default stderr) and
+ * JUST_WEATHER_LOG_LEVEL (default info)
+ *
+ * @return 0 on success, -1 if the file cannot be opened
+ */
+int log_init_from_env(void);
+
+/**
+ * Change the runtime level
+ */
+void log_set_level(LogLevel level);
+
+/**
+ * Parse "trace", "debug", "info", "warn", "error" or "off"
+ *
+ * @return Level, or -1 if unknown
+ */
+int log_level_from_string(const char* name);
+
+/**
+ * Append a message to the calling thread's ring. Use the LOG_* macros.
+ *
+ * @param level Message level
+ * @param module Module name (must be a string literal)
+ * @param site Call site state
+ * @param format printf format of the message
+ */
+void log_write(LogLevel level, const char* module, LogSite* site,
+               const char* format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+/**
+ * Write out everything logged so far and stop the writer thread
+ *
+ * Registered with atexit when logging starts.
+ */
+void log_shutdown(void);
+
+#endif /* LOG_H */
@@ -0,0 +1,359 @@
+/**
+ * metrics.c - Implementation of the metrics registry
+ */
+
+#include "metrics.h"
+
+#include "log.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+    MetricType      type;
+    char            name[METRICS_NAME_MAX];
+    char            labels[METRICS_LABELS_MAX];
+    const char*     help;
+    uint32_t        slot;  /* First value slot in every shard */
+    _Atomic int64_t gauge; /* Gauges live here instead of in the shards */
+} MetricDescriptor;
+
+static const char* const METRIC_TYPE_NAMES[] = {"counter", "gauge",
+                                                "histogram"};
+
+/* Histogram slot layout: buckets, then the sum. The count is the sum of the
+ * buckets, which keeps it consistent with them within a scrape. */
+#define HISTOGRAM_SLOTS (METRICS_HISTOGRAM_BUCKETS + 1)
+
+typedef struct MetricsShard {
+    _Atomic uint64_t     values[METRICS_MAX_SLOTS];
+    struct MetricsShard* next;
+} MetricsShard;
+
+typedef struct {
+    char*  data;
+    size_t size;
+    size_t capacity;
+    bool   failed;
+} RenderBuffer;
+
+static MetricDescriptor g_metrics[METRICS_MAX];
+static _Atomic int      g_metric_count = 0; /* Published descriptors */
+static uint32_t         g_next_slot    = 0;
+static pthread_mutex_t  g_register_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Shards are pushed once per thread and never freed, so a scrape can still
+ * read the counts of threads that have exited */
+static _Atomic(MetricsShard*)      g_shards = NULL;
+static _Thread_local MetricsShard* t_shard  = NULL;
+
+/* ============= Internal Functions ============= */
+
+static MetricsShard* current_shard(void);
+static void          shard_add(uint32_t slot, uint64_t value);
+static uint32_t      histogram_bucket(uint64_t micros);
+static uint64_t      merged_value(uint32_t slot);
+static void          render_append(RenderBuffer* buffer, const char* format,
+                                   ...);
+static void          render_series(RenderBuffer*           buffer,
+                                   const MetricDescriptor* metric);
+
+/* ============= Public API Implementation ============= */
+
+MetricId metrics_register(MetricType type, const char* name,
+                          const char* labels, const char* help) {
+    if (!name || strlen(name) >= METRICS_NAME_MAX) {
+        return -1;
+    }
+    if (!labels) {
+        labels = "";
+    }
+    if (strlen(labels) >= METRICS_LABELS_MAX) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&g_register_lock);
+
+    int count = atomic_load_explicit(&g_metric_count, memory_order_relaxed);
+    for (int i = 0; i < count; i++) {
+        if (strcmp(g_metrics[i].name, name) == 0 &&
+            strcmp(g_metrics[i].labels, labels) == 0) {
+            pthread_mutex_unlock(&g_register_lock);
+            return g_metrics[i].type == type ? i : -1;
+        }
+    }
+
+    uint32_t slots = 0;
+    if (type == METRIC_COUNTER) {
+        slots = 1;
+    } else if (type == METRIC_HISTOGRAM) {
+        slots = HISTOGRAM_SLOTS;
+    }
+
+    if (count >= METRICS_MAX || g_next_slot + slots > METRICS_MAX_SLOTS) {
+        pthread_mutex_unlock(&g_register_lock);
+        LOG_WARN("metrics", "Registry full, dropping %s{%s}", name, labels);
+        return -1;
+    }
+
+    MetricDescriptor* metric = &g_metrics[count];
+    metric->type             = type;
+    metric->help             = help ? help : "";
+    metric->slot             = g_next_slot;
+    snprintf(metric->name, sizeof(metric->name), "%s", name);
+    snprintf(metric->labels, sizeof(metric->labels), "%s", labels);
+    atomic_store_explicit(&metric->gauge, 0, memory_order_relaxed);
+    g_next_slot += slots;
+
+    /* Publish only after the descriptor is complete */
+    atomic_store_explicit(&g_metric_count, count + 1, memory_order_release);
+
+    pthread_mutex_unlock(&g_register_lock);
+    return count;
+}
+
+void metrics_add(MetricId id, uint64_t value) {
+    if (id < 0) {
+        return;
+    }
+    shard_add(g_metrics[id].slot, value);
+}
+
+void metrics_inc(MetricId id) { metrics_add(id, 1); }
+
+void metrics_gauge_set(MetricId id, int64_t value) {
+    if (id < 0) {
+        return;
+    }
+    atomic_store_explicit(&g_metrics[id].gauge, value, memory_order_relaxed);
+}
+
+void metrics_gauge_add(MetricId id, int64_t delta) {
+    if (id < 0) {
+        return;
+    }
+    atomic_fetch_add_explicit(&g_metrics[id].gauge, delta,
+                              memory_order_relaxed);
+}
+
+void metrics_observe(MetricId id, uint64_t micros) {
+    if (id < 0) {
+        return;
+    }
+
+    /* Bucketed by micros - 1, so each bucket covers (lower, upper] and a
+     * value on an exported bound counts towards that bound's le */
+    uint32_t slot = g_metrics[id].slot;
+    shard_add(slot + histogram_bucket(micros > 0 ? micros - 1 : 0), 1);
+    shard_add(slot + METRICS_HISTOGRAM_BUCKETS, micros);
+}
+
+uint64_t metrics_now_us(void) {
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return (uint64_t)spec.tv_sec * 1000000 + (uint64_t)spec.tv_nsec / 1000;
+}
+
+int metrics_render(char** output, size_t* output_len) {
+    if (!output || !output_len) {
+        return -1;
+    }
+
+    RenderBuffer buffer = {0};
+    int count = atomic_load_explicit(&g_metric_count, memory_order_acquire);
+
+    render_append(&buffer, "%s", ""); /* Valid output even when empty */
+
+    /* The text format wants all series of a metric grouped under one
+     * HELP/TYPE header, while registration order interleaves them */
+    for (int i = 0; i < count; i++) {
+        bool seen = false;
+        for (int j = 0; j < i && !seen; j++) {
+            seen = strcmp(g_metrics[j].name, g_metrics[i].name) == 0;
+        }
+        if (seen) {
+            continue;
+        }
+
+        render_append(&buffer, "# HELP %s %s\n# TYPE %s %s\n",
+                      g_metrics[i].name, g_metrics[i].help, g_metrics[i].name,
+                      METRIC_TYPE_NAMES[g_metrics[i].type]);
+
+        for (int j = i; j < count; j++) {
+            if (strcmp(g_metrics[j].name, g_metrics[i].name) == 0) {
+                render_series(&buffer, &g_metrics[j]);
+            }
+        }
+    }
+
+    if (buffer.failed || !buffer.data) {
+        free(buffer.data);
+        return -1;
+    }
+
+    *output     = buffer.data;
+    *output_len = buffer.size;
+    return 0;
+}
+
+/* ============= Internal Functions Implementation ============= */
+
+static MetricsShard* current_shard(void) {
+    if (t_shard) {
+        return t_shard;
+    }
+
+    MetricsShard* shard = calloc(1, sizeof(MetricsShard));
+    if (!shard) {
+        return NULL;
+    }
+
+    shard->next = atomic_load_explicit(&g_shards, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&g_shards, &shard->next,
+                                                  shard, memory_order_release,
+                                                  memory_order_relaxed)) {
+    }
+
+    t_shard = shard;
+    return shard;
+}
+
+/* Only the owning thread writes its shard, so a plain load and store is
+ * enough; the atomics just keep concurrent scrapes well-defined */
+static void shard_add(uint32_t slot, uint64_t value) {
+    MetricsShard* shard = current_shard();
+    if (!shard) {
+        return;
+    }
+
+    _Atomic uint64_t* cell = &shard->values[slot];
+    atomic_store_explicit(
+        cell, atomic_load_explicit(cell, memory_order_relaxed) + value,
+        memory_order_relaxed);
+}
+
+static uint32_t histogram_bucket(uint64_t micros) {
+    const uint32_t sub_count = 1u << METRICS_HISTOGRAM_SUB_BITS;
+    if (micros < sub_count) {
+        return (uint32_t)micros;
+    }
+
+    uint32_t exponent = 63 - (uint32_t)__builtin_clzll(micros);
+    if (exponent > METRICS_HISTOGRAM_MAX_EXPONENT) {
+        return METRICS_HISTOGRAM_BUCKETS - 1;
+    }
+
+    uint32_t shift = exponent - METRICS_HISTOGRAM_SUB_BITS;
+    uint32_t sub   = (uint32_t)(micros >> shift) & (sub_count - 1);
+    return ((shift + 1) << METRICS_HISTOGRAM_SUB_BITS) + sub;
+}
+
+static uint64_t merged_value(uint32_t slot) {
+    uint64_t total = 0;
+    for (MetricsShard* shard =
+             atomic_load_explicit(&g_shards, memory_order_acquire);
+         shard; shard = shard->next) {
+        total += atomic_load_explicit(&shard->values[slot],
+                                      memory_order_relaxed);
+    }
+    return total;
+}
+
+static void render_append(RenderBuffer* buffer, const char* format, ...) {
+    if (buffer->failed) {
+        return;
+    }
+
+    for (;;) {
+        size_t  available = buffer->capacity - buffer->size;
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(buffer->data ? buffer->data + buffer->size
+                                            : NULL,
+                               available, format, args);
+        va_end(args);
+
+        if (length < 0) {
+            buffer->failed = true;
+            return;
+        }
+        if ((size_t)length < available) {
+            buffer->size += (size_t)length;
+            return;
+        }
+
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        while (capacity - buffer->size <= (size_t)length) {
+            capacity *= 2;
+        }
+        char* data = realloc(buffer->data, capacity);
+        if (!data) {
+            buffer->failed = true;
+            return;
+        }
+        buffer->data     = data;
+        buffer->capacity = capacity;
+    }
+}
+
+static void render_series(RenderBuffer*           buffer,
+                          const MetricDescriptor* metric) {
+    const char* open  = metric->labels[0] ? "{" : "";
+    const char* close = metric->labels[0] ? "}" : "";
+
+    if (metric->type == METRIC_COUNTER) {
+        render_append(buffer, "%s%s%s%s %llu\n", metric->name, open,
+                      metric->labels, close,
+                      (unsigned long long)merged_value(metric->slot));
+        return;
+    }
+
+    if (metric->type == METRIC_GAUGE) {
+        render_append(
+            buffer, "%s%s%s%s %lld\n", metric->name, open, metric->labels,
+            close,
+            (long long)atomic_load_explicit(&metric->gauge,
+                                            memory_order_relaxed));
+        return;
+    }
+
+    uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        buckets[i] = merged_value(metric->slot + i);
+        count += buckets[i];
+    }
+    uint64_t sum = merged_value(metric->slot + METRICS_HISTOGRAM_BUCKETS);
+
+    /* Export one bucket per power of two; the finer HDR buckets are summed
+     * into them. Buckets below histogram_bucket(bound) hold exactly the
+     * values <= bound, as le requires. */
+    const char* separator  = metric->labels[0] ? "," : "";
+    uint64_t    cumulative = 0;
+    uint32_t    bucket     = 0;
+    for (uint32_t power = 0; power <= METRICS_HISTOGRAM_MAX_EXPONENT + 1;
+         power++) {
+        uint64_t bound = 1ULL << power;
+        uint32_t limit = power <= METRICS_HISTOGRAM_MAX_EXPONENT
+                             ? histogram_bucket(bound)
+                             : METRICS_HISTOGRAM_BUCKETS;
+        while (bucket < limit) {
+            cumulative += buckets[bucket++];
+        }
+        render_append(buffer, "%s_bucket{%s%sle=\"%g\"} %llu\n", metric->name,
+                      metric->labels, separator, (double)bound / 1e6,
+                      (unsigned long long)cumulative);
+    }
+    render_append(buffer, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", metric->name,
+                  metric->labels, separator, (unsigned long long)count);
+    render_append(buffer, "%s_sum%s%s%s %.6f\n", metric->name, open,
+                  metric->labels, close, (double)sum / 1e6);
+    render_append(buffer, "%s_count%s%s%s %llu\n", metric->name, open,
+                  metric->labels, close, (unsigned long long)count);
+}
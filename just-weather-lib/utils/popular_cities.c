@@ -4,12 +4,55 @@
 
 #include "popular_cities.h"
 
+#include "linked_list.h"
+#include "log.h"
+#include "smw.h"
+
 #include <ctype.h>
 #include <jansson.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/stat.h>
+
+/* How often the published mode checks the files for changes */
+#define POPULAR_CITIES_WATCH_INTERVAL_MS 2000
+
+/* State of the published (background loaded) database */
+typedef struct {
+    char*  hot_file;
+    char*  full_file;
+    void** mirror;
+
+    _Atomic(PopularCitiesDB*) current;
+
+    /* Replaced versions waiting for a quiescent point of the smw loop */
+    LinkedList*     retired;
+    pthread_mutex_t retired_lock;
+
+    /* One loader thread for the life of the service, woken for each load.
+     * A load wanted while one runs follows right after it. */
+    pthread_t       loader;
+    bool            loader_started;
+    pthread_mutex_t load_lock;
+    pthread_cond_t  load_wake;
+    bool            load_wanted; /* Under load_lock */
+    bool            stopping;    /* Under load_lock */
+    atomic_bool     reload_requested;
+
+    SmwTask*        task;
+    uint64_t        next_watch;
+    struct timespec hot_mtime;
+    struct timespec full_mtime;
+} PopularCitiesService;
+
+static PopularCitiesService g_service = {
+    .retired_lock = PTHREAD_MUTEX_INITIALIZER,
+    .load_lock    = PTHREAD_MUTEX_INITIALIZER,
+    .load_wake    = PTHREAD_COND_INITIALIZER};
 
 /* ============= Internal Functions ============= */
 
@@ -17,13 +60,19 @@ static int  load_cities_from_json(const char* filepath, PopularCity** cities,
                                   size_t* count);
 static void normalize_query(const char* input, char* output,
                             size_t output_size);
+static PopularCitiesDB* build_version(bool with_full);
+static void             publish_version(PopularCitiesDB* db);
+static void*            loader_thread(void* arg);
+static int              start_loader(void);
+static bool             files_changed(void);
+static void popular_cities_task_work(void* context, uint64_t mon_time);
 
 /* ============= Public API Implementation ============= */
 
 int popular_cities_load(const char* hot_file, const char* full_file,
                         PopularCitiesDB** db) {
     if (!hot_file || !full_file || !db) {
-        fprintf(stderr, "[POPULAR_CITIES] Invalid parameters\n");
+        LOG_ERROR("popular_cities", "Invalid parameters");
         return -1;
     }
 
@@ -31,23 +80,23 @@ int popular_cities_load(const char* hot_file, const char* full_file,
     PopularCitiesDB* database =
         (PopularCitiesDB*)calloc(1, sizeof(PopularCitiesDB));
     if (!database) {
-        fprintf(stderr, "[POPULAR_CITIES] Failed to allocate database\n");
+        LOG_ERROR("popular_cities", "Failed to allocate database");
         return -2;
     }
 
     /* Load hot cities (immediately) */
-    printf("[POPULAR_CITIES] Loading hot cities from: %s\n", hot_file);
+    LOG_INFO("popular_cities", "Loading hot cities from: %s", hot_file);
 
     int result = load_cities_from_json(hot_file, &database->hot_cities,
                                        &database->hot_count);
 
     if (result != 0) {
-        fprintf(stderr, "[POPULAR_CITIES] Failed to load hot cities\n");
+        LOG_ERROR("popular_cities", "Failed to load hot cities");
         free(database);
         return -3;
     }
 
-    printf("[POPULAR_CITIES] Loaded %zu hot cities\n", database->hot_count);
+    LOG_INFO("popular_cities", "Loaded %zu hot cities", database->hot_count);
 
     /* Save full database path for lazy loading */
     database->full_db_path = strdup(full_file);
@@ -98,19 +147,18 @@ int popular_cities_search(PopularCitiesDB* db, const char* query,
 
     /* Lazy load full database if needed */
     if (!db->full_loaded && db->full_db_path) {
-        printf("[POPULAR_CITIES] Lazy loading full database from: %s\n",
-               db->full_db_path);
+        LOG_INFO("popular_cities", "Lazy loading full database from: %s",
+                 db->full_db_path);
 
         int result = load_cities_from_json(db->full_db_path, &db->full_cities,
                                            &db->full_count);
 
         if (result == 0) {
             db->full_loaded = true;
-            printf("[POPULAR_CITIES] Loaded %zu cities from full database\n",
-                   db->full_count);
+            LOG_INFO("popular_cities", "Loaded %zu cities from full database",
+                     db->full_count);
         } else {
-            fprintf(stderr,
-                    "[POPULAR_CITIES] Failed to lazy load full database\n");
+            LOG_WARN("popular_cities", "Failed to lazy load full database");
             return 0; /* Return empty results instead of error */
         }
     }
@@ -159,7 +207,116 @@ void popular_cities_free(PopularCitiesDB* db) {
     /* Free database structure */
     free(db);
 
-    printf("[POPULAR_CITIES] Database freed\n");
+    LOG_INFO("popular_cities", "Database freed");
+}
+
+/* ============= Published Mode ============= */
+
+int popular_cities_start(const char* hot_file, const char* full_file,
+                         void** mirror) {
+    if (!hot_file || !full_file) {
+        LOG_ERROR("popular_cities", "Invalid parameters");
+        return -1;
+    }
+
+    if (g_service.task) {
+        return 0; /* Already started */
+    }
+
+    g_service.hot_file  = strdup(hot_file);
+    g_service.full_file = strdup(full_file);
+    g_service.retired   = linked_list_create();
+    if (!g_service.hot_file || !g_service.full_file || !g_service.retired) {
+        popular_cities_stop();
+        return -2;
+    }
+
+    g_service.mirror = mirror;
+    atomic_store(&g_service.current, NULL);
+    atomic_store(&g_service.reload_requested, false);
+    g_service.next_watch = 0;
+
+    /* Remember the current modification times so the first watch tick does
+     * not trigger a redundant reload */
+    files_changed();
+
+    /* Watching the files and freeing old versions can wait for a quiet pass */
+    g_service.task = smw_create_task_with_priority(
+        NULL, popular_cities_task_work, SMW_PRIORITY_BACKGROUND);
+    if (!g_service.task) {
+        popular_cities_stop();
+        return -3;
+    }
+
+    if (start_loader() != 0) {
+        popular_cities_stop();
+        return -4;
+    }
+
+    return 0;
+}
+
+PopularCitiesDB* popular_cities_current(void) {
+    return atomic_load_explicit(&g_service.current, memory_order_acquire);
+}
+
+PopularCitiesDB* popular_cities_acquire(void) {
+    PopularCitiesDB* db = popular_cities_current();
+    if (db) {
+        db->readers++;
+    }
+    return db;
+}
+
+void popular_cities_release(PopularCitiesDB* db) {
+    if (db && db->readers > 0) {
+        db->readers--;
+    }
+}
+
+void popular_cities_request_reload(void) {
+    atomic_store(&g_service.reload_requested, true);
+}
+
+void popular_cities_stop(void) {
+    if (g_service.loader_started) {
+        /* A load in progress finishes first */
+        pthread_mutex_lock(&g_service.load_lock);
+        g_service.stopping = true;
+        pthread_cond_signal(&g_service.load_wake);
+        pthread_mutex_unlock(&g_service.load_lock);
+
+        pthread_join(g_service.loader, NULL);
+        g_service.loader_started = false;
+        g_service.stopping       = false;
+        g_service.load_wanted    = false;
+    }
+
+    if (g_service.task) {
+        smw_destroy_task(g_service.task);
+        g_service.task = NULL;
+    }
+
+    if (g_service.mirror) {
+        *g_service.mirror = NULL;
+        g_service.mirror  = NULL;
+    }
+
+    PopularCitiesDB* current = atomic_exchange(&g_service.current, NULL);
+    if (current) {
+        popular_cities_free(current);
+    }
+
+    if (g_service.retired) {
+        linked_list_dispose(&g_service.retired,
+                            (void (*)(void*))popular_cities_free);
+    }
+
+    free(g_service.hot_file);
+    g_service.hot_file = NULL;
+
+    free(g_service.full_file);
+    g_service.full_file = NULL;
 }
 
 /* ============= Internal Functions Implementation ============= */
@@ -175,7 +332,7 @@ static int load_cities_from_json(const char* filepath, PopularCity** cities,
     json_t*      root = json_load_file(filepath, 0, &error);
 
     if (!root) {
-        fprintf(stderr, "[POPULAR_CITIES] JSON load error: %s\n", error.text);
+        LOG_ERROR("popular_cities", "JSON load error: %s", error.text);
         return -2;
     }
 
@@ -183,9 +340,8 @@ static int load_cities_from_json(const char* filepath, PopularCity** cities,
     json_t* cities_array = json_object_get(root, "cities");
 
     if (!cities_array || !json_is_array(cities_array)) {
-        fprintf(
-            stderr,
-            "[POPULAR_CITIES] Invalid JSON format: missing 'cities' array\n");
+        LOG_ERROR("popular_cities",
+                  "Invalid JSON format: missing 'cities' array");
         json_decref(root);
         return -3;
     }
@@ -193,7 +349,7 @@ static int load_cities_from_json(const char* filepath, PopularCity** cities,
     size_t num_cities = json_array_size(cities_array);
 
     if (num_cities == 0) {
-        fprintf(stderr, "[POPULAR_CITIES] Empty cities array\n");
+        LOG_ERROR("popular_cities", "Empty cities array");
         json_decref(root);
         return -4;
     }
@@ -203,7 +359,7 @@ static int load_cities_from_json(const char* filepath, PopularCity** cities,
         (PopularCity*)calloc(num_cities, sizeof(PopularCity));
 
     if (!city_list) {
-        fprintf(stderr, "[POPULAR_CITIES] Failed to allocate cities array\n");
+        LOG_ERROR("popular_cities", "Failed to allocate cities array");
         json_decref(root);
         return -5;
     }
@@ -293,3 +449,167 @@ static void normalize_query(const char* input, char* output,
 
     output[j] = '\0';
 }
+
+/* Build an immutable version. Published versions never lazy-load, so the
+ * full database is either loaded here or not searched at all. */
+static PopularCitiesDB* build_version(bool with_full) {
+    PopularCitiesDB* database =
+        (PopularCitiesDB*)calloc(1, sizeof(PopularCitiesDB));
+    if (!database) {
+        return NULL;
+    }
+
+    if (load_cities_from_json(g_service.hot_file, &database->hot_cities,
+                              &database->hot_count) != 0) {
+        LOG_ERROR("popular_cities", "Failed to load hot cities");
+        free(database);
+        return NULL;
+    }
+
+    if (with_full) {
+        if (load_cities_from_json(g_service.full_file, &database->full_cities,
+                                  &database->full_count) == 0) {
+            database->full_loaded = true;
+        } else {
+            LOG_WARN("popular_cities", "Failed to load full database, "
+                     "publishing hot cities only");
+        }
+    }
+
+    return database;
+}
+
+/* Swap in a new version; the old one is reclaimed by the smw task */
+static void publish_version(PopularCitiesDB* db) {
+    PopularCitiesDB* old = atomic_exchange_explicit(&g_service.current, db,
+                                                    memory_order_acq_rel);
+    if (!old) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_service.retired_lock);
+    if (linked_list_append(g_service.retired, old) != 0) {
+        LOG_ERROR("popular_cities", "Failed to retire old version");
+    }
+    pthread_mutex_unlock(&g_service.retired_lock);
+}
+
+static void* loader_thread(void* arg) {
+    (void)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&g_service.load_lock);
+        while (!g_service.load_wanted && !g_service.stopping) {
+            pthread_cond_wait(&g_service.load_wake, &g_service.load_lock);
+        }
+        bool stopping         = g_service.stopping;
+        g_service.load_wanted = false;
+        pthread_mutex_unlock(&g_service.load_lock);
+
+        if (stopping) {
+            return NULL;
+        }
+
+        /* On the first load, publish the hot cities as soon as they are
+         * ready instead of waiting for the (much larger) full database */
+        if (!popular_cities_current()) {
+            PopularCitiesDB* hot_only = build_version(false);
+            if (hot_only) {
+                publish_version(hot_only);
+                LOG_INFO("popular_cities", "Published %zu hot cities",
+                         hot_only->hot_count);
+            }
+        }
+
+        PopularCitiesDB* full = build_version(true);
+        if (full) {
+            publish_version(full);
+            LOG_INFO("popular_cities", "Published %zu hot + %zu full cities",
+                     full->hot_count, full->full_count);
+        }
+    }
+}
+
+/* Wake the loader, starting it on first use */
+static int start_loader(void) {
+    if (!g_service.loader_started) {
+        if (pthread_create(&g_service.loader, NULL, loader_thread, NULL) !=
+            0) {
+            LOG_ERROR("popular_cities", "Failed to start loader thread");
+            return -1;
+        }
+        g_service.loader_started = true;
+    }
+
+    pthread_mutex_lock(&g_service.load_lock);
+    g_service.load_wanted = true;
+    pthread_cond_signal(&g_service.load_wake);
+    pthread_mutex_unlock(&g_service.load_lock);
+    return 0;
+}
+
+static bool timespec_equal(const struct timespec* a,
+                           const struct timespec* b) {
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/* Compare the files' modification times with the last seen ones */
+static bool files_changed(void) {
+    struct stat     st;
+    struct timespec hot_mtime  = {0};
+    struct timespec full_mtime = {0};
+
+    if (stat(g_service.hot_file, &st) == 0) {
+        hot_mtime = st.st_mtim;
+    }
+    if (stat(g_service.full_file, &st) == 0) {
+        full_mtime = st.st_mtim;
+    }
+
+    bool changed = !timespec_equal(&hot_mtime, &g_service.hot_mtime) ||
+                   !timespec_equal(&full_mtime, &g_service.full_mtime);
+
+    g_service.hot_mtime  = hot_mtime;
+    g_service.full_mtime = full_mtime;
+
+    return changed;
+}
+
+/* Runs on the smw thread between callbacks, which is a quiescent point for
+ * every reader: no callback can still hold a pointer obtained from
+ * popular_cities_current() before the last swap. Versions taken with
+ * popular_cities_acquire wait for their last release. */
+static void popular_cities_task_work(void* context, uint64_t mon_time) {
+    (void)context;
+
+    PopularCitiesDB* current = popular_cities_current();
+    if (g_service.mirror && *g_service.mirror != current) {
+        *g_service.mirror = current;
+    }
+
+    pthread_mutex_lock(&g_service.retired_lock);
+    Node* node = g_service.retired->head;
+    while (node) {
+        Node* next = node->front;
+        if (((PopularCitiesDB*)node->item)->readers == 0) {
+            linked_list_remove(g_service.retired, node,
+                               (void (*)(void*))popular_cities_free);
+        }
+        node = next;
+    }
+    pthread_mutex_unlock(&g_service.retired_lock);
+
+    bool reload = atomic_exchange(&g_service.reload_requested, false);
+
+    if (mon_time >= g_service.next_watch) {
+        g_service.next_watch = mon_time + POPULAR_CITIES_WATCH_INTERVAL_MS;
+        if (files_changed()) {
+            LOG_INFO("popular_cities", "City files changed, reloading");
+            reload = true;
+        }
+    }
+
+    if (reload) {
+        start_loader();
+    }
+}
@@ -4,6 +4,12 @@
  * Implements dual-file strategy:
  * - Hot cache: Top 100-1000 cities loaded in RAM at startup
  * - Full database: All cities lazy-loaded from disk when needed
+ *
+ * The server uses the published mode (popular_cities_start): both files are
+ * loaded on a background thread and each finished version is published with
+ * an atomic pointer swap. Published versions are immutable; a replaced version
+ * is reclaimed RCU-style once the smw loop has passed a quiescent point, so
+ * readers on the smw thread never block and never see a freed database.
  */
 
 #ifndef POPULAR_CITIES_H
@@ -31,6 +37,8 @@ typedef struct {
     PopularCity* full_cities;  /* NULL until lazy-loaded */
     size_t       full_count;
     bool         full_loaded;
+
+    int readers; /* References from popular_cities_acquire */
 } PopularCitiesDB;
 
 /**
@@ -58,6 +66,62 @@ int popular_cities_search(PopularCitiesDB* db, const char* query,
                           PopularCity** results, size_t* count,
                           size_t max_results);
 
+/**
+ * Start loading the database on a background thread (published mode)
+ *
+ * Returns immediately. Until the first version is published,
+ * popular_cities_current() returns NULL and callers should fall back to the
+ * API. The files are reloaded on popular_cities_request_reload() or when their
+ * modification time changes.
+ *
+ * @param hot_file Path to hot_cities.json
+ * @param full_file Path to all_cities.json
+ * @param mirror Optional legacy pointer kept equal to the published version;
+ * it is only updated on the smw thread, before the old version is reclaimed
+ * @return 0 on success, negative on error
+ */
+int popular_cities_start(const char* hot_file, const char* full_file,
+                         void** mirror);
+
+/**
+ * Get the currently published database
+ *
+ * The returned pointer stays valid until the calling smw callback returns.
+ * Must only be used from the smw thread.
+ *
+ * @return Database instance, or NULL while the first load is in progress
+ */
+PopularCitiesDB* popular_cities_current(void);
+
+/**
+ * Get the currently published database and keep it alive past the current
+ * smw callback, e.g. while a response streams it. A version replaced
+ * meanwhile is only reclaimed after popular_cities_release.
+ * Must only be used from the smw thread.
+ *
+ * @return Database instance, or NULL while the first load is in progress
+ */
+PopularCitiesDB* popular_cities_acquire(void);
+
+/**
+ * Drop a reference taken with popular_cities_acquire
+ *
+ * @param db Database instance (can be NULL)
+ */
+void popular_cities_release(PopularCitiesDB* db);
+
+/**
+ * Request a reload of the published database
+ *
+ * Async-signal-safe, intended to be called from a SIGHUP handler.
+ */
+void popular_cities_request_reload(void);
+
+/**
+ * Stop published mode: wait for a running load and free all versions
+ */
+void popular_cities_stop(void);
+
 /**
  * Free database resources
  *
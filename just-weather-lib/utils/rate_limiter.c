@@ -0,0 +1,446 @@
+/**
+ * rate_limiter.c - Implementation of the per-client rate limiter
+ */
+
+#include "rate_limiter.h"
+
+#include "log.h"
+#include "metrics.h"
+
+#include <math.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Fill limit of the table; past it new clients are not tracked */
+#define RATE_LIMITER_MAX_LOAD (RATE_LIMITER_CAPACITY / 4 * 3)
+#define RATE_LIMITER_SWEEP_INTERVAL_MS 1000
+
+/* Token counts are kept in thousandths of a token. They keep their
+ * fractions, so rates below one request per second still refill when a
+ * client calls every millisecond. */
+#define MILLI 1000.0
+
+typedef struct {
+    RateLimiterKey key;
+    uint32_t       used;
+    uint32_t       connections;
+    uint64_t       stamp_ms; /* Last refill of the buckets */
+    double         tokens[RATE_LIMITER_MAX_RULES];
+} RateLimiterEntry;
+
+typedef struct {
+    RateLimiterEntry* entries;
+    size_t            count;
+    uint64_t          seed;
+    uint64_t          last_sweep_ms;
+    size_t            sweep_next; /* Next slot of a sweep in progress */
+    bool              sweeping;
+    uint64_t          full_warned_ms; /* Last "table full" warning, or 0 */
+
+    RateLimitRule rules[RATE_LIMITER_MAX_RULES];
+    size_t        rule_count;
+    int           default_rule; /* Index of the "*" rule, or -1 */
+    uint32_t      max_connections;
+
+    MetricId metric_rate;
+    MetricId metric_connections;
+    MetricId metric_untracked;
+    MetricId metric_clients;
+} RateLimiter;
+
+static RateLimiter g_limiter = {0};
+
+/* ============= Internal Functions ============= */
+
+static size_t            key_slot(const RateLimiterKey* key);
+static RateLimiterEntry* find_entry(const RateLimiterKey* key);
+static RateLimiterEntry* insert_entry(const RateLimiterKey* key,
+                                      uint64_t              now_ms);
+static void              remove_entry(RateLimiterEntry* entry);
+static void              refill(RateLimiterEntry* entry, uint64_t now_ms);
+static bool              buckets_full(const RateLimiterEntry* entry);
+static int               find_rule(const char* path);
+
+/* ============= Public API Implementation ============= */
+
+int rate_limiter_init(const RateLimitRule* rules, size_t rule_count,
+                      uint32_t max_connections) {
+    if (g_limiter.entries || rule_count > RATE_LIMITER_MAX_RULES ||
+        (rule_count > 0 && !rules)) {
+        return -1;
+    }
+
+    g_limiter.entries =
+        calloc(RATE_LIMITER_CAPACITY, sizeof(RateLimiterEntry));
+    if (!g_limiter.entries) {
+        return -1;
+    }
+
+    g_limiter.count           = 0;
+    g_limiter.last_sweep_ms   = 0;
+    g_limiter.sweep_next      = 0;
+    g_limiter.sweeping        = false;
+    g_limiter.full_warned_ms  = 0;
+    g_limiter.rule_count      = rule_count;
+    g_limiter.default_rule    = -1;
+    g_limiter.max_connections = max_connections;
+    g_limiter.seed = metrics_now_us() ^ (uint64_t)(uintptr_t)g_limiter.entries;
+
+    for (size_t i = 0; i < rule_count; i++) {
+        g_limiter.rules[i] = rules[i];
+        if (strcmp(rules[i].route, "*") == 0) {
+            g_limiter.default_rule = (int)i;
+        }
+    }
+
+    g_limiter.metric_rate = metrics_register(
+        METRIC_COUNTER, "just_weather_rate_limited_total", "reason=\"rate\"",
+        "Requests and connections refused by the rate limiter");
+    g_limiter.metric_connections = metrics_register(
+        METRIC_COUNTER, "just_weather_rate_limited_total",
+        "reason=\"connections\"",
+        "Requests and connections refused by the rate limiter");
+    g_limiter.metric_untracked = metrics_register(
+        METRIC_COUNTER, "just_weather_rate_limiter_untracked_total", NULL,
+        "Clients let through untracked because the table was full");
+    g_limiter.metric_clients = metrics_register(
+        METRIC_GAUGE, "just_weather_rate_limiter_clients", NULL,
+        "Clients tracked by the rate limiter");
+
+    return 0;
+}
+
+int rate_limiter_parse_rules(const char* spec, RateLimitRule* rules,
+                             size_t max_rules) {
+    if (!spec || !rules) {
+        return -1;
+    }
+
+    size_t      count = 0;
+    const char* p     = spec;
+    while (*p) {
+        const char* end = strchr(p, ',');
+        if (!end) {
+            end = p + strlen(p);
+        }
+
+        const char* equals = memchr(p, '=', (size_t)(end - p));
+        if (!equals || equals == p || count >= max_rules ||
+            (size_t)(equals - p) >= RATE_LIMITER_ROUTE_MAX) {
+            return -1;
+        }
+
+        RateLimitRule* rule = &rules[count];
+        memcpy(rule->route, p, (size_t)(equals - p));
+        rule->route[equals - p] = '\0';
+
+        char* number_end = NULL;
+        rule->rate       = strtod(equals + 1, &number_end);
+        rule->burst      = rule->rate;
+        if (number_end == equals + 1 || rule->rate < 0) {
+            return -1;
+        }
+        if (*number_end == ':') {
+            const char* burst = number_end + 1;
+            rule->burst       = strtod(burst, &number_end);
+            if (number_end == burst || rule->burst < 1) {
+                return -1;
+            }
+        }
+        if (number_end != end) {
+            return -1;
+        }
+        if (rule->rate > 0 && rule->burst < 1) {
+            rule->burst = 1;
+        }
+
+        count++;
+        p = *end ? end + 1 : end;
+    }
+
+    return (int)count;
+}
+
+int rate_limiter_key(const struct sockaddr* address, socklen_t length,
+                     RateLimiterKey* key) {
+    if (!address || !key) {
+        return -1;
+    }
+
+    memset(key, 0, sizeof(*key));
+
+    if (address->sa_family == AF_INET &&
+        length >= (socklen_t)sizeof(struct sockaddr_in)) {
+        const struct sockaddr_in* in = (const struct sockaddr_in*)address;
+        key->bytes[10]               = 0xff;
+        key->bytes[11]               = 0xff;
+        memcpy(&key->bytes[12], &in->sin_addr, 4);
+        return 0;
+    }
+
+    if (address->sa_family == AF_INET6 &&
+        length >= (socklen_t)sizeof(struct sockaddr_in6)) {
+        const struct sockaddr_in6* in6 = (const struct sockaddr_in6*)address;
+        const uint8_t*             raw = in6->sin6_addr.s6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+            memcpy(key->bytes, raw, 16);
+        } else {
+            /* One host usually owns a whole /64 */
+            memcpy(key->bytes, raw, 8);
+        }
+        return 0;
+    }
+
+    return -1;
+}
+
+int rate_limiter_connection_open(const RateLimiterKey* key, uint64_t now_ms) {
+    if (!g_limiter.entries || !key || g_limiter.max_connections == 0) {
+        return 0;
+    }
+
+    RateLimiterEntry* entry = find_entry(key);
+    if (!entry) {
+        entry = insert_entry(key, now_ms);
+        if (!entry) {
+            return 0;
+        }
+    }
+
+    if (entry->connections >= g_limiter.max_connections) {
+        metrics_inc(g_limiter.metric_connections);
+        return -1;
+    }
+
+    entry->connections++;
+    return 1;
+}
+
+void rate_limiter_connection_close(const RateLimiterKey* key) {
+    if (!g_limiter.entries || !key) {
+        return;
+    }
+
+    RateLimiterEntry* entry = find_entry(key);
+    if (entry && entry->connections > 0) {
+        entry->connections--;
+    }
+}
+
+bool rate_limiter_allow(const RateLimiterKey* key, const char* path,
+                        uint64_t now_ms, uint32_t* retry_after) {
+    if (!g_limiter.entries || !key || !path) {
+        return true;
+    }
+
+    int rule_index = find_rule(path);
+    if (rule_index < 0 || g_limiter.rules[rule_index].rate <= 0) {
+        return true;
+    }
+
+    RateLimiterEntry* entry = find_entry(key);
+    if (!entry) {
+        entry = insert_entry(key, now_ms);
+        if (!entry) {
+            return true;
+        }
+    }
+
+    refill(entry, now_ms);
+
+    double* tokens = &entry->tokens[rule_index];
+    if (*tokens >= MILLI) {
+        *tokens -= MILLI;
+        return true;
+    }
+
+    if (retry_after) {
+        double deficit = (MILLI - *tokens) / MILLI;
+        double seconds = ceil(deficit / g_limiter.rules[rule_index].rate);
+        if (seconds < 1) {
+            seconds = 1;
+        } else if (seconds > RATE_LIMITER_RETRY_MAX) {
+            seconds = RATE_LIMITER_RETRY_MAX;
+        }
+        *retry_after = (uint32_t)seconds;
+    }
+
+    metrics_inc(g_limiter.metric_rate);
+    return false;
+}
+
+bool rate_limiter_sweep(uint64_t now_ms) {
+    if (!g_limiter.entries) {
+        return false;
+    }
+
+    if (!g_limiter.sweeping) {
+        if (now_ms - g_limiter.last_sweep_ms <
+            RATE_LIMITER_SWEEP_INTERVAL_MS) {
+            return false;
+        }
+        g_limiter.last_sweep_ms = now_ms;
+        g_limiter.sweep_next    = 0;
+        g_limiter.sweeping      = true;
+    }
+
+    /* Entries inserted or shifted between steps may be missed; they are
+     * looked at by the next sweep */
+    size_t i   = g_limiter.sweep_next;
+    size_t end = i + RATE_LIMITER_SWEEP_STEP;
+    if (end > RATE_LIMITER_CAPACITY) {
+        end = RATE_LIMITER_CAPACITY;
+    }
+
+    while (i < end) {
+        RateLimiterEntry* entry = &g_limiter.entries[i];
+        if (entry->used && entry->connections == 0) {
+            refill(entry, now_ms);
+            if (buckets_full(entry)) {
+                /* Removal may shift a later entry into this slot */
+                remove_entry(entry);
+                continue;
+            }
+        }
+        i++;
+    }
+
+    g_limiter.sweep_next = i;
+    if (i < RATE_LIMITER_CAPACITY) {
+        return true;
+    }
+
+    g_limiter.sweeping = false;
+    metrics_gauge_set(g_limiter.metric_clients, (int64_t)g_limiter.count);
+    return false;
+}
+
+void rate_limiter_dispose(void) {
+    free(g_limiter.entries);
+    g_limiter.entries = NULL;
+    g_limiter.count   = 0;
+}
+
+/* ============= Internal Functions Implementation ============= */
+
+static size_t key_slot(const RateLimiterKey* key) {
+    uint64_t high;
+    uint64_t low;
+    memcpy(&high, key->bytes, 8);
+    memcpy(&low, key->bytes + 8, 8);
+
+    /* splitmix64 finalizer over the seeded key */
+    uint64_t x = high ^ (low * 0x9e3779b97f4a7c15ULL) ^ g_limiter.seed;
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+
+    return (size_t)(x & (RATE_LIMITER_CAPACITY - 1));
+}
+
+static RateLimiterEntry* find_entry(const RateLimiterKey* key) {
+    size_t slot = key_slot(key);
+    for (size_t probe = 0; probe < RATE_LIMITER_CAPACITY; probe++) {
+        RateLimiterEntry* entry = &g_limiter.entries[slot];
+        if (!entry->used) {
+            return NULL;
+        }
+        if (memcmp(&entry->key, key, sizeof(*key)) == 0) {
+            return entry;
+        }
+        slot = (slot + 1) & (RATE_LIMITER_CAPACITY - 1);
+    }
+    return NULL;
+}
+
+static RateLimiterEntry* insert_entry(const RateLimiterKey* key,
+                                      uint64_t              now_ms) {
+    if (g_limiter.count >= RATE_LIMITER_MAX_LOAD) {
+        /* Under a flood this is every new client; the counter has the
+         * numbers, the log only needs the occasional reminder */
+        metrics_inc(g_limiter.metric_untracked);
+        if (g_limiter.full_warned_ms == 0 ||
+            now_ms - g_limiter.full_warned_ms >=
+                RATE_LIMITER_SWEEP_INTERVAL_MS) {
+            g_limiter.full_warned_ms = now_ms;
+            LOG_WARN("rate_limiter",
+                     "Client table full, not tracking new clients");
+        }
+        return NULL;
+    }
+
+    size_t slot = key_slot(key);
+    while (g_limiter.entries[slot].used) {
+        slot = (slot + 1) & (RATE_LIMITER_CAPACITY - 1);
+    }
+
+    RateLimiterEntry* entry = &g_limiter.entries[slot];
+    memset(entry, 0, sizeof(*entry));
+    entry->key      = *key;
+    entry->used     = 1;
+    entry->stamp_ms = now_ms;
+    for (size_t i = 0; i < g_limiter.rule_count; i++) {
+        entry->tokens[i] = g_limiter.rules[i].burst * MILLI;
+    }
+
+    g_limiter.count++;
+    metrics_gauge_set(g_limiter.metric_clients, (int64_t)g_limiter.count);
+    return entry;
+}
+
+static void remove_entry(RateLimiterEntry* entry) {
+    /* Backward-shift deletion keeps probe sequences intact without
+     * tombstones */
+    size_t hole = (size_t)(entry - g_limiter.entries);
+    size_t next = (hole + 1) & (RATE_LIMITER_CAPACITY - 1);
+
+    while (g_limiter.entries[next].used) {
+        size_t home = key_slot(&g_limiter.entries[next].key);
+        /* Move the entry back if the hole lies on its probe path */
+        if (((next - home) & (RATE_LIMITER_CAPACITY - 1)) >=
+            ((next - hole) & (RATE_LIMITER_CAPACITY - 1))) {
+            g_limiter.entries[hole] = g_limiter.entries[next];
+            hole                    = next;
+        }
+        next = (next + 1) & (RATE_LIMITER_CAPACITY - 1);
+    }
+
+    memset(&g_limiter.entries[hole], 0, sizeof(RateLimiterEntry));
+    g_limiter.count--;
+}
+
+static void refill(RateLimiterEntry* entry, uint64_t now_ms) {
+    if (now_ms <= entry->stamp_ms) {
+        return;
+    }
+
+    uint64_t elapsed = now_ms - entry->stamp_ms;
+    for (size_t i = 0; i < g_limiter.rule_count; i++) {
+        /* rate tokens per second is rate milli-tokens per millisecond */
+        double tokens = entry->tokens[i] + elapsed * g_limiter.rules[i].rate;
+        double limit  = g_limiter.rules[i].burst * MILLI;
+        entry->tokens[i] = tokens < limit ? tokens : limit;
+    }
+    entry->stamp_ms = now_ms;
+}
+
+static bool buckets_full(const RateLimiterEntry* entry) {
+    for (size_t i = 0; i < g_limiter.rule_count; i++) {
+        if (entry->tokens[i] < g_limiter.rules[i].burst * MILLI) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int find_rule(const char* path) {
+    for (size_t i = 0; i < g_limiter.rule_count; i++) {
+        if (strcmp(g_limiter.rules[i].route, path) == 0) {
+            return (int)i;
+        }
+    }
+    return g_limiter.default_rule;
+}
@@ -0,0 +1,125 @@
+/**
+ * rate_limiter.h - Per-client token buckets and connection counters
+ *
+ * Clients are identified by their address (IPv4, or the /64 prefix of an
+ * IPv6 address, which is what one host typically controls). Each client has
+ * a token bucket per rule and a count of open connections, kept in a fixed
+ * open-addressing hash table with no allocation after init.
+ *
+ * Rules match request paths exactly; the rule with route "*" applies to every
+ * other path. A rule with rate 0 does not limit. Idle clients whose buckets
+ * have refilled carry no information and are dropped by rate_limiter_sweep,
+ * so the table only holds recently active clients. When it is full, new
+ * clients are let through rather than rejected.
+ *
+ * Must only be used from the smw thread.
+ */
+
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* Clients tracked at once, must be a power of two */
+#define RATE_LIMITER_CAPACITY 4096
+
+/* Slots rate_limiter_sweep looks at per call */
+#define RATE_LIMITER_SWEEP_STEP 512
+
+#define RATE_LIMITER_MAX_RULES 8
+#define RATE_LIMITER_ROUTE_MAX 64
+
+/* Longest Retry-After reported, in seconds */
+#define RATE_LIMITER_RETRY_MAX 60
+
+typedef struct {
+    char   route[RATE_LIMITER_ROUTE_MAX]; /* Request path, or "*" */
+    double rate;                          /* Requests per second, 0 = none */
+    double burst;                         /* Bucket size */
+} RateLimitRule;
+
+typedef struct {
+    uint8_t bytes[16]; /* IPv4-mapped IPv6 address, or IPv6 /64 prefix */
+} RateLimiterKey;
+
+/**
+ * Initialize the limiter
+ *
+ * @param rules Rules to apply, copied
+ * @param rule_count Number of rules, at most RATE_LIMITER_MAX_RULES
+ * @param max_connections Open connections allowed per client, 0 = no limit
+ * @return 0 on success, -1 on error
+ */
+int rate_limiter_init(const RateLimitRule* rules, size_t rule_count,
+                      uint32_t max_connections);
+
+/**
+ * Parse rules of the form "/v1/weather=5:20,/v1/cities=20:40,*=50:100"
+ * (route=rate:burst; the burst defaults to the rate)
+ *
+ * @param spec Rule list
+ * @param rules Output array
+ * @param max_rules Size of the output array
+ * @return Number of rules parsed, or -1 on a syntax error
+ */
+int rate_limiter_parse_rules(const char* spec, RateLimitRule* rules,
+                             size_t max_rules);
+
+/**
+ * Derive the client key of a peer address
+ *
+ * @return 0 on success, -1 for unsupported address families
+ */
+int rate_limiter_key(const struct sockaddr* address, socklen_t length,
+                     RateLimiterKey* key);
+
+/**
+ * Count a new connection from a client
+ *
+ * @param key Client
+ * @param now_ms Monotonic time in milliseconds
+ * @return 1 if the connection is counted and must be released with
+ * rate_limiter_connection_close, 0 if it is accepted without counting (no
+ * limit configured, or the table is full), -1 if the client is at its
+ * connection limit
+ */
+int rate_limiter_connection_open(const RateLimiterKey* key, uint64_t now_ms);
+
+/**
+ * Release a connection counted by rate_limiter_connection_open
+ */
+void rate_limiter_connection_close(const RateLimiterKey* key);
+
+/**
+ * Take a token for a request
+ *
+ * @param key Client
+ * @param path Request path without query
+ * @param now_ms Monotonic time in milliseconds
+ * @param retry_after Output: seconds until a token is available, when the
+ * request is throttled (1 to RATE_LIMITER_RETRY_MAX)
+ * @return true if the request may proceed, false if it is throttled
+ */
+bool rate_limiter_allow(const RateLimiterKey* key, const char* path,
+                        uint64_t now_ms, uint32_t* retry_after);
+
+/**
+ * Drop clients without connections whose buckets are full again. A sweep
+ * starts at most once per second and scans RATE_LIMITER_SWEEP_STEP slots
+ * per call, carrying on where the previous call stopped, so it can be
+ * spread over several loop passes. Cheap to call often.
+ *
+ * @param now_ms Monotonic time in milliseconds
+ * @return true while the current sweep is unfinished
+ */
+bool rate_limiter_sweep(uint64_t now_ms);
+
+/**
+ * Release the limiter
+ */
+void rate_limiter_dispose(void);
+
+#endif /* RATE_LIMITER_H */
@@ -1,85 +1,554 @@
+#define _GNU_SOURCE // dladdr
 #include "smw.h"
 
-#include "linked_list.h"
+#include "log.h"
 
+#include <dlfcn.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 Smw g_smw;
 
+//-----------------Internal Functions-----------------
+
+static uint32_t     smw_alloc_slot(void);
+static SmwTaskSlot* smw_task_slot(SmwTask* task);
+static void     smw_remove_entry(SmwQueue* queue, size_t index);
+static void     smw_collect(SmwQueue* queue);
+static void     smw_run_queue(SmwQueue* queue, uint64_t mon_time);
+static void     smw_run_background(uint64_t mon_time);
+static void     smw_call(SmwQueue* queue, size_t index, uint64_t mon_time);
+static SmwCallbackStats* smw_profile_stats(
+    void (*callback)(void* context, uint64_t mon_time));
+static void smw_profile_slow(SmwCallbackStats* stats, uint64_t elapsed,
+                             uint64_t now_us);
+static void smw_timer_place(SmwTimer* timer, size_t index);
+static void smw_timer_up(size_t index);
+static void smw_timer_down(size_t index);
+static void smw_timer_remove(size_t index);
+static void smw_run_timers(uint64_t now_us, uint64_t mon_time);
+
+//----------------------------------------------------
+
 int smw_init() {
     memset(&g_smw, 0, sizeof(g_smw));
-    g_smw.tasks = linked_list_create();
-    if (!g_smw.tasks) {
-        return -1;
+    g_smw.free_slot = SMW_TASK_NONE;
+
+    for (int i = 0; i < SMW_PRIORITY_COUNT; i++) {
+        SmwQueue* queue = &g_smw.queues[i];
+        queue->capacity = SMW_MAX_TASKS;
+        queue->entries  = malloc(queue->capacity * sizeof(SmwEntry));
+        if (!queue->entries) {
+            smw_dispose();
+            return -1;
+        }
     }
+
+    g_smw.metric_tick =
+        metrics_register(METRIC_HISTOGRAM, "just_weather_smw_tick_seconds",
+                         NULL, "Time spent running all tasks once");
+    g_smw.metric_lag = metrics_register(
+        METRIC_HISTOGRAM, "just_weather_smw_loop_lag_seconds", NULL,
+        "Time between the starts of two passes, i.e. how long a task waits "
+        "to run again");
+    g_smw.metric_tasks =
+        metrics_register(METRIC_GAUGE, "just_weather_smw_tasks", NULL,
+                         "Number of registered smw tasks");
+    g_smw.metric_deferred = metrics_register(
+        METRIC_COUNTER, "just_weather_smw_background_deferred_total", NULL,
+        "Background task runs put off because a pass overran its budget");
+    g_smw.metric_timers =
+        metrics_register(METRIC_COUNTER, "just_weather_smw_timers_total", NULL,
+                         "Timers that went off");
     return 0;
 }
 
 SmwTask* smw_create_task(void* context,
                          void (*callback)(void* context, uint64_t mon_time)) {
-    if (!g_smw.tasks) {
+    return smw_create_task_with_priority(context, callback,
+                                         SMW_PRIORITY_NORMAL);
+}
+
+SmwTask* smw_create_task_with_priority(
+    void* context, void (*callback)(void* context, uint64_t mon_time),
+    SmwPriority priority) {
+    if ((unsigned)priority >= SMW_PRIORITY_COUNT) {
         return NULL;
     }
 
-    SmwTask* task = malloc(sizeof(SmwTask));
-    if (!task) {
+    SmwQueue* queue = &g_smw.queues[priority];
+    if (!queue->entries) {
         return NULL;
     }
 
-    task->context  = context;
-    task->callback = callback;
+    if (queue->count == queue->capacity) {
+        size_t    capacity = queue->capacity * 2;
+        SmwEntry* entries =
+            realloc(queue->entries, capacity * sizeof(SmwEntry));
+        if (!entries) {
+            return NULL;
+        }
+        queue->entries  = entries;
+        queue->capacity = capacity;
+    }
 
-    if (linked_list_append(g_smw.tasks, task) != 0) {
-        free(task);
+    uint32_t slot = smw_alloc_slot();
+    if (slot == SMW_TASK_NONE) {
         return NULL;
     }
 
-    return task;
+    SmwTaskSlot* task = &g_smw.slots[slot];
+    task->priority    = priority;
+    task->index       = (uint32_t)queue->count;
+
+    queue->entries[queue->count++] = (SmwEntry){
+        .callback = callback, .context = context, .slot = slot, .stats = NULL};
+    metrics_gauge_set(g_smw.metric_tasks, smw_get_task_count());
+
+    return (SmwTask*)(((uintptr_t)task->generation << SMW_TASK_SLOT_BITS) |
+                      (slot + 1));
 }
 
 void smw_destroy_task(SmwTask* task) {
-    if (!g_smw.tasks || !task) {
+    SmwTaskSlot* slot = smw_task_slot(task);
+    if (!slot) {
         return;
     }
 
-    Node* node = g_smw.tasks->head;
-    while (node) {
-        Node* next = node->front;
-        if (node->item == task) {
-            linked_list_remove(g_smw.tasks, node, free);
-            break;
-        }
-        node = next;
+    SmwQueue* queue = &g_smw.queues[slot->priority];
+    size_t    index = slot->index;
+    slot->index     = SMW_TASK_NONE;
+
+    // Give the slot back; handles of this task no longer match it
+    slot->generation++;
+    slot->next_free = g_smw.free_slot;
+    g_smw.free_slot = (uint32_t)(slot - g_smw.slots);
+
+    if (g_smw.running) {
+        // Moving entries now could make the pass skip or repeat one
+        queue->entries[index].callback = NULL;
+        queue->entries[index].slot     = SMW_TASK_NONE;
+        queue->dead++;
+    } else {
+        smw_remove_entry(queue, index);
     }
+
+    metrics_gauge_set(g_smw.metric_tasks, smw_get_task_count());
 }
 
 void smw_work(uint64_t mon_time) {
-    if (!g_smw.tasks) {
+    if (!g_smw.queues[SMW_PRIORITY_NORMAL].entries) {
         return;
     }
 
-    Node* node = g_smw.tasks->head;
-    while (node) {
-        Node*    next = node->front; // Save next node before callback
-        SmwTask* task = (SmwTask*)node->item;
-        if (task && task->callback) {
-            task->callback(task->context, mon_time);
+    uint64_t start = metrics_now_us();
+    if (g_smw.pass_start_us != 0) {
+        metrics_observe(g_smw.metric_lag, start - g_smw.pass_start_us);
+    }
+    g_smw.pass_start_us = start;
+
+    g_smw.running = true;
+    smw_run_timers(start, mon_time);
+    smw_run_queue(&g_smw.queues[SMW_PRIORITY_IO], mon_time);
+    smw_run_queue(&g_smw.queues[SMW_PRIORITY_NORMAL], mon_time);
+    smw_run_background(mon_time);
+    g_smw.running = false;
+
+    for (int i = 0; i < SMW_PRIORITY_COUNT; i++) {
+        if (g_smw.queues[i].dead > 0) {
+            smw_collect(&g_smw.queues[i]);
         }
-        node = next;
     }
+
+    uint64_t elapsed = metrics_now_us() - start;
+    metrics_observe(g_smw.metric_tick, elapsed);
+
+    // Exponential moving average over about 8 passes
+    g_smw.tick_us = (g_smw.tick_us * 7 + elapsed) / 8;
 }
 
-int smw_get_task_count() {
-    if (!g_smw.tasks) {
+void smw_timer_init(SmwTimer* timer, void* context,
+                    void (*callback)(void* context, uint64_t mon_time)) {
+    timer->context     = context;
+    timer->callback    = callback;
+    timer->deadline_us = 0;
+    timer->index       = SMW_TIMER_NONE;
+}
+
+int smw_timer_set(SmwTimer* timer, uint64_t deadline_us) {
+    if (timer->index != SMW_TIMER_NONE) {
+        uint64_t previous  = timer->deadline_us;
+        timer->deadline_us = deadline_us;
+        if (deadline_us < previous) {
+            smw_timer_up(timer->index);
+        } else {
+            smw_timer_down(timer->index);
+        }
         return 0;
     }
-    return (int)g_smw.tasks->size;
+
+    if (g_smw.timer_count == g_smw.timer_capacity) {
+        size_t capacity =
+            g_smw.timer_capacity ? g_smw.timer_capacity * 2 : SMW_MAX_TASKS;
+        SmwTimer** timers = realloc(g_smw.timers, capacity * sizeof(SmwTimer*));
+        if (!timers) {
+            return -1;
+        }
+        g_smw.timers         = timers;
+        g_smw.timer_capacity = capacity;
+    }
+
+    timer->deadline_us = deadline_us;
+    smw_timer_place(timer, g_smw.timer_count++);
+    smw_timer_up(timer->index);
+    return 0;
+}
+
+void smw_timer_cancel(SmwTimer* timer) {
+    if (timer && timer->index != SMW_TIMER_NONE) {
+        smw_timer_remove(timer->index);
+    }
+}
+
+bool smw_timer_armed(const SmwTimer* timer) {
+    return timer->index != SMW_TIMER_NONE;
+}
+
+int smw_get_task_count() {
+    size_t count = 0;
+    for (int i = 0; i < SMW_PRIORITY_COUNT; i++) {
+        count += g_smw.queues[i].count - g_smw.queues[i].dead;
+    }
+    return (int)count;
+}
+
+uint64_t smw_get_tick_us() { return g_smw.tick_us; }
+
+void smw_set_tick_budget(uint64_t budget_us) {
+    g_smw.tick_budget_us = budget_us;
+}
+
+bool smw_should_yield() {
+    return g_smw.running && g_smw.tick_budget_us != 0 &&
+           metrics_now_us() - g_smw.pass_start_us >= g_smw.tick_budget_us;
+}
+
+int smw_set_profiling(bool enabled, uint64_t slow_budget_us) {
+    if (enabled && !g_smw.profile) {
+        g_smw.profile =
+            calloc(SMW_PROFILE_CALLBACKS, sizeof(SmwCallbackStats));
+        if (!g_smw.profile) {
+            return -1;
+        }
+    }
+
+    g_smw.profiling      = enabled;
+    g_smw.slow_budget_us = slow_budget_us;
+    return 0;
+}
+
+const SmwCallbackStats* smw_get_profile(size_t* count) {
+    *count = g_smw.profile_count;
+    return g_smw.profile;
 }
 
 void smw_dispose() {
-    if (!g_smw.tasks) {
+    free(g_smw.slots);
+    for (int i = 0; i < SMW_PRIORITY_COUNT; i++) {
+        free(g_smw.queues[i].entries);
+    }
+    free(g_smw.profile);
+    for (size_t i = 0; i < g_smw.timer_count; i++) {
+        g_smw.timers[i]->index = SMW_TIMER_NONE;
+    }
+    free(g_smw.timers);
+
+    memset(&g_smw, 0, sizeof(g_smw));
+}
+
+// Take a slot from the free list, growing the array when there is none
+static uint32_t smw_alloc_slot(void) {
+    if (g_smw.free_slot == SMW_TASK_NONE) {
+        if (g_smw.slot_count == g_smw.slot_capacity) {
+            size_t limit    = ((size_t)1 << SMW_TASK_SLOT_BITS) - 1;
+            size_t capacity = g_smw.slot_capacity ? g_smw.slot_capacity * 2
+                                                  : SMW_TASK_CHUNK;
+            if (capacity > limit) {
+                capacity = limit;
+            }
+            if (capacity <= g_smw.slot_count) {
+                return SMW_TASK_NONE;
+            }
+
+            SmwTaskSlot* slots =
+                realloc(g_smw.slots, capacity * sizeof(SmwTaskSlot));
+            if (!slots) {
+                return SMW_TASK_NONE;
+            }
+            g_smw.slots         = slots;
+            g_smw.slot_capacity = capacity;
+        }
+
+        g_smw.slots[g_smw.slot_count] = (SmwTaskSlot){
+            .index = SMW_TASK_NONE, .generation = 0, .next_free = SMW_TASK_NONE};
+        g_smw.free_slot = (uint32_t)g_smw.slot_count++;
+    }
+
+    uint32_t slot   = g_smw.free_slot;
+    g_smw.free_slot = g_smw.slots[slot].next_free;
+    return slot;
+}
+
+// The slot of a live task, NULL for NULL or a handle of a destroyed task.
+// Generations are compared in the bits the handle has room for.
+static SmwTaskSlot* smw_task_slot(SmwTask* task) {
+    uintptr_t handle = (uintptr_t)task;
+    size_t    slot   = handle & (((uintptr_t)1 << SMW_TASK_SLOT_BITS) - 1);
+    if (slot == 0 || slot > g_smw.slot_count) {
+        return NULL;
+    }
+
+    SmwTaskSlot* found      = &g_smw.slots[slot - 1];
+    uintptr_t    generation = (uintptr_t)found->generation &
+                           (UINTPTR_MAX >> SMW_TASK_SLOT_BITS);
+    if (handle >> SMW_TASK_SLOT_BITS != generation ||
+        found->index == SMW_TASK_NONE) {
+        return NULL;
+    }
+    return found;
+}
+
+// Swap-remove: the last entry takes the place of the removed one
+static void smw_remove_entry(SmwQueue* queue, size_t index) {
+    size_t last = --queue->count;
+    if (index != last) {
+        queue->entries[index] = queue->entries[last];
+        if (queue->entries[index].slot != SMW_TASK_NONE) {
+            g_smw.slots[queue->entries[index].slot].index = (uint32_t)index;
+        }
+    }
+}
+
+// Remove the entries destroyed during a pass
+static void smw_collect(SmwQueue* queue) {
+    size_t i = 0;
+    while (i < queue->count && queue->dead > 0) {
+        if (queue->entries[i].slot != SMW_TASK_NONE) {
+            i++;
+            continue;
+        }
+
+        // The entry moved in may be dead too, so look at i again
+        smw_remove_entry(queue, i);
+        queue->dead--;
+    }
+}
+
+// Run every task of a class; ones created meanwhile wait for the next pass
+static void smw_run_queue(SmwQueue* queue, uint64_t mon_time) {
+    size_t count = queue->count;
+    for (size_t i = 0; i < count; i++) {
+        smw_call(queue, i, mon_time);
+    }
+}
+
+// Run background tasks in turn, starting where the last pass stopped, until
+// the budget is spent. The first one always runs so they keep moving.
+static void smw_run_background(uint64_t mon_time) {
+    SmwQueue* queue = &g_smw.queues[SMW_PRIORITY_BACKGROUND];
+    size_t    count = queue->count;
+    if (count == 0) {
         return;
     }
-    linked_list_dispose(&g_smw.tasks, free);
+
+    size_t first = queue->next < count ? queue->next : 0;
+    size_t ran   = 0;
+    while (ran < count) {
+        if (ran > 0 && smw_should_yield()) {
+            metrics_add(g_smw.metric_deferred, count - ran);
+            break;
+        }
+
+        smw_call(queue, (first + ran) % count, mon_time);
+        ran++;
+    }
+
+    queue->next = (first + ran) % count;
+}
+
+// Run one entry, timing it while profiling
+static void smw_call(SmwQueue* queue, size_t index, uint64_t mon_time) {
+    SmwEntry* entry = &queue->entries[index];
+    if (!entry->callback) {
+        return;
+    }
+
+    if (!g_smw.profiling) {
+        entry->callback(entry->context, mon_time);
+        return;
+    }
+
+    if (!entry->stats) {
+        entry->stats = smw_profile_stats(entry->callback);
+    }
+    SmwCallbackStats* stats = entry->stats;
+
+    // The callback may move the entries; only stats is used after it
+    uint64_t before = metrics_now_us();
+    entry->callback(entry->context, mon_time);
+    uint64_t after   = metrics_now_us();
+    uint64_t elapsed = after - before;
+
+    stats->calls++;
+    stats->total_us += elapsed;
+    if (elapsed > stats->max_us) {
+        stats->max_us = elapsed;
+    }
+    metrics_inc(stats->metric_calls);
+    metrics_add(stats->metric_time, elapsed);
+
+    if (g_smw.slow_budget_us != 0 && elapsed > g_smw.slow_budget_us) {
+        smw_profile_slow(stats, elapsed, after);
+    }
+}
+
+// Find or add the stats of a callback function
+static SmwCallbackStats* smw_profile_stats(
+    void (*callback)(void* context, uint64_t mon_time)) {
+    for (size_t i = 0; i < g_smw.profile_count; i++) {
+        if (g_smw.profile[i].callback == callback) {
+            return &g_smw.profile[i];
+        }
+    }
+
+    // Out of room: the last entry collects all remaining callbacks
+    if (g_smw.profile_count == SMW_PROFILE_CALLBACKS) {
+        return &g_smw.profile[SMW_PROFILE_CALLBACKS - 1];
+    }
+
+    SmwCallbackStats* stats = &g_smw.profile[g_smw.profile_count++];
+    stats->callback         = callback;
+
+    // Needs the symbols exported (-rdynamic) to name functions in the
+    // executable; static functions show up as their address
+    void*   address = (void*)(uintptr_t)callback;
+    Dl_info info;
+    if (g_smw.profile_count == SMW_PROFILE_CALLBACKS) {
+        snprintf(stats->name, sizeof(stats->name), "other");
+    } else if (dladdr(address, &info) && info.dli_sname &&
+               info.dli_saddr == address) {
+        snprintf(stats->name, sizeof(stats->name), "%s", info.dli_sname);
+    } else {
+        snprintf(stats->name, sizeof(stats->name), "%p", address);
+    }
+
+    char labels[METRICS_LABELS_MAX];
+    snprintf(labels, sizeof(labels), "callback=\"%s\"", stats->name);
+    stats->metric_calls =
+        metrics_register(METRIC_COUNTER, "just_weather_smw_callback_calls_total",
+                         labels, "Task callback runs per callback function");
+    stats->metric_time = metrics_register(
+        METRIC_COUNTER, "just_weather_smw_callback_microseconds_total", labels,
+        "Time spent in task callbacks per callback function");
+    stats->metric_slow = metrics_register(
+        METRIC_COUNTER, "just_weather_smw_slow_callbacks_total", labels,
+        "Task callback runs that exceeded the slow budget");
+
+    return stats;
+}
+
+static void smw_profile_slow(SmwCallbackStats* stats, uint64_t elapsed,
+                             uint64_t now_us) {
+    stats->slow++;
+    stats->unreported++;
+    metrics_inc(stats->metric_slow);
+
+    if (stats->reported_us != 0 &&
+        now_us - stats->reported_us < SMW_SLOW_REPORT_INTERVAL_US) {
+        return;
+    }
+
+    LOG_WARN("smw",
+             "Slow callback %s took %llu us (budget %llu us, %llu slow "
+             "calls since last report, max %llu us)",
+             stats->name, (unsigned long long)elapsed,
+             (unsigned long long)g_smw.slow_budget_us,
+             (unsigned long long)stats->unreported,
+             (unsigned long long)stats->max_us);
+
+    stats->reported_us = now_us;
+    stats->unreported  = 0;
+}
+
+static void smw_timer_place(SmwTimer* timer, size_t index) {
+    g_smw.timers[index] = timer;
+    timer->index        = (uint32_t)index;
+}
+
+// Move a timer towards the root while it is earlier than its parent
+static void smw_timer_up(size_t index) {
+    SmwTimer* timer = g_smw.timers[index];
+    while (index > 0) {
+        size_t parent = (index - 1) / 2;
+        if (g_smw.timers[parent]->deadline_us <= timer->deadline_us) {
+            break;
+        }
+        smw_timer_place(g_smw.timers[parent], index);
+        index = parent;
+    }
+    smw_timer_place(timer, index);
+}
+
+// Move a timer towards the leaves while a child is earlier
+static void smw_timer_down(size_t index) {
+    SmwTimer* timer = g_smw.timers[index];
+    for (;;) {
+        size_t child = index * 2 + 1;
+        if (child >= g_smw.timer_count) {
+            break;
+        }
+        if (child + 1 < g_smw.timer_count &&
+            g_smw.timers[child + 1]->deadline_us <
+                g_smw.timers[child]->deadline_us) {
+            child++;
+        }
+        if (timer->deadline_us <= g_smw.timers[child]->deadline_us) {
+            break;
+        }
+        smw_timer_place(g_smw.timers[child], index);
+        index = child;
+    }
+    smw_timer_place(timer, index);
+}
+
+// The last timer takes the place of the removed one and is sifted from there
+static void smw_timer_remove(size_t index) {
+    g_smw.timers[index]->index = SMW_TIMER_NONE;
+
+    size_t last = --g_smw.timer_count;
+    if (index == last) {
+        return;
+    }
+
+    SmwTimer* moved = g_smw.timers[last];
+    smw_timer_place(moved, index);
+    smw_timer_up(index);
+    smw_timer_down(moved->index);
+}
+
+// Fire the timers due by now. Each is disarmed before its callback runs, so
+// the callback may set it again, or set and cancel any other timer. At most
+// as many callbacks run as timers were armed, so timers set to a deadline
+// already passed cannot keep a pass going.
+static void smw_run_timers(uint64_t now_us, uint64_t mon_time) {
+    size_t due = g_smw.timer_count;
+    while (due > 0 && g_smw.timer_count > 0 &&
+           g_smw.timers[0]->deadline_us <= now_us) {
+        SmwTimer* timer = g_smw.timers[0];
+        smw_timer_remove(0);
+        metrics_inc(g_smw.metric_timers);
+        timer->callback(timer->context, mon_time);
+        due--;
+    }
 }
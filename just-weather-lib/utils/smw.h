@@ -1,36 +1,198 @@
 #ifndef SMW_H
 #define SMW_H
 
-#include "linked_list.h"
+#include "metrics.h"
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #ifndef SMW_MAX_TASKS
 #    define SMW_MAX_TASKS 16
 #endif
 
+// Task slots allocated at first; the array doubles when they run out
+#define SMW_TASK_CHUNK 256
+
+// Low bits of a task handle holding its slot, the rest hold the generation
+#define SMW_TASK_SLOT_BITS 24
+
+// SmwTaskSlot.index of a free slot, SmwEntry.slot of a destroyed task
+#define SMW_TASK_NONE UINT32_MAX
+
+// SmwTimer.index of a timer that is not armed
+#define SMW_TIMER_NONE UINT32_MAX
+
+// Task classes. Every pass runs the I/O tasks first, then the normal ones,
+// then as many background tasks as fit in the tick budget.
+typedef enum {
+    SMW_PRIORITY_IO,         // Socket work: accepts, reads, flushes
+    SMW_PRIORITY_NORMAL,     // Request handling; smw_create_task's default
+    SMW_PRIORITY_BACKGROUND, // Maintenance that can wait a few passes
+    SMW_PRIORITY_COUNT
+} SmwPriority;
+
+// Callback functions profiled separately; any further ones share one entry
+#define SMW_PROFILE_CALLBACKS 64
+#define SMW_PROFILE_NAME_MAX 64
+
+// Slow calls of one callback are reported at most this often
+#define SMW_SLOW_REPORT_INTERVAL_US 1000000
+
+// Time spent in one callback function, summed over all its tasks
 typedef struct {
+    void (*callback)(void* context, uint64_t mon_time);
+    char name[SMW_PROFILE_NAME_MAX]; // Symbol name, or address
+
+    uint64_t calls;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t slow; // Calls over the slow budget
+
+    uint64_t reported_us; // Last slow report
+    uint64_t unreported;  // Slow calls since then
+
+    MetricId metric_calls;
+    MetricId metric_time;
+    MetricId metric_slow;
+} SmwCallbackStats;
+
+// A task handle, never dereferenced: it holds the task's slot and the
+// generation of the slot when the task was created. A slot is reused after
+// its task is destroyed, with the next generation, so a handle kept past
+// smw_destroy_task matches no task.
+typedef struct SmwTask SmwTask;
+
+// Knows where its task's entry is, so destroying a task needs no search
+typedef struct {
+    SmwPriority priority;
+    uint32_t    index;      // Entry in its queue, or SMW_TASK_NONE when free
+    uint32_t    generation; // Bumped when the task is destroyed
+    uint32_t    next_free;  // Free list link while unused
+} SmwTaskSlot;
+
+// A one-shot timer, embedded in its owner, which must not move while it is
+// armed. Armed timers are kept in a min-heap on their deadline, so a pass
+// only looks at the earliest one, and arming, moving and cancelling a timer
+// is O(log n) whatever the number of timers.
+typedef struct SmwTimer {
     void* context;
     void (*callback)(void* context, uint64_t mon_time);
 
-} SmwTask;
+    uint64_t deadline_us; // metrics_now_us clock
+    uint32_t index;       // Heap slot, or SMW_TIMER_NONE
+} SmwTimer;
 
+// What smw_work runs, stored contiguously so a pass walks one array instead
+// of chasing a list node and a task per task
 typedef struct {
-    LinkedList* tasks;
+    void (*callback)(void* context, uint64_t mon_time);
+    void*             context;
+    uint32_t          slot;  // SMW_TASK_NONE once destroyed
+    SmwCallbackStats* stats; // Looked up on the first profiled run
+} SmwEntry;
+
+// The tasks of one priority class
+typedef struct {
+    SmwEntry* entries;
+    size_t    count;
+    size_t    capacity;
+    size_t    dead; // Entries destroyed during the current pass
+    size_t    next; // Background: where the next pass starts
+} SmwQueue;
+
+typedef struct {
+    SmwQueue queues[SMW_PRIORITY_COUNT];
+
+    SmwTaskSlot* slots;
+    size_t       slot_count; // Slots ever used
+    size_t       slot_capacity;
+    uint32_t     free_slot; // Free list head, SMW_TASK_NONE when empty
+
+    bool running; // Inside smw_work: removal is deferred to the end
+
+    // Armed timers, a binary min-heap on deadline_us
+    SmwTimer** timers;
+    size_t     timer_count;
+    size_t     timer_capacity;
+
+    uint64_t tick_us;        // Smoothed duration of an smw_work pass
+    uint64_t pass_start_us;  // When the current or previous pass started
+    uint64_t tick_budget_us; // Background work stops past this, 0 = never
+
+    // Profiling, see smw_set_profiling
+    bool              profiling;
+    uint64_t          slow_budget_us;
+    SmwCallbackStats* profile;
+    size_t            profile_count;
+
+    MetricId metric_tick;     // Duration of one smw_work pass
+    MetricId metric_lag;      // Time between the starts of two passes
+    MetricId metric_tasks;    // Number of registered tasks
+    MetricId metric_deferred; // Background runs put off to a later pass
+    MetricId metric_timers;   // Timers that went off
 } Smw;
 
 extern Smw g_smw;
 
 int smw_init();
 
+// Create a task of the normal class
 SmwTask* smw_create_task(void* context,
                          void (*callback)(void* context, uint64_t mon_time));
-void     smw_destroy_task(SmwTask* task);
+
+// Create a task of the given class. Tasks created during a pass first run in
+// the next one.
+SmwTask* smw_create_task_with_priority(
+    void* context, void (*callback)(void* context, uint64_t mon_time),
+    SmwPriority priority);
+
+// O(1). Safe to call from any task callback, for any task including the
+// running one; a task destroyed during a pass does not run again. Does
+// nothing for a task already destroyed, even once its slot is reused.
+void smw_destroy_task(SmwTask* task);
+
+// Prepare a timer; it is not armed
+void smw_timer_init(SmwTimer* timer, void* context,
+                    void (*callback)(void* context, uint64_t mon_time));
+
+// Arm a timer, or move it if it is armed. It goes off once, at the start of
+// the first pass at or after deadline_us. Returns -1 if out of memory.
+int smw_timer_set(SmwTimer* timer, uint64_t deadline_us);
+
+// Disarm a timer if it is armed. Safe to call from any callback.
+void smw_timer_cancel(SmwTimer* timer);
+
+bool smw_timer_armed(const SmwTimer* timer);
 
 void smw_work(uint64_t mon_time);
 
 int smw_get_task_count();
 
+// How long a pass over all tasks takes lately, i.e. roughly how long new
+// work waits before its task runs. Smoothed over the last few passes.
+uint64_t smw_get_tick_us();
+
+// Time a pass may take before background tasks are put off, 0 for no
+// limit. Background tasks take turns, and at least one runs every pass, so
+// none of them starves however busy the loop is.
+void smw_set_tick_budget(uint64_t budget_us);
+
+// True once the current pass has used up its budget. A background task
+// doing a long job should check it between steps and return when it is
+// set, keeping its position in its context to carry on next time.
+bool smw_should_yield();
+
+// Time every callback and keep call counts and time per callback function,
+// exported as metrics labelled with the function's name. Calls taking
+// longer than slow_budget_us (0 = never) are counted and logged, at most
+// once a second per function. Costs two clock reads per callback while
+// enabled. Returns -1 if out of memory.
+int smw_set_profiling(bool enabled, uint64_t slow_budget_us);
+
+// Stats of the callbacks profiled so far
+const SmwCallbackStats* smw_get_profile(size_t* count);
+
 void smw_dispose();
 
 #endif // SMW_H
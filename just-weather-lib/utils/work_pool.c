@@ -0,0 +1,359 @@
+/**
+ * work_pool.c - Implementation of the worker pool
+ */
+
+#include "work_pool.h"
+
+#include "log.h"
+#include "metrics.h"
+#include "smw.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+struct WorkPoolJob {
+    WorkPoolRun  run;
+    WorkPoolDone done;
+    void*        context;
+    _Atomic bool cancelled;
+    uint64_t     queued_us;
+    WorkPoolJob* next; /* Worker deque, then finished list */
+    WorkPoolJob* prev; /* Worker deque */
+};
+
+/* Jobs are appended at the tail. The owner takes them from the head and
+ * thieves from the tail. length lets thieves skip empty deques without
+ * locking. */
+typedef struct {
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    WorkPoolJob*    head;
+    WorkPoolJob*    tail;
+    _Atomic size_t  length;
+    size_t          index;
+} WorkPoolWorker;
+
+typedef struct {
+    bool            active;
+    WorkPoolWorker* workers;
+    size_t          count;
+    size_t          next_worker; /* Round-robin, smw thread only */
+
+    _Atomic size_t  queued; /* Submitted and not yet taken */
+    _Atomic bool    running;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t  idle;
+
+    /* Finished jobs, newest first */
+    _Atomic(WorkPoolJob*) finished;
+    SmwTask*              task;
+
+    MetricId metric_jobs;
+    MetricId metric_steals;
+    MetricId metric_rejected;
+    MetricId metric_queued;
+    MetricId metric_wait;
+} WorkPool;
+
+static WorkPool g_pool;
+
+/* ============= Internal Functions ============= */
+
+static void*        worker_thread(void* arg);
+static WorkPoolJob* take_job(WorkPoolWorker* from, bool steal);
+static void         run_job(WorkPoolJob* job);
+static void         finish_job(WorkPoolJob* job);
+static void         work_pool_task_work(void* context, uint64_t mon_time);
+static void         drain_finished(void);
+static void         stop_workers(size_t started);
+
+/* ============= Public API Implementation ============= */
+
+int work_pool_init(size_t workers) {
+    if (g_pool.active || workers == 0) {
+        return 0;
+    }
+    if (workers > WORK_POOL_MAX_WORKERS) {
+        workers = WORK_POOL_MAX_WORKERS;
+    }
+
+    g_pool.workers = calloc(workers, sizeof(WorkPoolWorker));
+    if (!g_pool.workers) {
+        return -1;
+    }
+
+    g_pool.metric_jobs = metrics_register(
+        METRIC_COUNTER, "just_weather_work_pool_jobs_total", NULL,
+        "Jobs finished by the worker pool");
+    g_pool.metric_steals = metrics_register(
+        METRIC_COUNTER, "just_weather_work_pool_steals_total", NULL,
+        "Jobs a worker took from another worker's queue");
+    g_pool.metric_rejected = metrics_register(
+        METRIC_COUNTER, "just_weather_work_pool_rejected_total", NULL,
+        "Jobs refused because too many were queued");
+    g_pool.metric_queued =
+        metrics_register(METRIC_GAUGE, "just_weather_work_pool_queued", NULL,
+                         "Jobs waiting for a worker");
+    g_pool.metric_wait = metrics_register(
+        METRIC_HISTOGRAM, "just_weather_work_pool_wait_seconds", NULL,
+        "Time jobs waited for a worker");
+
+    pthread_mutex_init(&g_pool.idle_lock, NULL);
+    pthread_cond_init(&g_pool.idle, NULL);
+    atomic_store(&g_pool.queued, 0);
+    atomic_store(&g_pool.finished, NULL);
+    atomic_store(&g_pool.running, true);
+    g_pool.count       = workers;
+    g_pool.next_worker = 0;
+
+    for (size_t i = 0; i < workers; i++) {
+        WorkPoolWorker* worker = &g_pool.workers[i];
+        worker->index          = i;
+        pthread_mutex_init(&worker->lock, NULL);
+        atomic_store(&worker->length, 0);
+
+        if (pthread_create(&worker->thread, NULL, worker_thread, worker) !=
+            0) {
+            LOG_ERROR("work_pool", "Cannot start worker %zu", i);
+            pthread_mutex_destroy(&worker->lock);
+            stop_workers(i);
+            return -1;
+        }
+    }
+
+    g_pool.task = smw_create_task_with_priority(NULL, work_pool_task_work,
+                                                SMW_PRIORITY_IO);
+    if (!g_pool.task) {
+        stop_workers(workers);
+        return -1;
+    }
+
+    g_pool.active = true;
+    LOG_INFO("work_pool", "Started %zu workers", workers);
+    return 0;
+}
+
+bool work_pool_active(void) { return g_pool.active; }
+
+WorkPoolJob* work_pool_submit(WorkPoolRun run, WorkPoolDone done,
+                              void* context) {
+    if (!g_pool.active || !run || !done) {
+        return NULL;
+    }
+
+    if (atomic_load_explicit(&g_pool.queued, memory_order_relaxed) >=
+        WORK_POOL_MAX_QUEUED) {
+        metrics_inc(g_pool.metric_rejected);
+        return NULL;
+    }
+
+    WorkPoolJob* job = malloc(sizeof(WorkPoolJob));
+    if (!job) {
+        return NULL;
+    }
+    job->run       = run;
+    job->done      = done;
+    job->context   = context;
+    job->queued_us = metrics_now_us();
+    job->next      = NULL;
+    job->prev      = NULL;
+    atomic_init(&job->cancelled, false);
+
+    /* Counted first, so the count never drops below the jobs in queues */
+    atomic_fetch_add(&g_pool.queued, 1);
+    metrics_gauge_add(g_pool.metric_queued, 1);
+
+    WorkPoolWorker* worker =
+        &g_pool.workers[g_pool.next_worker++ % g_pool.count];
+    pthread_mutex_lock(&worker->lock);
+    job->prev = worker->tail;
+    if (worker->tail) {
+        worker->tail->next = job;
+    } else {
+        worker->head = job;
+    }
+    worker->tail = job;
+    atomic_fetch_add(&worker->length, 1);
+    pthread_mutex_unlock(&worker->lock);
+
+    /* Any idle worker will do; the owner may be busy */
+    pthread_mutex_lock(&g_pool.idle_lock);
+    pthread_cond_signal(&g_pool.idle);
+    pthread_mutex_unlock(&g_pool.idle_lock);
+
+    return job;
+}
+
+void work_pool_cancel(WorkPoolJob* job) {
+    if (job) {
+        atomic_store(&job->cancelled, true);
+    }
+}
+
+void work_pool_dispose(void) {
+    if (!g_pool.active) {
+        return;
+    }
+
+    g_pool.active = false;
+    stop_workers(g_pool.count);
+}
+
+/* ============= Internal Functions Implementation ============= */
+
+static void* worker_thread(void* arg) {
+    WorkPoolWorker* self = (WorkPoolWorker*)arg;
+
+    for (;;) {
+        WorkPoolJob* job = take_job(self, false);
+        for (size_t i = 1; !job && i < g_pool.count; i++) {
+            job = take_job(&g_pool.workers[(self->index + i) % g_pool.count],
+                           true);
+            if (job) {
+                metrics_inc(g_pool.metric_steals);
+            }
+        }
+
+        if (job) {
+            run_job(job);
+            continue;
+        }
+
+        pthread_mutex_lock(&g_pool.idle_lock);
+        while (atomic_load(&g_pool.queued) == 0 &&
+               atomic_load(&g_pool.running)) {
+            pthread_cond_wait(&g_pool.idle, &g_pool.idle_lock);
+        }
+        bool stop =
+            atomic_load(&g_pool.queued) == 0 && !atomic_load(&g_pool.running);
+        pthread_mutex_unlock(&g_pool.idle_lock);
+
+        if (stop) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* The owner takes the oldest job, a thief the newest */
+static WorkPoolJob* take_job(WorkPoolWorker* from, bool steal) {
+    if (atomic_load_explicit(&from->length, memory_order_relaxed) == 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&from->lock);
+    WorkPoolJob* job = steal ? from->tail : from->head;
+    if (job) {
+        if (job->prev) {
+            job->prev->next = job->next;
+        } else {
+            from->head = job->next;
+        }
+        if (job->next) {
+            job->next->prev = job->prev;
+        } else {
+            from->tail = job->prev;
+        }
+        job->next = NULL;
+        job->prev = NULL;
+        atomic_fetch_sub(&from->length, 1);
+    }
+    pthread_mutex_unlock(&from->lock);
+
+    if (job) {
+        atomic_fetch_sub(&g_pool.queued, 1);
+        metrics_gauge_add(g_pool.metric_queued, -1);
+    }
+    return job;
+}
+
+/* Jobs still queued at shutdown are finished without running */
+static void run_job(WorkPoolJob* job) {
+    metrics_observe(g_pool.metric_wait, metrics_now_us() - job->queued_us);
+
+    if (!atomic_load(&job->cancelled) && atomic_load(&g_pool.running)) {
+        job->run(job->context);
+    } else {
+        atomic_store(&job->cancelled, true);
+    }
+
+    finish_job(job);
+}
+
+/* Push onto the finished list, for the smw task to pick up on its next
+ * pass */
+static void finish_job(WorkPoolJob* job) {
+    WorkPoolJob* head =
+        atomic_load_explicit(&g_pool.finished, memory_order_relaxed);
+    do {
+        job->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&g_pool.finished, &head,
+                                                    job, memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+static void work_pool_task_work(void* context, uint64_t mon_time) {
+    (void)context;
+    (void)mon_time;
+
+    /* Only a plain load per pass while nothing has finished */
+    if (atomic_load_explicit(&g_pool.finished, memory_order_relaxed)) {
+        drain_finished();
+    }
+}
+
+static void drain_finished(void) {
+    WorkPoolJob* job =
+        atomic_exchange_explicit(&g_pool.finished, NULL, memory_order_acquire);
+
+    /* Oldest first */
+    WorkPoolJob* ordered = NULL;
+    while (job) {
+        WorkPoolJob* next = job->next;
+        job->next         = ordered;
+        ordered           = job;
+        job               = next;
+    }
+
+    while (ordered) {
+        WorkPoolJob* next = ordered->next;
+        ordered->done(ordered->context, atomic_load(&ordered->cancelled));
+        metrics_inc(g_pool.metric_jobs);
+        free(ordered);
+        ordered = next;
+    }
+}
+
+/* Join the first started workers, then run the done callbacks of every job
+ * they finished. Workers only exit once all queues are empty, finishing the
+ * jobs left in them without running them. */
+static void stop_workers(size_t started) {
+    pthread_mutex_lock(&g_pool.idle_lock);
+    atomic_store(&g_pool.running, false);
+    pthread_cond_broadcast(&g_pool.idle);
+    pthread_mutex_unlock(&g_pool.idle_lock);
+
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(g_pool.workers[i].thread, NULL);
+    }
+
+    drain_finished();
+
+    if (g_pool.task) {
+        smw_destroy_task(g_pool.task);
+        g_pool.task = NULL;
+    }
+
+    for (size_t i = 0; i < started; i++) {
+        pthread_mutex_destroy(&g_pool.workers[i].lock);
+    }
+    pthread_cond_destroy(&g_pool.idle);
+    pthread_mutex_destroy(&g_pool.idle_lock);
+
+    free(g_pool.workers);
+    g_pool.workers = NULL;
+    g_pool.count   = 0;
+}
@@ -0,0 +1,74 @@
+/**
+ * work_pool.h - Worker threads for CPU-heavy work off the smw loop
+ *
+ * Handlers on the smw thread submit a job: a function to run on a worker
+ * and a done callback to run back on the smw thread with the result. Each
+ * worker has its own deque of jobs, filled round-robin. A worker takes its
+ * own jobs from the head, oldest first, and once it has none steals from
+ * the tail of another worker's deque, so one long job does not hold up the
+ * jobs queued behind it while other workers are idle. Idle workers sleep on
+ * a condition variable.
+ *
+ * Finished jobs are pushed onto a lock-free multi-producer list. An
+ * I/O-class smw task checks it with one atomic load per pass, takes the
+ * whole list with one atomic exchange when it is non-empty and runs the
+ * done callbacks, so they can touch loop state without locks.
+ */
+
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Most workers work_pool_init starts */
+#define WORK_POOL_MAX_WORKERS 64
+
+/* Jobs queued and not yet started before work_pool_submit refuses more */
+#define WORK_POOL_MAX_QUEUED 1024
+
+typedef struct WorkPoolJob WorkPoolJob;
+
+/* Runs on a worker thread. Must not touch smw loop state. */
+typedef void (*WorkPoolRun)(void* context);
+
+/* Runs on the smw thread once the job is finished, or right away when it
+ * was cancelled or the pool shut down before it ran (cancelled is set, run
+ * may not have been called). The job handle is freed after it returns. */
+typedef void (*WorkPoolDone)(void* context, bool cancelled);
+
+/**
+ * Start the workers and the smw task that runs done callbacks
+ *
+ * @param workers Number of worker threads; 0 leaves the pool inactive
+ * @return 0 on success, -1 on error
+ */
+int work_pool_init(size_t workers);
+
+bool work_pool_active(void);
+
+/**
+ * Queue a job. Only call from the smw thread.
+ *
+ * @param run Work to do on a worker
+ * @param done Called on the smw thread afterwards
+ * @param context Passed to both
+ * @return Handle valid until done is called, or NULL when the pool is not
+ * active or too many jobs are queued; neither callback is called then
+ */
+WorkPoolJob* work_pool_submit(WorkPoolRun run, WorkPoolDone done,
+                              void* context);
+
+/**
+ * Ask for a job to be skipped. run is not called if it has not started;
+ * done is called either way, with cancelled set.
+ */
+void work_pool_cancel(WorkPoolJob* job);
+
+/**
+ * Stop the workers. Jobs not started yet are cancelled; every pending done
+ * callback is called before this returns.
+ */
+void work_pool_dispose(void);
+
+#endif /* WORK_POOL_H */
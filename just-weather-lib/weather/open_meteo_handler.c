@@ -6,7 +6,6 @@
 #include "open_meteo_api.h"
 #include "response_builder.h"
 
-#include <jansson.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,20 +20,20 @@ int open_meteo_handler_init(void) {
 }
 
 /* Handle GET /v1/current endpoint */
-int open_meteo_handler_current(const char* query_string, char** response_json,
+int open_meteo_handler_current(const char* query_string, JsonWriter* writer,
                                int* status_code) {
-    if (!response_json || !status_code) {
+    if (!writer || !status_code) {
         return -1;
     }
 
-    *response_json = NULL;
-    *status_code   = HTTP_INTERNAL_ERROR;
+    *status_code = HTTP_INTERNAL_ERROR;
 
     /* Parse query parameters */
     float lat, lon;
     if (open_meteo_api_parse_query(query_string, &lat, &lon) != 0) {
-        *response_json = response_builder_error(
-            HTTP_BAD_REQUEST, response_builder_get_error_type(HTTP_BAD_REQUEST),
+        response_builder_write_error(
+            writer, HTTP_BAD_REQUEST,
+            response_builder_get_error_type(HTTP_BAD_REQUEST),
             "Invalid query parameters. Expected format: "
             "lat=XX.XXXX&lon=YY.YYYY");
         *status_code = HTTP_BAD_REQUEST;
@@ -50,70 +49,20 @@ int open_meteo_handler_current(const char* query_string, char** response_json,
     int          result = open_meteo_api_get_current(&location, &weather_data);
 
     if (result != 0 || !weather_data) {
-        *response_json = response_builder_error(
-            HTTP_INTERNAL_ERROR,
+        response_builder_write_error(
+            writer, HTTP_INTERNAL_ERROR,
             response_builder_get_error_type(HTTP_INTERNAL_ERROR),
             "Failed to fetch weather data from Open-Meteo API");
         *status_code = HTTP_INTERNAL_ERROR;
         return -1;
     }
 
-    /* Build structured JSON response */
-    json_t* data = json_object();
-
-    /* Weather data - add first (order matches documentation) */
-    json_t* weather_obj = json_object();
-    json_object_set_new(weather_obj, "temperature",
-                        json_real(weather_data->temperature));
-    json_object_set_new(weather_obj, "temperature_unit",
-                        json_string(weather_data->temperature_unit));
-    json_object_set_new(weather_obj, "windspeed",
-                        json_real(weather_data->windspeed));
-    json_object_set_new(weather_obj, "windspeed_unit",
-                        json_string(weather_data->windspeed_unit));
-    json_object_set_new(weather_obj, "wind_direction_10m",
-                        json_integer(weather_data->winddirection));
-    json_object_set_new(weather_obj, "wind_direction_name",
-                        json_string(open_meteo_api_get_wind_direction(
-                            weather_data->winddirection)));
-    json_object_set_new(weather_obj, "weather_code",
-                        json_integer(weather_data->weather_code));
-    json_object_set_new(weather_obj, "weather_description",
-                        json_string(open_meteo_api_get_description(
-                            weather_data->weather_code)));
-    json_object_set_new(weather_obj, "is_day",
-                        json_integer(weather_data->is_day ? 1 : 0));
-    json_object_set_new(weather_obj, "precipitation",
-                        json_real(weather_data->precipitation));
-    json_object_set_new(weather_obj, "precipitation_unit", json_string("mm"));
-    json_object_set_new(weather_obj, "humidity",
-                        json_real(weather_data->humidity));
-    json_object_set_new(weather_obj, "pressure",
-                        json_real(weather_data->pressure));
-
-    /* Format time as "YYYY-MM-DDTHH:MM" */
-    time_t     now     = time(NULL);
-    struct tm* tm_info = localtime(&now);
-    char       time_str[32];
-    strftime(time_str, sizeof(time_str), "%Y-%m-%dT%H:%M", tm_info);
-    json_object_set_new(weather_obj, "time", json_string(time_str));
-
-    json_object_set_new(data, "current_weather", weather_obj);
-
-    /* Location information - add last */
-    json_t* location_obj = json_object();
-    json_object_set_new(location_obj, "latitude", json_real(lat));
-    json_object_set_new(location_obj, "longitude", json_real(lon));
-    json_object_set_new(data, "location", location_obj);
+    open_meteo_handler_write_current(writer, weather_data, lat, lon);
 
     /* Cleanup weather data */
     open_meteo_api_free_current(weather_data);
 
-    /* Build standardized response */
-    *response_json = response_builder_success(data);
-
-    if (!*response_json) {
-        json_decref(data);
+    if (json_writer_finish(writer) != 0) {
         *status_code = HTTP_INTERNAL_ERROR;
         return -1;
     }
@@ -122,5 +71,67 @@ int open_meteo_handler_current(const char* query_string, char** response_json,
     return 0;
 }
 
+/* Stream the /v1/current success body */
+void open_meteo_handler_write_current(JsonWriter*        writer,
+                                      const WeatherData* weather_data,
+                                      double latitude, double longitude) {
+    /* Stream structured JSON response */
+    response_builder_begin_success(writer);
+    json_writer_begin_object(writer);
+
+    /* Weather data - add first (order matches documentation) */
+    json_writer_key(writer, "current_weather");
+    json_writer_begin_object(writer);
+    json_writer_key(writer, "temperature");
+    json_writer_number(writer, weather_data->temperature);
+    json_writer_key(writer, "temperature_unit");
+    json_writer_string(writer, weather_data->temperature_unit);
+    json_writer_key(writer, "windspeed");
+    json_writer_number(writer, weather_data->windspeed);
+    json_writer_key(writer, "windspeed_unit");
+    json_writer_string(writer, weather_data->windspeed_unit);
+    json_writer_key(writer, "wind_direction_10m");
+    json_writer_integer(writer, weather_data->winddirection);
+    json_writer_key(writer, "wind_direction_name");
+    json_writer_string(writer, open_meteo_api_get_wind_direction(
+                                   weather_data->winddirection));
+    json_writer_key(writer, "weather_code");
+    json_writer_integer(writer, weather_data->weather_code);
+    json_writer_key(writer, "weather_description");
+    json_writer_string(
+        writer, open_meteo_api_get_description(weather_data->weather_code));
+    json_writer_key(writer, "is_day");
+    json_writer_integer(writer, weather_data->is_day ? 1 : 0);
+    json_writer_key(writer, "precipitation");
+    json_writer_number(writer, weather_data->precipitation);
+    json_writer_key(writer, "precipitation_unit");
+    json_writer_string(writer, "mm");
+    json_writer_key(writer, "humidity");
+    json_writer_number(writer, weather_data->humidity);
+    json_writer_key(writer, "pressure");
+    json_writer_number(writer, weather_data->pressure);
+
+    /* Format time as "YYYY-MM-DDTHH:MM" */
+    time_t     now     = time(NULL);
+    struct tm* tm_info = localtime(&now);
+    char       time_str[32];
+    strftime(time_str, sizeof(time_str), "%Y-%m-%dT%H:%M", tm_info);
+    json_writer_key(writer, "time");
+    json_writer_string(writer, time_str);
+    json_writer_end_object(writer);
+
+    /* Location information - add last */
+    json_writer_key(writer, "location");
+    json_writer_begin_object(writer);
+    json_writer_key(writer, "latitude");
+    json_writer_number(writer, latitude);
+    json_writer_key(writer, "longitude");
+    json_writer_number(writer, longitude);
+    json_writer_end_object(writer);
+
+    json_writer_end_object(writer);
+    response_builder_end_success(writer);
+}
+
 /* Cleanup weather server module */
 void open_meteo_handler_cleanup(void) { open_meteo_api_cleanup(); }
@@ -4,6 +4,9 @@
 #ifndef OPEN_METEO_HANDLER_H
 #define OPEN_METEO_HANDLER_H
 
+#include "json_writer.h"
+#include "open_meteo_api.h"
+
 /**
  * Initialize the weather server module
  * Must be called before handling requests
@@ -16,22 +19,41 @@ int open_meteo_handler_init(void);
  * Handle GET /v1/current endpoint
  *
  * @param query_string Query parameters (e.g., "lat=37.7749&long=-122.4194")
- * @param response_json Output parameter - allocated JSON response string
- * (caller must free)
+ * @param writer Output parameter - the JSON response (success or error) is
+ * streamed into this writer
  * @param status_code Output parameter - HTTP status code
  *
  * @return 0 on success, -1 on error
  *
- * Example usage in http_server.c:
- *   char* json = NULL;
+ * Example usage:
+ *   JsonWriter writer;
  *   int status = 0;
- *   open_meteo_handler_current("lat=37.7749&long=-122.4194", &json, &status);
- *   send_http_response(client_fd, status, "application/json", json);
- *   free(json);
+ *   json_writer_init(&writer, 0, false);
+ *   open_meteo_handler_current("lat=37.7749&long=-122.4194", &writer,
+ *                              &status);
+ *   if (json_writer_finish(&writer) == 0) {
+ *       size_t      length = 0;
+ *       const char* json   = json_writer_data(&writer, &length);
+ *       // Answer with status and the length bytes at json
+ *   }
+ *   json_writer_dispose(&writer);
  */
-int open_meteo_handler_current(const char* query_string, char** response_json,
+int open_meteo_handler_current(const char* query_string, JsonWriter* writer,
                                int* status_code);
 
+/**
+ * Stream the success body of GET /v1/current for already fetched weather
+ * data. Does not finish the writer.
+ *
+ * @param writer Writer to append to
+ * @param weather_data Current weather at the location
+ * @param latitude Requested latitude
+ * @param longitude Requested longitude
+ */
+void open_meteo_handler_write_current(JsonWriter*        writer,
+                                      const WeatherData* weather_data,
+                                      double latitude, double longitude);
+
 /**
  * Cleanup the weather server module
  * Should be called on server shutdown
@@ -4,27 +4,29 @@
 
 #include "response_builder.h"
 
-#include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+
+static void  write_value(JsonWriter* writer, json_t* value);
+static char* finish_string(JsonWriter* writer);
 
 char* response_builder_success(json_t* data_object) {
     if (!data_object) {
         return NULL;
     }
 
-    json_t* root = json_object();
-    if (!root) {
+    JsonWriter writer;
+    if (json_writer_init(&writer, 0, false) != 0) {
+        json_decref(data_object);
         return NULL;
     }
 
-    json_object_set_new(root, "success", json_true());
-    json_object_set_new(root, "data", data_object);
-
-    char* json_str = json_dumps(root, JSON_INDENT(2) | JSON_PRESERVE_ORDER);
-    json_decref(root);
+    response_builder_begin_success(&writer);
+    write_value(&writer, data_object);
+    response_builder_end_success(&writer);
+    json_decref(data_object);
 
-    return json_str;
+    return finish_string(&writer);
 }
 
 char* response_builder_error(int code, const char* error_type,
@@ -33,24 +35,77 @@ char* response_builder_error(int code, const char* error_type,
         return NULL;
     }
 
-    json_t* root = json_object();
-    if (!root) {
+    JsonWriter writer;
+    if (json_writer_init(&writer, 0, false) != 0) {
         return NULL;
     }
 
-    json_object_set_new(root, "success", json_false());
+    response_builder_write_error(&writer, code, error_type, message);
+
+    return finish_string(&writer);
+}
 
-    json_t* error_obj = json_object();
-    json_object_set_new(error_obj, "code", json_integer(code));
-    json_object_set_new(error_obj, "type", json_string(error_type));
-    json_object_set_new(error_obj, "message", json_string(message));
+void response_builder_begin_success(JsonWriter* writer) {
+    json_writer_begin_object(writer);
+    json_writer_key(writer, "success");
+    json_writer_bool(writer, true);
+    json_writer_key(writer, "data");
+}
 
-    json_object_set_new(root, "error", error_obj);
+void response_builder_end_success(JsonWriter* writer) {
+    json_writer_end_object(writer);
+}
 
-    char* json_str = json_dumps(root, JSON_INDENT(2) | JSON_PRESERVE_ORDER);
-    json_decref(root);
+void response_builder_write_error(JsonWriter* writer, int code,
+                                  const char* error_type,
+                                  const char* message) {
+    json_writer_reset(writer);
 
-    return json_str;
+    json_writer_begin_object(writer);
+    json_writer_key(writer, "success");
+    json_writer_bool(writer, false);
+
+    json_writer_key(writer, "error");
+    json_writer_begin_object(writer);
+    json_writer_key(writer, "code");
+    json_writer_integer(writer, code);
+    json_writer_key(writer, "type");
+    json_writer_string(writer, error_type);
+    json_writer_key(writer, "message");
+    json_writer_string(writer, message);
+    json_writer_end_object(writer);
+
+    json_writer_end_object(writer);
+}
+
+ResponseFormat response_builder_negotiate_format(const char* pretty_param,
+                                                 const char* accept,
+                                                 size_t      accept_len) {
+    if (pretty_param) {
+        if (pretty_param[0] == '\0' || strcmp(pretty_param, "1") == 0 ||
+            strcmp(pretty_param, "true") == 0) {
+            return RESPONSE_FORMAT_PRETTY;
+        }
+        if (strcmp(pretty_param, "0") == 0 ||
+            strcmp(pretty_param, "false") == 0) {
+            return RESPONSE_FORMAT_COMPACT;
+        }
+    }
+
+    /* Browsers ask for text/html first; API clients and curl do not */
+    static const char BROWSER_TYPE[] = "text/html";
+    size_t            type_len       = sizeof(BROWSER_TYPE) - 1;
+    for (size_t i = 0; accept && i + type_len <= accept_len; i++) {
+        if (strncasecmp(accept + i, BROWSER_TYPE, type_len) == 0) {
+            return RESPONSE_FORMAT_PRETTY;
+        }
+    }
+
+    return RESPONSE_FORMAT_COMPACT;
+}
+
+const char* response_builder_format_name(ResponseFormat format) {
+    return format == RESPONSE_FORMAT_PRETTY ? "pretty" : "compact";
 }
 
 const char* response_builder_get_error_type(int code) {
@@ -59,11 +114,71 @@ const char* response_builder_get_error_type(int code) {
         return "Bad Request";
     case HTTP_NOT_FOUND:
         return "Not Found";
+    case HTTP_TOO_MANY_REQUESTS:
+        return "Too Many Requests";
     case HTTP_INTERNAL_ERROR:
         return "Internal Server Error";
+    case HTTP_SERVICE_UNAVAILABLE:
+        return "Service Unavailable";
     case HTTP_OK:
         return "OK";
+    case HTTP_NOT_MODIFIED:
+        return "Not Modified";
     default:
         return "Unknown Error";
     }
 }
+
+/* Stream a jansson value; objects keep their insertion order */
+static void write_value(JsonWriter* writer, json_t* value) {
+    switch (json_typeof(value)) {
+    case JSON_OBJECT: {
+        const char* key;
+        json_t*     member;
+        json_writer_begin_object(writer);
+        json_object_foreach(value, key, member) {
+            json_writer_key(writer, key);
+            write_value(writer, member);
+        }
+        json_writer_end_object(writer);
+        break;
+    }
+    case JSON_ARRAY: {
+        size_t  index;
+        json_t* element;
+        json_writer_begin_array(writer);
+        json_array_foreach(value, index, element) {
+            write_value(writer, element);
+        }
+        json_writer_end_array(writer);
+        break;
+    }
+    case JSON_STRING:
+        json_writer_string(writer, json_string_value(value));
+        break;
+    case JSON_INTEGER:
+        json_writer_integer(writer, (long long)json_integer_value(value));
+        break;
+    case JSON_REAL:
+        json_writer_number(writer, json_real_value(value));
+        break;
+    case JSON_TRUE:
+    case JSON_FALSE:
+        json_writer_bool(writer, json_is_true(value));
+        break;
+    default:
+        json_writer_null(writer);
+        break;
+    }
+}
+
+/* Finish the writer and hand its text to the caller, NUL-terminated */
+static char* finish_string(JsonWriter* writer) {
+    char* json_str = NULL;
+    if (json_writer_finish(writer) == 0) {
+        json_str = (char*)json_writer_detach(writer, NULL);
+    }
+    json_writer_dispose(writer);
+
+    return json_str;
+}
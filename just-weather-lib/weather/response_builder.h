@@ -8,18 +8,32 @@
 #ifndef RESPONSE_BUILDER_H
 #define RESPONSE_BUILDER_H
 
+#include "json_writer.h"
+
 #include <jansson.h>
 
 /* HTTP status codes */
 #define HTTP_OK 200
+#define HTTP_NOT_MODIFIED 304
 #define HTTP_BAD_REQUEST 400
 #define HTTP_NOT_FOUND 404
+#define HTTP_TOO_MANY_REQUESTS 429
 #define HTTP_INTERNAL_ERROR 500
+#define HTTP_SERVICE_UNAVAILABLE 503
+
+/* JSON layout of a response body */
+typedef enum {
+    RESPONSE_FORMAT_COMPACT, /* Default: no whitespace, for machine clients */
+    RESPONSE_FORMAT_PRETTY,  /* Two-space indentation, for humans */
+} ResponseFormat;
 
 /**
  * Build a standardized success response
  *
- * @param data_object The JSON object containing endpoint-specific data
+ * Written with a JsonWriter in compact form, like the streamed responses.
+ *
+ * @param data_object The JSON object containing endpoint-specific data;
+ * the reference is stolen
  * @return JSON string (caller must free), or NULL on error
  */
 char* response_builder_success(json_t* data_object);
@@ -27,6 +41,8 @@ char* response_builder_success(json_t* data_object);
 /**
  * Build a standardized error response
  *
+ * Written with response_builder_write_error() in compact form.
+ *
  * @param code HTTP status code (400, 404, 500, etc.)
  * @param error_type Error type string ("Bad Request", "Not Found", etc.)
  * @param message Detailed error message
@@ -35,6 +51,56 @@ char* response_builder_success(json_t* data_object);
 char* response_builder_error(int code, const char* error_type,
                              const char* message);
 
+/**
+ * Begin a standardized success response in a streaming writer
+ *
+ * Writes the envelope up to the "data" member; the caller writes the data
+ * value next and then calls response_builder_end_success().
+ *
+ * @param writer Writer positioned at the start of the document
+ */
+void response_builder_begin_success(JsonWriter* writer);
+
+/**
+ * Finish a success response started with response_builder_begin_success()
+ */
+void response_builder_end_success(JsonWriter* writer);
+
+/**
+ * Write a standardized error response into a streaming writer
+ *
+ * Anything already written is discarded first, so handlers can bail out at
+ * any point.
+ *
+ * @param writer Writer to write into
+ * @param code HTTP status code (400, 404, 500, etc.)
+ * @param error_type Error type string ("Bad Request", "Not Found", etc.)
+ * @param message Detailed error message
+ */
+void response_builder_write_error(JsonWriter* writer, int code,
+                                  const char* error_type, const char* message);
+
+/**
+ * Choose between compact and pretty output for a request
+ *
+ * An explicit pretty query value wins ("1"/"true"/empty or "0"/"false").
+ * Otherwise browsers (Accept containing text/html) get pretty output and
+ * everyone else gets compact output.
+ *
+ * @param pretty_param Value of the pretty query parameter, or NULL if absent
+ * @param accept Accept header value (not NUL-terminated), or NULL
+ * @param accept_len Length of the Accept header value
+ * @return Negotiated format
+ */
+ResponseFormat response_builder_negotiate_format(const char* pretty_param,
+                                                 const char* accept,
+                                                 size_t      accept_len);
+
+/**
+ * Helper: Short name of a format, used to key cached variants
+ */
+const char* response_builder_format_name(ResponseFormat format);
+
 /**
  * Helper: Get error type string from HTTP status code
  */
@@ -0,0 +1,845 @@
+/**
+ * response_cache.c - Implementation of the response cache
+ */
+
+#include "response_cache.h"
+
+#include "cache_store.h"
+#include "deflate.h"
+#include "log.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* Every cached blob starts with this header, followed by the body */
+typedef struct {
+    uint32_t encoding;  /* HttpContentEncoding of the body */
+    uint32_t stale_for; /* Seconds the blob is kept after it expires */
+    uint64_t version; /* Hash of the identity body, shared by all variants */
+} ResponseCacheHeader;
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/* Slots of the key index, a power of two at least twice the live plus stale
+ * capacity so probe sequences stay short */
+#define INDEX_SIZE 2048
+
+/* Compressed variants kept per entry: gzip and deflate */
+#define VARIANT_COUNT 2
+
+/* Keys written to the store per batch at most */
+#define PERSIST_BATCH 64
+
+typedef struct {
+    uint8_t* body; /* NULL when compression did not pay off */
+    size_t   length;
+    bool     done; /* Compression was attempted for this version */
+} ResponseCacheVariant;
+
+typedef struct ResponseCacheEntry {
+    char*    key;
+    uint64_t hash;       /* Hash of the key */
+    uint8_t* blob;       /* Header followed by the identity body */
+    size_t   blob_len;
+    time_t   expiry;     /* When the entry stops being fresh */
+    time_t   kept_until; /* End of its stale period */
+    bool     stale;      /* On the stale list instead of the live one */
+    bool     queued;     /* Waiting in the persist queue */
+
+    ResponseCacheVariant variants[VARIANT_COUNT];
+
+    struct ResponseCacheEntry* prev; /* Towards the most recently used */
+    struct ResponseCacheEntry* next;
+} ResponseCacheEntry;
+
+/* Entries in order of use, most recently used first */
+typedef struct {
+    ResponseCacheEntry* head;
+    ResponseCacheEntry* tail;
+    size_t              count;
+    size_t              capacity;
+} ResponseCacheList;
+
+typedef struct {
+    ResponseCacheEntry** index; /* Open addressing by key hash */
+    ResponseCacheList    live;  /* Fresh entries, evicted in LRU order */
+    ResponseCacheList    stale; /* Expired or evicted identity bodies */
+    int64_t              bytes; /* Blobs and variants of all entries */
+
+    MetricId metric_hits;
+    MetricId metric_misses;
+    MetricId metric_evictions;
+    MetricId metric_bytes;
+    MetricId metric_entries;
+    MetricId metric_stale_entries;
+} ResponseCache;
+
+static ResponseCache g_cache = {0};
+
+/* Persistent copy of the identity bodies, when opened */
+static CacheStore g_response_store;
+static bool       g_response_store_open = false;
+
+/* Keys put since the store was last written, by response_cache_maintain
+ * instead of on every put */
+static char   g_persist_pending[PERSIST_BATCH][RESPONSE_CACHE_KEY_MAX];
+static size_t g_persist_count = 0;
+
+/* ============= Internal Functions ============= */
+
+static ResponseCacheEntry* find_entry(const char* key);
+static ResponseCacheEntry* find_fresh(const char* key, time_t now);
+static ResponseCacheEntry* set_entry(const char* key, uint8_t* blob,
+                                     size_t blob_len, time_t expiry,
+                                     time_t kept_until);
+static void                index_insert(ResponseCacheEntry* entry);
+static void                index_remove(ResponseCacheEntry* entry);
+static void                list_push(ResponseCacheList*  list,
+                                     ResponseCacheEntry* entry);
+static void                list_unlink(ResponseCacheList*  list,
+                                       ResponseCacheEntry* entry);
+static void                touch_entry(ResponseCacheEntry* entry);
+static void                demote_entry(ResponseCacheEntry* entry);
+static void                stale_push(ResponseCacheEntry* entry);
+static void                drop_entry(ResponseCacheEntry* entry);
+static void                clear_variants(ResponseCacheEntry* entry);
+static void                set_variant(ResponseCacheEntry* entry, int slot,
+                                       uint8_t* body, size_t length);
+static void                update_gauges(void);
+static int                 variant_slot(HttpContentEncoding encoding);
+static uint8_t*            make_blob(const uint8_t* body, size_t length,
+                                     uint64_t version, size_t* blob_len);
+static const uint8_t*      entry_body(const ResponseCacheEntry* entry,
+                                      size_t* length, uint64_t* version);
+static uint64_t            hash_body(const uint8_t* body, size_t length);
+static void                fill_info(ResponseCacheInfo* info, uint64_t version,
+                                     time_t expiry);
+static void                persist_blob(ResponseCacheEntry* entry);
+static void                persist_pending(void);
+static void                load_blob(const char* key, const void* blob,
+                                     size_t length, time_t expiry,
+                                     void* context);
+static int                 ensure_parent_dir(const char* path);
+
+/* ============= Public API Implementation ============= */
+
+int response_cache_init(void) {
+    if (g_cache.index) {
+        return 0;
+    }
+
+    g_cache.index = calloc(INDEX_SIZE, sizeof(ResponseCacheEntry*));
+    if (!g_cache.index) {
+        return -1;
+    }
+    g_cache.live.capacity  = RESPONSE_CACHE_MAX_ENTRIES;
+    g_cache.stale.capacity = RESPONSE_CACHE_MAX_STALE_ENTRIES;
+
+    const char* labels = "cache=\"responses\"";
+    g_cache.metric_hits =
+        metrics_register(METRIC_COUNTER, "just_weather_cache_hits_total",
+                         labels, "Cache lookups that found a live entry");
+    g_cache.metric_misses =
+        metrics_register(METRIC_COUNTER, "just_weather_cache_misses_total",
+                         labels, "Cache lookups that found nothing or expired");
+    g_cache.metric_evictions = metrics_register(
+        METRIC_COUNTER, "just_weather_cache_evictions_total", labels,
+        "Entries dropped to make room for new ones");
+    g_cache.metric_bytes =
+        metrics_register(METRIC_GAUGE, "just_weather_cache_bytes", labels,
+                         "Bytes of cached data");
+    g_cache.metric_entries =
+        metrics_register(METRIC_GAUGE, "just_weather_cache_entries", labels,
+                         "Number of cached entries");
+    g_cache.metric_stale_entries = metrics_register(
+        METRIC_GAUGE, "just_weather_cache_stale_entries", labels,
+        "Expired entries kept as a fallback for when upstream is down");
+    return 0;
+}
+
+int response_cache_open_store(const char* path) {
+    if (!g_cache.index || !path || g_response_store_open) {
+        return -1;
+    }
+
+    if (ensure_parent_dir(path) != 0 ||
+        cache_store_open(&g_response_store, path) != 0) {
+        return -1;
+    }
+    g_response_store_open = true;
+
+    size_t loaded = 0;
+    cache_store_foreach(&g_response_store, load_blob, &loaded);
+    return (int)loaded;
+}
+
+void response_cache_maintain(void) {
+    if (!g_cache.index) {
+        return;
+    }
+
+    /* Retire entries nobody asked for since they expired */
+    time_t              now   = time(NULL);
+    ResponseCacheEntry* entry = g_cache.live.head;
+    while (entry) {
+        ResponseCacheEntry* next = entry->next;
+        if (now > entry->expiry) {
+            demote_entry(entry);
+        }
+        entry = next;
+    }
+
+    entry = g_cache.stale.head;
+    while (entry) {
+        ResponseCacheEntry* next = entry->next;
+        if (now > entry->kept_until) {
+            drop_entry(entry);
+        }
+        entry = next;
+    }
+    update_gauges();
+
+    if (g_response_store_open) {
+        persist_pending();
+        cache_store_maintain(&g_response_store);
+    }
+}
+
+int response_cache_put(const char* key, const uint8_t* body, size_t length,
+                       time_t ttl) {
+    if (!g_cache.index || !key || !body) {
+        return -1;
+    }
+
+    size_t   blob_len = 0;
+    uint8_t* blob = make_blob(body, length, hash_body(body, length), &blob_len);
+    if (!blob) {
+        return -1;
+    }
+
+    time_t              expiry = time(NULL) + ttl;
+    ResponseCacheEntry* entry  = set_entry(key, blob, blob_len, expiry,
+                                           expiry + RESPONSE_CACHE_STALE_TTL);
+    if (!entry) {
+        return -1;
+    }
+
+    persist_blob(entry);
+    return 0;
+}
+
+const uint8_t* response_cache_get(const char* key, HttpContentEncoding encoding,
+                                  size_t*              length,
+                                  HttpContentEncoding* body_encoding,
+                                  ResponseCacheInfo*   info) {
+    if (!g_cache.index || !key || !length || !body_encoding) {
+        return NULL;
+    }
+
+    ResponseCacheEntry* entry = find_fresh(key, time(NULL));
+    if (!entry) {
+        metrics_inc(g_cache.metric_misses);
+        return NULL;
+    }
+    metrics_inc(g_cache.metric_hits);
+    touch_entry(entry);
+
+    size_t         identity_len = 0;
+    uint64_t       version      = 0;
+    const uint8_t* identity     = entry_body(entry, &identity_len, &version);
+    fill_info(info, version, entry->expiry);
+
+    int slot = variant_slot(encoding);
+    if (slot >= 0 && identity_len >= RESPONSE_CACHE_MIN_COMPRESS_SIZE) {
+        ResponseCacheVariant* variant = &entry->variants[slot];
+        if (!variant->done) {
+            /* First request for this variant: compress once */
+            uint8_t* compressed     = NULL;
+            size_t   compressed_len = 0;
+            if (response_cache_compress(identity, identity_len, encoding,
+                                        &compressed, &compressed_len) != 0) {
+                compressed = NULL;
+            }
+            set_variant(entry, slot, compressed, compressed_len);
+        }
+
+        if (variant->body) {
+            *length        = variant->length;
+            *body_encoding = encoding;
+            return variant->body;
+        }
+    }
+
+    *length        = identity_len;
+    *body_encoding = HTTP_CONTENT_ENCODING_IDENTITY;
+    return identity;
+}
+
+const uint8_t* response_cache_get_uncompressed(const char*         key,
+                                               HttpContentEncoding encoding,
+                                               size_t*             length,
+                                               ResponseCacheInfo*  info) {
+    int slot = variant_slot(encoding);
+    if (!g_cache.index || !key || !length || slot < 0) {
+        return NULL;
+    }
+
+    ResponseCacheEntry* entry = find_fresh(key, time(NULL));
+    if (!entry || entry->variants[slot].done) {
+        return NULL;
+    }
+
+    size_t         identity_len = 0;
+    uint64_t       version      = 0;
+    const uint8_t* identity     = entry_body(entry, &identity_len, &version);
+    if (identity_len < RESPONSE_CACHE_MIN_COMPRESS_SIZE) {
+        return NULL;
+    }
+
+    fill_info(info, version, entry->expiry);
+    *length = identity_len;
+    return identity;
+}
+
+int response_cache_put_variant(const char* key, HttpContentEncoding encoding,
+                               uint64_t version, const uint8_t* body,
+                               size_t length) {
+    int slot = variant_slot(encoding);
+    if (!g_cache.index || !key || slot < 0) {
+        return -1;
+    }
+
+    /* The entry may have been refreshed or dropped while compressing */
+    ResponseCacheEntry* entry            = find_fresh(key, time(NULL));
+    size_t              identity_len     = 0;
+    uint64_t            identity_version = 0;
+    if (!entry) {
+        return -1;
+    }
+    entry_body(entry, &identity_len, &identity_version);
+    if (identity_version != version) {
+        return -1;
+    }
+
+    uint8_t* copy = NULL;
+    if (body) {
+        copy = malloc(length);
+        if (!copy) {
+            return -1;
+        }
+        memcpy(copy, body, length);
+    }
+
+    set_variant(entry, slot, copy, length);
+    return 0;
+}
+
+const uint8_t* response_cache_get_stale(const char* key, size_t* length,
+                                        time_t* stale_seconds) {
+    if (!g_cache.index || !key || !length) {
+        return NULL;
+    }
+
+    time_t              now   = time(NULL);
+    ResponseCacheEntry* entry = find_entry(key);
+    if (!entry) {
+        return NULL;
+    }
+    if (now > entry->kept_until) {
+        drop_entry(entry);
+        update_gauges();
+        return NULL;
+    }
+
+    uint64_t       version = 0;
+    const uint8_t* body    = entry_body(entry, length, &version);
+    if (stale_seconds) {
+        time_t stale   = now - entry->expiry;
+        *stale_seconds = stale > 0 ? stale : 0;
+    }
+    return body;
+}
+
+void response_cache_etag(const ResponseCacheInfo* info,
+                         HttpContentEncoding encoding, char* out,
+                         size_t out_size) {
+    const char* coding = http_content_encoding_name(encoding);
+    if (coding) {
+        snprintf(out, out_size, "\"%016llx-%s\"",
+                 (unsigned long long)info->version, coding);
+    } else {
+        snprintf(out, out_size, "\"%016llx\"",
+                 (unsigned long long)info->version);
+    }
+}
+
+bool response_cache_etag_matches(const char* if_none_match, size_t length,
+                                 const ResponseCacheInfo* info) {
+    if (!if_none_match || !info) {
+        return false;
+    }
+
+    char version[17];
+    snprintf(version, sizeof(version), "%016llx",
+             (unsigned long long)info->version);
+
+    const char* p   = if_none_match;
+    const char* end = if_none_match + length;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        if (p >= end) {
+            break;
+        }
+
+        if (*p == '*') {
+            return true;
+        }
+
+        /* Weak comparison ignores the W/ prefix */
+        if (end - p >= 2 && p[0] == 'W' && p[1] == '/') {
+            p += 2;
+        }
+
+        if (p < end && *p == '"') {
+            const char* tag = ++p;
+            while (p < end && *p != '"') {
+                p++;
+            }
+            size_t tag_len = (size_t)(p - tag);
+
+            /* Representation tags are the version plus an optional
+             * "-coding" suffix */
+            if (tag_len >= 16 && memcmp(tag, version, 16) == 0 &&
+                (tag_len == 16 || tag[16] == '-')) {
+                return true;
+            }
+        }
+
+        /* Skip to the next list element */
+        while (p < end && *p != ',') {
+            p++;
+        }
+    }
+
+    return false;
+}
+
+int response_cache_compress(const uint8_t* body, size_t length,
+                            HttpContentEncoding encoding, uint8_t** output,
+                            size_t* output_len) {
+    DeflateFormat format;
+    if (encoding == HTTP_CONTENT_ENCODING_GZIP) {
+        format = DEFLATE_FORMAT_GZIP;
+    } else if (encoding == HTTP_CONTENT_ENCODING_DEFLATE) {
+        format = DEFLATE_FORMAT_ZLIB;
+    } else {
+        return -1;
+    }
+
+    if (deflate_compress(body, length, format, output, output_len) != 0) {
+        return -1;
+    }
+
+    if (*output_len >= length) {
+        free(*output);
+        *output = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+void response_cache_dispose(void) {
+    if (g_response_store_open) {
+        persist_pending();
+        cache_store_close(&g_response_store);
+        g_response_store_open = false;
+    }
+    if (g_cache.index) {
+        while (g_cache.live.head) {
+            drop_entry(g_cache.live.head);
+        }
+        while (g_cache.stale.head) {
+            drop_entry(g_cache.stale.head);
+        }
+        update_gauges();
+        free(g_cache.index);
+        g_cache.index = NULL;
+    }
+}
+
+/* ============= Internal Functions Implementation ============= */
+
+static ResponseCacheEntry* find_entry(const char* key) {
+    uint64_t hash = hash_body((const uint8_t*)key, strlen(key));
+    size_t   slot = hash & (INDEX_SIZE - 1);
+    for (size_t probe = 0; probe < INDEX_SIZE; probe++) {
+        ResponseCacheEntry* entry = g_cache.index[slot];
+        if (!entry) {
+            return NULL;
+        }
+        if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+            return entry;
+        }
+        slot = (slot + 1) & (INDEX_SIZE - 1);
+    }
+    return NULL;
+}
+
+/* Find an entry that is still fresh. One found expired is moved to the
+ * stale list, or dropped once its stale period is over too. */
+static ResponseCacheEntry* find_fresh(const char* key, time_t now) {
+    ResponseCacheEntry* entry = find_entry(key);
+    if (!entry) {
+        return NULL;
+    }
+
+    if (now > entry->kept_until) {
+        drop_entry(entry);
+        update_gauges();
+        return NULL;
+    }
+    if (entry->stale || now > entry->expiry) {
+        demote_entry(entry);
+        update_gauges();
+        return NULL;
+    }
+    return entry;
+}
+
+/* Store an identity blob, taking ownership of it. Variants of a previous
+ * body are dropped, and a stale entry becomes live again. */
+static ResponseCacheEntry* set_entry(const char* key, uint8_t* blob,
+                                     size_t blob_len, time_t expiry,
+                                     time_t kept_until) {
+    if (time(NULL) > kept_until) {
+        free(blob);
+        return NULL;
+    }
+
+    ResponseCacheEntry* entry = find_entry(key);
+    if (entry) {
+        clear_variants(entry);
+        free(entry->blob);
+        if (entry->stale) {
+            list_unlink(&g_cache.stale, entry);
+        } else {
+            list_unlink(&g_cache.live, entry);
+        }
+    } else {
+        entry = calloc(1, sizeof(ResponseCacheEntry));
+        if (!entry) {
+            free(blob);
+            return NULL;
+        }
+        entry->key = strdup(key);
+        if (!entry->key) {
+            free(entry);
+            free(blob);
+            return NULL;
+        }
+        entry->hash = hash_body((const uint8_t*)key, strlen(key));
+        index_insert(entry);
+    }
+
+    g_cache.bytes    -= (int64_t)entry->blob_len;
+    entry->blob       = blob;
+    entry->blob_len   = blob_len;
+    g_cache.bytes    += (int64_t)blob_len;
+    entry->expiry     = expiry;
+    entry->kept_until = kept_until;
+
+    if (time(NULL) > expiry) {
+        /* Loaded or put already expired: only good as a fallback */
+        stale_push(entry);
+        update_gauges();
+        return entry;
+    }
+
+    /* Make room by retiring the least recently used live entry */
+    if (g_cache.live.count >= g_cache.live.capacity && g_cache.live.tail) {
+        metrics_inc(g_cache.metric_evictions);
+        demote_entry(g_cache.live.tail);
+    }
+
+    entry->stale = false;
+    list_push(&g_cache.live, entry);
+    update_gauges();
+    return entry;
+}
+
+static void index_insert(ResponseCacheEntry* entry) {
+    size_t slot = entry->hash & (INDEX_SIZE - 1);
+    while (g_cache.index[slot]) {
+        slot = (slot + 1) & (INDEX_SIZE - 1);
+    }
+    g_cache.index[slot] = entry;
+}
+
+static void index_remove(ResponseCacheEntry* entry) {
+    size_t hole = entry->hash & (INDEX_SIZE - 1);
+    while (g_cache.index[hole] != entry) {
+        hole = (hole + 1) & (INDEX_SIZE - 1);
+    }
+
+    /* Backward-shift deletion keeps probe sequences intact without
+     * tombstones */
+    size_t next = (hole + 1) & (INDEX_SIZE - 1);
+    while (g_cache.index[next]) {
+        size_t home = g_cache.index[next]->hash & (INDEX_SIZE - 1);
+        /* Move the entry back if the hole lies on its probe path */
+        if (((next - home) & (INDEX_SIZE - 1)) >=
+            ((next - hole) & (INDEX_SIZE - 1))) {
+            g_cache.index[hole] = g_cache.index[next];
+            hole                = next;
+        }
+        next = (next + 1) & (INDEX_SIZE - 1);
+    }
+    g_cache.index[hole] = NULL;
+}
+
+static void list_push(ResponseCacheList* list, ResponseCacheEntry* entry) {
+    entry->prev = NULL;
+    entry->next = list->head;
+    if (list->head) {
+        list->head->prev = entry;
+    } else {
+        list->tail = entry;
+    }
+    list->head = entry;
+    list->count++;
+}
+
+static void list_unlink(ResponseCacheList* list, ResponseCacheEntry* entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        list->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        list->tail = entry->prev;
+    }
+    entry->prev = NULL;
+    entry->next = NULL;
+    list->count--;
+}
+
+static void touch_entry(ResponseCacheEntry* entry) {
+    ResponseCacheList* list = entry->stale ? &g_cache.stale : &g_cache.live;
+    if (list->head != entry) {
+        list_unlink(list, entry);
+        list_push(list, entry);
+    }
+}
+
+/* Move a live entry to the stale list, where only its identity body is
+ * kept, for response_cache_get_stale. The stale list has its own capacity,
+ * so expired bodies never take room from fresh ones. */
+static void demote_entry(ResponseCacheEntry* entry) {
+    if (entry->stale) {
+        return;
+    }
+
+    list_unlink(&g_cache.live, entry);
+    clear_variants(entry);
+    stale_push(entry);
+}
+
+/* Add an entry to the stale list, dropping the least recently used stale
+ * entry when over capacity */
+static void stale_push(ResponseCacheEntry* entry) {
+    entry->stale = true;
+    list_push(&g_cache.stale, entry);
+
+    if (time(NULL) > entry->kept_until) {
+        drop_entry(entry);
+    } else if (g_cache.stale.count > g_cache.stale.capacity) {
+        drop_entry(g_cache.stale.tail);
+    }
+}
+
+static void drop_entry(ResponseCacheEntry* entry) {
+    list_unlink(entry->stale ? &g_cache.stale : &g_cache.live, entry);
+    index_remove(entry);
+    clear_variants(entry);
+    g_cache.bytes -= (int64_t)entry->blob_len;
+    free(entry->blob);
+    free(entry->key);
+    free(entry);
+}
+
+static void clear_variants(ResponseCacheEntry* entry) {
+    for (int i = 0; i < VARIANT_COUNT; i++) {
+        g_cache.bytes -= (int64_t)entry->variants[i].length;
+        free(entry->variants[i].body);
+        entry->variants[i] = (ResponseCacheVariant){0};
+    }
+}
+
+/* Record the outcome of compressing a variant, taking ownership of body */
+static void set_variant(ResponseCacheEntry* entry, int slot, uint8_t* body,
+                        size_t length) {
+    ResponseCacheVariant* variant = &entry->variants[slot];
+    g_cache.bytes -= (int64_t)variant->length;
+    free(variant->body);
+    variant->body   = body;
+    variant->length = body ? length : 0;
+    variant->done   = true;
+    g_cache.bytes  += (int64_t)variant->length;
+    update_gauges();
+}
+
+static void update_gauges(void) {
+    metrics_gauge_set(g_cache.metric_bytes, g_cache.bytes);
+    metrics_gauge_set(g_cache.metric_entries, (int64_t)g_cache.live.count);
+    metrics_gauge_set(g_cache.metric_stale_entries,
+                      (int64_t)g_cache.stale.count);
+}
+
+static int variant_slot(HttpContentEncoding encoding) {
+    switch (encoding) {
+    case HTTP_CONTENT_ENCODING_GZIP:
+        return 0;
+    case HTTP_CONTENT_ENCODING_DEFLATE:
+        return 1;
+    default:
+        return -1;
+    }
+}
+
+static uint8_t* make_blob(const uint8_t* body, size_t length, uint64_t version,
+                          size_t* blob_len) {
+    *blob_len     = sizeof(ResponseCacheHeader) + length;
+    uint8_t* blob = malloc(*blob_len);
+    if (!blob) {
+        return NULL;
+    }
+
+    ResponseCacheHeader header = {
+        .encoding  = (uint32_t)HTTP_CONTENT_ENCODING_IDENTITY,
+        .stale_for = (uint32_t)RESPONSE_CACHE_STALE_TTL,
+        .version   = version};
+    memcpy(blob, &header, sizeof(header));
+    if (length > 0) {
+        memcpy(blob + sizeof(header), body, length);
+    }
+    return blob;
+}
+
+static const uint8_t* entry_body(const ResponseCacheEntry* entry,
+                                 size_t* length, uint64_t* version) {
+    ResponseCacheHeader header;
+    memcpy(&header, entry->blob, sizeof(header));
+    *version = header.version;
+    *length  = entry->blob_len - sizeof(header);
+    return entry->blob + sizeof(header);
+}
+
+/* FNV-1a: content-addressed versions, so an unchanged body refetched from
+ * upstream keeps its ETag. Also hashes the keys of the index. */
+static uint64_t hash_body(const uint8_t* body, size_t length) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= body[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static void fill_info(ResponseCacheInfo* info, uint64_t version,
+                      time_t expiry) {
+    if (!info) {
+        return;
+    }
+
+    time_t remaining = expiry - time(NULL);
+    info->version    = version;
+    info->max_age    = remaining > 0 ? remaining : 0;
+}
+
+/* Queue an entry's key for the store; an entry put again before the batch
+ * is written is written once, with its latest body */
+static void persist_blob(ResponseCacheEntry* entry) {
+    if (!g_response_store_open || entry->queued ||
+        strlen(entry->key) >= RESPONSE_CACHE_KEY_MAX) {
+        return;
+    }
+
+    if (g_persist_count == PERSIST_BATCH) {
+        persist_pending();
+    }
+    strcpy(g_persist_pending[g_persist_count++], entry->key);
+    entry->queued = true;
+}
+
+/* Write the queued keys that are still cached */
+static void persist_pending(void) {
+    for (size_t i = 0; i < g_persist_count; i++) {
+        const char*         key   = g_persist_pending[i];
+        ResponseCacheEntry* entry = find_entry(key);
+        if (!entry || !entry->queued) {
+            continue;
+        }
+
+        entry->queued = false;
+        if (cache_store_put(&g_response_store, key, entry->blob,
+                            entry->blob_len, entry->kept_until) != 0) {
+            LOG_WARN("response_cache", "Cannot persist %s", key);
+        }
+    }
+    g_persist_count = 0;
+}
+
+static void load_blob(const char* key, const void* blob, size_t length,
+                      time_t expiry, void* context) {
+    size_t* loaded = (size_t*)context;
+
+    if (expiry < time(NULL) || length < sizeof(ResponseCacheHeader)) {
+        return;
+    }
+
+    ResponseCacheHeader header;
+    memcpy(&header, blob, sizeof(header));
+    if (header.encoding != HTTP_CONTENT_ENCODING_IDENTITY) {
+        return;
+    }
+
+    uint8_t* copy = malloc(length);
+    if (!copy) {
+        return;
+    }
+    memcpy(copy, blob, length);
+
+    /* expiry is the end of the stale period */
+    if (set_entry(key, copy, length, expiry - (time_t)header.stale_for,
+                  expiry)) {
+        (*loaded)++;
+    }
+}
+
+static int ensure_parent_dir(const char* path) {
+    const char* slash = strrchr(path, '/');
+    if (!slash || slash == path) {
+        return 0;
+    }
+
+    char dir[CACHE_STORE_PATH_MAX];
+    int  len = snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+    if (len < 0 || (size_t)len >= sizeof(dir)) {
+        return -1;
+    }
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,204 @@
+/**
+ * response_cache.h - Cache of serialized API responses
+ *
+ * Keeps successful response bodies per request key (path, query and JSON
+ * format) together with their compressed variants. A variant is compressed
+ * the first time a client asks for it and expires together with the identity
+ * body, so each body is compressed at most once per TTL instead of once per
+ * request.
+ *
+ * Every entry carries a version, a hash of the identity body, from which the
+ * strong ETag of each representation is derived. A refreshed entry whose
+ * content did not change keeps its ETag, so polling clients keep getting 304.
+ *
+ * Entries are found through a hash index. Fresh entries are evicted least
+ * recently used first. Expired identity bodies move to a separate stale list
+ * with its own capacity, and can still be read with response_cache_get_stale
+ * as a fallback when upstream is down, without pushing out fresh entries.
+ *
+ * Identity bodies can also be copied to a persistent cache store, in batches
+ * from response_cache_maintain. The cache is refilled from it on startup, so
+ * a restarted server answers from cache right away instead of fetching
+ * everything from upstream again.
+ */
+
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include "http_server_connection.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Fresh entries, evicted least recently used first */
+#define RESPONSE_CACHE_MAX_ENTRIES 512
+/* Expired entries kept for response_cache_get_stale, on top of the fresh
+ * ones */
+#define RESPONSE_CACHE_MAX_STALE_ENTRIES 512
+#define RESPONSE_CACHE_KEY_MAX 1024
+
+/* Bodies smaller than this are always sent uncompressed */
+#define RESPONSE_CACHE_MIN_COMPRESS_SIZE 512
+
+/* How long identity bodies are kept after they expire, for
+ * response_cache_get_stale */
+#define RESPONSE_CACHE_STALE_TTL (24 * 60 * 60)
+
+/* Longest ETag produced by response_cache_etag, including quotes and NUL */
+#define RESPONSE_CACHE_ETAG_MAX 32
+
+typedef struct {
+    uint64_t version; /* Hash of the identity body */
+    time_t   max_age; /* Seconds until the entry expires */
+} ResponseCacheInfo;
+
+/**
+ * Initialize the response cache
+ *
+ * @return 0 on success, -1 on error
+ */
+int response_cache_init(void);
+
+/**
+ * Persist identity bodies in a cache store and load its unexpired entries.
+ * Creates the directory of the log file if needed.
+ *
+ * @param path Log file of the store
+ * @return Number of entries loaded, or -1 on error (the cache keeps working
+ * in memory only)
+ */
+int response_cache_open_store(const char* path);
+
+/**
+ * Write bodies stored since the last call to the persistent store and give
+ * it a chance to compact. Cheap; call regularly.
+ */
+void response_cache_maintain(void);
+
+/**
+ * Store an identity body, replacing any previous body and its variants
+ *
+ * @param key Request key
+ * @param body Response body
+ * @param length Body length
+ * @param ttl Time-to-live in seconds
+ * @return 0 on success, -1 on error
+ */
+int response_cache_put(const char* key, const uint8_t* body, size_t length,
+                       time_t ttl);
+
+/**
+ * Find a cached body in the requested encoding
+ *
+ * Falls back to the identity body when the body is too small to compress or
+ * compression does not make it smaller. The returned pointer is only valid
+ * until the cache is modified.
+ *
+ * @param key Request key
+ * @param encoding Preferred content coding
+ * @param length Output body length
+ * @param body_encoding Output content coding of the returned body
+ * @param info Output version and remaining lifetime (can be NULL)
+ * @return Body, or NULL when the key is not cached
+ */
+const uint8_t* response_cache_get(const char* key, HttpContentEncoding encoding,
+                                  size_t*              length,
+                                  HttpContentEncoding* body_encoding,
+                                  ResponseCacheInfo*   info);
+
+/**
+ * Find the identity body of an entry that response_cache_get would have to
+ * compress first, because its variant for the coding has not been produced
+ * yet. The caller can compress it elsewhere and store the result with
+ * response_cache_put_variant. The returned pointer is only valid until the
+ * cache is modified.
+ *
+ * @param key Request key
+ * @param encoding Content coding of the variant
+ * @param length Output body length
+ * @param info Output version and remaining lifetime (can be NULL)
+ * @return Identity body, or NULL when the key is not cached or nothing needs
+ * compressing
+ */
+const uint8_t* response_cache_get_uncompressed(const char*         key,
+                                               HttpContentEncoding encoding,
+                                               size_t*             length,
+                                               ResponseCacheInfo*  info);
+
+/**
+ * Store a variant compressed outside the cache
+ *
+ * @param key Request key
+ * @param encoding Content coding of the variant
+ * @param version Version of the identity body it was compressed from
+ * @param body Compressed body, or NULL when compression did not pay off
+ * @param length Compressed length
+ * @return 0 on success, -1 if the entry expired or was replaced meanwhile,
+ * or on error
+ */
+int response_cache_put_variant(const char* key, HttpContentEncoding encoding,
+                               uint64_t version, const uint8_t* body,
+                               size_t length);
+
+/**
+ * Find the identity body of an entry even if it has expired, as long as it
+ * is within RESPONSE_CACHE_STALE_TTL of expiring. The returned pointer is
+ * only valid until the cache is modified.
+ *
+ * @param key Request key
+ * @param length Output body length
+ * @param stale_seconds Output seconds since the entry expired, 0 if it is
+ * still fresh (can be NULL)
+ * @return Body, or NULL when the key is not cached
+ */
+const uint8_t* response_cache_get_stale(const char* key, size_t* length,
+                                        time_t* stale_seconds);
+
+/**
+ * Format the strong ETag of one representation of an entry
+ *
+ * @param info Entry version
+ * @param encoding Content coding of the representation
+ * @param out Output buffer, at least RESPONSE_CACHE_ETAG_MAX bytes
+ * @param out_size Size of the output buffer
+ */
+void response_cache_etag(const ResponseCacheInfo* info,
+                         HttpContentEncoding encoding, char* out,
+                         size_t out_size);
+
+/**
+ * Check an If-None-Match header value against an entry
+ *
+ * Uses the weak comparison RFC 9110 prescribes for If-None-Match, and treats
+ * all content codings of the entry as the same resource version.
+ *
+ * @param if_none_match Header value (not NUL-terminated)
+ * @param length Header value length
+ * @param info Entry version
+ * @return true if the client already has the current version
+ */
+bool response_cache_etag_matches(const char* if_none_match, size_t length,
+                                 const ResponseCacheInfo* info);
+
+/**
+ * Compress a body for a content coding. Safe to call from any thread.
+ *
+ * @param body Body to compress
+ * @param length Body length
+ * @param encoding GZIP or DEFLATE
+ * @param output Compressed body (caller must free)
+ * @param output_len Compressed length
+ * @return 0 on success, -1 on error or if compression does not pay off
+ */
+int response_cache_compress(const uint8_t* body, size_t length,
+                            HttpContentEncoding encoding, uint8_t** output,
+                            size_t* output_len);
+
+/**
+ * Free all cached responses and close the persistent store
+ */
+void response_cache_dispose(void);
+
+#endif /* RESPONSE_CACHE_H */
@@ -5,19 +5,18 @@
 #include "weather_location_handler.h"
 
 #include "geocoding_api.h"
+#include "log.h"
 #include "open_meteo_api.h"
 #include "open_meteo_handler.h"
 #include "popular_cities.h"
 #include "response_builder.h"
 
-#include <jansson.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 /* Global state for lazy initialization */
-static bool             g_initialized       = false;
-static PopularCitiesDB* s_popular_cities_db = NULL;
+static bool g_initialized = false;
 
 /* External reference to geocoding API's global popular cities DB pointer */
 extern void* g_popular_cities_db;
@@ -36,12 +35,12 @@ static int ensure_initialized(void) {
         return 0; /* Already initialized */
     }
 
-    printf("[WEATHER_LOCATION] Initializing modules...\n");
+    LOG_INFO("weather_location", "Initializing modules");
 
     /* FIX: Initialize Weather API FIRST */
     /* This will create ./cache/ and set up caching */
     if (open_meteo_handler_init() != 0) {
-        fprintf(stderr, "[WEATHER_LOCATION] Failed to init weather API\n");
+        LOG_ERROR("weather_location", "Failed to init weather API");
         return -1;
     }
 
@@ -53,57 +52,52 @@ static int ensure_initialized(void) {
                                   .language    = "eng"};
 
     if (geocoding_api_init(&geo_config) != 0) {
-        fprintf(stderr, "[WEATHER_LOCATION] Failed to init geocoding API\n");
+        LOG_ERROR("weather_location", "Failed to init geocoding API");
         return -1;
     }
 
-    /* Load popular cities database */
-    int cities_result =
-        popular_cities_load("./data/hot_cities.json", "./data/all_cities.json",
-                            &s_popular_cities_db);
-
-    if (cities_result != 0) {
-        fprintf(stderr,
-                "[WEATHER_LOCATION] Warning: Failed to load popular cities "
-                "database (fallback to API-only mode)\n");
+    /* Build popular cities database in the background. Until it is
+     * published g_popular_cities_db stays NULL and geocoding falls back to
+     * the API, so no request waits for the load. */
+    if (popular_cities_start("./data/hot_cities.json",
+                             "./data/all_cities.json",
+                             &g_popular_cities_db) != 0) {
+        LOG_WARN("weather_location",
+                 "Failed to start popular cities loader (fallback to "
+                 "API-only mode)");
         /* Not a critical error - continue without local database */
-        g_popular_cities_db = NULL;
-    } else {
-        printf("[WEATHER_LOCATION] Loaded popular cities database\n");
-        /* Set the global pointer for geocoding_api to use */
-        g_popular_cities_db = s_popular_cities_db;
     }
 
     g_initialized = true;
-    printf("[WEATHER_LOCATION] All modules initialized successfully\n");
+    LOG_INFO("weather_location", "All modules initialized successfully");
     return 0;
 }
 
 /* ============= Public API ============= */
 
 int weather_location_handler_init(void) {
-    /* Explicit initialization (optional) */
+    /* Called by the server at startup so the city database loads before
+     * the first request arrives */
     return ensure_initialized();
 }
 
 int weather_location_handler_by_city(const char* query_string,
-                                     char** response_json, int* status_code) {
-    if (!response_json || !status_code) {
+                                     JsonWriter* writer, int* status_code) {
+    if (!writer || !status_code) {
         return -1;
     }
 
     /* Automatic initialization on first call */
     if (ensure_initialized() != 0) {
-        *response_json = response_builder_error(
-            HTTP_INTERNAL_ERROR,
+        response_builder_write_error(
+            writer, HTTP_INTERNAL_ERROR,
             response_builder_get_error_type(HTTP_INTERNAL_ERROR),
             "Failed to initialize geocoding module");
         *status_code = HTTP_INTERNAL_ERROR;
         return -1;
     }
 
-    *response_json = NULL;
-    *status_code   = HTTP_INTERNAL_ERROR;
+    *status_code = HTTP_INTERNAL_ERROR;
 
     /* Parse query parameters */
     char city[128]  = {0};
@@ -112,24 +106,26 @@ int weather_location_handler_by_city(const char* query_string,
 
     if (parse_city_query(query_string, city, sizeof(city), country,
                          sizeof(country), region, sizeof(region)) != 0) {
-        *response_json = response_builder_error(
-            HTTP_BAD_REQUEST, response_builder_get_error_type(HTTP_BAD_REQUEST),
+        response_builder_write_error(
+            writer, HTTP_BAD_REQUEST,
+            response_builder_get_error_type(HTTP_BAD_REQUEST),
             "Invalid query parameters. Expected: city=<name>&country=<code>");
         *status_code = HTTP_BAD_REQUEST;
         return -1;
     }
 
     if (city[0] == '\0') {
-        *response_json = response_builder_error(
-            HTTP_BAD_REQUEST, response_builder_get_error_type(HTTP_BAD_REQUEST),
+        response_builder_write_error(
+            writer, HTTP_BAD_REQUEST,
+            response_builder_get_error_type(HTTP_BAD_REQUEST),
             "Missing required parameter: city");
         *status_code = HTTP_BAD_REQUEST;
         return -1;
     }
 
-    printf("[WEATHER_LOCATION] Request for city: %s%s%s%s%s\n", city,
-           region[0] ? ", " : "", region, country[0] ? " (" : "",
-           country[0] ? country : "");
+    LOG_DEBUG("weather_location", "Request for city: %s%s%s%s%s", city,
+              region[0] ? ", " : "", region, country[0] ? " (" : "",
+              country[0] ? country : "");
 
     /* 1. Find city coordinates via geocoding */
     GeocodingResponse* geo_response = NULL;
@@ -146,9 +142,9 @@ int weather_location_handler_by_city(const char* query_string,
     if (result != 0 || !geo_response || geo_response->count == 0) {
         char error_msg[256];
         snprintf(error_msg, sizeof(error_msg), "City not found: %s", city);
-        *response_json = response_builder_error(
-            HTTP_NOT_FOUND, response_builder_get_error_type(HTTP_NOT_FOUND),
-            error_msg);
+        response_builder_write_error(
+            writer, HTTP_NOT_FOUND,
+            response_builder_get_error_type(HTTP_NOT_FOUND), error_msg);
         *status_code = HTTP_NOT_FOUND;
 
         if (geo_response) {
@@ -161,8 +157,8 @@ int weather_location_handler_by_city(const char* query_string,
     GeocodingResult* best_location = geocoding_api_get_best_result(
         geo_response, country[0] ? country : NULL);
     if (!best_location) {
-        *response_json = response_builder_error(
-            HTTP_INTERNAL_ERROR,
+        response_builder_write_error(
+            writer, HTTP_INTERNAL_ERROR,
             response_builder_get_error_type(HTTP_INTERNAL_ERROR),
             "Failed to determine best location");
         *status_code = HTTP_INTERNAL_ERROR;
@@ -170,9 +166,9 @@ int weather_location_handler_by_city(const char* query_string,
         return -1;
     }
 
-    printf("[WEATHER_LOCATION] Found: %s, %s (%.4f, %.4f)\n",
-           best_location->name, best_location->country, best_location->latitude,
-           best_location->longitude);
+    LOG_DEBUG("weather_location", "Found: %s, %s (%.4f, %.4f)",
+              best_location->name, best_location->country,
+              best_location->latitude, best_location->longitude);
 
     /* 2. Fetch weather for the found coordinates */
     Location location = {.latitude  = best_location->latitude,
@@ -183,8 +179,8 @@ int weather_location_handler_by_city(const char* query_string,
     result = open_meteo_api_get_current(&location, &weather_data);
 
     if (result != 0 || !weather_data) {
-        *response_json = response_builder_error(
-            HTTP_INTERNAL_ERROR,
+        response_builder_write_error(
+            writer, HTTP_INTERNAL_ERROR,
             response_builder_get_error_type(HTTP_INTERNAL_ERROR),
             "Failed to fetch weather data");
         *status_code = HTTP_INTERNAL_ERROR;
@@ -192,114 +188,116 @@ int weather_location_handler_by_city(const char* query_string,
         return -1;
     }
 
-    /* 3. Build JSON response with city and weather information */
-    json_t* data = json_object();
+    /* 3. Stream JSON response with city and weather information */
+    response_builder_begin_success(writer);
+    json_writer_begin_object(writer);
 
     /* Add location information */
-    json_t* location_obj = json_object();
-    json_object_set_new(location_obj, "name", json_string(best_location->name));
-    json_object_set_new(location_obj, "country",
-                        json_string(best_location->country));
-    json_object_set_new(location_obj, "country_code",
-                        json_string(best_location->country_code));
+    json_writer_key(writer, "location");
+    json_writer_begin_object(writer);
+    json_writer_key(writer, "name");
+    json_writer_string(writer, best_location->name);
+    json_writer_key(writer, "country");
+    json_writer_string(writer, best_location->country);
+    json_writer_key(writer, "country_code");
+    json_writer_string(writer, best_location->country_code);
 
     if (best_location->admin1[0]) {
-        json_object_set_new(location_obj, "region",
-                            json_string(best_location->admin1));
+        json_writer_key(writer, "region");
+        json_writer_string(writer, best_location->admin1);
     }
 
-    json_object_set_new(location_obj, "latitude",
-                        json_real(best_location->latitude));
-    json_object_set_new(location_obj, "longitude",
-                        json_real(best_location->longitude));
+    json_writer_key(writer, "latitude");
+    json_writer_number(writer, best_location->latitude);
+    json_writer_key(writer, "longitude");
+    json_writer_number(writer, best_location->longitude);
 
     if (best_location->population > 0) {
-        json_object_set_new(location_obj, "population",
-                            json_integer(best_location->population));
+        json_writer_key(writer, "population");
+        json_writer_integer(writer, best_location->population);
     }
 
     if (best_location->timezone[0]) {
-        json_object_set_new(location_obj, "timezone",
-                            json_string(best_location->timezone));
+        json_writer_key(writer, "timezone");
+        json_writer_string(writer, best_location->timezone);
     }
 
-    json_object_set_new(data, "location", location_obj);
+    json_writer_end_object(writer);
 
     /* Add weather data */
-    json_t* weather_obj = json_object();
-    json_object_set_new(weather_obj, "temperature",
-                        json_real(weather_data->temperature));
-    json_object_set_new(weather_obj, "temperature_unit",
-                        json_string(weather_data->temperature_unit));
-    json_object_set_new(weather_obj, "weather_code",
-                        json_integer(weather_data->weather_code));
-    json_object_set_new(weather_obj, "weather_description",
-                        json_string(open_meteo_api_get_description(
-                            weather_data->weather_code)));
-    json_object_set_new(weather_obj, "windspeed",
-                        json_real(weather_data->windspeed));
-    json_object_set_new(weather_obj, "windspeed_unit",
-                        json_string(weather_data->windspeed_unit));
-    json_object_set_new(weather_obj, "wind_direction_10m",
-                        json_integer(weather_data->winddirection));
-    json_object_set_new(weather_obj, "wind_direction_name",
-                        json_string(open_meteo_api_get_wind_direction(
-                            weather_data->winddirection)));
-    json_object_set_new(weather_obj, "humidity",
-                        json_real(weather_data->humidity));
-    json_object_set_new(weather_obj, "pressure",
-                        json_real(weather_data->pressure));
-    json_object_set_new(weather_obj, "precipitation",
-                        json_real(weather_data->precipitation));
-    json_object_set_new(weather_obj, "is_day",
-                        json_integer(weather_data->is_day ? 1 : 0));
-
-    json_object_set_new(data, "current_weather", weather_obj);
+    json_writer_key(writer, "current_weather");
+    json_writer_begin_object(writer);
+    json_writer_key(writer, "temperature");
+    json_writer_number(writer, weather_data->temperature);
+    json_writer_key(writer, "temperature_unit");
+    json_writer_string(writer, weather_data->temperature_unit);
+    json_writer_key(writer, "weather_code");
+    json_writer_integer(writer, weather_data->weather_code);
+    json_writer_key(writer, "weather_description");
+    json_writer_string(
+        writer, open_meteo_api_get_description(weather_data->weather_code));
+    json_writer_key(writer, "windspeed");
+    json_writer_number(writer, weather_data->windspeed);
+    json_writer_key(writer, "windspeed_unit");
+    json_writer_string(writer, weather_data->windspeed_unit);
+    json_writer_key(writer, "wind_direction_10m");
+    json_writer_integer(writer, weather_data->winddirection);
+    json_writer_key(writer, "wind_direction_name");
+    json_writer_string(writer, open_meteo_api_get_wind_direction(
+                                   weather_data->winddirection));
+    json_writer_key(writer, "humidity");
+    json_writer_number(writer, weather_data->humidity);
+    json_writer_key(writer, "pressure");
+    json_writer_number(writer, weather_data->pressure);
+    json_writer_key(writer, "precipitation");
+    json_writer_number(writer, weather_data->precipitation);
+    json_writer_key(writer, "is_day");
+    json_writer_integer(writer, weather_data->is_day ? 1 : 0);
+    json_writer_end_object(writer);
+
+    json_writer_end_object(writer);
+    response_builder_end_success(writer);
 
     /* Cleanup weather data */
     open_meteo_api_free_current(weather_data);
     geocoding_api_free_response(geo_response);
 
-    /* Build standardized response */
-    *response_json = response_builder_success(data);
-
-    if (!*response_json) {
-        json_decref(data);
+    if (json_writer_finish(writer) != 0) {
         *status_code = HTTP_INTERNAL_ERROR;
         return -1;
     }
 
     *status_code = HTTP_OK;
-    printf("[WEATHER_LOCATION] Response generated successfully\n");
+    LOG_DEBUG("weather_location", "Response generated successfully");
     return 0;
 }
 
 int weather_location_handler_search_cities(const char* query_string,
-                                           char**      response_json,
+                                           JsonWriter* writer,
                                            int*        status_code) {
-    if (!response_json || !status_code) {
+    if (!writer || !status_code) {
         return -1;
     }
 
     /* Automatic initialization on first call */
     if (ensure_initialized() != 0) {
-        *response_json = response_builder_error(
-            HTTP_INTERNAL_ERROR,
+        response_builder_write_error(
+            writer, HTTP_INTERNAL_ERROR,
             response_builder_get_error_type(HTTP_INTERNAL_ERROR),
             "Failed to initialize geocoding module");
         *status_code = HTTP_INTERNAL_ERROR;
         return -1;
     }
 
-    *response_json = NULL;
-    *status_code   = HTTP_INTERNAL_ERROR;
+    *status_code = HTTP_INTERNAL_ERROR;
 
     /* Parse query parameter */
     char query[256] = {0};
     if (sscanf(query_string, "query=%255[^&]", query) != 1 ||
         query[0] == '\0') {
-        *response_json = response_builder_error(
-            HTTP_BAD_REQUEST, response_builder_get_error_type(HTTP_BAD_REQUEST),
+        response_builder_write_error(
+            writer, HTTP_BAD_REQUEST,
+            response_builder_get_error_type(HTTP_BAD_REQUEST),
             "Missing required parameter: query");
         *status_code = HTTP_BAD_REQUEST;
         return -1;
@@ -311,8 +309,9 @@ int weather_location_handler_search_cities(const char* query_string,
 
     /* Validate minimum query length (2 characters) */
     if (strlen(decoded_query) < 2) {
-        *response_json = response_builder_error(
-            HTTP_BAD_REQUEST, response_builder_get_error_type(HTTP_BAD_REQUEST),
+        response_builder_write_error(
+            writer, HTTP_BAD_REQUEST,
+            response_builder_get_error_type(HTTP_BAD_REQUEST),
             "Query must be at least 2 characters");
         *status_code = HTTP_BAD_REQUEST;
         return -1;
@@ -327,53 +326,60 @@ int weather_location_handler_search_cities(const char* query_string,
     int result = geocoding_api_search_smart(decoded_query, &response);
 
     if (result != 0 || !response) {
-        *response_json = response_builder_error(
-            HTTP_INTERNAL_ERROR,
+        response_builder_write_error(
+            writer, HTTP_INTERNAL_ERROR,
             response_builder_get_error_type(HTTP_INTERNAL_ERROR),
             "Failed to search cities");
         *status_code = HTTP_INTERNAL_ERROR;
         return -1;
     }
 
-    /* Build JSON response */
-    json_t* data = json_object();
-    json_object_set_new(data, "query", json_string(decoded_query));
-    json_object_set_new(data, "count", json_integer(response->count));
+    /* Stream JSON response */
+    response_builder_begin_success(writer);
+    json_writer_begin_object(writer);
+    json_writer_key(writer, "query");
+    json_writer_string(writer, decoded_query);
+    json_writer_key(writer, "count");
+    json_writer_integer(writer, response->count);
 
-    json_t* cities_array = json_array();
+    json_writer_key(writer, "cities");
+    json_writer_begin_array(writer);
     for (int i = 0; i < response->count; i++) {
-        GeocodingResult* city     = &response->results[i];
-        json_t*          city_obj = json_object();
+        GeocodingResult* city = &response->results[i];
 
-        json_object_set_new(city_obj, "name", json_string(city->name));
-        json_object_set_new(city_obj, "country", json_string(city->country));
-        json_object_set_new(city_obj, "country_code",
-                            json_string(city->country_code));
+        json_writer_begin_object(writer);
+        json_writer_key(writer, "name");
+        json_writer_string(writer, city->name);
+        json_writer_key(writer, "country");
+        json_writer_string(writer, city->country);
+        json_writer_key(writer, "country_code");
+        json_writer_string(writer, city->country_code);
 
         if (city->admin1[0]) {
-            json_object_set_new(city_obj, "region", json_string(city->admin1));
+            json_writer_key(writer, "region");
+            json_writer_string(writer, city->admin1);
         }
 
-        json_object_set_new(city_obj, "latitude", json_real(city->latitude));
-        json_object_set_new(city_obj, "longitude", json_real(city->longitude));
+        json_writer_key(writer, "latitude");
+        json_writer_number(writer, city->latitude);
+        json_writer_key(writer, "longitude");
+        json_writer_number(writer, city->longitude);
 
         if (city->population > 0) {
-            json_object_set_new(city_obj, "population",
-                                json_integer(city->population));
+            json_writer_key(writer, "population");
+            json_writer_integer(writer, city->population);
         }
 
-        json_array_append_new(cities_array, city_obj);
+        json_writer_end_object(writer);
     }
+    json_writer_end_array(writer);
 
-    json_object_set_new(data, "cities", cities_array);
+    json_writer_end_object(writer);
+    response_builder_end_success(writer);
 
     geocoding_api_free_response(response);
 
-    /* Build standardized response */
-    *response_json = response_builder_success(data);
-
-    if (!*response_json) {
-        json_decref(data);
+    if (json_writer_finish(writer) != 0) {
         *status_code = HTTP_INTERNAL_ERROR;
         return -1;
     }
@@ -390,15 +396,11 @@ void weather_location_handler_cleanup(void) {
     geocoding_api_cleanup();
     open_meteo_handler_cleanup();
 
-    /* Cleanup popular cities database */
-    if (s_popular_cities_db) {
-        popular_cities_free(s_popular_cities_db);
-        s_popular_cities_db = NULL;
-        g_popular_cities_db = NULL;
-    }
+    /* Cleanup popular cities database (also clears g_popular_cities_db) */
+    popular_cities_stop();
 
     g_initialized = false;
-    printf("[WEATHER_LOCATION] Handler cleaned up\n");
+    LOG_INFO("weather_location", "Handler cleaned up");
 }
 
 /* ============= Internal Functions ============= */
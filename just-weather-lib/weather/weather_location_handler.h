@@ -8,6 +8,8 @@
 #ifndef WEATHER_LOCATION_HANDLER_H
 #define WEATHER_LOCATION_HANDLER_H
 
+#include "json_writer.h"
+
 /**
  * Initialize the weather location handler
  * Calls initialization for both modules (geocoding + weather)
@@ -29,7 +31,7 @@ int weather_location_handler_init(void);
  * 4. Return weather together with city information
  *
  * @param query_string Query parameters
- * @param response_json Output JSON (caller must free)
+ * @param writer Output JSON (success or error) is streamed into this writer
  * @param status_code HTTP status code
  * @return 0 on success
  *
@@ -39,7 +41,7 @@ int weather_location_handler_init(void);
  *   /v1/weather?city=Lviv&region=Lviv%20Oblast&country=UA
  */
 int weather_location_handler_by_city(const char* query_string,
-                                     char** response_json, int* status_code);
+                                     JsonWriter* writer, int* status_code);
 
 /**
  * Handle city list request (for autocomplete)
@@ -47,7 +49,7 @@ int weather_location_handler_by_city(const char* query_string,
  * Endpoint: GET /v1/cities?query=<search>
  *
  * @param query_string Query parameters
- * @param response_json Output JSON list of cities
+ * @param writer Output JSON list of cities is streamed into this writer
  * @param status_code HTTP status code
  * @return 0 on success
  *
@@ -55,7 +57,7 @@ int weather_location_handler_by_city(const char* query_string,
  *   /v1/cities?query=Kyiv
  */
 int weather_location_handler_search_cities(const char* query_string,
-                                           char**      response_json,
+                                           JsonWriter* writer,
                                            int*        status_code);
 
 /**
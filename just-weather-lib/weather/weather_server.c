@@ -1,25 +1,107 @@
 #include "weather_server.h"
 
+#include "log.h"
+#include "metrics.h"
+#include "popular_cities.h"
+#include "rate_limiter.h"
+#include "response_cache.h"
+#include "tcp_uring.h"
+#include "weather_location_handler.h"
 #include "weather_server_instance.h"
+#include "work_pool.h"
 
-#include <stdio.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 
 //-----------------Internal Functions-----------------
 
-void weather_server_task_work(void* context, uint64_t mon_time);
+void weather_server_maintenance_work(void* context, uint64_t mon_time);
 int  weather_server_on_http_connection(void*                 context,
                                        HTTPServerConnection* connection);
+static void weather_server_cache_store_init(void);
+static int  weather_server_rate_limiter_init(void);
+static int weather_server_listener_init(void);
+static int weather_server_admission_init(WeatherServer* server);
+static int weather_server_limits_init(void);
+static int weather_server_scheduling_init(void);
+static int weather_server_workers_init(void);
+static int weather_server_io_init(void);
+static int weather_server_locations_init(void);
+static void weather_server_signals_init(void);
+static void weather_server_on_sighup(int signum);
+static int weather_server_env_number(const char* name, long fallback,
+                                     long* value);
 
 //----------------------------------------------------
 
 int weather_server_initiate(WeatherServer* server) {
+    if (log_init_from_env() != 0) {
+        LOG_WARN("weather_server", "Cannot open log file, logging to stderr");
+    }
+
+    if (response_cache_init() != 0 ||
+        weather_server_instance_static_init() != 0) {
+        LOG_ERROR("weather_server", "Failed to prepare responses");
+        return -1;
+    }
+
+    weather_server_cache_store_init();
+
+    if (weather_server_rate_limiter_init() != 0) {
+        LOG_ERROR("weather_server", "Failed to set up rate limiting");
+        return -1;
+    }
+
+    if (weather_server_io_init() != 0) {
+        LOG_ERROR("weather_server", "Failed to set up socket I/O");
+        return -1;
+    }
+
+    if (weather_server_listener_init() != 0) {
+        LOG_ERROR("weather_server", "Failed to set up the listener");
+        return -1;
+    }
+
     http_server_initiate(&server->httpServer,
                          weather_server_on_http_connection);
 
+    if (weather_server_admission_init(server) != 0) {
+        LOG_ERROR("weather_server", "Failed to set up overload protection");
+        return -1;
+    }
+
+    if (weather_server_limits_init() != 0) {
+        LOG_ERROR("weather_server", "Failed to set up request limits");
+        return -1;
+    }
+
+    if (weather_server_scheduling_init() != 0) {
+        LOG_ERROR("weather_server", "Failed to set up task scheduling");
+        return -1;
+    }
+
+    if (weather_server_workers_init() != 0) {
+        LOG_ERROR("weather_server", "Failed to start worker threads");
+        return -1;
+    }
+
+    if (weather_server_locations_init() != 0) {
+        LOG_ERROR("weather_server", "Failed to set up location lookups");
+        return -1;
+    }
+
+    weather_server_signals_init();
+
+    // Open instances, each removed when its connection closes
     server->instances = linked_list_create();
+    if (!server->instances) {
+        return -1;
+    }
 
-    server->task = smw_create_task(server, weather_server_task_work);
+    server->maintenance_task = smw_create_task_with_priority(
+        server, weather_server_maintenance_work, SMW_PRIORITY_BACKGROUND);
 
     return 0;
 }
@@ -52,27 +134,305 @@ int weather_server_on_http_connection(void*                 context,
     WeatherServerInstance* instance = NULL;
     int result = weather_server_instance_initiate_ptr(connection, &instance);
     if (result != 0) {
-        printf("WeatherServer_OnHTTPConnection: Failed to initiate instance\n");
+        LOG_ERROR("weather_server", "Failed to initiate instance");
+        http_server_connection_dispose_ptr(&connection);
         return -1;
     }
 
-    linked_list_append(server->instances, instance);
+    if (weather_server_instance_track(instance, server->instances) != 0) {
+        LOG_ERROR("weather_server", "Failed to track instance");
+        weather_server_instance_dispose_ptr(&instance); // Closes connection
+        return -1;
+    }
 
     return 0;
 }
 
-void weather_server_task_work(void* context, uint64_t mon_time) {
-    WeatherServer* server = (WeatherServer*)context;
+void weather_server_maintenance_work(void* context, uint64_t mon_time) {
+    (void)context;
+    (void)mon_time;
 
-    LinkedList_foreach(server->instances, node) {
-        WeatherServerInstance* instance = (WeatherServerInstance*)node->item;
-        weather_server_instance_work(instance, mon_time);
+    response_cache_maintain();
+
+    // A sweep left unfinished here continues on the next pass
+    uint64_t now_ms = metrics_now_us() / 1000;
+    while (rate_limiter_sweep(now_ms) && !smw_should_yield()) {
     }
 }
 
 void weather_server_dispose(WeatherServer* server) {
     http_server_dispose(&server->httpServer);
-    smw_destroy_task(server->task);
+    smw_destroy_task(server->maintenance_task);
+
+    // Close the connections still open; each instance unlinks itself
+    while (server->instances->head) {
+        WeatherServerInstance* instance =
+            (WeatherServerInstance*)server->instances->head->item;
+        weather_server_instance_dispose_ptr(&instance);
+    }
+    linked_list_dispose(&server->instances, NULL);
+
+    // Runs the done callbacks of jobs still in flight
+    work_pool_dispose();
+
+    weather_location_handler_cleanup();
+    weather_server_instance_static_dispose();
+    rate_limiter_dispose();
+    response_cache_dispose();
+    tcp_uring_dispose();
+}
+
+/* Refill the response cache from disk; without it the server still works,
+ * it just starts cold */
+static void weather_server_cache_store_init(void) {
+    const char* path = getenv(WEATHER_SERVER_CACHE_FILE_ENV);
+    if (!path) {
+        path = WEATHER_SERVER_CACHE_FILE_DEFAULT;
+    }
+    if (path[0] == '\0') {
+        return;
+    }
+
+    uint64_t start  = metrics_now_us();
+    int      loaded = response_cache_open_store(path);
+    if (loaded < 0) {
+        LOG_WARN("weather_server", "Cannot open cache store %s, responses "
+                 "are cached in memory only", path);
+        return;
+    }
+
+    LOG_INFO("weather_server", "Loaded %d cached responses from %s in %llu us",
+             loaded, path, (unsigned long long)(metrics_now_us() - start));
+}
+
+static int weather_server_rate_limiter_init(void) {
+    const char* spec = getenv(WEATHER_SERVER_RATE_LIMITS_ENV);
+    if (!spec) {
+        spec = WEATHER_SERVER_RATE_LIMITS_DEFAULT;
+    }
+
+    RateLimitRule rules[RATE_LIMITER_MAX_RULES];
+    int count = rate_limiter_parse_rules(spec, rules, RATE_LIMITER_MAX_RULES);
+    if (count < 0) {
+        LOG_ERROR("weather_server", "Invalid %s: %s",
+                  WEATHER_SERVER_RATE_LIMITS_ENV, spec);
+        return -1;
+    }
+
+    long max_connections = 0;
+    if (weather_server_env_number(WEATHER_SERVER_MAX_CONNECTIONS_ENV,
+                                  WEATHER_SERVER_MAX_CONNECTIONS_DEFAULT,
+                                  &max_connections) != 0) {
+        return -1;
+    }
+
+    return rate_limiter_init(rules, (size_t)count, (uint32_t)max_connections);
+}
+
+static int weather_server_listener_init(void) {
+    long accept_batch   = 0;
+    long defer_accept   = 0;
+    long fastopen_queue = 0;
+    long nodelay        = 0;
+    if (weather_server_env_number(WEATHER_SERVER_ACCEPT_BATCH_ENV,
+                                  WEATHER_SERVER_ACCEPT_BATCH_DEFAULT,
+                                  &accept_batch) != 0 ||
+        weather_server_env_number(WEATHER_SERVER_DEFER_ACCEPT_ENV,
+                                  WEATHER_SERVER_DEFER_ACCEPT_DEFAULT,
+                                  &defer_accept) != 0 ||
+        weather_server_env_number(WEATHER_SERVER_FASTOPEN_QUEUE_ENV,
+                                  WEATHER_SERVER_FASTOPEN_QUEUE_DEFAULT,
+                                  &fastopen_queue) != 0 ||
+        weather_server_env_number(WEATHER_SERVER_TCP_NODELAY_ENV,
+                                  WEATHER_SERVER_TCP_NODELAY_DEFAULT,
+                                  &nodelay) != 0) {
+        return -1;
+    }
+    if (defer_accept > INT_MAX || fastopen_queue > INT_MAX) {
+        LOG_ERROR("weather_server", "Listener option out of range");
+        return -1;
+    }
+
+    TcpServerOptions options = {
+        .accept_batch   = (size_t)accept_batch,
+        .defer_accept_s = (int)defer_accept,
+        .fastopen_queue = (int)fastopen_queue,
+        .nodelay        = nodelay != 0,
+    };
+    tcp_server_set_options(&options);
+
+    return 0;
+}
+
+static int weather_server_admission_init(WeatherServer* server) {
+    long max_inflight   = 0;
+    long max_lag_ms     = 0;
+    long queue_deadline = 0;
+    if (weather_server_env_number(WEATHER_SERVER_MAX_INFLIGHT_ENV,
+                                  WEATHER_SERVER_MAX_INFLIGHT_DEFAULT,
+                                  &max_inflight) != 0 ||
+        weather_server_env_number(WEATHER_SERVER_MAX_LOOP_LAG_ENV,
+                                  WEATHER_SERVER_MAX_LOOP_LAG_DEFAULT,
+                                  &max_lag_ms) != 0 ||
+        weather_server_env_number(WEATHER_SERVER_QUEUE_DEADLINE_ENV,
+                                  WEATHER_SERVER_QUEUE_DEADLINE_DEFAULT,
+                                  &queue_deadline) != 0) {
+        return -1;
+    }
+
+    HttpServerAdmission admission = {
+        .max_connections = (size_t)max_inflight,
+        .max_loop_lag_us = (uint64_t)max_lag_ms * 1000,
+    };
+    http_server_set_admission(&server->httpServer, &admission);
+    weather_server_instance_set_queue_deadline((uint64_t)queue_deadline *
+                                               1000);
+
+    return 0;
+}
+
+static int weather_server_limits_init(void) {
+    long max_header       = 0;
+    long max_body         = 0;
+    long idle_timeout     = 0;
+    long header_timeout   = 0;
+    long transfer_timeout = 0;
+    long min_body_rate    = 0;
+    if (weather_server_env_number(WEATHER_SERVER_MAX_HEADER_SIZE_ENV,
+                                  WEATHER_SERVER_MAX_HEADER_SIZE_DEFAULT,
+                                  &max_header) != 0 ||
+        weather_server_env_number(WEATHER_SERVER_MAX_BODY_SIZE_ENV,
+                                  WEATHER_SERVER_MAX_BODY_SIZE_DEFAULT,
+                                  &max_body) != 0 ||
+        weather_server_env_number(WEATHER_SERVER_IDLE_TIMEOUT_ENV,
+                                  WEATHER_SERVER_IDLE_TIMEOUT_DEFAULT,
+                                  &idle_timeout) != 0 ||
+        weather_server_env_number(WEATHER_SERVER_HEADER_TIMEOUT_ENV,
+                                  WEATHER_SERVER_HEADER_TIMEOUT_DEFAULT,
+                                  &header_timeout) != 0 ||
+        weather_server_env_number(WEATHER_SERVER_TRANSFER_TIMEOUT_ENV,
+                                  WEATHER_SERVER_TRANSFER_TIMEOUT_DEFAULT,
+                                  &transfer_timeout) != 0 ||
+        weather_server_env_number(WEATHER_SERVER_MIN_BODY_RATE_ENV,
+                                  WEATHER_SERVER_MIN_BODY_RATE_DEFAULT,
+                                  &min_body_rate) != 0) {
+        return -1;
+    }
+
+    HttpServerConnectionLimits limits = {
+        .max_header_size     = (size_t)max_header,
+        .max_body_size       = (size_t)max_body,
+        .idle_timeout_us     = (uint64_t)idle_timeout * 1000,
+        .header_timeout_us   = (uint64_t)header_timeout * 1000,
+        .transfer_timeout_us = (uint64_t)transfer_timeout * 1000,
+        .min_body_rate       = (size_t)min_body_rate,
+    };
+    http_server_connection_set_limits(&limits);
+
+    return 0;
+}
+
+static int weather_server_scheduling_init(void) {
+    long slow_task_ms   = 0;
+    long tick_budget_ms = 0;
+    if (weather_server_env_number(WEATHER_SERVER_SLOW_TASK_ENV,
+                                  WEATHER_SERVER_SLOW_TASK_DEFAULT,
+                                  &slow_task_ms) != 0 ||
+        weather_server_env_number(WEATHER_SERVER_TICK_BUDGET_ENV,
+                                  WEATHER_SERVER_TICK_BUDGET_DEFAULT,
+                                  &tick_budget_ms) != 0) {
+        return -1;
+    }
+
+    smw_set_tick_budget((uint64_t)tick_budget_ms * 1000);
+
+    if (slow_task_ms == 0) {
+        return 0;
+    }
+
+    return smw_set_profiling(true, (uint64_t)slow_task_ms * 1000);
+}
+
+static int weather_server_workers_init(void) {
+    long workers = 0;
+    if (weather_server_env_number(WEATHER_SERVER_WORKERS_ENV,
+                                  WEATHER_SERVER_WORKERS_DEFAULT,
+                                  &workers) != 0) {
+        return -1;
+    }
+
+    return work_pool_init((size_t)workers);
+}
+
+static int weather_server_io_init(void) {
+    const char* backend = getenv(WEATHER_SERVER_IO_BACKEND_ENV);
+    if (!backend) {
+        backend = WEATHER_SERVER_IO_BACKEND_DEFAULT;
+    }
+
+    if (strcmp(backend, "syscalls") == 0) {
+        return 0;
+    }
+
+    if (strcmp(backend, "uring") != 0 && strcmp(backend, "auto") != 0) {
+        LOG_ERROR("weather_server", "Invalid %s: %s",
+                  WEATHER_SERVER_IO_BACKEND_ENV, backend);
+        return -1;
+    }
+
+    if (tcp_uring_init() != 0 && strcmp(backend, "uring") == 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Starts loading the popular cities database now rather than on the first
+// /v1/cities or /v1/weather request
+static int weather_server_locations_init(void) {
+    uint64_t start = metrics_now_us();
+    if (weather_location_handler_init() != 0) {
+        return -1;
+    }
+
+    LOG_INFO("weather_server", "Location lookups ready in %llu us",
+             (unsigned long long)(metrics_now_us() - start));
+    return 0;
+}
+
+// Process-wide signal handlers are installed here and nowhere else
+static void weather_server_signals_init(void) {
+    struct sigaction action = {0};
+    action.sa_handler       = weather_server_on_sighup;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGHUP, &action, NULL);
+}
+
+// SIGHUP reloads the popular cities database
+static void weather_server_on_sighup(int signum) {
+    (void)signum;
+    popular_cities_request_reload();
+}
+
+// Read a non-negative integer setting, or use the fallback when unset
+static int weather_server_env_number(const char* name, long fallback,
+                                     long* value) {
+    const char* text = getenv(name);
+    if (!text) {
+        *value = fallback;
+        return 0;
+    }
+
+    char* end    = NULL;
+    long  parsed = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || parsed < 0) {
+        LOG_ERROR("weather_server", "Invalid %s: %s", name, text);
+        return -1;
+    }
+
+    *value = parsed;
+    return 0;
 }
 
 void weather_server_dispose_ptr(WeatherServer** server_ptr) {
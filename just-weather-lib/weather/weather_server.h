@@ -5,12 +5,90 @@
 #include "linked_list.h"
 #include "smw.h"
 
+// Per-route request limits, "route=rate:burst,..." with "*" for other routes
+// and rate 0 for no limit (see rate_limiter_parse_rules)
+#define WEATHER_SERVER_RATE_LIMITS_ENV "JUST_WEATHER_RATE_LIMITS"
+#define WEATHER_SERVER_RATE_LIMITS_DEFAULT                                     \
+    "/v1/weather=5:20,/v1/current=5:20,/v1/cities=10:30,*=20:60"
+
+// Log file of the persistent response cache, "" to keep responses in memory
+// only
+#define WEATHER_SERVER_CACHE_FILE_ENV "JUST_WEATHER_CACHE_FILE"
+#define WEATHER_SERVER_CACHE_FILE_DEFAULT "./cache/responses.log"
+
+// Open connections allowed per client, 0 for no limit
+#define WEATHER_SERVER_MAX_CONNECTIONS_ENV                                     \
+    "JUST_WEATHER_MAX_CONNECTIONS_PER_CLIENT"
+#define WEATHER_SERVER_MAX_CONNECTIONS_DEFAULT 32
+
+// Overload protection (see HttpServerAdmission), 0 disables each of them:
+// stop accepting above this many open connections...
+#define WEATHER_SERVER_MAX_INFLIGHT_ENV "JUST_WEATHER_MAX_INFLIGHT"
+#define WEATHER_SERVER_MAX_INFLIGHT_DEFAULT 384
+// ...or while a pass of the main loop takes longer than this...
+#define WEATHER_SERVER_MAX_LOOP_LAG_ENV "JUST_WEATHER_MAX_LOOP_LAG_MS"
+#define WEATHER_SERVER_MAX_LOOP_LAG_DEFAULT 50
+// ...and answer 503 to requests accepted longer ago than this
+#define WEATHER_SERVER_QUEUE_DEADLINE_ENV "JUST_WEATHER_QUEUE_DEADLINE_MS"
+#define WEATHER_SERVER_QUEUE_DEADLINE_DEFAULT 1000
+
+// Connections taken from the listen backlog per pass of the main loop
+#define WEATHER_SERVER_ACCEPT_BATCH_ENV "JUST_WEATHER_ACCEPT_BATCH"
+#define WEATHER_SERVER_ACCEPT_BATCH_DEFAULT 64
+// Listener socket options (see TcpServerOptions), 0 to leave them off
+#define WEATHER_SERVER_DEFER_ACCEPT_ENV "JUST_WEATHER_DEFER_ACCEPT_S"
+#define WEATHER_SERVER_DEFER_ACCEPT_DEFAULT 0
+#define WEATHER_SERVER_FASTOPEN_QUEUE_ENV "JUST_WEATHER_FASTOPEN_QUEUE"
+#define WEATHER_SERVER_FASTOPEN_QUEUE_DEFAULT 0
+#define WEATHER_SERVER_TCP_NODELAY_ENV "JUST_WEATHER_TCP_NODELAY"
+#define WEATHER_SERVER_TCP_NODELAY_DEFAULT 1
+
+// Larger requests are refused with 431 (headers) or 413 (body), 0 for no
+// limit
+#define WEATHER_SERVER_MAX_HEADER_SIZE_ENV "JUST_WEATHER_MAX_HEADER_BYTES"
+#define WEATHER_SERVER_MAX_HEADER_SIZE_DEFAULT (16 * 1024)
+#define WEATHER_SERVER_MAX_BODY_SIZE_ENV "JUST_WEATHER_MAX_BODY_BYTES"
+#define WEATHER_SERVER_MAX_BODY_SIZE_DEFAULT (1024 * 1024)
+
+// Connections are closed when a client takes longer than this to start its
+// request, or to finish its headers once started, 0 for no limit
+#define WEATHER_SERVER_IDLE_TIMEOUT_ENV "JUST_WEATHER_IDLE_TIMEOUT_MS"
+#define WEATHER_SERVER_IDLE_TIMEOUT_DEFAULT 10000
+#define WEATHER_SERVER_HEADER_TIMEOUT_ENV "JUST_WEATHER_HEADER_TIMEOUT_MS"
+#define WEATHER_SERVER_HEADER_TIMEOUT_DEFAULT 10000
+// ...or when a body falls behind the minimum rate after the transfer
+// timeout, or a response makes no progress for that long
+#define WEATHER_SERVER_TRANSFER_TIMEOUT_ENV "JUST_WEATHER_TRANSFER_TIMEOUT_MS"
+#define WEATHER_SERVER_TRANSFER_TIMEOUT_DEFAULT 10000
+#define WEATHER_SERVER_MIN_BODY_RATE_ENV "JUST_WEATHER_MIN_BODY_RATE"
+#define WEATHER_SERVER_MIN_BODY_RATE_DEFAULT 1024
+
+// Background work (cache upkeep, city file watching) is put off while a pass
+// of the main loop has run longer than this, 0 for no limit
+#define WEATHER_SERVER_TICK_BUDGET_ENV "JUST_WEATHER_TICK_BUDGET_MS"
+#define WEATHER_SERVER_TICK_BUDGET_DEFAULT 10
+
+// Socket I/O backend: "uring" (fail when io_uring is unusable), "syscalls",
+// or "auto" for io_uring when the kernel supports it
+#define WEATHER_SERVER_IO_BACKEND_ENV "JUST_WEATHER_IO_BACKEND"
+#define WEATHER_SERVER_IO_BACKEND_DEFAULT "auto"
+
+// Profile task callbacks and log those taking longer than this, 0 to not
+// profile at all (see smw_set_profiling)
+#define WEATHER_SERVER_SLOW_TASK_ENV "JUST_WEATHER_SLOW_TASK_MS"
+#define WEATHER_SERVER_SLOW_TASK_DEFAULT 0
+
+// Worker threads compressing responses off the main loop, 0 to compress on
+// the main loop (see work_pool)
+#define WEATHER_SERVER_WORKERS_ENV "JUST_WEATHER_WORKERS"
+#define WEATHER_SERVER_WORKERS_DEFAULT 2
+
 typedef struct {
     HTTPServer httpServer;
 
     LinkedList* instances;
 
-    SmwTask* task;
+    SmwTask* maintenance_task; // Background class
 
 } WeatherServer;
 
@@ -1,26 +1,330 @@
 #include "weather_server_instance.h"
 
+#include "http_client.h"
+#include "json_writer.h"
+#include "log.h"
+#include "metrics.h"
 #include "open_meteo_handler.h"
+#include "rate_limiter.h"
 #include "response_builder.h"
+#include "response_cache.h"
 #include "weather_location_handler.h"
+#include "work_pool.h"
 
+#include <errno.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// Room reserved in front of JSON bodies for the response headers
+#define RESPONSE_HEAD_ROOM 384
+
+// Fits the ETag and Cache-Control lines of cacheable responses
+#define CACHE_HEADERS_MAX 128
+
+// Lines of GET /v1/cities/export queued per stream chunk, in bytes, and the
+// longest line, bounded by the fixed-size fields of PopularCity
+#define EXPORT_CHUNK_SIZE (16 * 1024)
+#define EXPORT_LINE_MAX 2048
+
+// Distinct (route, status) pairs with their own request metrics
+#define ROUTE_METRICS_MAX 64
+
+// How long successful responses are served from the response cache
+#define WEATHER_RESPONSE_TTL 300 /* 5 minutes */
+#define CITIES_RESPONSE_TTL 3600 /* 1 hour */
+
+// Upstream hosts as named in the URLs the API clients request. While a
+// host's circuit breaker is open, cache misses that need it are answered
+// from stale cache entries or with a 503 instead of waiting on it.
+#define FORECAST_HOST "api.open-meteo.com"
+#define GEOCODING_HOST "geocoding-api.open-meteo.com"
+
+// Retry-After of the 503 sent while upstream is unavailable, in seconds
+#define UPSTREAM_RETRY_AFTER 5
+
+static const char HOMEPAGE_HTML[] =
+    "<!DOCTYPE html>"
+    "<html>"
+    "<head><title>Just Weather</title></head>"
+    "<body>"
+    "<h1>Just Weather API</h1>"
+    "<p>Available endpoints:</p>"
+    "<ul>"
+    "  <li><b>GET /echo</b> — echo raw request</li>"
+    "  <li><b>POST /echo</b> — echo raw body</li>"
+    "  <li><b>GET /v1/current?lat=XX&lon=YY</b> — current weather by "
+    "coordinates</li>"
+    "  <li><b>GET /v1/weather?city=NAME&country=CODE</b> — weather by "
+    "city name</li>"
+    "  <li><b>GET /v1/cities?query=SEARCH</b> — city search "
+    "(autocomplete)</li>"
+    "  <li><b>GET /v1/cities/export</b> — all known cities, one JSON object "
+    "per line</li>"
+    "  <li><b>GET /metrics</b> — Prometheus metrics</li>"
+    "</ul>"
+    "<p>Source code available on <a "
+    "href=\"https://github.com/Stockholm-3/just-weather-server\" "
+    "target=\"_blank\">GitHub</a>.</p>"
+    "</body>"
+    "</html>";
+
+// Homepage bodies indexed by HttpContentEncoding, compressed once at startup.
+// An entry without a body means that coding is not worth it.
+typedef struct {
+    const uint8_t* body;
+    size_t         length;
+} StaticVariant;
+
+static StaticVariant g_homepage[3];
+
+// Complete 429 responses indexed by their Retry-After seconds, built once so
+// throttling a client costs no formatting or allocation
+static StaticVariant g_too_many_requests[RATE_LIMITER_RETRY_MAX + 1];
+static StaticVariant g_service_unavailable;
+static StaticVariant g_upstream_unavailable;
+static StaticVariant g_cities_loading;
+
+// Lines of the export chunk being built; only touched from the smw thread
+static uint8_t g_export_chunk[EXPORT_CHUNK_SIZE + EXPORT_LINE_MAX];
+
+// Requests queued longer than this are answered with 503 instead of being
+// handled; 0 disables shedding
+static uint64_t g_queue_deadline_us = 0;
+
+static MetricId g_metric_queue = -1; // Accept to handling, per request
+static MetricId g_metric_shed  = -1; // Requests shed after their deadline
+static MetricId g_metric_stale = -1; // Stale bodies served, upstream down
+
+// Known routes; anything else is reported as "unmatched" so unknown paths
+// cannot grow the number of series
+static const char* const ROUTES[] = {"/",           "/echo",
+                                     "/metrics",    "/v1/weather",
+                                     "/v1/cities",  "/v1/cities/export",
+                                     "/v1/current"};
+
+typedef struct {
+    const char* route;
+    int         status;
+    MetricId    requests;
+    MetricId    latency;
+} RouteMetrics;
+
+// Only touched from the smw thread
+static RouteMetrics g_route_metrics[ROUTE_METRICS_MAX];
+static int          g_route_metric_count = 0;
+
+// A cached body being compressed on a worker. The worker only touches the
+// copies in here; inst is cleared when the connection closes first.
+typedef struct WeatherServerCompressJob {
+    WeatherServerInstance* inst;
+    WorkPoolJob*           handle;
+
+    char                key[RESPONSE_CACHE_KEY_MAX];
+    HttpContentEncoding encoding;
+    uint64_t            version;
+    uint8_t*            body; // Identity body
+    size_t              length;
+
+    uint8_t* compressed; // NULL if compression did not pay off
+    size_t   compressed_len;
+} WeatherServerCompressJob;
+
 //-----------------Internal Functions-----------------
 
-int weather_server_instance_on_request(void* context);
+int         weather_server_instance_on_request(void* context);
+static void weather_server_instance_on_close(void* context);
+static int  weather_server_instance_build_error(int         status_code,
+                                                uint32_t    retry_after,
+                                                const char* message,
+                                                StaticVariant* out);
+static void weather_server_instance_send_static(HTTPServerConnection* conn,
+                                                const StaticVariant*  response);
+static void weather_server_instance_send_throttled(HTTPServerConnection* conn,
+                                                   uint32_t retry_after);
+static int weather_server_instance_handle_request(WeatherServerInstance* inst);
+static void weather_server_instance_record(HTTPServerConnection* conn,
+                                           int result, uint64_t elapsed_us);
+static int weather_server_instance_send_json(HTTPServerConnection* conn,
+                                             int                   status_code,
+                                             JsonWriter*           writer,
+                                             const char* extra_headers);
+static int weather_server_instance_send_body(HTTPServerConnection* conn,
+                                             int                   status_code,
+                                             const char*    content_type,
+                                             const uint8_t* body, size_t length,
+                                             HttpContentEncoding encoding,
+                                             const char*         extra_headers);
+static void weather_server_instance_cache_headers(const ResponseCacheInfo* info,
+                                                  HttpContentEncoding encoding,
+                                                  char* out, size_t out_size);
+static int  weather_server_instance_send_not_modified(
+    HTTPServerConnection* conn, const ResponseCacheInfo* info,
+    HttpContentEncoding encoding);
+static int weather_server_instance_send_cached(HTTPServerConnection* conn,
+                                               const char*           key,
+                                               HttpContentEncoding   encoding);
+static int weather_server_instance_send_if_not_modified(
+    HTTPServerConnection* conn, const char* key, HttpContentEncoding encoding);
+static int weather_server_instance_send_cached_now(
+    HTTPServerConnection* conn, const char* key, HttpContentEncoding encoding);
+static int weather_server_instance_compress_async(
+    HTTPServerConnection* conn, const char* key, HttpContentEncoding encoding);
+static void weather_server_instance_compress_run(void* context);
+static void weather_server_instance_compress_done(void* context,
+                                                  bool  cancelled);
+static int weather_server_instance_send_fresh(HTTPServerConnection* conn,
+                                              int                   status_code,
+                                              JsonWriter*           writer,
+                                              const char*           key,
+                                              time_t                ttl,
+                                              HttpContentEncoding   encoding);
+static int weather_server_instance_take_param(char* query, const char* name,
+                                              char* value, size_t value_size);
+static int weather_server_instance_export_start(WeatherServerInstance* inst);
+static void weather_server_instance_export_more(void* context);
+static void weather_server_instance_export_line(JsonWriter*        writer,
+                                                const PopularCity* city,
+                                                size_t*            length);
+static int weather_server_instance_send_stale(HTTPServerConnection* conn,
+                                              const char*           key);
+static int weather_server_instance_send_fallback(HTTPServerConnection* conn,
+                                                 const char*           key);
 
 //----------------------------------------------------
 
+int weather_server_instance_static_init(void) {
+    g_homepage[HTTP_CONTENT_ENCODING_IDENTITY].body =
+        (const uint8_t*)HOMEPAGE_HTML;
+    g_homepage[HTTP_CONTENT_ENCODING_IDENTITY].length =
+        sizeof(HOMEPAGE_HTML) - 1;
+
+    HttpContentEncoding codings[] = {HTTP_CONTENT_ENCODING_GZIP,
+                                     HTTP_CONTENT_ENCODING_DEFLATE};
+    for (size_t i = 0; i < sizeof(codings) / sizeof(codings[0]); i++) {
+        uint8_t* body   = NULL;
+        size_t   length = 0;
+        if (response_cache_compress((const uint8_t*)HOMEPAGE_HTML,
+                                    sizeof(HOMEPAGE_HTML) - 1, codings[i],
+                                    &body, &length) == 0) {
+            g_homepage[codings[i]].body   = body;
+            g_homepage[codings[i]].length = length;
+        }
+    }
+
+    for (uint32_t seconds = 1; seconds <= RATE_LIMITER_RETRY_MAX; seconds++) {
+        char message[96];
+        snprintf(message, sizeof(message),
+                 "Rate limit exceeded, retry in %u second%s", seconds,
+                 seconds == 1 ? "" : "s");
+        if (weather_server_instance_build_error(
+                HTTP_TOO_MANY_REQUESTS, seconds, message,
+                &g_too_many_requests[seconds]) != 0) {
+            return -1;
+        }
+    }
+
+    if (weather_server_instance_build_error(
+            HTTP_SERVICE_UNAVAILABLE, 1,
+            "Server is overloaded, please retry shortly",
+            &g_service_unavailable) != 0) {
+        return -1;
+    }
+
+    if (weather_server_instance_build_error(
+            HTTP_SERVICE_UNAVAILABLE, UPSTREAM_RETRY_AFTER,
+            "Weather service is temporarily unavailable",
+            &g_upstream_unavailable) != 0) {
+        return -1;
+    }
+
+    if (weather_server_instance_build_error(
+            HTTP_SERVICE_UNAVAILABLE, 1,
+            "City database is still loading, please retry shortly",
+            &g_cities_loading) != 0) {
+        return -1;
+    }
+
+    g_metric_queue = metrics_register(
+        METRIC_HISTOGRAM, "just_weather_http_queue_seconds", NULL,
+        "Time from a request reaching the server to handling it");
+    g_metric_shed =
+        metrics_register(METRIC_COUNTER, "just_weather_http_shed_total", NULL,
+                         "Requests answered with 503 after their deadline");
+    g_metric_stale = metrics_register(
+        METRIC_COUNTER, "just_weather_http_stale_total", NULL,
+        "Expired cache entries served because upstream was unavailable");
+
+    return 0;
+}
+
+void weather_server_instance_set_queue_deadline(uint64_t deadline_us) {
+    g_queue_deadline_us = deadline_us;
+}
+
+void weather_server_instance_static_dispose(void) {
+    for (size_t i = 0; i < sizeof(g_homepage) / sizeof(g_homepage[0]); i++) {
+        if (i != HTTP_CONTENT_ENCODING_IDENTITY) {
+            free((void*)g_homepage[i].body);
+        }
+        g_homepage[i].body   = NULL;
+        g_homepage[i].length = 0;
+    }
+
+    for (size_t i = 0; i <= RATE_LIMITER_RETRY_MAX; i++) {
+        free((void*)g_too_many_requests[i].body);
+        g_too_many_requests[i].body   = NULL;
+        g_too_many_requests[i].length = 0;
+    }
+
+    free((void*)g_service_unavailable.body);
+    g_service_unavailable.body   = NULL;
+    g_service_unavailable.length = 0;
+
+    free((void*)g_upstream_unavailable.body);
+    g_upstream_unavailable.body   = NULL;
+    g_upstream_unavailable.length = 0;
+
+    free((void*)g_cities_loading.body);
+    g_cities_loading.body   = NULL;
+    g_cities_loading.length = 0;
+}
+
 int weather_server_instance_initiate(WeatherServerInstance* instance,
                                      HTTPServerConnection*  connection) {
-    instance->connection = connection;
+    instance->connection   = connection;
+    instance->has_client   = false;
+    instance->counted      = false;
+    instance->compress_job = NULL;
+    instance->started_us   = 0;
+    instance->export_db    = NULL;
+    instance->export_next  = 0;
+    instance->list         = NULL;
+    instance->node         = NULL;
+    instance->allocated    = false;
 
     http_server_connection_set_callback(instance->connection, instance,
                                         weather_server_instance_on_request);
+    http_server_connection_set_on_close(instance->connection,
+                                        weather_server_instance_on_close);
+
+    if (connection->peer_len > 0 &&
+        rate_limiter_key((const struct sockaddr*)&connection->peer,
+                         connection->peer_len, &instance->client) == 0) {
+        instance->has_client = true;
+
+        int open = rate_limiter_connection_open(&instance->client,
+                                                metrics_now_us() / 1000);
+        if (open < 0) {
+            // Over the per-client connection cap: answer without reading
+            LOG_DEBUG("weather", "Connection limit reached, refusing client");
+            weather_server_instance_send_throttled(connection, 1);
+            connection->state = HTTP_SERVER_CONNECTION_STATE_SEND;
+        }
+        instance->counted = open > 0;
+    }
 
     return 0;
 }
@@ -43,16 +347,69 @@ int weather_server_instance_initiate_ptr(HTTPServerConnection*   connection,
         return result;
     }
 
-    *(instance_ptr) = instance;
+    instance->allocated = true;
+    *(instance_ptr)     = instance;
 
     return 0;
 }
 
 int weather_server_instance_on_request(void* context) {
     WeatherServerInstance* inst = (WeatherServerInstance*)context;
-    HTTPServerConnection*  conn = inst->connection;
 
-    printf("[WEATHER] onRequest: %s %s\n", conn->method, conn->request_path);
+    uint64_t start  = metrics_now_us();
+    uint64_t queued = start - inst->connection->arrived_us;
+    metrics_observe(g_metric_queue, queued);
+    inst->started_us = start;
+
+    // The client has likely given up on a request this old; answering it
+    // quickly frees the loop for requests that can still make it
+    if (g_queue_deadline_us > 0 && queued > g_queue_deadline_us) {
+        metrics_inc(g_metric_shed);
+        weather_server_instance_send_static(inst->connection,
+                                            &g_service_unavailable);
+        weather_server_instance_record(inst->connection, 0,
+                                       metrics_now_us() - start);
+        return 0;
+    }
+
+    int result = weather_server_instance_handle_request(inst);
+
+    // A response finished on a worker is recorded once it is ready
+    if (inst->connection->state != HTTP_SERVER_CONNECTION_STATE_WAIT) {
+        weather_server_instance_record(inst->connection, result,
+                                       metrics_now_us() - start);
+    }
+
+    return result;
+}
+
+int weather_server_instance_track(WeatherServerInstance* instance,
+                                  LinkedList*            list) {
+    if (linked_list_append(list, instance) != 0) {
+        return -1;
+    }
+
+    instance->list = list;
+    instance->node = list->tail;
+    return 0;
+}
+
+// Nothing else refers to the instance once its connection is gone
+static void weather_server_instance_on_close(void* context) {
+    WeatherServerInstance* inst = (WeatherServerInstance*)context;
+
+    inst->connection = NULL;
+    if (inst->allocated) {
+        weather_server_instance_dispose_ptr(&inst);
+    } else {
+        weather_server_instance_dispose(inst);
+    }
+}
+
+static int weather_server_instance_handle_request(WeatherServerInstance* inst) {
+    HTTPServerConnection* conn = inst->connection;
+
+    LOG_DEBUG("weather", "Request: %s %s", conn->method, conn->request_path);
 
     // Parse URL to get path and query
     char path[256]  = {0};
@@ -68,54 +425,71 @@ int weather_server_instance_on_request(void* context) {
         strcpy(path, conn->request_path);
     }
 
+    uint32_t retry_after = 0;
+    if (inst->has_client &&
+        !rate_limiter_allow(&inst->client, path, metrics_now_us() / 1000,
+                            &retry_after)) {
+        LOG_DEBUG("weather", "Rate limited: %s %s", conn->method, path);
+        weather_server_instance_send_throttled(conn, retry_after);
+        return 0;
+    }
+
+    // Negotiate compact/pretty JSON. The pretty parameter is removed from
+    // the query so the endpoint handlers never see it.
+    char pretty_param[8] = {0};
+    int  has_pretty      = weather_server_instance_take_param(
+        query, "pretty", pretty_param, sizeof(pretty_param));
+
+    size_t      accept_len = 0;
+    const char* accept =
+        http_server_connection_get_header(conn, "Accept", &accept_len);
+
+    ResponseFormat format = response_builder_negotiate_format(
+        has_pretty ? pretty_param : NULL, accept, accept_len);
+    bool pretty = format == RESPONSE_FORMAT_PRETTY;
+
+    HttpContentEncoding encoding = http_server_connection_get_encoding(conn);
+
+    // Responses differ per endpoint, parameters and JSON format; the content
+    // coding is handled inside the response cache
+    char cache_key[RESPONSE_CACHE_KEY_MAX];
+    snprintf(cache_key, sizeof(cache_key), "%s?%s|%s", path, query,
+             response_builder_format_name(format));
+
     // ==================================================================
     // ENDPOINT: GET /
     // Homepage with API documentation
     // ==================================================================
     if (strcmp(conn->method, "GET") == 0 && strcmp(path, "/") == 0) {
-        printf("[WEATHER] Serving homepage\n");
-
-        const char* html =
-            "<!DOCTYPE html>"
-            "<html>"
-            "<head><title>Just Weather</title></head>"
-            "<body>"
-            "<h1>Just Weather API</h1>"
-            "<p>Available endpoints:</p>"
-            "<ul>"
-            "  <li><b>GET /echo</b> — echo raw request</li>"
-            "  <li><b>POST /echo</b> — echo raw body</li>"
-            "  <li><b>GET /v1/current?lat=XX&lon=YY</b> — current weather by "
-            "coordinates</li>"
-            "  <li><b>GET /v1/weather?city=NAME&country=CODE</b> — weather by "
-            "city name</li>"
-            "  <li><b>GET /v1/cities?query=SEARCH</b> — city search "
-            "(autocomplete)</li>"
-            "</ul>"
-            "<p>Source code available on <a "
-            "href=\"https://github.com/Stockholm-3/just-weather-server\" "
-            "target=\"_blank\">GitHub</a>.</p>"
-            "</body>"
-            "</html>";
+        LOG_DEBUG("weather", "Serving homepage");
 
-        char header[256];
-        int  header_len = snprintf(header, sizeof(header),
-                                   "HTTP/1.1 200 OK\r\n"
-                                    "Content-Type: text/html; charset=utf-8\r\n"
-                                    "Access-Control-Allow-Origin: *\r\n"
-                                    "Content-Length: %zu\r\n"
-                                    "\r\n",
-                                   strlen(html));
+        StaticVariant* variant = &g_homepage[encoding];
+        if (!variant->body) {
+            encoding = HTTP_CONTENT_ENCODING_IDENTITY;
+            variant  = &g_homepage[encoding];
+        }
 
-        size_t   total = header_len + strlen(html);
-        uint8_t* buf   = malloc(total + 1);
+        return weather_server_instance_send_body(
+            conn, HTTP_OK, "text/html; charset=utf-8", variant->body,
+            variant->length, encoding, "");
+    }
 
-        memcpy(buf, header, header_len);
-        strcpy((char*)buf + header_len, html);
+    // ==================================================================
+    // ENDPOINT: GET /metrics
+    // Prometheus text exposition of all registered metrics
+    // ==================================================================
+    if (strcmp(conn->method, "GET") == 0 && strcmp(path, "/metrics") == 0) {
+        char*  text   = NULL;
+        size_t length = 0;
+        if (metrics_render(&text, &length) != 0) {
+            return -1;
+        }
 
-        conn->write_buffer = buf;
-        conn->write_size   = total;
-        return 0;
+        int result = weather_server_instance_send_body(
+            conn, HTTP_OK, "text/plain; version=0.0.4; charset=utf-8",
+            (const uint8_t*)text, length, HTTP_CONTENT_ENCODING_IDENTITY, "");
+        free(text);
+        return result;
     }
 
     // ==================================================================
@@ -123,7 +497,7 @@ int weather_server_instance_on_request(void* context) {
     // Echo endpoint for debugging
     // ==================================================================
     if (strcmp(path, "/echo") == 0) {
-        printf("[WEATHER] Echo endpoint hit (%s)\n", conn->method);
+        LOG_DEBUG("weather", "Echo endpoint hit (%s)", conn->method);
 
         size_t body_len = conn->read_buffer_size;
 
@@ -152,73 +526,51 @@ int weather_server_instance_on_request(void* context) {
     // Weather by city name (uses geocoding + weather API)
     // ==================================================================
     if (strcmp(conn->method, "GET") == 0 && strcmp(path, "/v1/weather") == 0) {
-        printf("[WEATHER] Handling /v1/weather request\n");
+        LOG_DEBUG("weather", "Handling /v1/weather request");
+
+        if (weather_server_instance_send_cached(conn, cache_key, encoding) ==
+            0) {
+            LOG_DEBUG("weather", "Served from response cache");
+            return 0;
+        }
 
-        char* json_response = NULL;
-        int   status_code   = 0;
+        if (http_client_circuit_open(GEOCODING_HOST) ||
+            http_client_circuit_open(FORECAST_HOST)) {
+            return weather_server_instance_send_fallback(conn, cache_key);
+        }
+
+        JsonWriter writer;
+        if (json_writer_init(&writer, RESPONSE_HEAD_ROOM, pretty) != 0) {
+            return -1;
+        }
+
+        int status_code = 0;
 
         // Call the city-based weather handler
-        weather_location_handler_by_city(query, &json_response, &status_code);
+        weather_location_handler_by_city(query, &writer, &status_code);
 
-        if (!json_response) {
+        if (json_writer_finish(&writer) != 0) {
             const char* reason = "Failed to fetch weather data for city";
 
-            char* error_json = response_builder_error(
-                HTTP_INTERNAL_ERROR,
+            response_builder_write_error(
+                &writer, HTTP_INTERNAL_ERROR,
                 response_builder_get_error_type(HTTP_INTERNAL_ERROR), reason);
+            status_code = HTTP_INTERNAL_ERROR;
 
-            if (!error_json) {
-                return -1;
-            }
-
-            char header[256];
-            int  header_len = snprintf(header, sizeof(header),
-                                       "HTTP/1.1 500 Internal Server Error\r\n"
-                                        "Content-Type: application/json\r\n"
-                                        "Access-Control-Allow-Origin: *\r\n"
-                                        "Content-Length: %zu\r\n"
-                                        "\r\n",
-                                       strlen(error_json));
-
-            size_t   total_len = header_len + strlen(error_json);
-            uint8_t* response  = malloc(total_len + 1);
-            if (response) {
-                memcpy(response, header, header_len);
-                strcpy((char*)(response + header_len), error_json);
-
-                conn->write_buffer = response;
-                conn->write_size   = total_len;
-            }
-
-            free(error_json);
-            printf("[WEATHER] /v1/weather failed: %s\n", reason);
-            return 0;
+            LOG_WARN("weather", "/v1/weather failed: %s", reason);
         }
 
-        // Success: return JSON
-        char header[256];
-        int  header_len =
-            snprintf(header, sizeof(header),
-                     "HTTP/1.1 %d %s\r\n"
-                     "Content-Type: application/json\r\n"
-                     "Access-Control-Allow-Origin: *\r\n"
-                     "Content-Length: %zu\r\n"
-                     "\r\n",
-                     status_code, status_code == 200 ? "OK" : "Error",
-                     strlen(json_response));
-
-        size_t   total_len = header_len + strlen(json_response);
-        uint8_t* response  = malloc(total_len + 1);
-        if (response) {
-            memcpy(response, header, header_len);
-            strcpy((char*)(response + header_len), json_response);
-
-            conn->write_buffer = response;
-            conn->write_size   = total_len;
+        if (status_code >= HTTP_INTERNAL_ERROR &&
+            weather_server_instance_send_stale(conn, cache_key) == 0) {
+            json_writer_dispose(&writer);
+            return 0;
         }
 
-        free(json_response);
-        return 0;
+        int result = weather_server_instance_send_fresh(
+            conn, status_code, &writer, cache_key, WEATHER_RESPONSE_TTL,
+            encoding);
+        json_writer_dispose(&writer);
+        return result;
     }
 
     // ==================================================================
@@ -226,73 +578,60 @@ int weather_server_instance_on_request(void* context) {
     // City search (autocomplete)
     // ==================================================================
     if (strcmp(conn->method, "GET") == 0 && strcmp(path, "/v1/cities") == 0) {
-        printf("[WEATHER] Handling /v1/cities request\n");
+        LOG_DEBUG("weather", "Handling /v1/cities request");
 
-        char* json_response = NULL;
-        int   status_code   = 0;
+        if (weather_server_instance_send_cached(conn, cache_key, encoding) ==
+            0) {
+            LOG_DEBUG("weather", "Served from response cache");
+            return 0;
+        }
+
+        if (http_client_circuit_open(GEOCODING_HOST)) {
+            return weather_server_instance_send_fallback(conn, cache_key);
+        }
+
+        JsonWriter writer;
+        if (json_writer_init(&writer, RESPONSE_HEAD_ROOM, pretty) != 0) {
+            return -1;
+        }
 
-        weather_location_handler_search_cities(query, &json_response,
-                                               &status_code);
+        int status_code = 0;
 
-        if (!json_response) {
+        weather_location_handler_search_cities(query, &writer, &status_code);
+
+        if (json_writer_finish(&writer) != 0) {
             const char* reason = "Failed to search cities";
 
-            char* error_json = response_builder_error(
-                HTTP_INTERNAL_ERROR,
+            response_builder_write_error(
+                &writer, HTTP_INTERNAL_ERROR,
                 response_builder_get_error_type(HTTP_INTERNAL_ERROR), reason);
+            status_code = HTTP_INTERNAL_ERROR;
 
-            if (!error_json) {
-                return -1;
-            }
-
-            char header[256];
-            int  header_len = snprintf(header, sizeof(header),
-                                       "HTTP/1.1 500 Internal Server Error\r\n"
-                                        "Content-Type: application/json\r\n"
-                                        "Access-Control-Allow-Origin: *\r\n"
-                                        "Content-Length: %zu\r\n"
-                                        "\r\n",
-                                       strlen(error_json));
-
-            size_t   total_len = header_len + strlen(error_json);
-            uint8_t* response  = malloc(total_len + 1);
-            if (response) {
-                memcpy(response, header, header_len);
-                strcpy((char*)(response + header_len), error_json);
-
-                conn->write_buffer = response;
-                conn->write_size   = total_len;
-            }
+            LOG_WARN("weather", "/v1/cities failed: %s", reason);
+        }
 
-            free(error_json);
-            printf("[WEATHER] /v1/cities failed: %s\n", reason);
+        if (status_code >= HTTP_INTERNAL_ERROR &&
+            weather_server_instance_send_stale(conn, cache_key) == 0) {
+            json_writer_dispose(&writer);
             return 0;
         }
 
-        // Success: return JSON
-        char header[256];
-        int  header_len =
-            snprintf(header, sizeof(header),
-                     "HTTP/1.1 %d %s\r\n"
-                     "Content-Type: application/json\r\n"
-                     "Access-Control-Allow-Origin: *\r\n"
-                     "Content-Length: %zu\r\n"
-                     "\r\n",
-                     status_code, status_code == 200 ? "OK" : "Error",
-                     strlen(json_response));
-
-        size_t   total_len = header_len + strlen(json_response);
-        uint8_t* response  = malloc(total_len + 1);
-        if (response) {
-            memcpy(response, header, header_len);
-            strcpy((char*)(response + header_len), json_response);
-
-            conn->write_buffer = response;
-            conn->write_size   = total_len;
-        }
+        int result = weather_server_instance_send_fresh(
+            conn, status_code, &writer, cache_key, CITIES_RESPONSE_TTL,
+            encoding);
+        json_writer_dispose(&writer);
+        return result;
+    }
 
-        free(json_response);
-        return 0;
+    // ==================================================================
+    // ENDPOINT: GET /v1/cities/export
+    // Every city of the local database as one JSON object per line,
+    // streamed so the response is never built in memory
+    // ==================================================================
+    if (strcmp(conn->method, "GET") == 0 &&
+        strcmp(path, "/v1/cities/export") == 0) {
+        LOG_DEBUG("weather", "Handling /v1/cities/export request");
+        return weather_server_instance_export_start(inst);
     }
 
     // ==================================================================
@@ -300,127 +639,804 @@ int weather_server_instance_on_request(void* context) {
     // Weather by coordinates
     // ==================================================================
     if (strcmp(conn->method, "GET") == 0 && strcmp(path, "/v1/current") == 0) {
-        printf("[WEATHER] Handling /v1/current request\n");
+        LOG_DEBUG("weather", "Handling /v1/current request");
+
+        if (weather_server_instance_send_cached(conn, cache_key, encoding) ==
+            0) {
+            LOG_DEBUG("weather", "Served from response cache");
+            return 0;
+        }
 
-        char* json_response = NULL;
-        int   status_code   = 0;
+        if (http_client_circuit_open(FORECAST_HOST)) {
+            return weather_server_instance_send_fallback(conn, cache_key);
+        }
+
+        JsonWriter writer;
+        if (json_writer_init(&writer, RESPONSE_HEAD_ROOM, pretty) != 0) {
+            return -1;
+        }
+
+        int status_code = 0;
 
         // Call your Open-Meteo handler
-        open_meteo_handler_current(query, &json_response, &status_code);
+        open_meteo_handler_current(query, &writer, &status_code);
 
-        if (!json_response) {
+        if (json_writer_finish(&writer) != 0) {
             const char* reason =
                 "Failed to fetch weather data from Open-Meteo API";
 
-            char* error_json = response_builder_error(
-                HTTP_INTERNAL_ERROR,
+            response_builder_write_error(
+                &writer, HTTP_INTERNAL_ERROR,
                 response_builder_get_error_type(HTTP_INTERNAL_ERROR), reason);
+            status_code = HTTP_INTERNAL_ERROR;
 
-            if (!error_json) {
-                return -1;
-            }
-
-            char header[256];
-            int  header_len = snprintf(header, sizeof(header),
-                                       "HTTP/1.1 500 Internal Server Error\r\n"
-                                        "Content-Type: application/json\r\n"
-                                        "Access-Control-Allow-Origin: *\r\n"
-                                        "Content-Length: %zu\r\n"
-                                        "\r\n",
-                                       strlen(error_json));
-
-            size_t   total_len = header_len + strlen(error_json);
-            uint8_t* response  = malloc(total_len + 1);
-            if (response) {
-                memcpy(response, header, header_len);
-                strcpy((char*)(response + header_len), error_json);
-
-                conn->write_buffer = response;
-                conn->write_size   = total_len;
-            }
-
-            free(error_json);
-            printf("[WEATHER] /v1/current failed: %s\n", reason);
-            return 0;
+            LOG_WARN("weather", "/v1/current failed: %s", reason);
         }
 
-        // Success: return JSON from Open-Meteo
-        char header[256];
-        int  header_len =
-            snprintf(header, sizeof(header),
-                     "HTTP/1.1 %d %s\r\n"
-                     "Content-Type: application/json\r\n"
-                     "Access-Control-Allow-Origin: *\r\n"
-                     "Content-Length: %zu\r\n"
-                     "\r\n",
-                     status_code, status_code == 200 ? "OK" : "Error",
-                     strlen(json_response));
-
-        size_t   total_len = header_len + strlen(json_response);
-        uint8_t* response  = malloc(total_len + 1);
-        if (response) {
-            memcpy(response, header, header_len);
-            strcpy((char*)(response + header_len), json_response);
-
-            conn->write_buffer = response;
-            conn->write_size   = total_len;
+        if (status_code >= HTTP_INTERNAL_ERROR &&
+            weather_server_instance_send_stale(conn, cache_key) == 0) {
+            json_writer_dispose(&writer);
+            return 0;
         }
 
-        free(json_response);
-
-        return 0;
+        int result = weather_server_instance_send_fresh(
+            conn, status_code, &writer, cache_key, WEATHER_RESPONSE_TTL,
+            encoding);
+        json_writer_dispose(&writer);
+        return result;
     }
 
     // ==================================================================
     // DEFAULT RESPONSE (for unknown endpoints)
     // ==================================================================
-    printf("[WEATHER] 404 Not Found: %s %s\n", conn->method, path);
+    LOG_DEBUG("weather", "404 Not Found: %s %s", conn->method, path);
 
     char detailed_msg[512];
     snprintf(detailed_msg, sizeof(detailed_msg),
              "The requested endpoint '%s %s' was not found. "
-             "Available endpoints: GET /, POST /echo, "
+             "Available endpoints: GET /, POST /echo, GET /metrics, "
              "GET /v1/current?lat=XX&lon=YY, "
              "GET /v1/weather?city=NAME&country=CODE, "
-             "GET /v1/cities?query=SEARCH",
+             "GET /v1/cities?query=SEARCH, GET /v1/cities/export",
              conn->method, path);
 
-    char* json_response = response_builder_error(
-        HTTP_NOT_FOUND, response_builder_get_error_type(HTTP_NOT_FOUND),
-        detailed_msg);
+    JsonWriter writer;
+    if (json_writer_init(&writer, RESPONSE_HEAD_ROOM, pretty) != 0) {
+        return -1;
+    }
+
+    response_builder_write_error(
+        &writer, HTTP_NOT_FOUND,
+        response_builder_get_error_type(HTTP_NOT_FOUND), detailed_msg);
+
+    int result =
+        weather_server_instance_send_json(conn, HTTP_NOT_FOUND, &writer, "");
+    json_writer_dispose(&writer);
+    return result;
+}
+
+/* Count the request and its handling time per route and response status */
+static void weather_server_instance_record(HTTPServerConnection* conn,
+                                           int result, uint64_t elapsed_us) {
+    const char* route       = "unmatched";
+    size_t      path_len    = strcspn(conn->request_path, "?");
+    size_t      route_count = sizeof(ROUTES) / sizeof(ROUTES[0]);
+    for (size_t i = 0; i < route_count; i++) {
+        if (strlen(ROUTES[i]) == path_len &&
+            strncmp(ROUTES[i], conn->request_path, path_len) == 0) {
+            route = ROUTES[i];
+            break;
+        }
+    }
+
+    // The status line is always the first thing in the write buffer; a
+    // failed handler drops the connection, which we count as a 500
+    int status = HTTP_INTERNAL_ERROR;
+    if (result == 0 && conn->write_buffer &&
+        conn->write_size - conn->write_offset > 12) {
+        const char* line = (const char*)conn->write_buffer + conn->write_offset;
+        status           = atoi(line + 9); // Skip "HTTP/1.1 "
+    }
+
+    RouteMetrics* metrics = NULL;
+    for (int i = 0; i < g_route_metric_count; i++) {
+        if (g_route_metrics[i].route == route &&
+            g_route_metrics[i].status == status) {
+            metrics = &g_route_metrics[i];
+            break;
+        }
+    }
+
+    if (!metrics) {
+        if (g_route_metric_count == ROUTE_METRICS_MAX) {
+            return;
+        }
+
+        metrics         = &g_route_metrics[g_route_metric_count++];
+        metrics->route  = route;
+        metrics->status = status;
+
+        char labels[METRICS_LABELS_MAX];
+        snprintf(labels, sizeof(labels), "route=\"%s\",status=\"%d\"", route,
+                 status);
+        metrics->requests =
+            metrics_register(METRIC_COUNTER, "just_weather_http_requests_total",
+                             labels, "HTTP requests by route and status");
+        metrics->latency = metrics_register(
+            METRIC_HISTOGRAM, "just_weather_http_request_duration_seconds",
+            labels, "Time spent building the response");
+    }
+
+    metrics_inc(metrics->requests);
+    metrics_observe(metrics->latency, elapsed_us);
+}
+
+/* Format a complete error response with a Retry-After header, to be sent as
+ * is whenever it is needed */
+static int weather_server_instance_build_error(int         status_code,
+                                               uint32_t    retry_after,
+                                               const char* message,
+                                               StaticVariant* out) {
+    JsonWriter writer;
+    if (json_writer_init(&writer, 0, false) != 0) {
+        return -1;
+    }
+
+    response_builder_write_error(&writer, status_code,
+                                 response_builder_get_error_type(status_code),
+                                 message);
+    if (json_writer_finish(&writer) != 0) {
+        json_writer_dispose(&writer);
+        return -1;
+    }
+
+    size_t      json_len = 0;
+    const char* json     = json_writer_data(&writer, &json_len);
 
-    if (!json_response) {
+    char header[RESPONSE_HEAD_ROOM];
+    int  header_len = snprintf(header, sizeof(header),
+                               "HTTP/1.1 %d %s\r\n"
+                                "Content-Type: application/json\r\n"
+                                "Retry-After: %u\r\n"
+                                "Access-Control-Allow-Origin: *\r\n"
+                                "Content-Length: %zu\r\n"
+                                "\r\n",
+                               status_code,
+                               response_builder_get_error_type(status_code),
+                               retry_after, json_len);
+    if (!json || header_len < 0 || (size_t)header_len >= sizeof(header)) {
+        json_writer_dispose(&writer);
         return -1;
     }
 
-    char header[256];
+    uint8_t* response = malloc((size_t)header_len + json_len);
+    if (!response) {
+        json_writer_dispose(&writer);
+        return -1;
+    }
+    memcpy(response, header, (size_t)header_len);
+    memcpy(response + header_len, json, json_len);
+    json_writer_dispose(&writer);
+
+    out->body   = response;
+    out->length = (size_t)header_len + json_len;
+    return 0;
+}
+
+/* Point the connection at a shared prebuilt response; nothing is copied */
+static void weather_server_instance_send_static(HTTPServerConnection* conn,
+                                                const StaticVariant*  response) {
+    conn->write_buffer        = (uint8_t*)response->body;
+    conn->write_buffer_static = 1;
+    conn->write_offset        = 0;
+    conn->write_size          = response->length;
+}
+
+static void weather_server_instance_send_throttled(HTTPServerConnection* conn,
+                                                   uint32_t retry_after) {
+    if (retry_after < 1) {
+        retry_after = 1;
+    } else if (retry_after > RATE_LIMITER_RETRY_MAX) {
+        retry_after = RATE_LIMITER_RETRY_MAX;
+    }
+
+    weather_server_instance_send_static(conn,
+                                        &g_too_many_requests[retry_after]);
+}
+
+/* Place the headers right in front of the JSON text, inside the head room the
+ * writer reserved, and hand the buffer to the connection as is */
+static int weather_server_instance_send_json(HTTPServerConnection* conn,
+                                             int                   status_code,
+                                             JsonWriter*           writer,
+                                             const char* extra_headers) {
+    size_t json_len = 0;
+    json_writer_data(writer, &json_len);
+
+    char header[RESPONSE_HEAD_ROOM];
     int  header_len = snprintf(header, sizeof(header),
-                               "HTTP/1.1 404 Not Found\r\n"
+                               "HTTP/1.1 %d %s\r\n"
                                 "Content-Type: application/json\r\n"
+                                "%s"
                                 "Access-Control-Allow-Origin: *\r\n"
+                                "Vary: Accept, Accept-Encoding\r\n"
                                 "Content-Length: %zu\r\n"
                                 "\r\n",
-                               strlen(json_response));
+                               status_code,
+                               response_builder_get_error_type(status_code),
+                               extra_headers, json_len);
+    if (header_len < 0 || (size_t)header_len > writer->start) {
+        return -1;
+    }
+
+    size_t   head_offset = writer->start - (size_t)header_len;
+    size_t   total       = 0;
+    uint8_t* buffer      = json_writer_detach(writer, &total);
+    if (!buffer) {
+        return -1;
+    }
+
+    memcpy(buffer + head_offset, header, (size_t)header_len);
+
+    conn->write_buffer = buffer;
+    conn->write_offset = head_offset;
+    conn->write_size   = total;
+    return 0;
+}
+
+/* Copy headers and body into a new buffer owned by the connection */
+static int weather_server_instance_send_body(HTTPServerConnection* conn,
+                                             int                   status_code,
+                                             const char*    content_type,
+                                             const uint8_t* body, size_t length,
+                                             HttpContentEncoding encoding,
+                                             const char* extra_headers) {
+    char        content_encoding[64] = {0};
+    const char* coding_name          = http_content_encoding_name(encoding);
+    if (coding_name) {
+        snprintf(content_encoding, sizeof(content_encoding),
+                 "Content-Encoding: %s\r\n", coding_name);
+    }
+
+    char header[RESPONSE_HEAD_ROOM];
+    int  header_len = snprintf(header, sizeof(header),
+                               "HTTP/1.1 %d %s\r\n"
+                                "Content-Type: %s\r\n"
+                                "%s%s"
+                                "Access-Control-Allow-Origin: *\r\n"
+                                "Vary: Accept, Accept-Encoding\r\n"
+                                "Content-Length: %zu\r\n"
+                                "\r\n",
+                               status_code,
+                               response_builder_get_error_type(status_code),
+                               content_type, content_encoding, extra_headers,
+                               length);
+    if (header_len < 0 || (size_t)header_len >= sizeof(header)) {
+        return -1;
+    }
+
+    size_t   total  = (size_t)header_len + length;
+    uint8_t* buffer = malloc(total);
+    if (!buffer) {
+        return -1;
+    }
+
+    memcpy(buffer, header, (size_t)header_len);
+    memcpy(buffer + header_len, body, length);
+
+    conn->write_buffer = buffer;
+    conn->write_offset = 0;
+    conn->write_size   = total;
+    return 0;
+}
+
+static void weather_server_instance_cache_headers(const ResponseCacheInfo* info,
+                                                  HttpContentEncoding encoding,
+                                                  char* out, size_t out_size) {
+    char etag[RESPONSE_CACHE_ETAG_MAX];
+    response_cache_etag(info, encoding, etag, sizeof(etag));
+
+    snprintf(out, out_size,
+             "ETag: %s\r\n"
+             "Cache-Control: public, max-age=%lld\r\n",
+             etag, (long long)info->max_age);
+}
+
+static int weather_server_instance_send_not_modified(
+    HTTPServerConnection* conn, const ResponseCacheInfo* info,
+    HttpContentEncoding encoding) {
+    char cache_headers[CACHE_HEADERS_MAX];
+    weather_server_instance_cache_headers(info, encoding, cache_headers,
+                                          sizeof(cache_headers));
+
+    char header[RESPONSE_HEAD_ROOM];
+    int  header_len =
+        snprintf(header, sizeof(header),
+                 "HTTP/1.1 %d %s\r\n"
+                 "%s"
+                 "Access-Control-Allow-Origin: *\r\n"
+                 "Vary: Accept, Accept-Encoding\r\n"
+                 "\r\n",
+                 HTTP_NOT_MODIFIED,
+                 response_builder_get_error_type(HTTP_NOT_MODIFIED),
+                 cache_headers);
+    if (header_len < 0 || (size_t)header_len >= sizeof(header)) {
+        return -1;
+    }
+
+    uint8_t* buffer = malloc((size_t)header_len);
+    if (!buffer) {
+        return -1;
+    }
+    memcpy(buffer, header, (size_t)header_len);
 
-    size_t   total_len = header_len + strlen(json_response);
-    uint8_t* response  = malloc(total_len + 1);
+    conn->write_buffer = buffer;
+    conn->write_offset = 0;
+    conn->write_size   = (size_t)header_len;
+    return 0;
+}
 
-    if (response) {
-        memcpy(response, header, header_len);
-        strcpy((char*)response + header_len, json_response);
+/* Serve a response from the response cache, or a bodiless 304 when the
+ * client's If-None-Match already names the cached version. A body not yet
+ * compressed for the client is compressed on a worker while the connection
+ * waits. Returns 1 on a cache miss. */
+static int weather_server_instance_send_cached(HTTPServerConnection* conn,
+                                               const char*           key,
+                                               HttpContentEncoding   encoding) {
+    int result = weather_server_instance_send_if_not_modified(conn, key,
+                                                              encoding);
+    if (result != 1) {
+        return result;
+    }
 
-        conn->write_buffer = response;
-        conn->write_size   = total_len;
+    if (weather_server_instance_compress_async(conn, key, encoding) == 0) {
+        return 0;
+    }
+
+    return weather_server_instance_send_cached_now(conn, key, encoding);
+}
+
+/* Answer 304 when If-None-Match names the cached version. The version is
+ * read from the identity entry, so no variant is compressed for a response
+ * without a body. Returns 1 when the client needs the body. */
+static int weather_server_instance_send_if_not_modified(
+    HTTPServerConnection* conn, const char* key, HttpContentEncoding encoding) {
+    size_t      if_none_match_len = 0;
+    const char* if_none_match     = http_server_connection_get_header(
+        conn, "If-None-Match", &if_none_match_len);
+    if (!if_none_match) {
+        return 1;
+    }
+
+    size_t              length        = 0;
+    HttpContentEncoding body_encoding = HTTP_CONTENT_ENCODING_IDENTITY;
+    ResponseCacheInfo   info;
+    if (!response_cache_get(key, HTTP_CONTENT_ENCODING_IDENTITY, &length,
+                            &body_encoding, &info) ||
+        !response_cache_etag_matches(if_none_match, if_none_match_len,
+                                     &info)) {
+        return 1;
+    }
+
+    // Tagged with the coding a 200 would most likely use; matching only
+    // looks at the version
+    if (length < RESPONSE_CACHE_MIN_COMPRESS_SIZE) {
+        encoding = HTTP_CONTENT_ENCODING_IDENTITY;
+    }
+
+    LOG_DEBUG("weather", "Not modified: %s", key);
+    return weather_server_instance_send_not_modified(conn, &info, encoding);
+}
+
+/* weather_server_instance_send_cached without the 304 check, compressing on
+ * the smw thread if needed */
+static int weather_server_instance_send_cached_now(
+    HTTPServerConnection* conn, const char* key, HttpContentEncoding encoding) {
+    size_t              length        = 0;
+    HttpContentEncoding body_encoding = HTTP_CONTENT_ENCODING_IDENTITY;
+    ResponseCacheInfo   info;
+    const uint8_t*      body =
+        response_cache_get(key, encoding, &length, &body_encoding, &info);
+    if (!body) {
+        return 1;
+    }
+
+    char cache_headers[CACHE_HEADERS_MAX];
+    weather_server_instance_cache_headers(&info, body_encoding, cache_headers,
+                                          sizeof(cache_headers));
+
+    return weather_server_instance_send_body(conn, HTTP_OK, "application/json",
+                                             body, length, body_encoding,
+                                             cache_headers);
+}
+
+/* Send a freshly built response, caching it first when it is a success. A
+ * compressed variant is produced right away if the client accepts one. */
+static int weather_server_instance_send_fresh(HTTPServerConnection* conn,
+                                              int                   status_code,
+                                              JsonWriter*           writer,
+                                              const char*           key,
+                                              time_t                ttl,
+                                              HttpContentEncoding   encoding) {
+    if (status_code != HTTP_OK) {
+        return weather_server_instance_send_json(conn, status_code, writer,
+                                                 "");
+    }
+
+    size_t      json_len = 0;
+    const char* json     = json_writer_data(writer, &json_len);
+    if (response_cache_put(key, (const uint8_t*)json, json_len, ttl) != 0) {
+        return weather_server_instance_send_json(conn, status_code, writer,
+                                                 "");
+    }
+
+    // A refreshed entry may still match what the client has
+    size_t if_none_match_len = 0;
+    bool   conditional       = http_server_connection_get_header(
+                                 conn, "If-None-Match", &if_none_match_len) !=
+                             NULL;
+    bool compress = encoding != HTTP_CONTENT_ENCODING_IDENTITY &&
+                    json_len >= RESPONSE_CACHE_MIN_COMPRESS_SIZE;
+    if ((conditional || compress) &&
+        weather_server_instance_send_cached(conn, key, encoding) == 0) {
+        return 0;
+    }
+
+    char                cache_headers[CACHE_HEADERS_MAX] = {0};
+    ResponseCacheInfo   info;
+    size_t              length        = 0;
+    HttpContentEncoding body_encoding = HTTP_CONTENT_ENCODING_IDENTITY;
+    if (response_cache_get(key, HTTP_CONTENT_ENCODING_IDENTITY, &length,
+                           &body_encoding, &info)) {
+        weather_server_instance_cache_headers(&info, body_encoding,
+                                              cache_headers,
+                                              sizeof(cache_headers));
+    }
+
+    return weather_server_instance_send_json(conn, status_code, writer,
+                                             cache_headers);
+}
+
+/* Hand the compression response_cache_get would do to the worker pool and
+ * park the connection. Returns 1 when the response should be sent right
+ * away instead: nothing to compress, or no worker can take the job. */
+static int weather_server_instance_compress_async(
+    HTTPServerConnection* conn, const char* key, HttpContentEncoding encoding) {
+    WeatherServerInstance* inst = (WeatherServerInstance*)conn->context;
+    if (!work_pool_active() || !inst) {
+        return 1;
+    }
+
+    size_t            length = 0;
+    ResponseCacheInfo info;
+    const uint8_t*    body =
+        response_cache_get_uncompressed(key, encoding, &length, &info);
+    if (!body) {
+        return 1;
+    }
+
+    WeatherServerCompressJob* job = calloc(1, sizeof(WeatherServerCompressJob));
+    if (!job) {
+        return 1;
+    }
+    job->body = malloc(length);
+    if (!job->body) {
+        free(job);
+        return 1;
+    }
+    memcpy(job->body, body, length);
+    snprintf(job->key, sizeof(job->key), "%s", key);
+    job->length   = length;
+    job->encoding = encoding;
+    job->version  = info.version;
+    job->inst     = inst;
+
+    job->handle = work_pool_submit(weather_server_instance_compress_run,
+                                   weather_server_instance_compress_done, job);
+    if (!job->handle) {
+        free(job->body);
+        free(job);
+        return 1;
+    }
+
+    inst->compress_job = job;
+    http_server_connection_wait(conn);
+    return 0;
+}
+
+/* On a worker thread */
+static void weather_server_instance_compress_run(void* context) {
+    WeatherServerCompressJob* job = (WeatherServerCompressJob*)context;
+
+    if (response_cache_compress(job->body, job->length, job->encoding,
+                                &job->compressed, &job->compressed_len) != 0) {
+        job->compressed     = NULL;
+        job->compressed_len = 0;
+    }
+}
+
+/* Back on the smw thread: cache the variant, then answer as if it had been
+ * cached all along */
+static void weather_server_instance_compress_done(void* context,
+                                                  bool  cancelled) {
+    WeatherServerCompressJob* job  = (WeatherServerCompressJob*)context;
+    WeatherServerInstance*    inst = job->inst;
+
+    if (!cancelled) {
+        response_cache_put_variant(job->key, job->encoding, job->version,
+                                   job->compressed, job->compressed_len);
+    }
+
+    if (inst) {
+        HTTPServerConnection* conn = inst->connection;
+        inst->compress_job         = NULL;
+
+        // The entry may have expired meanwhile; the copy is still current
+        // enough to answer the request it was fetched for
+        int result = weather_server_instance_send_cached_now(conn, job->key,
+                                                             job->encoding);
+        if (result != 0) {
+            result = weather_server_instance_send_body(
+                conn, HTTP_OK, "application/json", job->body, job->length,
+                HTTP_CONTENT_ENCODING_IDENTITY, "");
+        }
+
+        weather_server_instance_record(conn, result,
+                                       metrics_now_us() - inst->started_us);
+        http_server_connection_resume(conn);
+    }
+
+    free(job->compressed);
+    free(job->body);
+    free(job);
+}
+
+/* Serve the last known body of an expired entry with "stale": true added at
+ * the top level. It must not be cached downstream, since a fresh body may
+ * be available any moment. Returns 1 if there is none. */
+static int weather_server_instance_send_stale(HTTPServerConnection* conn,
+                                              const char*           key) {
+    size_t         length        = 0;
+    time_t         stale_seconds = 0;
+    const uint8_t* body = response_cache_get_stale(key, &length, &stale_seconds);
+    if (!body || length < 2 || body[0] != '{') {
+        return 1;
+    }
+
+    // Pretty bodies open with a newline and indent their members
+    const char* flag     = body[1] == '\n' ? "\n  \"stale\": true," :
+                                              "\"stale\":true,";
+    size_t      flag_len = strlen(flag);
+
+    uint8_t* marked = malloc(length + flag_len);
+    if (!marked) {
+        return 1;
+    }
+    marked[0] = '{';
+    memcpy(marked + 1, flag, flag_len);
+    memcpy(marked + 1 + flag_len, body + 1, length - 1);
+
+    char headers[CACHE_HEADERS_MAX];
+    snprintf(headers, sizeof(headers), "Cache-Control: no-store\r\n");
+
+    int result = weather_server_instance_send_body(
+        conn, HTTP_OK, "application/json", marked, length + flag_len,
+        HTTP_CONTENT_ENCODING_IDENTITY, headers);
+    free(marked);
+
+    if (result == 0) {
+        metrics_inc(g_metric_stale);
+        LOG_DEBUG("weather", "Served stale response (%llds old): %s",
+                  (long long)stale_seconds, key);
+    }
+    return result;
+}
+
+/* Answer a cache miss while upstream is unavailable without waiting for it:
+ * with the last known body when there is one, with a 503 otherwise */
+static int weather_server_instance_send_fallback(HTTPServerConnection* conn,
+                                                 const char*           key) {
+    if (weather_server_instance_send_stale(conn, key) == 0) {
+        return 0;
+    }
+
+    LOG_DEBUG("weather", "Upstream unavailable, failing fast: %s", key);
+    weather_server_instance_send_static(conn, &g_upstream_unavailable);
+    return 0;
+}
+
+/* Start streaming the published city database, which stays alive until the
+ * last line is sent or the connection closes */
+static int weather_server_instance_export_start(WeatherServerInstance* inst) {
+    PopularCitiesDB* db = popular_cities_acquire();
+    if (!db) {
+        weather_server_instance_send_static(inst->connection,
+                                            &g_cities_loading);
+        return 0;
+    }
+
+    if (http_server_connection_stream_start(
+            inst->connection, HTTP_OK, "OK",
+            "Content-Type: application/x-ndjson\r\n"
+            "Access-Control-Allow-Origin: *\r\n",
+            weather_server_instance_export_more) != 0) {
+        popular_cities_release(db);
+        return -1;
+    }
+
+    inst->export_db   = db;
+    inst->export_next = 0;
+    return 0;
+}
+
+/* on_stream of an export: queue chunks of whole lines until the connection
+ * refuses more with EAGAIN, then end the stream after the last city. A
+ * refused chunk is built again on the next call. */
+static void weather_server_instance_export_more(void* context) {
+    WeatherServerInstance* inst = (WeatherServerInstance*)context;
+    PopularCitiesDB*       db   = inst->export_db;
+    if (!db) {
+        return;
+    }
+
+    const PopularCity* cities =
+        db->full_loaded ? db->full_cities : db->hot_cities;
+    size_t count = db->full_loaded ? db->full_count : db->hot_count;
+
+    JsonWriter writer;
+    if (json_writer_init(&writer, 0, false) != 0) {
+        inst->connection->state = HTTP_SERVER_CONNECTION_STATE_DISPOSE;
+        return;
+    }
+
+    int result = 0;
+    while (inst->export_next < count) {
+        size_t next   = inst->export_next;
+        size_t length = 0;
+        while (next < count && length < EXPORT_CHUNK_SIZE) {
+            weather_server_instance_export_line(&writer, &cities[next],
+                                                &length);
+            next++;
+        }
+
+        if (http_server_connection_stream_write(inst->connection,
+                                                g_export_chunk, length) != 0) {
+            result = errno == EAGAIN ? 0 : -1;
+            break;
+        }
+        inst->export_next = next;
+    }
+    json_writer_dispose(&writer);
+
+    if (result == 0 && inst->export_next == count) {
+        result = http_server_connection_stream_end(inst->connection);
+        if (result == 0) {
+            popular_cities_release(db);
+            inst->export_db = NULL;
+        }
+    }
+
+    if (result != 0) {
+        inst->connection->state = HTTP_SERVER_CONNECTION_STATE_DISPOSE;
+    }
+}
+
+/* Append one city to g_export_chunk as a line of compact JSON */
+static void weather_server_instance_export_line(JsonWriter*        writer,
+                                                const PopularCity* city,
+                                                size_t*            length) {
+    json_writer_reset(writer);
+    json_writer_begin_object(writer);
+    json_writer_key(writer, "name");
+    json_writer_string(writer, city->name);
+    json_writer_key(writer, "country");
+    json_writer_string(writer, city->country);
+    json_writer_key(writer, "country_code");
+    json_writer_string(writer, city->country_code);
+    json_writer_key(writer, "latitude");
+    json_writer_number(writer, city->latitude);
+    json_writer_key(writer, "longitude");
+    json_writer_number(writer, city->longitude);
+    json_writer_key(writer, "population");
+    json_writer_integer(writer, city->population);
+    json_writer_end_object(writer);
+
+    size_t      line_len = 0;
+    const char* line     = json_writer_data(writer, &line_len);
+    if (json_writer_finish(writer) != 0 || line_len + 1 > EXPORT_LINE_MAX) {
+        return;
+    }
+
+    memcpy(g_export_chunk + *length, line, line_len);
+    g_export_chunk[*length + line_len] = '\n';
+    *length += line_len + 1;
+}
+
+/* Remove "name=value" from a query string in place and copy out the value.
+ * Returns 1 if the parameter was present. */
+static int weather_server_instance_take_param(char* query, const char* name,
+                                              char* value, size_t value_size) {
+    size_t name_len = strlen(name);
+
+    char* param = query;
+    while (*param) {
+        char* next = strchr(param, '&');
+        char* end  = next ? next : param + strlen(param);
+
+        if (strncmp(param, name, name_len) == 0 &&
+            (param[name_len] == '=' || param + name_len == end)) {
+            const char* raw = param + name_len;
+            size_t      raw_len = end - raw;
+            if (*raw == '=') {
+                raw++;
+                raw_len--;
+            }
+
+            size_t copy_len =
+                raw_len < value_size - 1 ? raw_len : value_size - 1;
+            memcpy(value, raw, copy_len);
+            value[copy_len] = '\0';
+
+            // Drop the parameter together with one '&' separator
+            if (next) {
+                memmove(param, next + 1, strlen(next + 1) + 1);
+            } else if (param > query) {
+                param[-1] = '\0';
+            } else {
+                *param = '\0';
+            }
+            return 1;
+        }
+
+        if (!next) {
+            break;
+        }
+        param = next + 1;
     }
 
-    free(json_response);
     return 0;
 }
 
 void weather_server_instance_work(WeatherServerInstance* instance,
                                   uint64_t               mon_time) {}
 
-void weather_server_instance_dispose(WeatherServerInstance* instance) {}
+void weather_server_instance_dispose(WeatherServerInstance* instance) {
+    // Still open: close the connection without it calling back
+    HTTPServerConnection* connection = instance->connection;
+    if (connection) {
+        instance->connection = NULL;
+        http_server_connection_set_on_close(connection, NULL);
+        if (connection->allocated) {
+            http_server_connection_dispose_ptr(&connection);
+        } else {
+            http_server_connection_dispose(connection);
+        }
+    }
+
+    if (instance->counted) {
+        rate_limiter_connection_close(&instance->client);
+        instance->counted = false;
+    }
+
+    // The job finishes on its own and frees itself
+    if (instance->compress_job) {
+        work_pool_cancel(instance->compress_job->handle);
+        instance->compress_job->inst = NULL;
+        instance->compress_job       = NULL;
+    }
+
+    // An export that did not finish still holds its database version
+    if (instance->export_db) {
+        popular_cities_release(instance->export_db);
+        instance->export_db = NULL;
+    }
+
+    if (instance->list) {
+        linked_list_remove(instance->list, instance->node, NULL);
+        instance->list = NULL;
+        instance->node = NULL;
+    }
+}
 
 void weather_server_instance_dispose_ptr(WeatherServerInstance** instance_ptr) {
     if (instance_ptr == NULL || *(instance_ptr) == NULL) {
@@ -2,19 +2,60 @@
 #define WEATHER_SERVER_INSTANCE_H
 
 #include "http_server_connection.h"
+#include "linked_list.h"
+#include "popular_cities.h"
+#include "rate_limiter.h"
+
+#include <stdbool.h>
+#include <stdint.h>
 
 typedef struct {
     HTTPServerConnection* connection;
+
+    RateLimiterKey client;
+    bool           has_client; // client is valid
+    bool           counted;    // Holds a connection slot in the rate limiter
+
+    // While the connection waits for a body compressed on a worker
+    struct WeatherServerCompressJob* compress_job;
+    uint64_t                         started_us; // Request handling began
+
+    // While the connection streams GET /v1/cities/export
+    PopularCitiesDB* export_db;   // Version being exported, held until done
+    size_t           export_next; // Index of the next city to send
+
+    // Entry in a list of open instances (weather_server_instance_track)
+    LinkedList* list;
+    Node*       node;
+
+    bool allocated; // By weather_server_instance_initiate_ptr
 } WeatherServerInstance;
 
+// Prepare static responses (precompressed homepage, 429 responses). Call once
+// at startup.
+int  weather_server_instance_static_init(void);
+void weather_server_instance_static_dispose(void);
+
+// Answer requests with a prebuilt 503 instead of handling them once they have
+// been queued this long (see HTTPServerConnection arrived_us). 0, the
+// default, disables shedding.
+void weather_server_instance_set_queue_deadline(uint64_t deadline_us);
+
 int weather_server_instance_initiate(WeatherServerInstance* instance,
                                      HTTPServerConnection*  connection);
 int weather_server_instance_initiate_ptr(HTTPServerConnection*   connection,
                                          WeatherServerInstance** instance_ptr);
 
+// Keep the instance in list while it is open. It unlinks itself on dispose.
+int weather_server_instance_track(WeatherServerInstance* instance,
+                                  LinkedList*            list);
+
 void weather_server_instance_work(WeatherServerInstance* instance,
                                   uint64_t               mon_time);
 
+// Runs by itself when the connection closes, freeing an instance from
+// weather_server_instance_initiate_ptr. Disposing an instance first closes
+// its connection.
 void weather_server_instance_dispose(WeatherServerInstance* instance);
 void weather_server_instance_dispose_ptr(WeatherServerInstance** instance_ptr);
 